@@ -41,6 +41,7 @@
 #include <linux/miscdevice.h>
 #include <linux/log2.h>
 #include <linux/kthread.h>
+#include <linux/cpumask.h>
 
 #include "ubi.h"
 
@@ -68,9 +69,6 @@ static struct mtd_dev_param mtd_dev_param[UBI_MAX_DEVICES];
 /* Root UBI "class" object (corresponds to '/<sysfs>/class/ubi/') */
 struct class *ubi_class;
 
-/* Slab cache for wear-leveling entries */
-struct kmem_cache *ubi_wl_entry_slab;
-
 /* UBI control character device */
 static struct miscdevice ubi_ctrl_cdev = {
 	.minor = MISC_DYNAMIC_MINOR,
@@ -99,6 +97,9 @@ static struct class_attribute ubi_version =
 
 static ssize_t dev_attribute_show(struct device *dev,
 				  struct device_attribute *attr, char *buf);
+static ssize_t dev_attribute_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count);
 
 /* UBI device attributes (correspond to files in '/<sysfs>/class/ubi/ubiX') */
 static struct device_attribute dev_eraseblock_size =
@@ -123,6 +124,63 @@ static struct device_attribute dev_bgt_enabled =
 	__ATTR(bgt_enabled, S_IRUGO, dev_attribute_show, NULL);
 static struct device_attribute dev_mtd_num =
 	__ATTR(mtd_num, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_wl_copies =
+	__ATTR(wl_copies, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_wl_moves =
+	__ATTR(wl_moves, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_scrub_count =
+	__ATTR(scrub_count, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_wl_bytes_copied =
+	__ATTR(wl_bytes_copied, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_torture_count =
+	__ATTR(torture_count, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_torture_failures =
+	__ATTR(torture_failures, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_pq_evictions =
+	__ATTR(pq_evictions, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_wl_wasted_copies =
+	__ATTR(wl_wasted_copies, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_rd_scrubs =
+	__ATTR(read_disturb_scrubs, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_rd_threshold =
+	__ATTR(read_disturb_threshold, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_pq_len =
+	__ATTR(pq_len, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_min_ec =
+	__ATTR(min_ec, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_mean_ec =
+	__ATTR(mean_ec, S_IRUGO, dev_attribute_show, NULL);
+static struct device_attribute dev_wl_threshold =
+	__ATTR(wl_threshold, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_wl_threshold_min =
+	__ATTR(wl_threshold_min, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_wl_threshold_max =
+	__ATTR(wl_threshold_max, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_wl_wa_budget =
+	__ATTR(wl_wa_budget, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_bgt_rate =
+	__ATTR(bgt_rate, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_bgt_burst =
+	__ATTR(bgt_burst, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_bgt_idle_ms =
+	__ATTR(bgt_idle_ms, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_bgt_group =
+	__ATTR(bgt_group, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_bgt_nice =
+	__ATTR(bgt_nice, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
+static struct device_attribute dev_bgt_cpus =
+	__ATTR(bgt_cpus, S_IRUGO | S_IWUSR, dev_attribute_show,
+	       dev_attribute_store);
 
 /**
  * ubi_get_device - get UBI device.
@@ -259,8 +317,218 @@ static ssize_t dev_attribute_show(struct device *dev,
 		ret = sprintf(buf, "%d\n", ubi->thread_enabled);
 	else if (attr == &dev_mtd_num)
 		ret = sprintf(buf, "%d\n", ubi->mtd->index);
-	else
+	else if (attr == &dev_wl_copies) {
+		unsigned long long wl_copies;
+
+		spin_lock(&ubi->wl_lock);
+		wl_copies = ubi->wl_copies;
+		spin_unlock(&ubi->wl_lock);
+		ret = sprintf(buf, "%llu\n", wl_copies);
+	} else if (attr == &dev_wl_moves || attr == &dev_scrub_count ||
+		   attr == &dev_wl_bytes_copied ||
+		   attr == &dev_torture_count ||
+		   attr == &dev_torture_failures || attr == &dev_pq_evictions ||
+		   attr == &dev_wl_wasted_copies || attr == &dev_rd_scrubs) {
+		unsigned long long cnt;
+
+		spin_lock(&ubi->wl_lock);
+		if (attr == &dev_wl_moves)
+			cnt = ubi->wl_moves;
+		else if (attr == &dev_scrub_count)
+			cnt = ubi->scrub_count;
+		else if (attr == &dev_wl_bytes_copied)
+			cnt = ubi->wl_bytes_copied;
+		else if (attr == &dev_torture_count)
+			cnt = ubi->torture_count;
+		else if (attr == &dev_torture_failures)
+			cnt = ubi->torture_failures;
+		else if (attr == &dev_wl_wasted_copies)
+			cnt = ubi->wl_wasted_copies;
+		else if (attr == &dev_rd_scrubs)
+			cnt = ubi->rd_scrubs;
+		else
+			cnt = ubi->pq_evictions;
+		spin_unlock(&ubi->wl_lock);
+		ret = sprintf(buf, "%llu\n", cnt);
+	} else if (attr == &dev_rd_threshold)
+		ret = sprintf(buf, "%d\n", ubi->rd_threshold);
+	else if (attr == &dev_pq_len)
+		ret = sprintf(buf, "%d\n", ubi->pq_len);
+	else if (attr == &dev_min_ec)
+		ret = sprintf(buf, "%d\n", ubi_wl_min_ec(ubi));
+	else if (attr == &dev_mean_ec)
+		ret = sprintf(buf, "%d\n", ubi->mean_ec);
+	else if (attr == &dev_wl_threshold)
+		ret = sprintf(buf, "%d\n", ubi->wl_threshold);
+	else if (attr == &dev_wl_threshold_min)
+		ret = sprintf(buf, "%d\n", ubi->wl_threshold_min);
+	else if (attr == &dev_wl_threshold_max)
+		ret = sprintf(buf, "%d\n", ubi->wl_threshold_max);
+	else if (attr == &dev_wl_wa_budget)
+		ret = sprintf(buf, "%d\n", ubi->wl_wa_budget);
+	else if (attr == &dev_bgt_rate)
+		ret = sprintf(buf, "%d\n", ubi->bgt_rate);
+	else if (attr == &dev_bgt_burst)
+		ret = sprintf(buf, "%d\n", ubi->bgt_burst);
+	else if (attr == &dev_bgt_idle_ms)
+		ret = sprintf(buf, "%d\n", ubi->bgt_idle_ms);
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	else if (attr == &dev_bgt_group)
+		ret = sprintf(buf, "%d\n", ubi->bgt_group);
+#endif
+	else if (attr != &dev_bgt_nice && attr != &dev_bgt_cpus)
 		ret = -EINVAL;
+	else if (!ubi->bgt_thread)
+		/* The background thread is not created yet */
+		ret = -ENODEV;
+	else if (attr == &dev_bgt_nice)
+		ret = sprintf(buf, "%d\n", task_nice(ubi->bgt_thread));
+	else {
+		ret = cpulist_scnprintf(buf, PAGE_SIZE - 2,
+					&ubi->bgt_thread->cpus_allowed);
+		buf[ret++] = '\n';
+		buf[ret] = '\0';
+	}
+
+	ubi_put_device(ubi);
+	return ret;
+}
+
+/**
+ * bgt_attribute_store - change the scheduling parameters of the background
+ *                       thread.
+ * @ubi: UBI device description object
+ * @attr: the attribute to change
+ * @buf: new value as a string (used for the CPU list)
+ * @val: new value as a number (used for the nice level)
+ *
+ * This function returns zero in case of success and a negative error code in
+ * case of failure.
+ */
+static int bgt_attribute_store(struct ubi_device *ubi,
+			       struct device_attribute *attr, const char *buf,
+			       long val)
+{
+	int err;
+	cpumask_var_t mask;
+
+	if (!ubi->bgt_thread)
+		return -ENODEV;
+
+	if (attr == &dev_bgt_nice) {
+		if (val < -20 || val > 19)
+			return -EINVAL;
+		set_user_nice(ubi->bgt_thread, val);
+		return 0;
+	}
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	err = cpulist_parse(buf, mask);
+	if (!err)
+		err = set_cpus_allowed_ptr(ubi->bgt_thread, mask);
+	free_cpumask_var(mask);
+	return err;
+}
+
+/**
+ * dev_attribute_store - change a writable UBI device sysfs attribute.
+ * @dev: the device object
+ * @attr: the attribute to change
+ * @buf: new value
+ * @count: length of @buf
+ *
+ * The writable attributes are the wear-leveling threshold and its adjustment
+ * limits, the wear-leveling write amplification budget and the background
+ * thread parameters. This function returns @count in case of success and a
+ * negative error code in case of failure.
+ */
+static ssize_t dev_attribute_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	ssize_t ret = count;
+	long val = 0;
+	char *endp;
+	struct ubi_device *ubi;
+
+	if (attr != &dev_bgt_cpus) {
+		val = simple_strtol(buf, &endp, 0);
+		if (endp == buf || (*endp && *endp != '\n') ||
+		    val < INT_MIN || val > INT_MAX)
+			return -EINVAL;
+	}
+
+	/* See the comment in 'dev_attribute_show()' */
+	ubi = container_of(dev, struct ubi_device, dev);
+	ubi = ubi_get_device(ubi->ubi_num);
+	if (!ubi)
+		return -ENODEV;
+
+	if (attr == &dev_bgt_nice || attr == &dev_bgt_cpus) {
+		ret = bgt_attribute_store(ubi, attr, buf, val);
+		ubi_put_device(ubi);
+		return ret ? ret : count;
+	}
+
+	spin_lock(&ubi->wl_lock);
+	if (attr == &dev_wl_threshold) {
+		if (val < ubi->wl_threshold_min || val > ubi->wl_threshold_max)
+			ret = -EINVAL;
+		else
+			ubi->wl_threshold = val;
+	} else if (attr == &dev_wl_threshold_min) {
+		if (val < 2 || val > ubi->wl_threshold_max)
+			ret = -EINVAL;
+		else {
+			ubi->wl_threshold_min = val;
+			if (ubi->wl_threshold < val)
+				ubi->wl_threshold = val;
+		}
+	} else if (attr == &dev_wl_threshold_max) {
+		if (val < ubi->wl_threshold_min || val > UBI_MAX_ERASECOUNTER)
+			ret = -EINVAL;
+		else {
+			ubi->wl_threshold_max = val;
+			if (ubi->wl_threshold > val)
+				ubi->wl_threshold = val;
+		}
+	} else if (attr == &dev_wl_wa_budget) {
+		if (val < 1 || val > 1000)
+			ret = -EINVAL;
+		else
+			ubi->wl_wa_budget = val;
+	} else if (attr == &dev_bgt_rate) {
+		if (val < 0 || val > 10000)
+			ret = -EINVAL;
+		else
+			ubi->bgt_rate = val;
+	} else if (attr == &dev_bgt_burst) {
+		if (val < 1 || val > 1000)
+			ret = -EINVAL;
+		else
+			ubi->bgt_burst = val;
+	} else if (attr == &dev_bgt_idle_ms) {
+		if (val < 0 || val > 3600000)
+			ret = -EINVAL;
+		else
+			ubi->bgt_idle_ms = val;
+	} else if (attr == &dev_rd_threshold) {
+		if (val < 0)
+			ret = -EINVAL;
+		else
+			ubi->rd_threshold = val;
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	} else if (attr == &dev_bgt_group) {
+		if (val < 0 || val >= UBI_MAX_DEVICES)
+			ret = -EINVAL;
+		else
+			ubi->bgt_group = val;
+#endif
+	} else
+		ret = -EINVAL;
+	spin_unlock(&ubi->wl_lock);
 
 	ubi_put_device(ubi);
 	return ret;
@@ -323,6 +591,77 @@ static int ubi_sysfs_init(struct ubi_device *ubi)
 	if (err)
 		return err;
 	err = device_create_file(&ubi->dev, &dev_mtd_num);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_copies);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_moves);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_scrub_count);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_bytes_copied);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_torture_count);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_torture_failures);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_pq_evictions);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_wasted_copies);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_rd_scrubs);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_rd_threshold);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_pq_len);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_min_ec);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_mean_ec);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_threshold);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_threshold_min);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_threshold_max);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_wl_wa_budget);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_bgt_rate);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_bgt_burst);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_bgt_idle_ms);
+	if (err)
+		return err;
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	/* The shared threads cannot be tuned per device */
+	err = device_create_file(&ubi->dev, &dev_bgt_group);
+#else
+	err = device_create_file(&ubi->dev, &dev_bgt_nice);
+	if (err)
+		return err;
+	err = device_create_file(&ubi->dev, &dev_bgt_cpus);
+#endif
 	return err;
 }
 
@@ -332,6 +671,32 @@ static int ubi_sysfs_init(struct ubi_device *ubi)
  */
 static void ubi_sysfs_close(struct ubi_device *ubi)
 {
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	device_remove_file(&ubi->dev, &dev_bgt_group);
+#else
+	device_remove_file(&ubi->dev, &dev_bgt_cpus);
+	device_remove_file(&ubi->dev, &dev_bgt_nice);
+#endif
+	device_remove_file(&ubi->dev, &dev_bgt_idle_ms);
+	device_remove_file(&ubi->dev, &dev_bgt_burst);
+	device_remove_file(&ubi->dev, &dev_bgt_rate);
+	device_remove_file(&ubi->dev, &dev_wl_wa_budget);
+	device_remove_file(&ubi->dev, &dev_wl_threshold_max);
+	device_remove_file(&ubi->dev, &dev_wl_threshold_min);
+	device_remove_file(&ubi->dev, &dev_wl_threshold);
+	device_remove_file(&ubi->dev, &dev_mean_ec);
+	device_remove_file(&ubi->dev, &dev_min_ec);
+	device_remove_file(&ubi->dev, &dev_pq_len);
+	device_remove_file(&ubi->dev, &dev_rd_threshold);
+	device_remove_file(&ubi->dev, &dev_rd_scrubs);
+	device_remove_file(&ubi->dev, &dev_wl_wasted_copies);
+	device_remove_file(&ubi->dev, &dev_pq_evictions);
+	device_remove_file(&ubi->dev, &dev_torture_failures);
+	device_remove_file(&ubi->dev, &dev_torture_count);
+	device_remove_file(&ubi->dev, &dev_wl_bytes_copied);
+	device_remove_file(&ubi->dev, &dev_scrub_count);
+	device_remove_file(&ubi->dev, &dev_wl_moves);
+	device_remove_file(&ubi->dev, &dev_wl_copies);
 	device_remove_file(&ubi->dev, &dev_mtd_num);
 	device_remove_file(&ubi->dev, &dev_bgt_enabled);
 	device_remove_file(&ubi->dev, &dev_min_io_size);
@@ -374,6 +739,7 @@ static void free_user_volumes(struct ubi_device *ubi)
 	for (i = 0; i < ubi->vtbl_slots; i++)
 		if (ubi->volumes[i]) {
 			kfree(ubi->volumes[i]->eba_tbl);
+			kfree(ubi->volumes[i]->st_lebs);
 			kfree(ubi->volumes[i]);
 		}
 }
@@ -849,6 +1215,7 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	ubi->autoresize_vol_id = -1;
 
 	mutex_init(&ubi->buf_mutex);
+	mutex_init(&ubi->torture_mutex);
 	mutex_init(&ubi->ckvol_mutex);
 	mutex_init(&ubi->mult_mutex);
 	mutex_init(&ubi->volumes_mutex);
@@ -856,11 +1223,24 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 
 	ubi_msg("attaching mtd%d to ubi%d", mtd->index, ubi_num);
 
+	err = ubi_debugfs_init_dev(ubi);
+	if (err)
+		goto out_free;
+
 	err = io_init(ubi);
 	if (err)
 		goto out_free;
 
 	err = -ENOMEM;
+	ubi->vid_hdr_pool = mempool_create_kmalloc_pool(UBI_VID_HDR_POOL_SIZE,
+							ubi->vid_hdr_alsize);
+	if (!ubi->vid_hdr_pool)
+		goto out_free;
+
+	ubi->move_vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!ubi->move_vid_hdr)
+		goto out_free;
+
 	ubi->peb_buf1 = vmalloc(ubi->peb_size);
 	if (!ubi->peb_buf1)
 		goto out_free;
@@ -869,6 +1249,10 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	if (!ubi->peb_buf2)
 		goto out_free;
 
+	ubi->torture_buf = vmalloc(ubi->peb_size);
+	if (!ubi->torture_buf)
+		goto out_free;
+
 #ifdef CONFIG_MTD_UBI_DEBUG
 	mutex_init(&ubi->dbg_buf_mutex);
 	ubi->dbg_peb_buf = vmalloc(ubi->peb_size);
@@ -892,6 +1276,7 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	if (err)
 		goto out_nofree;
 
+#ifndef CONFIG_MTD_UBI_BGT_POOL
 	ubi->bgt_thread = kthread_create(ubi_thread, ubi, ubi->bgt_name);
 	if (IS_ERR(ubi->bgt_thread)) {
 		err = PTR_ERR(ubi->bgt_thread);
@@ -899,6 +1284,7 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 			err);
 		goto out_uif;
 	}
+#endif
 
 	ubi_msg("attached mtd%d to ubi%d", mtd->index, ubi_num);
 	ubi_msg("MTD device name:            \"%s\"", mtd->name);
@@ -914,17 +1300,25 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	ubi_msg("total number of reserved PEBs: %d", ubi->rsvd_pebs);
 	ubi_msg("number of PEBs reserved for bad PEB handling: %d",
 		ubi->beb_rsvd_pebs);
+	ubi_msg("number of PEBs reserved for atomic LEB change: %d",
+		ubi->alc_slots);
 	ubi_msg("max/mean erase counter: %d/%d", ubi->max_ec, ubi->mean_ec);
 
 	if (!DBG_DISABLE_BGT)
 		ubi->thread_enabled = 1;
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	ubi_bgt_pool_start(ubi);
+#else
 	wake_up_process(ubi->bgt_thread);
+#endif
 
 	ubi_devices[ubi_num] = ubi;
 	return ubi_num;
 
+#ifndef CONFIG_MTD_UBI_BGT_POOL
 out_uif:
 	uif_close(ubi);
+#endif
 out_nofree:
 	do_free = 0;
 out_detach:
@@ -936,9 +1330,15 @@ out_detach:
 out_free:
 	vfree(ubi->peb_buf1);
 	vfree(ubi->peb_buf2);
+	vfree(ubi->torture_buf);
 #ifdef CONFIG_MTD_UBI_DEBUG
 	vfree(ubi->dbg_peb_buf);
 #endif
+	if (ubi->vid_hdr_pool) {
+		ubi_free_vid_hdr(ubi, ubi->move_vid_hdr);
+		mempool_destroy(ubi->vid_hdr_pool);
+	}
+	ubi_debugfs_exit_dev(ubi);
 	kfree(ubi);
 	return err;
 }
@@ -975,6 +1375,13 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 #ifdef CONFIG_MTD_UBI_FASTSCAN
 	if(ubi_num == 0)
 	{
+		/* Buffered data has to be on the flash before the metadata */
+		spin_unlock(&ubi_devices_lock);
+		ret = ubi_wb_sync(ubi);
+		if (ret)
+			ubi_err("cannot flush write buffers, error %d", ret);
+		spin_lock(&ubi_devices_lock);
+
 		ubi_msg("update memtadata on Flash");	
 		ret = fastscan_update_metadata(ubi);
 		if(!ret)
@@ -1001,8 +1408,12 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 	 * Before freeing anything, we have to stop the background thread to
 	 * prevent it from doing anything on this device while we are freeing.
 	 */
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	ubi_bgt_pool_stop(ubi);
+#else
 	if (ubi->bgt_thread)
 		kthread_stop(ubi->bgt_thread);
+#endif
 
 	/*
 	 * Get a reference to the device in order to prevent 'dev_release()'
@@ -1017,9 +1428,15 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 	put_mtd_device(ubi->mtd);
 	vfree(ubi->peb_buf1);
 	vfree(ubi->peb_buf2);
+	vfree(ubi->torture_buf);
 #ifdef CONFIG_MTD_UBI_DEBUG
 	vfree(ubi->dbg_peb_buf);
 #endif
+	if (ubi->vid_hdr_pool) {
+		ubi_free_vid_hdr(ubi, ubi->move_vid_hdr);
+		mempool_destroy(ubi->vid_hdr_pool);
+	}
+	ubi_debugfs_exit_dev(ubi);
 	ubi_msg("mtd%d is detached from ubi%d", ubi->mtd->index, ubi->ubi_num);
 	put_device(&ubi->dev);
 	return 0;
@@ -1086,12 +1503,16 @@ static int __init ubi_init(void)
 		goto out_version;
 	}
 
-	ubi_wl_entry_slab = kmem_cache_create("ubi_wl_entry_slab",
-					      sizeof(struct ubi_wl_entry),
-					      0, 0, NULL);
-	if (!ubi_wl_entry_slab)
+	err = ubi_debugfs_init();
+	if (err)
 		goto out_dev_unreg;
 
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	err = ubi_bgt_pool_init();
+	if (err)
+		goto out_debugfs;
+#endif
+
 	/* Attach MTD devices */
 	for (i = 0; i < mtd_devs; i++) {
 		struct mtd_dev_param *p = &mtd_dev_param[i];
@@ -1125,7 +1546,11 @@ out_detach:
 			ubi_detach_mtd_dev(ubi_devices[k]->ubi_num, 1);
 			mutex_unlock(&ubi_devices_mutex);
 		}
-	kmem_cache_destroy(ubi_wl_entry_slab);
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	ubi_bgt_pool_exit();
+out_debugfs:
+#endif
+	ubi_debugfs_exit();
 out_dev_unreg:
 	misc_deregister(&ubi_ctrl_cdev);
 out_version:
@@ -1149,7 +1574,10 @@ static void __exit ubi_exit(void)
 			ubi_detach_mtd_dev(ubi_devices[i]->ubi_num, 1);
 			mutex_unlock(&ubi_devices_mutex);
 		}
-	kmem_cache_destroy(ubi_wl_entry_slab);
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	ubi_bgt_pool_exit();
+#endif
+	ubi_debugfs_exit();
 	misc_deregister(&ubi_ctrl_cdev);
 	class_remove_file(ubi_class, &ubi_version);
 	class_destroy(ubi_class);
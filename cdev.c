@@ -242,7 +242,7 @@ static ssize_t vol_cdev_read(struct file *file, __user char *buf, size_t count,
 		if (off + len >= vol->usable_leb_size)
 			len = vol->usable_leb_size - off;
 
-		err = ubi_eba_read_leb(ubi, vol, lnum, tbuf, off, len, 0);
+		err = ubi_wb_read(ubi, vol, lnum, tbuf, off, len, 0);
 		if (err)
 			break;
 
@@ -293,7 +293,7 @@ static ssize_t vol_cdev_direct_write(struct file *file, const char __user *buf,
 		return -EROFS;
 
 	lnum = div_u64_rem(*offp, vol->usable_leb_size, &off);
-	if (off & (ubi->min_io_size - 1)) {
+	if (!vol->wb_buf && off & (ubi->min_io_size - 1)) {
 		dbg_err("unaligned position");
 		return -EINVAL;
 	}
@@ -301,8 +301,11 @@ static ssize_t vol_cdev_direct_write(struct file *file, const char __user *buf,
 	if (*offp + count > vol->used_bytes)
 		count_save = count = vol->used_bytes - *offp;
 
-	/* We can write only in fractions of the minimum I/O unit */
-	if (count & (ubi->min_io_size - 1)) {
+	/*
+	 * We can write only in fractions of the minimum I/O unit, unless the
+	 * write buffer is enabled.
+	 */
+	if (!vol->wb_buf && count & (ubi->min_io_size - 1)) {
 		dbg_err("unaligned write length");
 		return -EINVAL;
 	}
@@ -328,8 +331,8 @@ static ssize_t vol_cdev_direct_write(struct file *file, const char __user *buf,
 			break;
 		}
 
-		err = ubi_eba_write_leb(ubi, vol, lnum, tbuf, off, len,
-					UBI_UNKNOWN);
+		err = ubi_wb_write(ubi, vol, lnum, tbuf, off, len,
+				   UBI_UNKNOWN);
 		if (err)
 			break;
 
@@ -400,6 +403,82 @@ static ssize_t vol_cdev_write(struct file *file, const char __user *buf,
 	return count;
 }
 
+/**
+ * leb_change_multi - handle the multi-LEB atomic change command.
+ * @desc: volume descriptor
+ * @req: the request
+ *
+ * This function copies the array of logical eraseblocks and their new
+ * contents from user-space and changes them in one transaction. Returns zero
+ * in case of success and a negative error code in case of failure.
+ */
+static int leb_change_multi(struct ubi_volume_desc *desc,
+			    const struct ubi_leb_change_multi_req *req)
+{
+	int err, i, count = req->count;
+	struct ubi_volume *vol = desc->vol;
+	struct ubi_leb_change_vec_req *ureq;
+	struct ubi_leb_change_vec *vec;
+
+	if (count < 1 || count > UBI_TXN_MAX_LEBS)
+		return -EINVAL;
+
+	ureq = kmalloc(count * sizeof(struct ubi_leb_change_vec_req),
+		       GFP_KERNEL);
+	if (!ureq)
+		return -ENOMEM;
+
+	vec = kzalloc(count * sizeof(struct ubi_leb_change_vec), GFP_KERNEL);
+	if (!vec) {
+		err = -ENOMEM;
+		goto out_free_ureq;
+	}
+
+	err = copy_from_user(ureq, (void __user *)(unsigned long)req->lebs,
+			     count * sizeof(struct ubi_leb_change_vec_req));
+	if (err) {
+		err = -EFAULT;
+		goto out_free;
+	}
+
+	for (i = 0; i < count; i++) {
+		void *buf;
+
+		if (ureq[i].bytes < 0 ||
+		    ureq[i].bytes > vol->usable_leb_size) {
+			err = -EINVAL;
+			goto out_free;
+		}
+
+		buf = vmalloc(ureq[i].bytes ? ureq[i].bytes : 1);
+		if (!buf) {
+			err = -ENOMEM;
+			goto out_free;
+		}
+		vec[i].lnum = ureq[i].lnum;
+		vec[i].buf = buf;
+		vec[i].len = ureq[i].bytes;
+
+		err = copy_from_user(buf,
+				     (void __user *)(unsigned long)ureq[i].buf,
+				     ureq[i].bytes);
+		if (err) {
+			err = -EFAULT;
+			goto out_free;
+		}
+	}
+
+	err = ubi_leb_change_multi(desc, vec, count, req->dtype);
+
+out_free:
+	for (i = 0; i < count; i++)
+		vfree((void *)vec[i].buf);
+	kfree(vec);
+out_free_ureq:
+	kfree(ureq);
+	return err;
+}
+
 static long vol_cdev_ioctl(struct file *file, unsigned int cmd,
 			   unsigned long arg)
 {
@@ -485,6 +564,28 @@ static long vol_cdev_ioctl(struct file *file, unsigned int cmd,
 		break;
 	}
 
+	/* Multi-LEB atomic change command */
+	case UBI_IOCEBCHMULTI:
+	{
+		struct ubi_leb_change_multi_req req;
+
+		err = copy_from_user(&req, argp,
+				     sizeof(struct ubi_leb_change_multi_req));
+		if (err) {
+			err = -EFAULT;
+			break;
+		}
+
+		if (desc->mode == UBI_READONLY ||
+		    vol->vol_type == UBI_STATIC_VOLUME) {
+			err = -EROFS;
+			break;
+		}
+
+		err = leb_change_multi(desc, &req);
+		break;
+	}
+
 	/* Logical eraseblock erasure command */
 	case UBI_IOCEBER:
 	{
@@ -512,7 +613,7 @@ static long vol_cdev_ioctl(struct file *file, unsigned int cmd,
 		if (err)
 			break;
 
-		err = ubi_wl_flush(ubi);
+		err = ubi_wl_flush(ubi, vol->vol_id, lnum);
 		break;
 	}
 
@@ -544,6 +645,21 @@ static long vol_cdev_ioctl(struct file *file, unsigned int cmd,
 		break;
 	}
 
+	/* Logical eraseblock range un-map command */
+	case UBI_IOCEBUNMAPRANGE:
+	{
+		struct ubi_unmap_range_req req;
+
+		err = copy_from_user(&req, argp,
+				     sizeof(struct ubi_unmap_range_req));
+		if (err) {
+			err = -EFAULT;
+			break;
+		}
+		err = ubi_leb_unmap_range(desc, req.lnum, req.count);
+		break;
+	}
+
 	/* Check if logical eraseblock is mapped command */
 	case UBI_IOCEBISMAP:
 	{
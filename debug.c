@@ -194,4 +194,398 @@ void ubi_dbg_dump_mkvol_req(const struct ubi_mkvol_req *req)
 	printk(KERN_DEBUG "\t1st 16 characters of name: %s\n", nm);
 }
 
+#ifdef CONFIG_MTD_UBI_DEBUGFS
+
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+
+/* The UBI debugfs directory */
+static struct dentry *dfs_rootdir;
+
+static int dfs_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+/*
+ * The erase counter histogram, one line per bucket up to the highest
+ * non-empty one. Each line contains the lowest erase counter of the bucket
+ * and the count of physical eraseblocks in it.
+ */
+static ssize_t dfs_ec_hist_read(struct file *file, char __user *user_buf,
+				size_t count, loff_t *ppos)
+{
+	struct ubi_device *ubi = file->private_data;
+	int i, last = 0, width, len = 0, hist[UBI_EC_HIST_BUCKETS];
+	char *buf;
+	ssize_t ret;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	spin_lock(&ubi->wl_lock);
+	memcpy(hist, ubi->ec_hist, sizeof(hist));
+	width = ubi->ec_hist_width;
+	spin_unlock(&ubi->wl_lock);
+
+	for (i = 0; i < UBI_EC_HIST_BUCKETS; i++)
+		if (hist[i])
+			last = i;
+
+	for (i = 0; i <= last; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d %d\n",
+				 i * width, hist[i]);
+
+	ret = simple_read_from_buffer(user_buf, count, ppos, buf, len);
+	kfree(buf);
+	return ret;
+}
+
+static const struct file_operations dfs_ec_hist_fops = {
+	.open  = dfs_open,
+	.read  = dfs_ec_hist_read,
+	.owner = THIS_MODULE,
+};
+
+#endif /* CONFIG_MTD_UBI_DEBUGFS */
+
+#ifdef CONFIG_MTD_UBI_DEBUG_LATENCY
+
+/* Wait point names in the order of the %UBI_LAT_* constants */
+static const char * const lat_names[UBI_LAT_POINTS] = {
+	"get_peb", "leb_write_lock", "alc_slot", "move_mutex",
+};
+
+/**
+ * ubi_dbg_lat_add - account a wait.
+ * @ubi: UBI device description object
+ * @point: the wait point (%UBI_LAT_GET_PEB, etc)
+ * @start: when the wait started
+ */
+void ubi_dbg_lat_add(struct ubi_device *ubi, int point, ktime_t start)
+{
+	struct ubi_lat_stat *st = &ubi->lat[point];
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	bucket = fls(min_t(s64, us, 1 << 30)) - 1;
+	if (bucket < 0)
+		bucket = 0;
+	else if (bucket >= UBI_LAT_BUCKETS)
+		bucket = UBI_LAT_BUCKETS - 1;
+
+	spin_lock(&ubi->lat_lock);
+	st->count += 1;
+	st->total_us += us;
+	if (us > st->max_us)
+		st->max_us = us;
+	st->hist[bucket] += 1;
+	spin_unlock(&ubi->lat_lock);
+}
+
+static ssize_t dfs_lat_read(struct file *file, char __user *user_buf,
+			    size_t count, loff_t *ppos)
+{
+	struct ubi_device *ubi = file->private_data;
+	struct ubi_lat_stat *lat;
+	char *buf;
+	int i, j, len = 0;
+	ssize_t ret = -ENOMEM;
+
+	lat = kmalloc(sizeof(ubi->lat), GFP_KERNEL);
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!lat || !buf)
+		goto out_free;
+
+	spin_lock(&ubi->lat_lock);
+	memcpy(lat, ubi->lat, sizeof(ubi->lat));
+	spin_unlock(&ubi->lat_lock);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "%-15s %10s %14s %10s  histogram (2^N usec)\n",
+			 "wait point", "count", "total usec", "max usec");
+	for (i = 0; i < UBI_LAT_POINTS; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%-15s %10llu %14llu %10llu ", lat_names[i],
+				 lat[i].count, lat[i].total_us,
+				 lat[i].max_us);
+		for (j = 0; j < UBI_LAT_BUCKETS; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %u",
+					 lat[i].hist[j]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	ret = simple_read_from_buffer(user_buf, count, ppos, buf, len);
+out_free:
+	kfree(buf);
+	kfree(lat);
+	return ret;
+}
+
+/* Writing anything to the file resets the statistics */
+static ssize_t dfs_lat_write(struct file *file, const char __user *user_buf,
+			     size_t count, loff_t *ppos)
+{
+	struct ubi_device *ubi = file->private_data;
+
+	spin_lock(&ubi->lat_lock);
+	memset(ubi->lat, 0, sizeof(ubi->lat));
+	spin_unlock(&ubi->lat_lock);
+	return count;
+}
+
+static const struct file_operations dfs_lat_fops = {
+	.open  = dfs_open,
+	.read  = dfs_lat_read,
+	.write = dfs_lat_write,
+	.owner = THIS_MODULE,
+};
+
+#endif /* CONFIG_MTD_UBI_DEBUG_LATENCY */
+
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+
+/**
+ * trace_add - add a record to the trace ring buffer.
+ * @ubi: UBI device description object
+ * @op: the operation
+ * @vol_id: volume ID
+ * @lnum: logical eraseblock number
+ * @dtype: data type
+ *
+ * Note, @ubi->trace_lock has to be locked and there has to be free space in
+ * the ring buffer.
+ */
+static void trace_add(struct ubi_device *ubi, int op, int vol_id, int lnum,
+		      int dtype)
+{
+	struct ubi_trace_rec *rec;
+
+	rec = &ubi->trace[ubi->trace_head & (UBI_TRACE_RECS - 1)];
+	rec->op = op;
+	rec->vol_id = vol_id;
+	rec->lnum = lnum;
+	rec->dtype = dtype;
+	ubi->trace_head += 1;
+}
+
+/**
+ * ubi_dbg_trace - record a LEB operation.
+ * @ubi: UBI device description object
+ * @op: the operation (%UBI_TRACE_MAP, etc)
+ * @vol_id: volume ID
+ * @lnum: logical eraseblock number
+ * @dtype: data type the LEB was mapped for (%UBI_TRACE_MAP only)
+ *
+ * If the ring buffer is full, the record is lost. The count of lost records
+ * is reported by a %UBI_TRACE_LOST record as soon as there is room for it, so
+ * that the replaying side knows where the trace has a gap.
+ */
+void ubi_dbg_trace(struct ubi_device *ubi, int op, int vol_id, int lnum,
+		   int dtype)
+{
+	unsigned int room;
+
+	if (!ubi->trace_enabled)
+		return;
+
+	spin_lock(&ubi->trace_lock);
+	if (!ubi->trace_enabled)
+		goto out_unlock;
+
+	room = UBI_TRACE_RECS - (ubi->trace_head - ubi->trace_tail);
+	if (room < (ubi->trace_lost ? 2 : 1)) {
+		ubi->trace_lost += 1;
+		goto out_unlock;
+	}
+
+	if (ubi->trace_lost) {
+		trace_add(ubi, UBI_TRACE_LOST, 0, ubi->trace_lost, 0);
+		ubi->trace_lost = 0;
+	}
+	trace_add(ubi, op, vol_id, lnum, dtype);
+
+out_unlock:
+	spin_unlock(&ubi->trace_lock);
+}
+
+/* Reading consumes the records, so the file is read as a stream */
+static ssize_t dfs_trace_read(struct file *file, char __user *user_buf,
+			      size_t count, loff_t *ppos)
+{
+	struct ubi_device *ubi = file->private_data;
+	struct ubi_trace_rec *rec;
+	char *buf, line[48];
+	int n;
+	size_t len = 0;
+	ssize_t ret;
+
+	if (count > PAGE_SIZE)
+		count = PAGE_SIZE;
+	buf = kmalloc(count, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	spin_lock(&ubi->trace_lock);
+	while (ubi->trace_tail != ubi->trace_head) {
+		rec = &ubi->trace[ubi->trace_tail & (UBI_TRACE_RECS - 1)];
+		n = snprintf(line, sizeof(line), "%c %d %d %d\n", rec->op,
+			     rec->vol_id, rec->lnum, rec->dtype);
+		if (len + n > count)
+			break;
+		memcpy(buf + len, line, n);
+		len += n;
+		ubi->trace_tail += 1;
+	}
+	spin_unlock(&ubi->trace_lock);
+
+	ret = len;
+	if (copy_to_user(user_buf, buf, len))
+		ret = -EFAULT;
+	kfree(buf);
+	return ret;
+}
+
+/* Writing "1" starts recording and writing "0" stops it */
+static ssize_t dfs_trace_write(struct file *file, const char __user *user_buf,
+			       size_t count, loff_t *ppos)
+{
+	struct ubi_device *ubi = file->private_data;
+	char c;
+
+	if (count == 0)
+		return 0;
+	if (copy_from_user(&c, user_buf, 1))
+		return -EFAULT;
+	if (c != '0' && c != '1')
+		return -EINVAL;
+
+	spin_lock(&ubi->trace_lock);
+	ubi->trace_enabled = (c == '1');
+	ubi->trace_head = ubi->trace_tail = 0;
+	ubi->trace_lost = 0;
+	spin_unlock(&ubi->trace_lock);
+	return count;
+}
+
+static const struct file_operations dfs_trace_fops = {
+	.open  = dfs_open,
+	.read  = dfs_trace_read,
+	.write = dfs_trace_write,
+	.owner = THIS_MODULE,
+};
+
+#endif /* CONFIG_MTD_UBI_DEBUG_TRACE */
+
+#ifdef CONFIG_MTD_UBI_DEBUGFS
+
+/**
+ * ubi_debugfs_init - create the UBI debugfs directory.
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubi_debugfs_init(void)
+{
+	int err;
+
+	dfs_rootdir = debugfs_create_dir(UBI_NAME_STR, NULL);
+	if (!dfs_rootdir || IS_ERR(dfs_rootdir)) {
+		err = dfs_rootdir ? PTR_ERR(dfs_rootdir) : -ENODEV;
+		ubi_err("cannot create \"%s\" debugfs directory, error %d",
+			UBI_NAME_STR, err);
+		dfs_rootdir = NULL;
+		return err;
+	}
+	return 0;
+}
+
+/**
+ * ubi_debugfs_exit - remove the UBI debugfs directory.
+ */
+void ubi_debugfs_exit(void)
+{
+	debugfs_remove(dfs_rootdir);
+}
+
+/**
+ * ubi_debugfs_init_dev - initialize debugfs for an UBI device.
+ * @ubi: UBI device description object
+ *
+ * This function initializes the debugging statistics and buffers of the UBI
+ * device and creates its debugfs directory. Returns zero in case of success
+ * and a negative error code in case of failure.
+ */
+int ubi_debugfs_init_dev(struct ubi_device *ubi)
+{
+	char name[sizeof(UBI_NAME_STR) + 5];
+	struct dentry *dent;
+	int err = -ENOMEM;
+
+	sprintf(name, UBI_NAME_STR "%d", ubi->ubi_num);
+
+#ifdef CONFIG_MTD_UBI_DEBUG_LATENCY
+	spin_lock_init(&ubi->lat_lock);
+#endif
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+	spin_lock_init(&ubi->trace_lock);
+	ubi->trace = vmalloc(UBI_TRACE_RECS * sizeof(struct ubi_trace_rec));
+	if (!ubi->trace)
+		goto out;
+#endif
+
+	dent = debugfs_create_dir(name, dfs_rootdir);
+	if (!dent || IS_ERR(dent))
+		goto out_dent;
+	ubi->dfs_dir = dent;
+
+	dent = debugfs_create_file("ec_histogram", S_IRUSR, ubi->dfs_dir, ubi,
+				   &dfs_ec_hist_fops);
+	if (!dent || IS_ERR(dent))
+		goto out_dent;
+
+#ifdef CONFIG_MTD_UBI_DEBUG_LATENCY
+	dent = debugfs_create_file("latency", S_IWUSR | S_IRUSR, ubi->dfs_dir,
+				   ubi, &dfs_lat_fops);
+	if (!dent || IS_ERR(dent))
+		goto out_dent;
+#endif
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+	dent = debugfs_create_file("trace", S_IWUSR | S_IRUSR, ubi->dfs_dir,
+				   ubi, &dfs_trace_fops);
+	if (!dent || IS_ERR(dent))
+		goto out_dent;
+#endif
+	return 0;
+
+out_dent:
+	err = dent ? PTR_ERR(dent) : -ENODEV;
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+out:
+#endif
+	ubi_err("cannot initialize debugfs for %s, error %d", name, err);
+	ubi_debugfs_exit_dev(ubi);
+	return err;
+}
+
+/**
+ * ubi_debugfs_exit_dev - remove debugfs files of an UBI device.
+ * @ubi: UBI device description object
+ */
+void ubi_debugfs_exit_dev(struct ubi_device *ubi)
+{
+	debugfs_remove_recursive(ubi->dfs_dir);
+	ubi->dfs_dir = NULL;
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+	vfree(ubi->trace);
+	ubi->trace = NULL;
+#endif
+}
+
+#endif /* CONFIG_MTD_UBI_DEBUGFS */
+
 #endif /* CONFIG_MTD_UBI_DEBUG */
@@ -169,4 +169,112 @@ static inline int ubi_dbg_is_erase_failure(void)
 #define ubi_dbg_is_erase_failure() 0
 
 #endif /* !CONFIG_MTD_UBI_DEBUG */
+
+/*
+ * Wait points where writers may block, see 'ubi_dbg_lat_add()'.
+ *
+ * UBI_LAT_GET_PEB: waiting for a free physical eraseblock to be produced
+ * UBI_LAT_LEB_LOCK: waiting for a logical eraseblock write lock
+ * UBI_LAT_ALC_SLOT: waiting for an atomic LEB change slot
+ * UBI_LAT_MOVE_MUTEX: waiting for the wear-leveling worker to finish moving
+ */
+enum {
+	UBI_LAT_GET_PEB,
+	UBI_LAT_LEB_LOCK,
+	UBI_LAT_ALC_SLOT,
+	UBI_LAT_MOVE_MUTEX,
+	UBI_LAT_POINTS
+};
+
+#ifdef CONFIG_MTD_UBI_DEBUG_LATENCY
+#include <linux/ktime.h>
+
+struct ubi_device;
+
+/* Count of buckets in wait time histograms, bucket @i is 2^@i microseconds */
+#define UBI_LAT_BUCKETS 20
+
+/**
+ * struct ubi_lat_stat - wait point statistics.
+ * @count: how many times writers had to wait
+ * @total_us: total wait time in microseconds
+ * @max_us: longest wait in microseconds
+ * @hist: wait time histogram, bucket @i counts waits which took from 2^@i
+ *        to 2^(@i+1) microseconds (the first bucket also counts shorter
+ *        waits, the last one - longer waits)
+ */
+struct ubi_lat_stat {
+	unsigned long long count;
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned int hist[UBI_LAT_BUCKETS];
+};
+
+typedef ktime_t ubi_lat_t;
+#define ubi_lat_begin() ktime_get()
+#define ubi_lat_end(ubi, point, t) ubi_dbg_lat_add(ubi, point, t)
+
+void ubi_dbg_lat_add(struct ubi_device *ubi, int point, ktime_t start);
+#else
+typedef int ubi_lat_t;
+#define ubi_lat_begin()            0
+#define ubi_lat_end(ubi, point, t) ({ (void)(t); })
+#endif /* !CONFIG_MTD_UBI_DEBUG_LATENCY */
+
+/*
+ * LEB operations recorded by 'ubi_dbg_trace()'. The trace is read from the
+ * "ubi/ubiX/trace" debugfs file as text lines of "<op> <vol_id> <lnum>
+ * <dtype>" format, which is what the userspace wear-leveling simulator in
+ * tools/wlsim replays.
+ *
+ * UBI_TRACE_MAP: the LEB was mapped to a new PEB (if it was mapped, the old
+ *                PEB was put)
+ * UBI_TRACE_UNMAP: the LEB was un-mapped
+ * UBI_TRACE_READ: the LEB was read from the flash
+ * UBI_TRACE_LOST: records were lost because the ring buffer was full, the
+ *                 count of lost records is in the @lnum field
+ */
+#define UBI_TRACE_MAP   'M'
+#define UBI_TRACE_UNMAP 'U'
+#define UBI_TRACE_READ  'R'
+#define UBI_TRACE_LOST  'L'
+
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+/* How many LEB operations may be buffered, has to be a power of 2 */
+#define UBI_TRACE_RECS 16384
+
+/**
+ * struct ubi_trace_rec - a recorded LEB operation.
+ * @vol_id: volume ID
+ * @lnum: logical eraseblock number
+ * @op: the operation (%UBI_TRACE_MAP, etc)
+ * @dtype: data type the LEB was mapped for
+ */
+struct ubi_trace_rec {
+	int vol_id;
+	int lnum;
+	unsigned char op;
+	unsigned char dtype;
+};
+
+struct ubi_device;
+
+void ubi_dbg_trace(struct ubi_device *ubi, int op, int vol_id, int lnum,
+		   int dtype);
+#else
+#define ubi_dbg_trace(ubi, op, vol_id, lnum, dtype) ({})
+#endif /* !CONFIG_MTD_UBI_DEBUG_TRACE */
+
+#ifdef CONFIG_MTD_UBI_DEBUGFS
+int ubi_debugfs_init(void);
+void ubi_debugfs_exit(void);
+int ubi_debugfs_init_dev(struct ubi_device *ubi);
+void ubi_debugfs_exit_dev(struct ubi_device *ubi);
+#else
+#define ubi_debugfs_init()         0
+#define ubi_debugfs_exit()         ({})
+#define ubi_debugfs_init_dev(ubi)  0
+#define ubi_debugfs_exit_dev(ubi)  ({})
+#endif /* !CONFIG_MTD_UBI_DEBUGFS */
+
 #endif /* !__UBI_DEBUG_H__ */
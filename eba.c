@@ -29,10 +29,23 @@
  *
  * The EBA sub-system implements per-logical eraseblock locking. Before
  * accessing a logical eraseblock it is locked for reading or writing. The
- * per-logical eraseblock locking is implemented by means of the lock tree. The
- * lock tree is an RB-tree which refers all the currently locked logical
- * eraseblocks. The lock tree elements are &struct ubi_ltree_entry objects.
- * They are indexed by (@vol_id, @lnum) pairs.
+ * locks are a fixed-size array of read/write semaphores (@ubi->leb_locks)
+ * indexed by a hash of the (@vol_id, @lnum) pair, so locking does not need to
+ * allocate memory. Different logical eraseblocks may hash to the same lock,
+ * which only causes some false contention: UBI never holds more than one
+ * logical eraseblock lock at a time, and the wear-leveling worker only
+ * try-locks (see 'ubi_eba_copy_leb()'), so sharing cannot dead-lock. The only
+ * exception are multi-LEB transactions and range un-maps, which take all their
+ * locks at once, serialized by @ubi->leb_multi_mutex (see
+ * 'leb_write_lock_multi()').
+ *
+ * Multi-LEB transactions change several logical eraseblocks of a volume
+ * atomically. The new physical eraseblocks are marked with the sequence
+ * number of the transaction (@txn_sqnum in the VID header), and the
+ * transaction is committed by changing the only logical eraseblock of the
+ * transaction volume, which keeps the table of committed transaction physical
+ * eraseblocks. The scanning code drops marked physical eraseblocks which are
+ * not referred to by the table.
  *
  * EBA also maintains the global sequence counter which is incremented each
  * time a logical eraseblock is mapped to a physical eraseblock and it is
@@ -44,10 +57,28 @@
 #include <linux/slab.h>
 #include <linux/crc32.h>
 #include <linux/err.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
 #include "ubi.h"
 
-/* Number of physical eraseblocks reserved for atomic LEB change operation */
-#define EBA_RESERVED_PEBS 1
+/*
+ * Number of physical eraseblocks reserved for atomic LEB change operation,
+ * i.e. how many of them may be done in parallel
+ */
+#define EBA_RESERVED_PEBS CONFIG_MTD_UBI_ALC_SLOTS
+
+/*
+ * If a logical eraseblock was mapped to a new physical eraseblock this many
+ * times recently, its data are considered to be short-term, see
+ * 'infer_dtype()'.
+ */
+#define EBA_HOT_MAPS 3
+
+/*
+ * How many logical eraseblocks 'ubi_eba_unmap_lebs()' un-maps under one set
+ * of locks and hands over to the WL sub-system at once
+ */
+#define EBA_UNMAP_BATCH 512
 
 /**
  * next_sqnum - get next sequence number.
@@ -56,6 +87,13 @@
  * This function returns next sequence number to use, which is just the current
  * global sequence counter value. It also increases the global sequence
  * counter.
+ *
+ * The counter is a single atomic variable rather than per-CPU ranges, because
+ * 'compare_lebs()' relies on a later mapping of a logical eraseblock always
+ * having a higher sequence number. Mappings of the same logical eraseblock are
+ * serialized by the LEB lock, so one atomic increment per mapping is enough.
+ * Architectures without 64-bit atomic operations fall back to a spinlock which
+ * protects nothing but the counter.
  */
 #ifdef CONFIG_MTD_UBI_FASTSCAN
 unsigned long long next_sqnum(struct ubi_device *ubi)
@@ -63,138 +101,74 @@ unsigned long long next_sqnum(struct ubi_device *ubi)
 static unsigned long long next_sqnum(struct ubi_device *ubi)
 #endif
 {
+#ifdef CONFIG_64BIT
+	return atomic64_inc_return(&ubi->global_sqnum) - 1;
+#else
 	unsigned long long sqnum;
 
-	spin_lock(&ubi->ltree_lock);
+	spin_lock(&ubi->sqnum_lock);
 	sqnum = ubi->global_sqnum++;
-	spin_unlock(&ubi->ltree_lock);
+	spin_unlock(&ubi->sqnum_lock);
 
 	return sqnum;
+#endif
 }
 
 /**
- * ubi_get_compat - get compatibility flags of a volume.
+ * ubi_eba_cur_sqnum - get current sequence number.
  * @ubi: UBI device description object
- * @vol_id: volume ID
  *
- * This function returns compatibility flags for an internal volume. User
- * volumes have no compatibility flags, so %0 is returned.
+ * This function returns the sequence number which the next mapped logical
+ * eraseblock will get, without increasing the global sequence counter.
  */
-static int ubi_get_compat(const struct ubi_device *ubi, int vol_id)
+unsigned long long ubi_eba_cur_sqnum(struct ubi_device *ubi)
 {
-	if (vol_id == UBI_LAYOUT_VOLUME_ID)
-		return UBI_LAYOUT_VOLUME_COMPAT;
-	return 0;
+#ifdef CONFIG_64BIT
+	return atomic64_read(&ubi->global_sqnum);
+#else
+	unsigned long long sqnum;
+
+	spin_lock(&ubi->sqnum_lock);
+	sqnum = ubi->global_sqnum;
+	spin_unlock(&ubi->sqnum_lock);
+
+	return sqnum;
+#endif
 }
 
 /**
- * ltree_lookup - look up the lock tree.
+ * ubi_get_compat - get compatibility flags of a volume.
  * @ubi: UBI device description object
  * @vol_id: volume ID
- * @lnum: logical eraseblock number
  *
- * This function returns a pointer to the corresponding &struct ubi_ltree_entry
- * object if the logical eraseblock is locked and %NULL if it is not.
- * @ubi->ltree_lock has to be locked.
+ * This function returns compatibility flags for an internal volume. User
+ * volumes have no compatibility flags, so %0 is returned.
  */
-static struct ubi_ltree_entry *ltree_lookup(struct ubi_device *ubi, int vol_id,
-					    int lnum)
+static int ubi_get_compat(const struct ubi_device *ubi, int vol_id)
 {
-	struct rb_node *p;
-
-	p = ubi->ltree.rb_node;
-	while (p) {
-		struct ubi_ltree_entry *le;
-
-		le = rb_entry(p, struct ubi_ltree_entry, rb);
-
-		if (vol_id < le->vol_id)
-			p = p->rb_left;
-		else if (vol_id > le->vol_id)
-			p = p->rb_right;
-		else {
-			if (lnum < le->lnum)
-				p = p->rb_left;
-			else if (lnum > le->lnum)
-				p = p->rb_right;
-			else
-				return le;
-		}
-	}
-
-	return NULL;
+	if (vol_id == UBI_LAYOUT_VOLUME_ID)
+		return UBI_LAYOUT_VOLUME_COMPAT;
+	if (vol_id == UBI_TXN_VOLUME_ID)
+		return UBI_TXN_VOLUME_COMPAT;
+	return 0;
 }
 
 /**
- * ltree_add_entry - add new entry to the lock tree.
+ * leb_lock - find the lock of a logical eraseblock.
  * @ubi: UBI device description object
  * @vol_id: volume ID
  * @lnum: logical eraseblock number
  *
- * This function adds new entry for logical eraseblock (@vol_id, @lnum) to the
- * lock tree. If such entry is already there, its usage counter is increased.
- * Returns pointer to the lock tree entry or %-ENOMEM if memory allocation
- * failed.
+ * This function returns the read/write semaphore which serializes access to
+ * logical eraseblock (@vol_id, @lnum). The locks are pre-allocated and
+ * hashed, so several logical eraseblocks may share the same lock.
  */
-static struct ubi_ltree_entry *ltree_add_entry(struct ubi_device *ubi,
-					       int vol_id, int lnum)
+static struct rw_semaphore *leb_lock(struct ubi_device *ubi, int vol_id,
+				     int lnum)
 {
-	struct ubi_ltree_entry *le, *le1, *le_free;
-
-	le = kmalloc(sizeof(struct ubi_ltree_entry), GFP_NOFS);
-	if (!le)
-		return ERR_PTR(-ENOMEM);
-
-	le->users = 0;
-	init_rwsem(&le->mutex);
-	le->vol_id = vol_id;
-	le->lnum = lnum;
-
-	spin_lock(&ubi->ltree_lock);
-	le1 = ltree_lookup(ubi, vol_id, lnum);
+	unsigned long key = ((unsigned long)vol_id << 20) ^ lnum;
 
-	if (le1) {
-		/*
-		 * This logical eraseblock is already locked. The newly
-		 * allocated lock entry is not needed.
-		 */
-		le_free = le;
-		le = le1;
-	} else {
-		struct rb_node **p, *parent = NULL;
-
-		/*
-		 * No lock entry, add the newly allocated one to the
-		 * @ubi->ltree RB-tree.
-		 */
-		le_free = NULL;
-
-		p = &ubi->ltree.rb_node;
-		while (*p) {
-			parent = *p;
-			le1 = rb_entry(parent, struct ubi_ltree_entry, rb);
-
-			if (vol_id < le1->vol_id)
-				p = &(*p)->rb_left;
-			else if (vol_id > le1->vol_id)
-				p = &(*p)->rb_right;
-			else {
-				ubi_assert(lnum != le1->lnum);
-				if (lnum < le1->lnum)
-					p = &(*p)->rb_left;
-				else
-					p = &(*p)->rb_right;
-			}
-		}
-
-		rb_link_node(&le->rb, parent, p);
-		rb_insert_color(&le->rb, &ubi->ltree);
-	}
-	le->users += 1;
-	spin_unlock(&ubi->ltree_lock);
-
-	kfree(le_free);
-	return le;
+	return &ubi->leb_locks[hash_long(key, UBI_LEB_LOCKS_SHIFT)];
 }
 
 /**
@@ -208,12 +182,7 @@ static struct ubi_ltree_entry *ltree_add_entry(struct ubi_device *ubi,
  */
 static int leb_read_lock(struct ubi_device *ubi, int vol_id, int lnum)
 {
-	struct ubi_ltree_entry *le;
-
-	le = ltree_add_entry(ubi, vol_id, lnum);
-	if (IS_ERR(le))
-		return PTR_ERR(le);
-	down_read(&le->mutex);
+	down_read(leb_lock(ubi, vol_id, lnum));
 	return 0;
 }
 
@@ -225,18 +194,7 @@ static int leb_read_lock(struct ubi_device *ubi, int vol_id, int lnum)
  */
 static void leb_read_unlock(struct ubi_device *ubi, int vol_id, int lnum)
 {
-	struct ubi_ltree_entry *le;
-
-	spin_lock(&ubi->ltree_lock);
-	le = ltree_lookup(ubi, vol_id, lnum);
-	le->users -= 1;
-	ubi_assert(le->users >= 0);
-	up_read(&le->mutex);
-	if (le->users == 0) {
-		rb_erase(&le->rb, &ubi->ltree);
-		kfree(le);
-	}
-	spin_unlock(&ubi->ltree_lock);
+	up_read(leb_lock(ubi, vol_id, lnum));
 }
 
 /**
@@ -250,46 +208,31 @@ static void leb_read_unlock(struct ubi_device *ubi, int vol_id, int lnum)
  */
 static int leb_write_lock(struct ubi_device *ubi, int vol_id, int lnum)
 {
-	struct ubi_ltree_entry *le;
+	struct rw_semaphore *sem = leb_lock(ubi, vol_id, lnum);
+
+	if (!down_write_trylock(sem)) {
+		ubi_lat_t start = ubi_lat_begin();
 
-	le = ltree_add_entry(ubi, vol_id, lnum);
-	if (IS_ERR(le))
-		return PTR_ERR(le);
-	down_write(&le->mutex);
+		down_write(sem);
+		ubi_lat_end(ubi, UBI_LAT_LEB_LOCK, start);
+	}
 	return 0;
 }
 
 /**
- * leb_write_lock - lock logical eraseblock for writing.
+ * leb_write_trylock - try to lock logical eraseblock for writing.
  * @ubi: UBI device description object
  * @vol_id: volume ID
  * @lnum: logical eraseblock number
  *
  * This function locks a logical eraseblock for writing if there is no
  * contention and does nothing if there is contention. Returns %0 in case of
- * success, %1 in case of contention, and and a negative error code in case of
- * failure.
+ * success and %1 in case of contention.
  */
 static int leb_write_trylock(struct ubi_device *ubi, int vol_id, int lnum)
 {
-	struct ubi_ltree_entry *le;
-
-	le = ltree_add_entry(ubi, vol_id, lnum);
-	if (IS_ERR(le))
-		return PTR_ERR(le);
-	if (down_write_trylock(&le->mutex))
+	if (down_write_trylock(leb_lock(ubi, vol_id, lnum)))
 		return 0;
-
-	/* Contention, cancel */
-	spin_lock(&ubi->ltree_lock);
-	le->users -= 1;
-	ubi_assert(le->users >= 0);
-	if (le->users == 0) {
-		rb_erase(&le->rb, &ubi->ltree);
-		kfree(le);
-	}
-	spin_unlock(&ubi->ltree_lock);
-
 	return 1;
 }
 
@@ -301,18 +244,158 @@ static int leb_write_trylock(struct ubi_device *ubi, int vol_id, int lnum)
  */
 static void leb_write_unlock(struct ubi_device *ubi, int vol_id, int lnum)
 {
-	struct ubi_ltree_entry *le;
-
-	spin_lock(&ubi->ltree_lock);
-	le = ltree_lookup(ubi, vol_id, lnum);
-	le->users -= 1;
-	ubi_assert(le->users >= 0);
-	up_write(&le->mutex);
-	if (le->users == 0) {
-		rb_erase(&le->rb, &ubi->ltree);
-		kfree(le);
-	}
-	spin_unlock(&ubi->ltree_lock);
+	up_write(leb_lock(ubi, vol_id, lnum));
+}
+
+/* Compare LEB locks by address, used by 'leb_write_lock_multi()' */
+static int cmp_leb_lock(const void *a, const void *b)
+{
+	const struct rw_semaphore *sem1 = *(struct rw_semaphore * const *)a;
+	const struct rw_semaphore *sem2 = *(struct rw_semaphore * const *)b;
+
+	if (sem1 < sem2)
+		return -1;
+	return sem1 > sem2;
+}
+
+/**
+ * leb_write_lock_multi - lock several logical eraseblocks for writing.
+ * @ubi: UBI device description object
+ * @sems: locks of the logical eraseblocks (see 'leb_lock()')
+ * @count: count of elements in @sems
+ *
+ * This function sorts @sems by address, drops duplicates, which appear when
+ * logical eraseblocks share a lock, and takes the locks. Tasks which lock
+ * several logical eraseblocks are serialized by @ubi->leb_multi_mutex, and
+ * everybody else holds at most one logical eraseblock lock, so this cannot
+ * dead-lock. Returns the count of locks taken, which has to be passed to
+ * 'leb_write_unlock_multi()'.
+ *
+ * Lockdep cannot track dozens of locks of the same class held at once: it
+ * would report recursive locking and run out of its held locks stack. So
+ * every lock is hidden from lockdep as soon as it is taken, and lockdep only
+ * checks that it is taken under @ubi->leb_multi_mutex.
+ */
+static int leb_write_lock_multi(struct ubi_device *ubi,
+				struct rw_semaphore **sems, int count)
+{
+	int i, n = 0;
+
+	sort(sems, count, sizeof(struct rw_semaphore *), cmp_leb_lock, NULL);
+	for (i = 0; i < count; i++)
+		if (n == 0 || sems[n - 1] != sems[i])
+			sems[n++] = sems[i];
+
+	mutex_lock(&ubi->leb_multi_mutex);
+	for (i = 0; i < n; i++) {
+		if (!down_write_trylock(sems[i])) {
+			ubi_lat_t start = ubi_lat_begin();
+
+			down_write(sems[i]);
+			ubi_lat_end(ubi, UBI_LAT_LEB_LOCK, start);
+		}
+		rwsem_release(&sems[i]->dep_map, 1, _RET_IP_);
+	}
+	return n;
+}
+
+/**
+ * leb_write_unlock_multi - unlock several logical eraseblocks.
+ * @ubi: UBI device description object
+ * @sems: locks taken by 'leb_write_lock_multi()'
+ * @count: count of locks taken
+ */
+static void leb_write_unlock_multi(struct ubi_device *ubi,
+				   struct rw_semaphore **sems, int count)
+{
+	while (count--) {
+		/* Show the lock to lockdep again, see 'leb_write_lock_multi()' */
+		rwsem_acquire(&sems[count]->dep_map, 0, 1, _RET_IP_);
+		up_write(sems[count]);
+	}
+	mutex_unlock(&ubi->leb_multi_mutex);
+}
+
+/**
+ * clear_dead_tail - forget the dead tail of a logical eraseblock.
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ *
+ * This function is called when logical eraseblock @lnum is written to or
+ * un-mapped, so the data which was discarded earlier (see
+ * 'ubi_eba_discard()') is either gone or may be live again. The caller has to
+ * hold the logical eraseblock lock.
+ */
+static void clear_dead_tail(struct ubi_volume *vol, int lnum)
+{
+	if (vol->leb_dead)
+		vol->leb_dead[lnum] = 0;
+}
+
+/**
+ * st_leb_get - get cached VID header data of a static volume LEB.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @crc: the data CRC is returned here
+ *
+ * This function returns the data size of logical eraseblock @lnum and stores
+ * its data CRC in @crc, or returns %0 if they are not known.
+ */
+static int st_leb_get(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		      uint32_t *crc)
+{
+	int data_size = 0;
+
+	spin_lock(&ubi->volumes_lock);
+	if (vol->st_lebs && lnum < vol->reserved_pebs) {
+		data_size = vol->st_lebs[lnum].data_size;
+		*crc = vol->st_lebs[lnum].data_crc;
+	}
+	spin_unlock(&ubi->volumes_lock);
+	return data_size;
+}
+
+/**
+ * st_leb_set - set cached VID header data of a static volume LEB.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @data_size: data size, %0 to forget the cached data
+ * @crc: data CRC
+ *
+ * The cache is allocated on first use and is kept until the volume is re-sized
+ * or removed, like the dead tails. If there is no memory, nothing is cached.
+ * Both fields are updated under @ubi->volumes_lock, so 'st_leb_get()' never
+ * sees a data size with the CRC of another write, and re-size may replace the
+ * array at any time.
+ */
+static void st_leb_set(struct ubi_device *ubi, struct ubi_volume *vol,
+		       int lnum, int data_size, uint32_t crc)
+{
+	struct ubi_st_leb *st_lebs = NULL;
+
+	if (vol->vol_type != UBI_STATIC_VOLUME)
+		return;
+
+	if (!vol->st_lebs && data_size) {
+		st_lebs = kcalloc(vol->reserved_pebs, sizeof(struct ubi_st_leb),
+				  GFP_NOFS);
+		if (!st_lebs)
+			return;
+	}
+
+	spin_lock(&ubi->volumes_lock);
+	if (!vol->st_lebs) {
+		vol->st_lebs = st_lebs;
+		st_lebs = NULL;
+	}
+	if (vol->st_lebs && lnum < vol->reserved_pebs) {
+		vol->st_lebs[lnum].data_size = data_size;
+		vol->st_lebs[lnum].data_crc = crc;
+	}
+	spin_unlock(&ubi->volumes_lock);
+	kfree(st_lebs);
 }
 
 /**
@@ -333,6 +416,7 @@ int ubi_eba_unmap_leb(struct ubi_device *ubi, struct ubi_volume *vol,
 	if (ubi->ro_mode)
 		return -EROFS;
 
+	ubi_wb_drop(vol, lnum, 1);
 	err = leb_write_lock(ubi, vol_id, lnum);
 	if (err)
 		return err;
@@ -344,14 +428,254 @@ int ubi_eba_unmap_leb(struct ubi_device *ubi, struct ubi_volume *vol,
 
 	dbg_eba("erase LEB %d:%d, PEB %d", vol_id, lnum, pnum);
 
+	ubi_dbg_trace(ubi, UBI_TRACE_UNMAP, vol_id, lnum, 0);
 	vol->eba_tbl[lnum] = UBI_LEB_UNMAPPED;
-	err = ubi_wl_put_peb(ubi, pnum, 0);
+	clear_dead_tail(vol, lnum);
+	ubi_rc_invalidate(vol, lnum);
+	st_leb_set(ubi, vol, lnum, 0, 0);
+	err = ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 0);
+
+out_unlock:
+	leb_write_unlock(ubi, vol_id, lnum);
+	return err;
+}
+
+/**
+ * ubi_eba_unmap_lebs - un-map a range of logical eraseblocks.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: first logical eraseblock number to un-map
+ * @count: how many logical eraseblocks to un-map
+ *
+ * This function is the same as calling 'ubi_eba_unmap_leb()' for @count
+ * logical eraseblocks starting from @lnum, but it locks the logical
+ * eraseblocks and returns their physical eraseblocks to the WL sub-system in
+ * batches of %EBA_UNMAP_BATCH, so wiping a large volume does not cost a lock
+ * round-trip and an erase work submission per logical eraseblock. This
+ * function does not wait for the physical eraseblocks to be erased. Returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+int ubi_eba_unmap_lebs(struct ubi_device *ubi, struct ubi_volume *vol,
+		       int lnum, int count)
+{
+	int err = 0, i, n, batch, vol_id = vol->vol_id;
+	struct rw_semaphore **sems;
+	int *pnums;
+
+	if (ubi->ro_mode)
+		return -EROFS;
+
+	batch = min_t(int, count, EBA_UNMAP_BATCH);
+	if (batch <= 0)
+		return 0;
+
+	ubi_wb_drop(vol, lnum, count);
+
+	sems = kmalloc(batch * sizeof(struct rw_semaphore *), GFP_NOFS);
+	pnums = kmalloc(batch * sizeof(int), GFP_NOFS);
+	if (!sems || !pnums) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	dbg_eba("erase LEBs %d:%d-%d", vol_id, lnum, lnum + count - 1);
+
+	while (count > 0) {
+		batch = min_t(int, count, EBA_UNMAP_BATCH);
+
+		for (i = 0; i < batch; i++)
+			sems[i] = leb_lock(ubi, vol_id, lnum + i);
+		n = leb_write_lock_multi(ubi, sems, batch);
+
+		for (i = 0; i < batch; i++) {
+			pnums[i] = vol->eba_tbl[lnum + i];
+			if (pnums[i] < 0)
+				continue;
+			ubi_dbg_trace(ubi, UBI_TRACE_UNMAP, vol_id, lnum + i, 0);
+			vol->eba_tbl[lnum + i] = UBI_LEB_UNMAPPED;
+			clear_dead_tail(vol, lnum + i);
+			ubi_rc_invalidate(vol, lnum + i);
+			st_leb_set(ubi, vol, lnum + i, 0, 0);
+		}
+
+		leb_write_unlock_multi(ubi, sems, n);
+
+		/*
+		 * The physical eraseblocks are put after the logical
+		 * eraseblocks are unlocked. This is fine, because the WL
+		 * worker re-checks the EBA table under the LEB lock and does
+		 * not move physical eraseblocks which are not mapped anymore.
+		 */
+		err = ubi_wl_put_pebs(ubi, vol_id, lnum, pnums, batch);
+		if (err)
+			break;
+
+		lnum += batch;
+		count -= batch;
+		cond_resched();
+	}
+
+out_free:
+	kfree(pnums);
+	kfree(sems);
+	return err;
+}
+
+/**
+ * ubi_eba_discard - tell UBI that a part of a logical eraseblock is dead.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @offset: offset of the dead data within the logical eraseblock
+ * @len: length of the dead data
+ *
+ * This function is called when the user of a dynamic volume does not need
+ * some data anymore. If the dead data covers the whole logical eraseblock,
+ * the logical eraseblock is un-mapped. If it reaches the end of the logical
+ * eraseblock (or the dead tail known from earlier calls), the dead tail of
+ * the logical eraseblock grows and the WL worker does not copy it any more.
+ * When the dead tail grows down to offset zero, the logical eraseblock is
+ * un-mapped as well. Dead ranges in the middle of a logical eraseblock are
+ * ignored, because UBI may only cut data off the end when copying it.
+ *
+ * Reading discarded data returns whatever is on the flash until the data is
+ * lost. Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubi_eba_discard(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		    int offset, int len)
+{
+	int err, pnum, dead, vol_id = vol->vol_id;
+	int *leb_dead;
+
+	if (ubi->ro_mode)
+		return -EROFS;
+
+	if (len == 0)
+		return 0;
+
+	if (offset == 0 && len == vol->usable_leb_size)
+		return ubi_eba_unmap_leb(ubi, vol, lnum);
+
+	/* Buffered data may be before @offset, write it out first */
+	err = ubi_wb_flush_leb(ubi, vol, lnum);
+	if (err)
+		return err;
+
+	if (!vol->leb_dead) {
+		/*
+		 * The dead tails are allocated on first use and are kept
+		 * until the volume is re-sized or removed, like the data type
+		 * inference counters.
+		 */
+		leb_dead = kzalloc(vol->reserved_pebs * sizeof(int), GFP_NOFS);
+		if (!leb_dead)
+			return -ENOMEM;
+
+		spin_lock(&ubi->volumes_lock);
+		if (!vol->leb_dead) {
+			vol->leb_dead = leb_dead;
+			leb_dead = NULL;
+		}
+		spin_unlock(&ubi->volumes_lock);
+		kfree(leb_dead);
+	}
+
+	err = leb_write_lock(ubi, vol_id, lnum);
+	if (err)
+		return err;
+
+	pnum = vol->eba_tbl[lnum];
+	if (pnum < 0)
+		goto out_unlock;
+
+	dead = vol->leb_dead[lnum] ? vol->leb_dead[lnum] :
+				     vol->usable_leb_size;
+	if (offset + len < dead) {
+		dbg_eba("ignore discard of %d bytes at offset %d of LEB %d:%d",
+			len, offset, vol_id, lnum);
+		goto out_unlock;
+	}
+
+	if (offset == 0) {
+		dbg_eba("LEB %d:%d is dead, erase PEB %d", vol_id, lnum, pnum);
+		ubi_dbg_trace(ubi, UBI_TRACE_UNMAP, vol_id, lnum, 0);
+		vol->eba_tbl[lnum] = UBI_LEB_UNMAPPED;
+		clear_dead_tail(vol, lnum);
+		ubi_rc_invalidate(vol, lnum);
+		err = ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 0);
+		goto out_unlock;
+	}
+
+	if (offset < dead) {
+		dbg_eba("LEB %d:%d is dead from offset %d", vol_id, lnum,
+			offset);
+		vol->leb_dead[lnum] = offset;
+	}
 
 out_unlock:
 	leb_write_unlock(ubi, vol_id, lnum);
 	return err;
 }
 
+/**
+ * read_cached - read data through the read cache.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @pnum: physical eraseblock @lnum is mapped to
+ * @buf: buffer to store the read data
+ * @offset: offset from where to read
+ * @len: how many bytes to read
+ *
+ * This is a helper function for 'ubi_eba_read_leb()' which serves small reads
+ * from the read cache of the volume and, on a cache miss, reads the whole
+ * flash pages the data spans and adds them to the cache. The caller has to
+ * hold the logical eraseblock locked for reading.
+ *
+ * Returns zero if the data was read, %1 if the read has to go the usual way
+ * (too long read, no memory or an I/O error which the caller has to handle),
+ * and a negative error code if scrubbing the physical eraseblock failed.
+ */
+static int read_cached(struct ubi_device *ubi, struct ubi_volume *vol,
+		       int lnum, int pnum, void *buf, int offset, int len)
+{
+	int err, scrub = 0, start, end;
+	void *pages;
+
+	start = offset & ~(ubi->min_io_size - 1);
+	end = ALIGN(offset + len, ubi->min_io_size);
+	if (end - start > UBI_RC_MAX_SPAN * ubi->min_io_size)
+		return 1;
+
+	if (ubi_rc_lookup(ubi, vol, lnum, buf, offset, len)) {
+		ubi_dbg_trace(ubi, UBI_TRACE_READ, vol->vol_id, lnum, 0);
+		return 0;
+	}
+
+	pages = kmalloc(end - start, GFP_NOFS);
+	if (!pages)
+		return 1;
+
+	err = ubi_io_read_data(ubi, pages, pnum, start, end - start);
+	if (err && err != UBI_IO_BITFLIPS) {
+		kfree(pages);
+		return 1;
+	} else if (err == UBI_IO_BITFLIPS)
+		scrub = 1;
+
+	memcpy(buf, pages + offset - start, len);
+	ubi_rc_insert(ubi, vol, lnum, pages, start, end - start);
+	kfree(pages);
+
+	ubi_dbg_trace(ubi, UBI_TRACE_READ, vol->vol_id, lnum, 0);
+	if (!scrub)
+		scrub = ubi_wl_account_read(ubi, pnum);
+	if (scrub)
+		return ubi_wl_scrub_peb(ubi, pnum);
+	return 0;
+}
+
 /**
  * ubi_eba_read_leb - read data.
  * @ubi: UBI device description object
@@ -374,7 +698,7 @@ out_unlock:
 int ubi_eba_read_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
 		     void *buf, int offset, int len, int check)
 {
-	int err, pnum, scrub = 0, vol_id = vol->vol_id;
+	int err, pnum, scrub = 0, vol_id = vol->vol_id, data_size = 0;
 	struct ubi_vid_hdr *vid_hdr;
 	uint32_t uninitialized_var(crc);
 
@@ -403,8 +727,22 @@ int ubi_eba_read_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
 	if (vol->vol_type == UBI_DYNAMIC_VOLUME)
 		check = 0;
 
+	if (vol->rc_max && !check) {
+		err = read_cached(ubi, vol, lnum, pnum, buf, offset, len);
+		if (err <= 0) {
+			leb_read_unlock(ubi, vol_id, lnum);
+			return err;
+		}
+	}
+
 retry:
-	if (check) {
+	if (check)
+		data_size = st_leb_get(ubi, vol, lnum, &crc);
+
+	if (check && data_size) {
+		/* The data size and CRC are known, do not read the VID header */
+		ubi_assert(len == data_size);
+	} else if (check) {
 		vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
 		if (!vid_hdr) {
 			err = -ENOMEM;
@@ -437,6 +775,7 @@ retry:
 		ubi_assert(len == be32_to_cpu(vid_hdr->data_size));
 
 		crc = be32_to_cpu(vid_hdr->data_crc);
+		st_leb_set(ubi, vol, lnum, be32_to_cpu(vid_hdr->data_size), crc);
 		ubi_free_vid_hdr(ubi, vid_hdr);
 	}
 
@@ -468,6 +807,11 @@ retry:
 		}
 	}
 
+	ubi_dbg_trace(ubi, UBI_TRACE_READ, vol_id, lnum, 0);
+	if (!scrub)
+		/* Frequently read PEBs are scrubbed because of read disturb */
+		scrub = ubi_wl_account_read(ubi, pnum);
+
 	if (scrub)
 		err = ubi_wl_scrub_peb(ubi, pnum);
 
@@ -552,7 +896,7 @@ retry:
 	ubi_free_vid_hdr(ubi, vid_hdr);
 
 	vol->eba_tbl[lnum] = new_pnum;
-	ubi_wl_put_peb(ubi, pnum, 1);
+	ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 1);
 
 	ubi_msg("data was successfully recovered");
 	return 0;
@@ -560,7 +904,7 @@ retry:
 out_unlock:
 	mutex_unlock(&ubi->buf_mutex);
 out_put:
-	ubi_wl_put_peb(ubi, new_pnum, 1);
+	ubi_wl_put_peb(ubi, vol_id, lnum, new_pnum, 1);
 	ubi_free_vid_hdr(ubi, vid_hdr);
 	return err;
 
@@ -570,7 +914,7 @@ write_error:
 	 * get another one.
 	 */
 	ubi_warn("failed to write to PEB %d", new_pnum);
-	ubi_wl_put_peb(ubi, new_pnum, 1);
+	ubi_wl_put_peb(ubi, vol_id, lnum, new_pnum, 1);
 	if (++tries > UBI_IO_RETRIES) {
 		ubi_free_vid_hdr(ubi, vid_hdr);
 		return err;
@@ -579,6 +923,53 @@ write_error:
 	goto retry;
 }
 
+/**
+ * infer_dtype - guess the type of data written to a logical eraseblock.
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @dtype: data type the caller specified
+ *
+ * Most users do not know the type of their data and pass %UBI_UNKNOWN. If
+ * data type inference is enabled for volume @vol, UBI counts how many times
+ * each logical eraseblock is mapped to a new physical eraseblock, and this
+ * function uses the counters to guess the data type. Frequently re-mapped
+ * logical eraseblocks get %UBI_SHORTTERM, so they are written to physical
+ * eraseblocks with low erase counter. Logical eraseblocks written once get
+ * %UBI_LONGTERM, so they are written to physical eraseblocks with high erase
+ * counter. To make the counters reflect recent history, all of them are
+ * halved every time the volume is written twice over.
+ *
+ * The counters are not protected by any lock, so they are approximate, which
+ * is fine for a hint. This function is called with the logical eraseblock
+ * locked for writing and returns the data type to use.
+ */
+static int infer_dtype(struct ubi_volume *vol, int lnum, int dtype)
+{
+	unsigned char *maps = vol->leb_maps;
+	int i, cnt;
+
+	if (!vol->infer_dtype || !maps)
+		return dtype;
+
+	if (maps[lnum] != 0xFF)
+		maps[lnum] += 1;
+	cnt = maps[lnum];
+
+	if (++vol->leb_maps_total >= 2 * vol->reserved_pebs) {
+		for (i = 0; i < vol->reserved_pebs; i++)
+			maps[i] >>= 1;
+		vol->leb_maps_total = 0;
+	}
+
+	if (dtype != UBI_UNKNOWN)
+		return dtype;
+	if (cnt >= EBA_HOT_MAPS)
+		return UBI_SHORTTERM;
+	if (cnt == 1)
+		return UBI_LONGTERM;
+	return UBI_UNKNOWN;
+}
+
 /**
  * ubi_eba_write_leb - write data to dynamic volume.
  * @ubi: UBI device description object
@@ -607,6 +998,8 @@ int ubi_eba_write_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
 	if (err)
 		return err;
 
+	clear_dead_tail(vol, lnum);
+	ubi_rc_invalidate(vol, lnum);
 	pnum = vol->eba_tbl[lnum];
 	if (pnum >= 0) {
 		dbg_eba("write %d bytes at offset %d of LEB %d:%d, PEB %d",
@@ -641,6 +1034,7 @@ int ubi_eba_write_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
 	vid_hdr->lnum = cpu_to_be32(lnum);
 	vid_hdr->compat = ubi_get_compat(ubi, vol_id);
 	vid_hdr->data_pad = cpu_to_be32(vol->data_pad);
+	dtype = infer_dtype(vol, lnum, dtype);
 
 retry:
 	pnum = ubi_wl_get_peb(ubi, dtype);
@@ -670,6 +1064,7 @@ retry:
 		}
 	}
 
+	ubi_dbg_trace(ubi, UBI_TRACE_MAP, vol_id, lnum, dtype);
 	vol->eba_tbl[lnum] = pnum;
 
 	leb_write_unlock(ubi, vol_id, lnum);
@@ -689,7 +1084,7 @@ write_error:
 	 * eraseblock, so just put it and request a new one. We assume that if
 	 * this physical eraseblock went bad, the erase code will handle that.
 	 */
-	err = ubi_wl_put_peb(ubi, pnum, 1);
+	err = ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 1);
 	if (err || ++tries > UBI_IO_RETRIES) {
 		ubi_ro_mode(ubi);
 		leb_write_unlock(ubi, vol_id, lnum);
@@ -731,6 +1126,7 @@ int ubi_eba_write_leb_st(struct ubi_device *ubi, struct ubi_volume *vol,
 {
 	int err, pnum, tries = 0, data_size = len, vol_id = vol->vol_id;
 	struct ubi_vid_hdr *vid_hdr;
+	struct ubi_st_leb *st;
 	uint32_t crc;
 
 	if (ubi->ro_mode)
@@ -751,6 +1147,7 @@ int ubi_eba_write_leb_st(struct ubi_device *ubi, struct ubi_volume *vol,
 		ubi_free_vid_hdr(ubi, vid_hdr);
 		return err;
 	}
+	ubi_rc_invalidate(vol, lnum);
 
 	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
 	vid_hdr->vol_id = cpu_to_be32(vol_id);
@@ -763,6 +1160,7 @@ int ubi_eba_write_leb_st(struct ubi_device *ubi, struct ubi_volume *vol,
 	vid_hdr->data_size = cpu_to_be32(data_size);
 	vid_hdr->used_ebs = cpu_to_be32(used_ebs);
 	vid_hdr->data_crc = cpu_to_be32(crc);
+	dtype = infer_dtype(vol, lnum, dtype);
 
 retry:
 	pnum = ubi_wl_get_peb(ubi, dtype);
@@ -790,8 +1188,11 @@ retry:
 	}
 
 	ubi_assert(vol->eba_tbl[lnum] < 0);
+	ubi_dbg_trace(ubi, UBI_TRACE_MAP, vol_id, lnum, dtype);
 	vol->eba_tbl[lnum] = pnum;
 
+	st_leb_set(ubi, vol, lnum, data_size, crc);
+
 	leb_write_unlock(ubi, vol_id, lnum);
 	ubi_free_vid_hdr(ubi, vid_hdr);
 	return 0;
@@ -809,7 +1210,7 @@ write_error:
 		return err;
 	}
 
-	err = ubi_wl_put_peb(ubi, pnum, 1);
+	err = ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 1);
 	if (err || ++tries > UBI_IO_RETRIES) {
 		ubi_ro_mode(ubi);
 		leb_write_unlock(ubi, vol_id, lnum);
@@ -837,8 +1238,13 @@ write_error:
  * unclean reboot the old contents is preserved. Returns zero in case of
  * success and a negative error code in case of failure.
  *
- * UBI reserves one LEB for the "atomic LEB change" operation, so only one
- * LEB change may be done at a time. This is ensured by @ubi->alc_mutex.
+ * The caller has to drop the buffered data of the logical eraseblock, see
+ * 'ubi_wb_drop()'. The write buffer itself uses this function to re-write a
+ * logical eraseblock, so it cannot be done here.
+ *
+ * UBI reserves @ubi->alc_slots PEBs for the "atomic LEB change" operation, so
+ * only that many LEB changes may be done at a time. This is ensured by
+ * @ubi->alc_sem.
  */
 int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 			      int lnum, const void *buf, int len, int dtype)
@@ -865,10 +1271,15 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 	if (!vid_hdr)
 		return -ENOMEM;
 
-	mutex_lock(&ubi->alc_mutex);
+	if (down_trylock(&ubi->alc_sem)) {
+		ubi_lat_t start = ubi_lat_begin();
+
+		down(&ubi->alc_sem);
+		ubi_lat_end(ubi, UBI_LAT_ALC_SLOT, start);
+	}
 	err = leb_write_lock(ubi, vol_id, lnum);
 	if (err)
-		goto out_mutex;
+		goto out_slot;
 
 	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
 	vid_hdr->vol_id = cpu_to_be32(vol_id);
@@ -881,6 +1292,7 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 	vid_hdr->data_size = cpu_to_be32(len);
 	vid_hdr->copy_flag = 1;
 	vid_hdr->data_crc = cpu_to_be32(crc);
+	dtype = infer_dtype(vol, lnum, dtype);
 
 retry:
 	pnum = ubi_wl_get_peb(ubi, dtype);
@@ -907,17 +1319,21 @@ retry:
 	}
 
 	if (vol->eba_tbl[lnum] >= 0) {
-		err = ubi_wl_put_peb(ubi, vol->eba_tbl[lnum], 0);
+		err = ubi_wl_put_peb(ubi, vol_id, lnum, vol->eba_tbl[lnum],
+				     0);
 		if (err)
 			goto out_leb_unlock;
 	}
 
+	ubi_dbg_trace(ubi, UBI_TRACE_MAP, vol_id, lnum, dtype);
 	vol->eba_tbl[lnum] = pnum;
+	clear_dead_tail(vol, lnum);
+	ubi_rc_invalidate(vol, lnum);
 
 out_leb_unlock:
 	leb_write_unlock(ubi, vol_id, lnum);
-out_mutex:
-	mutex_unlock(&ubi->alc_mutex);
+out_slot:
+	up(&ubi->alc_sem);
 	ubi_free_vid_hdr(ubi, vid_hdr);
 	return err;
 
@@ -932,7 +1348,7 @@ write_error:
 		goto out_leb_unlock;
 	}
 
-	err = ubi_wl_put_peb(ubi, pnum, 1);
+	err = ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 1);
 	if (err || ++tries > UBI_IO_RETRIES) {
 		ubi_ro_mode(ubi);
 		goto out_leb_unlock;
@@ -943,6 +1359,385 @@ write_error:
 	goto retry;
 }
 
+/**
+ * write_new_peb - write logical eraseblock contents to a new physical eraseblock.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @buf: data to write
+ * @len: how many bytes to write
+ * @dtype: data type
+ * @vid_hdr: VID header buffer to use
+ * @txn_sqnum: sequence number of the transaction, or %0 if none
+ *
+ * This function writes new contents of logical eraseblock @lnum to a new
+ * physical eraseblock the same way 'ubi_eba_atomic_leb_change()' does, but
+ * it neither changes the EBA table nor puts the old physical eraseblock,
+ * which is left to the caller. The copy flag is only set if the logical
+ * eraseblock is mapped, so that the scanning can tell the very first
+ * transaction table from the later ones. The caller has to hold the logical
+ * eraseblock lock. Returns the new physical eraseblock number in case of
+ * success and a negative error code in case of failure.
+ */
+static int write_new_peb(struct ubi_device *ubi, struct ubi_volume *vol,
+			 int lnum, const void *buf, int len, int dtype,
+			 struct ubi_vid_hdr *vid_hdr,
+			 unsigned long long txn_sqnum)
+{
+	int err, pnum, tries = 0, vol_id = vol->vol_id;
+
+	memset(vid_hdr, 0, sizeof(struct ubi_vid_hdr));
+	vid_hdr->vol_type = UBI_VID_DYNAMIC;
+	vid_hdr->vol_id = cpu_to_be32(vol_id);
+	vid_hdr->lnum = cpu_to_be32(lnum);
+	vid_hdr->compat = ubi_get_compat(ubi, vol_id);
+	vid_hdr->data_pad = cpu_to_be32(vol->data_pad);
+	vid_hdr->txn_sqnum = cpu_to_be64(txn_sqnum);
+	if (len > 0) {
+		vid_hdr->copy_flag = vol->eba_tbl[lnum] >= 0;
+		vid_hdr->data_size = cpu_to_be32(len);
+		vid_hdr->data_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, buf,
+						      len));
+	}
+	dtype = infer_dtype(vol, lnum, dtype);
+
+retry:
+	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	pnum = ubi_wl_get_peb(ubi, dtype);
+	if (pnum < 0)
+		return pnum;
+
+	dbg_eba("write LEB %d:%d to PEB %d, transaction %llu", vol_id, lnum,
+		pnum, txn_sqnum);
+
+	err = ubi_io_write_vid_hdr(ubi, pnum, vid_hdr);
+	if (err) {
+		ubi_warn("failed to write VID header to LEB %d:%d, PEB %d",
+			 vol_id, lnum, pnum);
+		goto write_error;
+	}
+
+	if (len > 0) {
+		err = ubi_io_write_data(ubi, buf, pnum, 0, len);
+		if (err) {
+			ubi_warn("failed to write %d bytes of data to PEB %d",
+				 len, pnum);
+			goto write_error;
+		}
+	}
+
+	return pnum;
+
+write_error:
+	if (err != -EIO || !ubi->bad_allowed) {
+		ubi_ro_mode(ubi);
+		return err;
+	}
+
+	err = ubi_wl_put_peb(ubi, vol_id, lnum, pnum, 1);
+	if (err || ++tries > UBI_IO_RETRIES) {
+		ubi_ro_mode(ubi);
+		return err ? err : -EIO;
+	}
+
+	ubi_msg("try another PEB");
+	goto retry;
+}
+
+/**
+ * txn_entry_live - check whether a transaction table entry is still needed.
+ * @ubi: UBI device description object
+ * @ent: the transaction table entry
+ *
+ * An entry is needed as long as the physical eraseblock it refers to is
+ * mapped to the logical eraseblock it was written for. When the logical
+ * eraseblock is changed or the physical eraseblock is moved by wear-leveling
+ * (which drops the transaction mark), the entry may be dropped. Returns
+ * non-zero if the entry is needed and zero if not.
+ */
+static int txn_entry_live(struct ubi_device *ubi,
+			  const struct ubi_txn_tbl_entry *ent)
+{
+	int vol_id = be32_to_cpu(ent->vol_id), lnum = be32_to_cpu(ent->lnum);
+	struct ubi_volume *vol;
+	int live = 0;
+
+	if (vol_id < 0 || vol_id >= ubi->vtbl_slots)
+		return 0;
+
+	spin_lock(&ubi->volumes_lock);
+	vol = ubi->volumes[vol_id];
+	if (vol && lnum >= 0 && lnum < vol->reserved_pebs)
+		live = vol->eba_tbl[lnum] == be32_to_cpu(ent->pnum);
+	spin_unlock(&ubi->volumes_lock);
+	return live;
+}
+
+/**
+ * write_txn_tbl - write a new transaction table.
+ * @ubi: UBI device description object
+ * @vol: volume the transaction changes
+ * @vec: logical eraseblocks the transaction changes
+ * @pnums: new physical eraseblocks of the logical eraseblocks
+ * @count: count of logical eraseblocks in the transaction
+ * @txn_sqnum: sequence number of the transaction
+ * @buf: buffer of logical eraseblock size
+ * @vid_hdr: VID header buffer to use
+ *
+ * This function reads the current transaction table, drops the entries which
+ * are not needed anymore, adds the entries of the new transaction and writes
+ * the result to a new physical eraseblock. Writing the table commits the
+ * transaction. The caller has to hold the lock of the transaction table
+ * logical eraseblock. Returns the physical eraseblock number of the new table
+ * in case of success and a negative error code in case of failure. If the
+ * current table turns out to be corrupted, UBI is switched to R/O mode and
+ * %-EINVAL is returned.
+ */
+static int write_txn_tbl(struct ubi_device *ubi, struct ubi_volume *vol,
+			 const struct ubi_leb_change_vec *vec, const int *pnums,
+			 int count, unsigned long long txn_sqnum, void *buf,
+			 struct ubi_vid_hdr *vid_hdr)
+{
+	int err, i, j, n = 0, len, tpnum;
+	struct ubi_volume *tvol = ubi->volumes[vol_id2idx(ubi,
+							  UBI_TXN_VOLUME_ID)];
+	struct ubi_txn_tbl_hdr *hdr = buf;
+	struct ubi_txn_tbl_entry *ent = buf + sizeof(struct ubi_txn_tbl_hdr);
+
+	tpnum = tvol->eba_tbl[0];
+	if (tpnum >= 0) {
+		err = ubi_io_read_data(ubi, buf, tpnum, 0,
+				       sizeof(struct ubi_txn_tbl_hdr));
+		if (err && err != UBI_IO_BITFLIPS)
+			return err;
+
+		n = be32_to_cpu(hdr->count);
+		if (n < 0 || n > UBI_TXN_TBL_MAX(ubi))
+			n = 0;
+		len = sizeof(struct ubi_txn_tbl_hdr) +
+		      n * sizeof(struct ubi_txn_tbl_entry);
+		err = ubi_io_read_data(ubi, buf, tpnum, 0, len);
+		if (err && err != UBI_IO_BITFLIPS)
+			return err;
+
+		n = ubi_check_txn_tbl(ubi, buf);
+		if (n < 0) {
+			/*
+			 * The table was fine when it was written or scanned,
+			 * and dropping it would lose the transactions it
+			 * still protects, so do not write a new one.
+			 */
+			ubi_err("bad transaction table in PEB %d", tpnum);
+			ubi_ro_mode(ubi);
+			return -EINVAL;
+		}
+	}
+
+	/* Drop the entries which are not needed anymore */
+	for (i = j = 0; i < n; i++) {
+		int k = count, lnum = be32_to_cpu(ent[i].lnum);
+
+		if (be32_to_cpu(ent[i].vol_id) == vol->vol_id)
+			for (k = 0; k < count; k++)
+				if (vec[k].lnum == lnum)
+					break;
+
+		if (k < count || !txn_entry_live(ubi, &ent[i]))
+			continue;
+		if (j != i)
+			ent[j] = ent[i];
+		j += 1;
+	}
+
+	if (j + count > UBI_TXN_TBL_MAX(ubi)) {
+		dbg_err("transaction table is full, %d entries", j);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < count; i++, j++) {
+		memset(&ent[j], 0, sizeof(struct ubi_txn_tbl_entry));
+		ent[j].txn_sqnum = cpu_to_be64(txn_sqnum);
+		ent[j].vol_id = cpu_to_be32(vol->vol_id);
+		ent[j].lnum = cpu_to_be32(vec[i].lnum);
+		ent[j].pnum = cpu_to_be32(pnums[i]);
+	}
+
+	memset(hdr, 0, sizeof(struct ubi_txn_tbl_hdr));
+	hdr->magic = cpu_to_be32(UBI_TXN_TBL_MAGIC);
+	hdr->count = cpu_to_be32(j);
+	hdr->crc = cpu_to_be32(ubi_txn_tbl_crc(buf, j));
+
+	len = sizeof(struct ubi_txn_tbl_hdr) +
+	      j * sizeof(struct ubi_txn_tbl_entry);
+	memset(buf + len, 0xFF, ALIGN(len, ubi->min_io_size) - len);
+	len = ALIGN(len, ubi->min_io_size);
+
+	return write_new_peb(ubi, tvol, 0, buf, len, UBI_SHORTTERM, vid_hdr, 0);
+}
+
+/**
+ * ubi_eba_atomic_leb_change_multi - change several logical eraseblocks
+ * atomically.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @vec: logical eraseblocks to change and their new contents
+ * @count: count of elements in @vec
+ * @dtype: data type
+ *
+ * This function changes the contents of @count logical eraseblocks of volume
+ * @vol as one transaction: in case of an unclean reboot either all of them
+ * have the new contents or all of them have the old contents. The logical
+ * eraseblock numbers in @vec have to be different and the lengths have to be
+ * aligned. Returns zero in case of success and a negative error code in case
+ * of failure.
+ *
+ * The new contents is written to new physical eraseblocks marked with the
+ * transaction sequence number, and then the transaction table is changed.
+ * Until the old physical eraseblocks are put, the transaction needs one extra
+ * physical eraseblock per logical eraseblock plus one for the table, so they
+ * are reserved for the time of the transaction. The physical eraseblock of
+ * the table stays reserved after the first transaction. Transactions are
+ * serialized by the lock of the table logical eraseblock.
+ */
+int ubi_eba_atomic_leb_change_multi(struct ubi_device *ubi,
+				    struct ubi_volume *vol,
+				    const struct ubi_leb_change_vec *vec,
+				    int count, int dtype)
+{
+	int err, i, n, tpnum, first, staged = 0, vol_id = vol->vol_id;
+	struct ubi_volume *tvol = ubi->volumes[vol_id2idx(ubi,
+							  UBI_TXN_VOLUME_ID)];
+	unsigned long long txn_sqnum;
+	struct rw_semaphore **sems;
+	struct ubi_vid_hdr *vid_hdr;
+	int *pnums;
+	void *buf;
+
+	if (ubi->ro_mode)
+		return -EROFS;
+
+	for (i = 0; i < count; i++)
+		ubi_wb_drop(vol, vec[i].lnum, 1);
+
+	spin_lock(&ubi->volumes_lock);
+	if (ubi->avail_pebs < count + 1) {
+		dbg_err("not enough PEBs for transaction, need %d, "
+			"available %d", count + 1, ubi->avail_pebs);
+		spin_unlock(&ubi->volumes_lock);
+		return -ENOSPC;
+	}
+	ubi->avail_pebs -= count + 1;
+	ubi->rsvd_pebs += count + 1;
+	spin_unlock(&ubi->volumes_lock);
+
+	err = -ENOMEM;
+	pnums = kmalloc(count * sizeof(int), GFP_NOFS);
+	if (!pnums)
+		goto out_unreserve;
+
+	sems = kmalloc((count + 1) * sizeof(struct rw_semaphore *), GFP_NOFS);
+	if (!sems)
+		goto out_free_pnums;
+
+	buf = vmalloc(ubi->leb_size);
+	if (!buf)
+		goto out_free_sems;
+
+	vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
+	if (!vid_hdr)
+		goto out_free_buf;
+
+	for (i = 0; i < count; i++)
+		sems[i] = leb_lock(ubi, vol_id, vec[i].lnum);
+	sems[count] = leb_lock(ubi, UBI_TXN_VOLUME_ID, 0);
+	n = leb_write_lock_multi(ubi, sems, count + 1);
+
+	first = tvol->eba_tbl[0] < 0;
+	txn_sqnum = next_sqnum(ubi);
+	dbg_eba("transaction %llu, %d LEBs of volume %d", txn_sqnum, count,
+		vol_id);
+
+	for (staged = 0; staged < count; staged++) {
+		i = staged;
+		err = write_new_peb(ubi, vol, vec[i].lnum, vec[i].buf,
+				    vec[i].len, dtype, vid_hdr, txn_sqnum);
+		if (err < 0)
+			goto out_put;
+		pnums[i] = err;
+	}
+
+	tpnum = write_txn_tbl(ubi, vol, vec, pnums, count, txn_sqnum, buf,
+			      vid_hdr);
+	if (tpnum < 0) {
+		err = tpnum;
+		goto out_put;
+	}
+
+	/* The transaction is committed, switch the EBA table */
+	err = 0;
+	for (i = 0; i < count; i++) {
+		int lnum = vec[i].lnum;
+
+		if (vol->eba_tbl[lnum] >= 0) {
+			err = ubi_wl_put_peb(ubi, vol_id, lnum,
+					     vol->eba_tbl[lnum], 0);
+			if (err)
+				ubi_ro_mode(ubi);
+		}
+		ubi_dbg_trace(ubi, UBI_TRACE_MAP, vol_id, lnum, dtype);
+		vol->eba_tbl[lnum] = pnums[i];
+		clear_dead_tail(vol, lnum);
+		ubi_rc_invalidate(vol, lnum);
+	}
+
+	if (!first) {
+		i = ubi_wl_put_peb(ubi, UBI_TXN_VOLUME_ID, 0, tvol->eba_tbl[0],
+				   0);
+		if (i) {
+			ubi_ro_mode(ubi);
+			err = i;
+		}
+	}
+	tvol->eba_tbl[0] = tpnum;
+
+	/* The table keeps its physical eraseblock from now on */
+	spin_lock(&ubi->volumes_lock);
+	ubi->avail_pebs += first ? count : count + 1;
+	ubi->rsvd_pebs -= first ? count : count + 1;
+	spin_unlock(&ubi->volumes_lock);
+	goto out_unlock;
+
+out_put:
+	while (staged--)
+		if (ubi_wl_put_peb(ubi, vol_id, vec[staged].lnum, pnums[staged],
+				   0))
+			ubi_ro_mode(ubi);
+	spin_lock(&ubi->volumes_lock);
+	ubi->avail_pebs += count + 1;
+	ubi->rsvd_pebs -= count + 1;
+	spin_unlock(&ubi->volumes_lock);
+out_unlock:
+	leb_write_unlock_multi(ubi, sems, n);
+	ubi_free_vid_hdr(ubi, vid_hdr);
+	vfree(buf);
+	kfree(sems);
+	kfree(pnums);
+	return err;
+
+out_free_buf:
+	vfree(buf);
+out_free_sems:
+	kfree(sems);
+out_free_pnums:
+	kfree(pnums);
+out_unreserve:
+	spin_lock(&ubi->volumes_lock);
+	ubi->avail_pebs += count + 1;
+	ubi->rsvd_pebs -= count + 1;
+	spin_unlock(&ubi->volumes_lock);
+	return err;
+}
+
 /**
  * ubi_eba_copy_leb - copy logical eraseblock.
  * @ubi: UBI device description object
@@ -965,7 +1760,7 @@ write_error:
 int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		     struct ubi_vid_hdr *vid_hdr)
 {
-	int err, vol_id, lnum, data_size, aldata_size, idx;
+	int err, vol_id, lnum, data_size, aldata_size, idx, dead = 0;
 	struct ubi_volume *vol;
 	uint32_t crc;
 
@@ -990,8 +1785,12 @@ int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 	 * be locked in 'ubi_wl_put_peb()' and wait for the WL worker to finish.
 	 */
 	vol = ubi->volumes[idx];
-	if (!vol) {
-		/* No need to do further work, cancel */
+	if (!vol || vol->vol_id != vol_id) {
+		/*
+		 * No need to do further work, cancel. Fastscan PEBs have no
+		 * volume either, their ID shares a slot with the transaction
+		 * volume.
+		 */
 		dbg_eba("volume %d is being removed, cancel", vol_id);
 		spin_unlock(&ubi->volumes_lock);
 		return 1;
@@ -1029,6 +1828,16 @@ int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		goto out_unlock_leb;
 	}
 
+	/*
+	 * The dead tail may only be read under the LEB lock, because writes
+	 * make it live again. The array may be replaced by re-size, which
+	 * does so under @ubi->volumes_lock.
+	 */
+	spin_lock(&ubi->volumes_lock);
+	if (vol->leb_dead && lnum < vol->reserved_pebs)
+		dead = vol->leb_dead[lnum];
+	spin_unlock(&ubi->volumes_lock);
+
 	/*
 	 * OK, now the LEB is locked and we can safely start moving it. Since
 	 * this function utilizes the @ubi->peb1_buf buffer which is shared
@@ -1054,10 +1863,19 @@ int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 	 * to include those 0xFFs to CRC because later the they may be filled
 	 * by data.
 	 */
-	if (vid_hdr->vol_type == UBI_VID_DYNAMIC)
+	if (vid_hdr->vol_type == UBI_VID_DYNAMIC) {
 		aldata_size = data_size =
 			ubi_calc_data_len(ubi, ubi->peb_buf1, data_size);
 
+		/* Do not copy the data the user discarded */
+		if (dead && data_size > ALIGN(dead, ubi->min_io_size)) {
+			dbg_eba("skip %d dead bytes",
+				data_size - ALIGN(dead, ubi->min_io_size));
+			aldata_size = data_size = ALIGN(dead,
+							ubi->min_io_size);
+		}
+	}
+
 	cond_resched();
 	crc = crc32(UBI_CRC32_INIT, ubi->peb_buf1, data_size);
 	cond_resched();
@@ -1075,6 +1893,13 @@ int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 	}
 	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
 
+	/*
+	 * The LEB is mapped, so if it was written by a transaction, the
+	 * transaction was committed. The copy is not a part of it anymore, and
+	 * the transaction table entry may go away.
+	 */
+	vid_hdr->txn_sqnum = 0;
+
 	err = ubi_io_write_vid_hdr(ubi, to, vid_hdr);
 	if (err) {
 		if (err == -EIO)
@@ -1132,6 +1957,14 @@ int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 	ubi_assert(vol->eba_tbl[lnum] == from);
 	vol->eba_tbl[lnum] = to;
 
+	st_leb_set(ubi, vol, lnum, data_size, crc);
+
+	/*
+	 * The data did not change, but the dead tail was not copied, so do not
+	 * let the cache keep it either.
+	 */
+	ubi_rc_invalidate(vol, lnum);
+
 out_unlock_buf:
 	mutex_unlock(&ubi->buf_mutex);
 out_unlock_leb:
@@ -1157,11 +1990,16 @@ int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 
 	dbg_eba("initialize EBA sub-system");
 
-	spin_lock_init(&ubi->ltree_lock);
-	mutex_init(&ubi->alc_mutex);
-	ubi->ltree = RB_ROOT;
+	for (i = 0; i < UBI_LEB_LOCKS; i++)
+		init_rwsem(&ubi->leb_locks[i]);
+	mutex_init(&ubi->leb_multi_mutex);
 
+#ifdef CONFIG_64BIT
+	atomic64_set(&ubi->global_sqnum, si->max_sqnum + 1);
+#else
+	spin_lock_init(&ubi->sqnum_lock);
 	ubi->global_sqnum = si->max_sqnum + 1;
+#endif
 	num_volumes = ubi->vtbl_slots + UBI_INT_VOL_COUNT;
 
 	for (i = 0; i < num_volumes; i++) {
@@ -1181,6 +2019,16 @@ int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 		for (j = 0; j < vol->reserved_pebs; j++)
 			vol->eba_tbl[j] = UBI_LEB_UNMAPPED;
 
+		if (vol->vol_type == UBI_STATIC_VOLUME) {
+			vol->st_lebs = kcalloc(vol->reserved_pebs,
+					       sizeof(struct ubi_st_leb),
+					       GFP_KERNEL);
+			if (!vol->st_lebs) {
+				err = -ENOMEM;
+				goto out_free;
+			}
+		}
+
 		sv = ubi_scan_find_sv(si, idx2vol_id(ubi, i));
 		if (!sv)
 			continue;
@@ -1193,17 +2041,31 @@ int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 				 */
 				ubi_scan_move_to_list(sv, seb, &si->erase);
 			vol->eba_tbl[seb->lnum] = seb->pnum;
+
+			/* Fastscan does not know the data size and CRC */
+			if (vol->st_lebs && seb->lnum < vol->reserved_pebs) {
+				vol->st_lebs[seb->lnum].data_size =
+							seb->data_size;
+				vol->st_lebs[seb->lnum].data_crc =
+							seb->data_crc;
+			}
 		}
 	}
 
-	if (ubi->avail_pebs < EBA_RESERVED_PEBS) {
-		ubi_err("no enough physical eraseblocks (%d, need %d)",
-			ubi->avail_pebs, EBA_RESERVED_PEBS);
+	if (ubi->avail_pebs < 1) {
+		ubi_err("no enough physical eraseblocks (%d, need 1)",
+			ubi->avail_pebs);
 		err = -ENOSPC;
 		goto out_free;
 	}
-	ubi->avail_pebs -= EBA_RESERVED_PEBS;
-	ubi->rsvd_pebs += EBA_RESERVED_PEBS;
+	ubi->alc_slots = min_t(int, ubi->avail_pebs, EBA_RESERVED_PEBS);
+	if (ubi->alc_slots < EBA_RESERVED_PEBS)
+		ubi_warn("cannot reserve enough PEBs for atomic LEB change, "
+			 "reserved %d, need %d", ubi->alc_slots,
+			 EBA_RESERVED_PEBS);
+	sema_init(&ubi->alc_sem, ubi->alc_slots);
+	ubi->avail_pebs -= ubi->alc_slots;
+	ubi->rsvd_pebs += ubi->alc_slots;
 
 	if (ubi->bad_allowed) {
 		ubi_calculate_reserved(ubi);
@@ -1229,6 +2091,8 @@ out_free:
 		if (!ubi->volumes[i])
 			continue;
 		kfree(ubi->volumes[i]->eba_tbl);
+		kfree(ubi->volumes[i]->st_lebs);
+		ubi->volumes[i]->st_lebs = NULL;
 	}
 	return err;
 }
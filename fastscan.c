@@ -44,17 +44,23 @@ int fastscan_scan_peb(struct ubi_device *ubi, int pnum, int *vid)
 	int err;
 
 	fs_vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if(!fs_vid_hdr)
+		return -ENOMEM;
 
 	ubi_msg("scan peb %d", pnum);	
 	err = fastscan_read_vid_hdr(ubi, pnum, fs_vid_hdr);
 	if(err != 0)
 	{
 		ubi_msg("failed to read vid hdr");	
-		return err;
+		goto out;
 	}
 	
 	*vid = fs_vid_hdr->vol_id;
-	return 0;
+out:
+	/* The header comes from the device pool, do not leak it */
+	ubi_free_vid_hdr(ubi, fs_vid_hdr);
+	fs_vid_hdr = NULL;
+	return err;
 }
 /*
  	读取PEB内容
@@ -94,6 +100,8 @@ static int add_peb_to_list(struct ubi_scan_info *si, struct list_head *list,
 	scan_eb->pnum = pnum;
 	scan_eb->ec = ec;
 	scan_eb->scrub = scrub;	
+	/* The metadata has no VID header data, it is read on first use */
+	scan_eb->data_size = 0;
 
 	si->ec_sum += scan_eb->ec;
 	si->ec_count++;
@@ -233,6 +241,7 @@ static int fastscan_rebuild_scan_info(struct ubi_device *ubi, struct ubi_scan_in
 	INIT_LIST_HEAD(&((si)->free));
 	INIT_LIST_HEAD(&((si)->erase));
 	INIT_LIST_HEAD(&((si)->alien));
+	INIT_LIST_HEAD(&((si)->txn));
 	
 	si->volumes = RB_ROOT;
 	si->min_ec = UBI_MAX_ERASECOUNTER;
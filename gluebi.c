@@ -28,6 +28,7 @@
  * eraseblock size is equivalent to the logical eraseblock size of the volume.
  */
 
+#include <linux/module.h>
 #include <linux/math64.h>
 #include "ubi.h"
 
@@ -126,7 +127,7 @@ static int gluebi_read(struct mtd_info *mtd, loff_t from, size_t len,
 		if (to_read > total_read)
 			to_read = total_read;
 
-		err = ubi_eba_read_leb(ubi, vol, lnum, buf, offs, to_read, 0);
+		err = ubi_wb_read(ubi, vol, lnum, buf, offs, to_read, 0);
 		if (err)
 			break;
 
@@ -181,8 +182,8 @@ static int gluebi_write(struct mtd_info *mtd, loff_t to, size_t len,
 		if (to_write > total_written)
 			to_write = total_written;
 
-		err = ubi_eba_write_leb(ubi, vol, lnum, buf, offs, to_write,
-					UBI_UNKNOWN);
+		err = ubi_wb_write(ubi, vol, lnum, buf, offs, to_write,
+				   UBI_UNKNOWN);
 		if (err)
 			break;
 
@@ -206,7 +207,7 @@ static int gluebi_write(struct mtd_info *mtd, loff_t to, size_t len,
  */
 static int gluebi_erase(struct mtd_info *mtd, struct erase_info *instr)
 {
-	int err, i, lnum, count;
+	int err, lnum, count;
 	struct ubi_volume *vol;
 	struct ubi_device *ubi;
 
@@ -231,17 +232,16 @@ static int gluebi_erase(struct mtd_info *mtd, struct erase_info *instr)
 	if (ubi->ro_mode)
 		return -EROFS;
 
-	for (i = 0; i < count; i++) {
-		err = ubi_eba_unmap_leb(ubi, vol, lnum + i);
-		if (err)
-			goto out_err;
-	}
+	err = ubi_eba_unmap_lebs(ubi, vol, lnum, count);
+	if (err)
+		goto out_err;
 
 	/*
 	 * MTD erase operations are synchronous, so we have to make sure the
-	 * physical eraseblock is wiped out.
+	 * physical eraseblock is wiped out. Only the erasures of this volume
+	 * are waited for, and of the very LEB if only one was unmapped.
 	 */
-	err = ubi_wl_flush(ubi);
+	err = ubi_wl_flush(ubi, vol->vol_id, count == 1 ? lnum : UBI_ALL);
 	if (err)
 		goto out_err;
 
@@ -92,10 +92,10 @@
 
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
 static int paranoid_check_not_bad(const struct ubi_device *ubi, int pnum);
-static int paranoid_check_peb_ec_hdr(const struct ubi_device *ubi, int pnum);
+static int paranoid_check_peb_ec_hdr(struct ubi_device *ubi, int pnum);
 static int paranoid_check_ec_hdr(const struct ubi_device *ubi, int pnum,
 				 const struct ubi_ec_hdr *ec_hdr);
-static int paranoid_check_peb_vid_hdr(const struct ubi_device *ubi, int pnum);
+static int paranoid_check_peb_vid_hdr(struct ubi_device *ubi, int pnum);
 static int paranoid_check_vid_hdr(const struct ubi_device *ubi, int pnum,
 				  const struct ubi_vid_hdr *vid_hdr);
 static int paranoid_check_all_ff(struct ubi_device *ubi, int pnum, int offset,
@@ -109,6 +109,34 @@ static int paranoid_check_all_ff(struct ubi_device *ubi, int pnum, int offset,
 #define paranoid_check_all_ff(ubi, pnum, offset, len) 0
 #endif
 
+/**
+ * fg_io_start - account the start of a foreground I/O operation.
+ * @ubi: UBI device description object
+ *
+ * All I/O which is not done by the background thread is foreground I/O. The
+ * background thread uses the in-flight counter and the time-stamp of the last
+ * foreground I/O to throttle itself, see 'bgt_throttle()' in wl.c.
+ */
+static void fg_io_start(struct ubi_device *ubi)
+{
+	if (current == ubi->bgt_thread)
+		return;
+	atomic_inc(&ubi->fg_io_inflight);
+	ubi->fg_io_stamp = jiffies;
+}
+
+/**
+ * fg_io_end - account the end of a foreground I/O operation.
+ * @ubi: UBI device description object
+ */
+static void fg_io_end(struct ubi_device *ubi)
+{
+	if (current == ubi->bgt_thread)
+		return;
+	ubi->fg_io_stamp = jiffies;
+	atomic_dec(&ubi->fg_io_inflight);
+}
+
 /**
  * ubi_io_read - read data from a physical eraseblock.
  * @ubi: UBI device description object
@@ -131,7 +159,7 @@ static int paranoid_check_all_ff(struct ubi_device *ubi, int pnum, int offset,
  * o %-EIO if some I/O error occurred;
  * o other negative error codes in case of other errors.
  */
-int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
+int ubi_io_read(struct ubi_device *ubi, void *buf, int pnum, int offset,
 		int len)
 {
 	int err, retries = 0;
@@ -150,7 +178,9 @@ int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
 
 	addr = (loff_t)pnum * ubi->peb_size + offset;
 retry:
+	fg_io_start(ubi);
 	err = ubi->mtd->read(ubi->mtd, addr, len, &read, buf);
+	fg_io_end(ubi);
 	if (err) {
 		if (err == -EUCLEAN) {
 			/*
@@ -267,7 +297,9 @@ int ubi_io_write(struct ubi_device *ubi, const void *buf, int pnum, int offset,
 	}
 
 	addr = (loff_t)pnum * ubi->peb_size + offset;
+	fg_io_start(ubi);
 	err = ubi->mtd->write(ubi->mtd, addr, len, &written, buf);
+	fg_io_end(ubi);
 	if (err) {
 		ubi_err("error %d while writing %d bytes to PEB %d:%d, written"
 			" %zd bytes", err, len, pnum, offset, written);
@@ -387,9 +419,11 @@ static uint8_t patterns[] = {0xa5, 0x5a, 0x0};
  * @ubi: UBI device description object
  * @pnum: the physical eraseblock number to test
  *
- * This function returns %-EIO if the physical eraseblock did not pass the
- * test, a positive number of erase operations done if the test was
- * successfully passed, and other negative error codes in case of other errors.
+ * The test uses its own buffer, so it does not block other users of
+ * @ubi->peb_buf1, e.g., eraseblock copying. This function returns %-EIO if the
+ * physical eraseblock did not pass the test, a positive number of erase
+ * operations done if the test was successfully passed, and other negative
+ * error codes in case of other errors.
  */
 static int torture_peb(struct ubi_device *ubi, int pnum)
 {
@@ -399,18 +433,18 @@ static int torture_peb(struct ubi_device *ubi, int pnum)
 	patt_count = ARRAY_SIZE(patterns);
 	ubi_assert(patt_count > 0);
 
-	mutex_lock(&ubi->buf_mutex);
+	mutex_lock(&ubi->torture_mutex);
 	for (i = 0; i < patt_count; i++) {
 		err = do_sync_erase(ubi, pnum);
 		if (err)
 			goto out;
 
 		/* Make sure the PEB contains only 0xFF bytes */
-		err = ubi_io_read(ubi, ubi->peb_buf1, pnum, 0, ubi->peb_size);
+		err = ubi_io_read(ubi, ubi->torture_buf, pnum, 0, ubi->peb_size);
 		if (err)
 			goto out;
 
-		err = check_pattern(ubi->peb_buf1, 0xFF, ubi->peb_size);
+		err = check_pattern(ubi->torture_buf, 0xFF, ubi->peb_size);
 		if (err == 0) {
 			ubi_err("erased PEB %d, but a non-0xFF byte found",
 				pnum);
@@ -419,17 +453,17 @@ static int torture_peb(struct ubi_device *ubi, int pnum)
 		}
 
 		/* Write a pattern and check it */
-		memset(ubi->peb_buf1, patterns[i], ubi->peb_size);
-		err = ubi_io_write(ubi, ubi->peb_buf1, pnum, 0, ubi->peb_size);
+		memset(ubi->torture_buf, patterns[i], ubi->peb_size);
+		err = ubi_io_write(ubi, ubi->torture_buf, pnum, 0, ubi->peb_size);
 		if (err)
 			goto out;
 
-		memset(ubi->peb_buf1, ~patterns[i], ubi->peb_size);
-		err = ubi_io_read(ubi, ubi->peb_buf1, pnum, 0, ubi->peb_size);
+		memset(ubi->torture_buf, ~patterns[i], ubi->peb_size);
+		err = ubi_io_read(ubi, ubi->torture_buf, pnum, 0, ubi->peb_size);
 		if (err)
 			goto out;
 
-		err = check_pattern(ubi->peb_buf1, patterns[i], ubi->peb_size);
+		err = check_pattern(ubi->torture_buf, patterns[i], ubi->peb_size);
 		if (err == 0) {
 			ubi_err("pattern %x checking failed for PEB %d",
 				patterns[i], pnum);
@@ -442,7 +476,7 @@ static int torture_peb(struct ubi_device *ubi, int pnum)
 	ubi_msg("PEB %d passed torture test, do not mark it a bad", pnum);
 
 out:
-	mutex_unlock(&ubi->buf_mutex);
+	mutex_unlock(&ubi->torture_mutex);
 	if (err == UBI_IO_BITFLIPS || err == -EBADMSG) {
 		/*
 		 * If a bit-flip or data integrity error was detected, the test
@@ -1118,7 +1152,7 @@ fail:
  * This function returns zero if the erase counter header is all right, %1 if
  * not, and a negative error code if an error occurred.
  */
-static int paranoid_check_peb_ec_hdr(const struct ubi_device *ubi, int pnum)
+static int paranoid_check_peb_ec_hdr(struct ubi_device *ubi, int pnum)
 {
 	int err;
 	uint32_t crc, hdr_crc;
@@ -1196,18 +1230,22 @@ fail:
  * This function returns zero if the volume identifier header is all right,
  * %1 if not, and a negative error code if an error occurred.
  */
-static int paranoid_check_peb_vid_hdr(const struct ubi_device *ubi, int pnum)
+static int paranoid_check_peb_vid_hdr(struct ubi_device *ubi, int pnum)
 {
 	int err;
 	uint32_t crc, hdr_crc;
 	struct ubi_vid_hdr *vid_hdr;
 	void *p;
 
-	vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
-	if (!vid_hdr)
+	/*
+	 * The caller holds a VID header from the pool already, see
+	 * 'ubi_zalloc_vid_hdr()'.
+	 */
+	p = kzalloc(ubi->vid_hdr_alsize, GFP_NOFS);
+	if (!p)
 		return -ENOMEM;
 
-	p = (char *)vid_hdr - ubi->vid_hdr_shift;
+	vid_hdr = p + ubi->vid_hdr_shift;
 	err = ubi_io_read(ubi, p, pnum, ubi->vid_hdr_aloffset,
 			  ubi->vid_hdr_alsize);
 	if (err && err != UBI_IO_BITFLIPS && err != -EBADMSG)
@@ -1228,7 +1266,7 @@ static int paranoid_check_peb_vid_hdr(const struct ubi_device *ubi, int pnum)
 	err = paranoid_check_vid_hdr(ubi, pnum, vid_hdr);
 
 exit:
-	ubi_free_vid_hdr(ubi, vid_hdr);
+	kfree(p);
 	return err;
 }
 
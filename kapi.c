@@ -344,7 +344,7 @@ int ubi_leb_read(struct ubi_volume_desc *desc, int lnum, char *buf, int offset,
 	if (len == 0)
 		return 0;
 
-	err = ubi_eba_read_leb(ubi, vol, lnum, buf, offset, len, check);
+	err = ubi_wb_read(ubi, vol, lnum, buf, offset, len, check);
 	if (err && err == -EBADMSG && vol->vol_type == UBI_STATIC_VOLUME) {
 		ubi_warn("mark volume %d as corrupted", vol_id);
 		vol->corrupted = 1;
@@ -378,6 +378,12 @@ EXPORT_SYMBOL_GPL(ubi_leb_read);
  * something was still written to the flash media, but that may be some
  * garbage.
  *
+ * If the write buffer of the volume is enabled, @offset and @len do not have
+ * to be aligned to the minimum I/O unit size as long as the write continues
+ * the data written last time, and the data may stay in RAM until the buffer
+ * is flushed, see 'ubi_leb_flush()'. After a flush, which may also happen on
+ * timeout, the write has to start at a minimum I/O unit boundary again.
+ *
  * If the volume is damaged because of an interrupted update this function just
  * returns immediately with %-EBADF code.
  */
@@ -397,8 +403,12 @@ int ubi_leb_write(struct ubi_volume_desc *desc, int lnum, const void *buf,
 		return -EROFS;
 
 	if (lnum < 0 || lnum >= vol->reserved_pebs || offset < 0 || len < 0 ||
-	    offset + len > vol->usable_leb_size ||
-	    offset & (ubi->min_io_size - 1) || len & (ubi->min_io_size - 1))
+	    offset + len > vol->usable_leb_size)
+		return -EINVAL;
+
+	/* The write buffer checks the alignment itself */
+	if (!vol->wb_buf && (offset & (ubi->min_io_size - 1) ||
+			     len & (ubi->min_io_size - 1)))
 		return -EINVAL;
 
 	if (dtype != UBI_LONGTERM && dtype != UBI_SHORTTERM &&
@@ -411,7 +421,7 @@ int ubi_leb_write(struct ubi_volume_desc *desc, int lnum, const void *buf,
 	if (len == 0)
 		return 0;
 
-	return ubi_eba_write_leb(ubi, vol, lnum, buf, offset, len, dtype);
+	return ubi_wb_write(ubi, vol, lnum, buf, offset, len, dtype);
 }
 EXPORT_SYMBOL_GPL(ubi_leb_write);
 
@@ -460,10 +470,66 @@ int ubi_leb_change(struct ubi_volume_desc *desc, int lnum, const void *buf,
 	if (len == 0)
 		return 0;
 
+	ubi_wb_drop(vol, lnum, 1);
 	return ubi_eba_atomic_leb_change(ubi, vol, lnum, buf, len, dtype);
 }
 EXPORT_SYMBOL_GPL(ubi_leb_change);
 
+/**
+ * ubi_leb_change_multi - change several logical eraseblocks atomically.
+ * @desc: volume descriptor
+ * @vec: logical eraseblocks to change and their new contents
+ * @count: count of elements in @vec
+ * @dtype: expected data type
+ *
+ * This function is similar to 'ubi_leb_change()', but it changes @count
+ * logical eraseblocks of the volume as one transaction: in case of an unclean
+ * reboot either all of them have the new contents or all of them have the old
+ * contents. Each logical eraseblock may appear in @vec only once, and at most
+ * %UBI_TXN_MAX_LEBS logical eraseblocks may be changed at a time. Returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+int ubi_leb_change_multi(struct ubi_volume_desc *desc,
+			 const struct ubi_leb_change_vec *vec, int count,
+			 int dtype)
+{
+	struct ubi_volume *vol = desc->vol;
+	struct ubi_device *ubi = vol->ubi;
+	int i, j, vol_id = vol->vol_id;
+
+	dbg_gen("atomically change %d LEBs of volume %d", count, vol_id);
+
+	if (vol_id < 0 || vol_id >= ubi->vtbl_slots)
+		return -EINVAL;
+
+	if (desc->mode == UBI_READONLY || vol->vol_type == UBI_STATIC_VOLUME)
+		return -EROFS;
+
+	if (count < 1 || count > UBI_TXN_MAX_LEBS)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (vec[i].lnum < 0 || vec[i].lnum >= vol->reserved_pebs ||
+		    vec[i].len < 0 || vec[i].len > vol->usable_leb_size ||
+		    vec[i].len & (ubi->min_io_size - 1))
+			return -EINVAL;
+
+		for (j = 0; j < i; j++)
+			if (vec[j].lnum == vec[i].lnum)
+				return -EINVAL;
+	}
+
+	if (dtype != UBI_LONGTERM && dtype != UBI_SHORTTERM &&
+	    dtype != UBI_UNKNOWN)
+		return -EINVAL;
+
+	if (vol->upd_marker)
+		return -EBADF;
+
+	return ubi_eba_atomic_leb_change_multi(ubi, vol, vec, count, dtype);
+}
+EXPORT_SYMBOL_GPL(ubi_leb_change_multi);
+
 /**
  * ubi_leb_erase - erase logical eraseblock.
  * @desc: volume descriptor
@@ -497,7 +563,7 @@ int ubi_leb_erase(struct ubi_volume_desc *desc, int lnum)
 	if (err)
 		return err;
 
-	return ubi_wl_flush(ubi);
+	return ubi_wl_flush(ubi, vol->vol_id, lnum);
 }
 EXPORT_SYMBOL_GPL(ubi_leb_erase);
 
@@ -557,6 +623,104 @@ int ubi_leb_unmap(struct ubi_volume_desc *desc, int lnum)
 }
 EXPORT_SYMBOL_GPL(ubi_leb_unmap);
 
+/**
+ * ubi_leb_unmap_range - un-map a range of logical eraseblocks.
+ * @desc: volume descriptor
+ * @lnum: first logical eraseblock number to un-map
+ * @count: how many logical eraseblocks to un-map
+ *
+ * This function is the same as calling 'ubi_leb_unmap()' for @count logical
+ * eraseblocks starting from @lnum, but it is much faster for large ranges.
+ * Like 'ubi_leb_unmap()', it does not wait for the physical eraseblocks to be
+ * erased. Returns zero in case of success and a negative error code in case
+ * of failure. If the volume is damaged because of an interrupted update this
+ * function just returns immediately with %-EBADF code.
+ */
+int ubi_leb_unmap_range(struct ubi_volume_desc *desc, int lnum, int count)
+{
+	struct ubi_volume *vol = desc->vol;
+	struct ubi_device *ubi = vol->ubi;
+
+	dbg_gen("unmap %d LEBs starting from LEB %d:%d", count, vol->vol_id,
+		lnum);
+
+	if (desc->mode == UBI_READONLY || vol->vol_type == UBI_STATIC_VOLUME)
+		return -EROFS;
+
+	if (lnum < 0 || count < 0 || lnum > vol->reserved_pebs ||
+	    count > vol->reserved_pebs - lnum)
+		return -EINVAL;
+
+	if (vol->upd_marker)
+		return -EBADF;
+
+	return ubi_eba_unmap_lebs(ubi, vol, lnum, count);
+}
+EXPORT_SYMBOL_GPL(ubi_leb_unmap_range);
+
+/**
+ * ubi_leb_discard - tell UBI that data is not needed anymore.
+ * @desc: volume descriptor
+ * @lnum: logical eraseblock number
+ * @offset: offset of the data within the logical eraseblock
+ * @len: length of the data
+ *
+ * This function lets users of dynamic volumes tell UBI that data in logical
+ * eraseblock @lnum is dead, so UBI does not waste time and erase cycles on
+ * copying it when wear-leveling. If the whole logical eraseblock is dead, it
+ * is un-mapped. The contents of discarded data is undefined. Returns zero in
+ * case of success and a negative error code in case of failure. If the volume
+ * is damaged because of an interrupted update this function just returns
+ * immediately with %-EBADF code.
+ */
+int ubi_leb_discard(struct ubi_volume_desc *desc, int lnum, int offset,
+		    int len)
+{
+	struct ubi_volume *vol = desc->vol;
+	struct ubi_device *ubi = vol->ubi;
+
+	dbg_gen("discard %d bytes at offset %d of LEB %d:%d", len, offset,
+		vol->vol_id, lnum);
+
+	if (desc->mode == UBI_READONLY || vol->vol_type == UBI_STATIC_VOLUME)
+		return -EROFS;
+
+	if (lnum < 0 || lnum >= vol->reserved_pebs || offset < 0 || len < 0 ||
+	    offset + len > vol->usable_leb_size)
+		return -EINVAL;
+
+	if (vol->upd_marker)
+		return -EBADF;
+
+	return ubi_eba_discard(ubi, vol, lnum, offset, len);
+}
+EXPORT_SYMBOL_GPL(ubi_leb_discard);
+
+/**
+ * ubi_leb_flush - flush the write buffer of a volume.
+ * @desc: volume descriptor
+ *
+ * This function writes the data gathered in the write buffer of the volume to
+ * the flash. The partially filled minimum I/O unit is padded with 0xFF bytes
+ * on the flash, so further appends to the logical eraseblock have to start at
+ * the next minimum I/O unit boundary.
+ * Does nothing if the write buffer is disabled. Returns zero in case of
+ * success and a negative error code in case of failure, including the case
+ * when an earlier flush on timeout failed.
+ */
+int ubi_leb_flush(struct ubi_volume_desc *desc)
+{
+	struct ubi_volume *vol = desc->vol;
+
+	dbg_gen("flush write buffer of volume %d", vol->vol_id);
+
+	if (desc->mode == UBI_READONLY)
+		return -EROFS;
+
+	return ubi_wb_flush(vol->ubi, vol);
+}
+EXPORT_SYMBOL_GPL(ubi_leb_flush);
+
 /**
  * ubi_leb_map - map logical erasblock to a physical eraseblock.
  * @desc: volume descriptor
@@ -638,21 +802,25 @@ EXPORT_SYMBOL_GPL(ubi_is_mapped);
  * @ubi_num: UBI device to synchronize
  *
  * The underlying MTD device may cache data in hardware or in software. This
- * function ensures the caches are flushed. Returns zero in case of success and
- * a negative error code in case of failure.
+ * function flushes the write buffers of the volumes and ensures the caches
+ * are flushed. Returns zero in case of success and a negative error code in
+ * case of failure.
  */
 int ubi_sync(int ubi_num)
 {
 	struct ubi_device *ubi;
+	int err;
 
 	ubi = ubi_get_device(ubi_num);
 	if (!ubi)
 		return -ENODEV;
 
+	err = ubi_wb_sync(ubi);
+
 	if (ubi->mtd->sync)
 		ubi->mtd->sync(ubi->mtd);
 
 	ubi_put_device(ubi);
-	return 0;
+	return err;
 }
 EXPORT_SYMBOL_GPL(ubi_sync);
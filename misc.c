@@ -20,6 +20,7 @@
 
 /* Here we keep miscellaneous functions which are used all over the UBI code */
 
+#include <linux/crc32.h>
 #include "ubi.h"
 
 /**
@@ -103,3 +104,53 @@ void ubi_calculate_reserved(struct ubi_device *ubi)
 	if (ubi->beb_rsvd_level < MIN_RESEVED_PEBS)
 		ubi->beb_rsvd_level = MIN_RESEVED_PEBS;
 }
+
+/**
+ * ubi_txn_tbl_crc - calculate the CRC of a transaction table.
+ * @buf: buffer containing the transaction table
+ * @count: count of entries in the table
+ *
+ * The CRC covers the table header without the CRC field and @count entries.
+ */
+uint32_t ubi_txn_tbl_crc(const void *buf, int count)
+{
+	uint32_t crc;
+
+	crc = crc32(UBI_CRC32_INIT, buf,
+		    offsetof(struct ubi_txn_tbl_hdr, crc));
+	return crc32(crc, buf + sizeof(struct ubi_txn_tbl_hdr),
+		     count * sizeof(struct ubi_txn_tbl_entry));
+}
+
+/**
+ * ubi_check_txn_tbl - check a transaction table.
+ * @ubi: UBI device description object
+ * @buf: buffer containing the transaction table
+ *
+ * @buf has to contain the table header and all the entries it refers to. This
+ * function returns the count of entries if the table is all right and
+ * %-EINVAL if not.
+ */
+int ubi_check_txn_tbl(const struct ubi_device *ubi, const void *buf)
+{
+	const struct ubi_txn_tbl_hdr *hdr = buf;
+	int count = be32_to_cpu(hdr->count);
+
+	if (be32_to_cpu(hdr->magic) != UBI_TXN_TBL_MAGIC) {
+		dbg_msg("bad transaction table magic %#08x",
+			be32_to_cpu(hdr->magic));
+		return -EINVAL;
+	}
+
+	if (count < 0 || count > UBI_TXN_TBL_MAX(ubi)) {
+		dbg_msg("bad transaction table entry count %d", count);
+		return -EINVAL;
+	}
+
+	if (be32_to_cpu(hdr->crc) != ubi_txn_tbl_crc(buf, count)) {
+		dbg_msg("bad transaction table CRC");
+		return -EINVAL;
+	}
+
+	return count;
+}
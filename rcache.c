@@ -0,0 +1,302 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * The per-volume read cache.
+ *
+ * Users like gluebi consumers and the volume character device keep re-reading
+ * the same few places of a volume (super blocks, indexes), and every read
+ * costs at least one NAND page read. The read cache keeps recently read
+ * flash pages (@ubi->min_io_size bytes) of a volume in RAM, keyed by the
+ * logical eraseblock number and the page number within it.
+ *
+ * The cache is disabled by default and is enabled per volume by writing the
+ * maximum number of cached pages to the "read_cache" sysfs file of the
+ * volume. It should not be enabled for volumes whose users have their own
+ * cache, like UBIFS, because then the same data would be cached twice.
+ *
+ * Only small reads go through the cache, see %UBI_RC_MAX_SPAN. The EBA
+ * sub-system looks up and fills the cache with the logical eraseblock locked
+ * for reading, and invalidates it with the logical eraseblock locked for
+ * writing (writes, un-maps, atomic changes, wear-leveling moves), so a
+ * reader never sees data which is older than the last write. All cache
+ * structures are protected by @vol->rc_lock. Least recently used pages are
+ * dropped when the cache is full.
+ */
+
+#include <linux/slab.h>
+#include "ubi.h"
+
+/* Count of hash buckets, logical eraseblocks are hashed to them by number */
+#define RC_HASH_SIZE 64
+
+/**
+ * struct ubi_rc_entry - a cached flash page.
+ * @hnode: link in the hash bucket of the logical eraseblock
+ * @lru: link in the LRU list of the volume
+ * @lnum: logical eraseblock number
+ * @page: page number within the logical eraseblock
+ * @data: page contents
+ */
+struct ubi_rc_entry {
+	struct hlist_node hnode;
+	struct list_head lru;
+	int lnum;
+	int page;
+	char data[0];
+};
+
+/**
+ * rc_find - find a cached page.
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @page: page number
+ *
+ * Returns the cache entry or %NULL if the page is not cached. Note,
+ * @vol->rc_lock has to be locked.
+ */
+static struct ubi_rc_entry *rc_find(struct ubi_volume *vol, int lnum,
+				    int page)
+{
+	struct ubi_rc_entry *ent;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(ent, node, &vol->rc_hash[lnum % RC_HASH_SIZE],
+			     hnode)
+		if (ent->lnum == lnum && ent->page == page)
+			return ent;
+	return NULL;
+}
+
+/**
+ * rc_drop - drop a page from the cache.
+ * @vol: volume description object
+ * @ent: the cache entry to drop
+ *
+ * Note, @vol->rc_lock has to be locked.
+ */
+static void rc_drop(struct ubi_volume *vol, struct ubi_rc_entry *ent)
+{
+	hlist_del(&ent->hnode);
+	list_del(&ent->lru);
+	vol->rc_count -= 1;
+	kfree(ent);
+}
+
+/**
+ * ubi_rc_init - initialize the read cache of a volume.
+ * @vol: volume description object
+ */
+void ubi_rc_init(struct ubi_volume *vol)
+{
+	spin_lock_init(&vol->rc_lock);
+	INIT_LIST_HEAD(&vol->rc_lru);
+}
+
+/**
+ * ubi_rc_set_size - change the read cache size of a volume.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @pages: maximum count of cached pages, %0 disables the cache
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubi_rc_set_size(struct ubi_device *ubi, struct ubi_volume *vol, int pages)
+{
+	struct hlist_head *hash = NULL;
+	struct ubi_rc_entry *ent, *tmp;
+	int i;
+
+	if (pages < 0)
+		return -EINVAL;
+
+	/*
+	 * Caching makes no sense for NOR flash, where reads are cheap and the
+	 * minimum I/O unit is tiny.
+	 */
+	if (pages && ubi->min_io_size < UBI_RC_MIN_PAGE)
+		return -EINVAL;
+
+	if (pages) {
+		hash = kmalloc(RC_HASH_SIZE * sizeof(struct hlist_head),
+			       GFP_KERNEL);
+		if (!hash)
+			return -ENOMEM;
+		for (i = 0; i < RC_HASH_SIZE; i++)
+			INIT_HLIST_HEAD(&hash[i]);
+	}
+
+	spin_lock(&vol->rc_lock);
+	if (pages && vol->rc_hash) {
+		/* Just shrink or grow the existing cache */
+		vol->rc_max = pages;
+		while (vol->rc_count > vol->rc_max) {
+			ent = list_entry(vol->rc_lru.prev, struct ubi_rc_entry,
+					 lru);
+			rc_drop(vol, ent);
+		}
+		spin_unlock(&vol->rc_lock);
+		kfree(hash);
+		return 0;
+	}
+
+	list_for_each_entry_safe(ent, tmp, &vol->rc_lru, lru)
+		rc_drop(vol, ent);
+	swap(vol->rc_hash, hash);
+	vol->rc_max = pages;
+	vol->rc_hits = vol->rc_misses = 0;
+	spin_unlock(&vol->rc_lock);
+
+	kfree(hash);
+	dbg_gen("read cache of volume %d: %d pages", vol->vol_id, pages);
+	return 0;
+}
+
+/**
+ * ubi_rc_lookup - read data from the read cache.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @buf: buffer to store the data
+ * @offset: offset within the logical eraseblock
+ * @len: how many bytes to read
+ *
+ * This function copies the data to @buf if all the pages it spans are
+ * cached. Returns %1 if the data was found in the cache and %0 if not. The
+ * caller has to hold the logical eraseblock locked.
+ */
+int ubi_rc_lookup(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		  void *buf, int offset, int len)
+{
+	int page, first, last, psize = ubi->min_io_size;
+	struct ubi_rc_entry *ent;
+
+	first = offset / psize;
+	last = (offset + len - 1) / psize;
+
+	spin_lock(&vol->rc_lock);
+	if (!vol->rc_hash)
+		goto out_miss;
+
+	for (page = first; page <= last; page++)
+		if (!rc_find(vol, lnum, page))
+			goto out_miss;
+
+	for (page = first; page <= last; page++) {
+		int start = max(offset, page * psize);
+		int end = min(offset + len, (page + 1) * psize);
+
+		ent = rc_find(vol, lnum, page);
+		memcpy(buf + start - offset, ent->data + start - page * psize,
+		       end - start);
+		list_move(&ent->lru, &vol->rc_lru);
+	}
+	vol->rc_hits += 1;
+	spin_unlock(&vol->rc_lock);
+	return 1;
+
+out_miss:
+	vol->rc_misses += 1;
+	spin_unlock(&vol->rc_lock);
+	return 0;
+}
+
+/**
+ * ubi_rc_insert - add data read from the flash to the read cache.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @buf: the data
+ * @offset: offset of the data within the logical eraseblock
+ * @len: length of the data
+ *
+ * @offset and @len have to be aligned to the page size. Pages which are
+ * already cached are not touched. The caller has to hold the logical
+ * eraseblock locked.
+ */
+void ubi_rc_insert(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		   const void *buf, int offset, int len)
+{
+	int i, psize = ubi->min_io_size;
+	struct ubi_rc_entry *ent;
+
+	ubi_assert(!(offset & (psize - 1)) && !(len & (psize - 1)));
+
+	for (i = 0; i < len; i += psize) {
+		int page = (offset + i) / psize;
+
+		ent = kmalloc(sizeof(struct ubi_rc_entry) + psize, GFP_NOFS);
+		if (!ent)
+			return;
+		ent->lnum = lnum;
+		ent->page = page;
+		memcpy(ent->data, buf + i, psize);
+
+		spin_lock(&vol->rc_lock);
+		if (!vol->rc_hash || rc_find(vol, lnum, page)) {
+			spin_unlock(&vol->rc_lock);
+			kfree(ent);
+			continue;
+		}
+
+		if (vol->rc_count >= vol->rc_max)
+			rc_drop(vol, list_entry(vol->rc_lru.prev,
+						struct ubi_rc_entry, lru));
+		hlist_add_head(&ent->hnode, &vol->rc_hash[lnum % RC_HASH_SIZE]);
+		list_add(&ent->lru, &vol->rc_lru);
+		vol->rc_count += 1;
+		spin_unlock(&vol->rc_lock);
+	}
+}
+
+/**
+ * ubi_rc_invalidate - drop cached pages of a logical eraseblock.
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ *
+ * This function has to be called when the contents of a logical eraseblock
+ * changes or it is moved to another physical eraseblock. The caller has to
+ * hold the logical eraseblock locked for writing.
+ */
+void ubi_rc_invalidate(struct ubi_volume *vol, int lnum)
+{
+	struct ubi_rc_entry *ent;
+	struct hlist_node *node, *tmp;
+
+	spin_lock(&vol->rc_lock);
+	if (vol->rc_hash)
+		hlist_for_each_entry_safe(ent, node, tmp,
+					  &vol->rc_hash[lnum % RC_HASH_SIZE],
+					  hnode)
+			if (ent->lnum == lnum)
+				rc_drop(vol, ent);
+	spin_unlock(&vol->rc_lock);
+}
+
+/**
+ * ubi_rc_free - free the read cache of a volume.
+ * @vol: volume description object
+ */
+void ubi_rc_free(struct ubi_volume *vol)
+{
+	struct ubi_rc_entry *ent, *tmp;
+
+	list_for_each_entry_safe(ent, tmp, &vol->rc_lru, lru)
+		kfree(ent);
+	kfree(vol->rc_hash);
+	vol->rc_hash = NULL;
+}
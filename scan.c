@@ -43,6 +43,7 @@
 #include <linux/err.h>
 #include <linux/crc32.h>
 #include <linux/math64.h>
+#include <linux/sort.h>
 #include "ubi.h"
 
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
@@ -55,6 +56,22 @@ static int paranoid_check_si(struct ubi_device *ubi, struct ubi_scan_info *si);
 static struct ubi_ec_hdr *ech;
 static struct ubi_vid_hdr *vidh;
 
+/**
+ * struct ubi_scan_txn_peb - a physical eraseblock written by a transaction.
+ * @list: link in the list of such physical eraseblocks (@si->txn)
+ * @pnum: physical eraseblock number
+ * @ec: erase counter
+ * @bitflips: if bit-flips were detected when reading the headers
+ * @vid_hdr: copy of the volume identifier header
+ */
+struct ubi_scan_txn_peb {
+	struct list_head list;
+	int pnum;
+	int ec;
+	int bitflips;
+	struct ubi_vid_hdr vid_hdr;
+};
+
 /**
  * add_to_list - add physical eraseblock to a list.
  * @si: scanning information
@@ -240,10 +257,10 @@ static struct ubi_scan_volume *add_volume(struct ubi_scan_info *si, int vol_id,
 static int compare_lebs(struct ubi_device *ubi, const struct ubi_scan_leb *seb,
 			int pnum, const struct ubi_vid_hdr *vid_hdr)
 {
-	void *buf;
+	void *buf, *p = NULL;
 	int len, err, second_is_newer, bitflips = 0, corrupted = 0;
 	uint32_t data_crc, crc;
-	struct ubi_vid_hdr *vh = NULL;
+	struct ubi_vid_hdr *vh;
 	unsigned long long sqnum2 = be64_to_cpu(vid_hdr->sqnum);
 
 	if (sqnum2 == seb->sqnum) {
@@ -281,9 +298,14 @@ static int compare_lebs(struct ubi_device *ubi, const struct ubi_scan_leb *seb,
 	} else {
 		pnum = seb->pnum;
 
-		vh = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
-		if (!vh)
+		/*
+		 * The caller holds a VID header from the pool already, see
+		 * 'ubi_zalloc_vid_hdr()'.
+		 */
+		p = kzalloc(ubi->vid_hdr_alsize, GFP_KERNEL);
+		if (!p)
 			return -ENOMEM;
+		vh = p + ubi->vid_hdr_shift;
 
 		err = ubi_io_read_vid_hdr(ubi, pnum, vh, 0);
 		if (err) {
@@ -337,7 +359,7 @@ static int compare_lebs(struct ubi_device *ubi, const struct ubi_scan_leb *seb,
 	}
 
 	vfree(buf);
-	ubi_free_vid_hdr(ubi, vh);
+	kfree(p);
 
 	if (second_is_newer)
 		dbg_bld("second PEB %d is newer, copy_flag is set", pnum);
@@ -349,7 +371,7 @@ static int compare_lebs(struct ubi_device *ubi, const struct ubi_scan_leb *seb,
 out_free_buf:
 	vfree(buf);
 out_free_vidh:
-	ubi_free_vid_hdr(ubi, vh);
+	kfree(p);
 	return err;
 }
 
@@ -470,6 +492,8 @@ int ubi_scan_add_used(struct ubi_device *ubi, struct ubi_scan_info *si,
 			seb->pnum = pnum;
 			seb->scrub = ((cmp_res & 2) || bitflips);
 			seb->sqnum = sqnum;
+			seb->data_size = be32_to_cpu(vid_hdr->data_size);
+			seb->data_crc = be32_to_cpu(vid_hdr->data_crc);
 
 			if (sv->highest_lnum == lnum)
 				sv->last_data_size =
@@ -506,6 +530,8 @@ int ubi_scan_add_used(struct ubi_device *ubi, struct ubi_scan_info *si,
 	seb->lnum = lnum;
 	seb->sqnum = sqnum;
 	seb->scrub = bitflips;
+	seb->data_size = be32_to_cpu(vid_hdr->data_size);
+	seb->data_crc = be32_to_cpu(vid_hdr->data_crc);
 
 	if (sv->highest_lnum <= lnum) {
 		sv->highest_lnum = lnum;
@@ -705,6 +731,192 @@ struct ubi_scan_leb *ubi_scan_get_free_peb(struct ubi_device *ubi,
 	return ERR_PTR(-ENOSPC);
 }
 
+/**
+ * add_txn_peb - remember a physical eraseblock written by a transaction.
+ * @si: scanning information
+ * @pnum: physical eraseblock number
+ * @ec: erase counter
+ * @vid_hdr: the volume identifier header
+ * @bitflips: if bit-flips were detected when this physical eraseblock was read
+ *
+ * Physical eraseblocks written by multi-LEB transactions cannot be added to
+ * the scanning information before the transaction table is found, so they are
+ * put to the @si->txn list for now and resolved by 'scan_txns()'. Returns zero
+ * in case of success and %-ENOMEM in case of failure.
+ */
+static int add_txn_peb(struct ubi_scan_info *si, int pnum, int ec,
+		       const struct ubi_vid_hdr *vid_hdr, int bitflips)
+{
+	struct ubi_scan_txn_peb *tp;
+	unsigned long long sqnum = be64_to_cpu(vid_hdr->sqnum);
+
+	dbg_bld("PEB %d, LEB %d:%d, transaction %llu", pnum,
+		be32_to_cpu(vid_hdr->vol_id), be32_to_cpu(vid_hdr->lnum),
+		(unsigned long long)be64_to_cpu(vid_hdr->txn_sqnum));
+
+	tp = kmalloc(sizeof(struct ubi_scan_txn_peb), GFP_KERNEL);
+	if (!tp)
+		return -ENOMEM;
+
+	tp->pnum = pnum;
+	tp->ec = ec;
+	tp->bitflips = bitflips;
+	memcpy(&tp->vid_hdr, vid_hdr, sizeof(struct ubi_vid_hdr));
+	list_add_tail(&tp->list, &si->txn);
+
+	/*
+	 * Even if the transaction turns out to be interrupted, its sequence
+	 * numbers must not be re-used while this physical eraseblock exists,
+	 * otherwise it could be taken for a part of a later transaction. The
+	 * transaction sequence number is always smaller than @sqnum.
+	 */
+	if (si->max_sqnum < sqnum)
+		si->max_sqnum = sqnum;
+	return 0;
+}
+
+/*
+ * Compare transaction table entries by physical eraseblock number, used to
+ * sort the table in 'scan_txns()'.
+ */
+static int cmp_txn_entry(const void *a, const void *b)
+{
+	const struct ubi_txn_tbl_entry *e1 = a, *e2 = b;
+
+	return (int)be32_to_cpu(e1->pnum) - (int)be32_to_cpu(e2->pnum);
+}
+
+/**
+ * txn_committed - check whether a transaction PEB is in the table.
+ * @ent: transaction table entries sorted by physical eraseblock number
+ * @count: count of entries
+ * @tp: the physical eraseblock to check
+ *
+ * Returns non-zero if @tp belongs to a committed transaction and zero if not.
+ */
+static int txn_committed(const struct ubi_txn_tbl_entry *ent, int count,
+			 const struct ubi_scan_txn_peb *tp)
+{
+	int lo = 0, hi = count - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2, pnum = be32_to_cpu(ent[mid].pnum);
+
+		if (pnum == tp->pnum)
+			return ent[mid].txn_sqnum == tp->vid_hdr.txn_sqnum;
+		if (pnum < tp->pnum)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return 0;
+}
+
+/**
+ * scan_txns - resolve physical eraseblocks written by transactions.
+ * @ubi: UBI device description object
+ * @si: scanning information
+ *
+ * This function reads the transaction table and adds the physical eraseblocks
+ * of committed transactions from the @si->txn list to the scanning
+ * information. Physical eraseblocks of transactions which were interrupted by
+ * an unclean reboot are not referred to by the table. They are scheduled for
+ * erasure, so their logical eraseblocks keep the old contents. Returns zero
+ * in case of success and a negative error code in case of failure.
+ */
+static int scan_txns(struct ubi_device *ubi, struct ubi_scan_info *si)
+{
+	int err = 0, count = 0, dropped = 0;
+	struct ubi_txn_tbl_entry *ent = NULL;
+	struct ubi_scan_txn_peb *tp, *tp_tmp;
+	struct ubi_scan_volume *sv;
+	struct ubi_scan_leb *seb = NULL;
+	void *buf = NULL;
+
+	if (list_empty(&si->txn))
+		return 0;
+
+	sv = ubi_scan_find_sv(si, UBI_TXN_VOLUME_ID);
+	if (sv)
+		seb = ubi_scan_find_seb(sv, 0);
+	if (seb) {
+		buf = vmalloc(ubi->leb_size);
+		if (!buf)
+			return -ENOMEM;
+
+		/*
+		 * If the table cannot be read, refuse to attach rather than
+		 * drop committed data.
+		 */
+		err = ubi_io_read_data(ubi, buf, seb->pnum, 0, ubi->leb_size);
+		if (err && err != UBI_IO_BITFLIPS) {
+			ubi_err("cannot read transaction table from PEB %d",
+				seb->pnum);
+			goto out_free;
+		}
+
+		count = ubi_check_txn_tbl(ubi, buf);
+		if (count < 0) {
+			/*
+			 * Only the very first table may be torn by an unclean
+			 * reboot, and then no transaction has been committed
+			 * yet. The first table is the only one written without
+			 * the copy flag. Later tables are protected by the data
+			 * CRC of the copy-on-write update, see
+			 * 'compare_lebs()', so if such a table is bad, it is
+			 * corrupted and committed data would be dropped.
+			 */
+			err = ubi_io_read_vid_hdr(ubi, seb->pnum, vidh, 0);
+			if (err && err != UBI_IO_BITFLIPS) {
+				if (err > 0)
+					err = -EINVAL;
+				goto out_free;
+			}
+			if (vidh->copy_flag) {
+				ubi_err("bad transaction table in PEB %d",
+					seb->pnum);
+				err = -EINVAL;
+				goto out_free;
+			}
+
+			ubi_warn("torn first transaction table in PEB %d, "
+				 "ignore it", seb->pnum);
+			count = 0;
+		}
+		err = 0;
+
+		ent = buf + sizeof(struct ubi_txn_tbl_hdr);
+		sort(ent, count, sizeof(struct ubi_txn_tbl_entry),
+		     cmp_txn_entry, NULL);
+	}
+
+	list_for_each_entry_safe(tp, tp_tmp, &si->txn, list) {
+		if (txn_committed(ent, count, tp))
+			err = ubi_scan_add_used(ubi, si, tp->pnum, tp->ec,
+						&tp->vid_hdr, tp->bitflips);
+		else {
+			dbg_bld("PEB %d belongs to interrupted transaction",
+				tp->pnum);
+			dropped += 1;
+			err = add_to_list(si, tp->pnum, tp->ec, &si->erase);
+		}
+		if (err)
+			goto out_free;
+
+		list_del(&tp->list);
+		kfree(tp);
+	}
+
+	if (dropped)
+		ubi_msg("%d PEBs of interrupted transactions are dropped",
+			dropped);
+
+out_free:
+	vfree(buf);
+	return err;
+}
+
 /**
  * process_eb - read, check UBI headers, and add them to scanning information.
  * @ubi: UBI device description object
@@ -803,7 +1015,8 @@ static int process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
 	}
 
 	vol_id = be32_to_cpu(vidh->vol_id);
-	if (vol_id > UBI_MAX_VOLUMES && vol_id != UBI_LAYOUT_VOLUME_ID) {
+	if (vol_id > UBI_MAX_VOLUMES && vol_id != UBI_LAYOUT_VOLUME_ID &&
+	    vol_id != UBI_TXN_VOLUME_ID) {
 		int lnum = be32_to_cpu(vidh->lnum);
 
 		/* Unsupported internal volume */
@@ -839,6 +1052,17 @@ static int process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
 		}
 	}
 
+	if (vidh->txn_sqnum) {
+		/*
+		 * Written by a multi-LEB transaction, it is not known yet
+		 * whether the transaction was committed.
+		 */
+		err = add_txn_peb(si, pnum, ec, vidh, bitflips);
+		if (err)
+			return err;
+		goto adjust_mean_ec;
+	}
+
 	/* Both UBI headers seem to be fine */
 	err = ubi_scan_add_used(ubi, si, pnum, ec, vidh, bitflips);
 	if (err)
@@ -880,6 +1104,7 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 	INIT_LIST_HEAD(&si->free);
 	INIT_LIST_HEAD(&si->erase);
 	INIT_LIST_HEAD(&si->alien);
+	INIT_LIST_HEAD(&si->txn);
 	si->volumes = RB_ROOT;
 	si->is_empty = 1;
 
@@ -903,6 +1128,10 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 
 	dbg_msg("scanning is finished");
 
+	err = scan_txns(ubi, si);
+	if (err)
+		goto out_vidh;
+
 	/* Calculate mean erase counter */
 	if (si->ec_count)
 		si->mean_ec = div_u64(si->ec_sum, si->ec_count);
@@ -994,9 +1223,14 @@ static void destroy_sv(struct ubi_scan_volume *sv)
 void ubi_scan_destroy_si(struct ubi_scan_info *si)
 {
 	struct ubi_scan_leb *seb, *seb_tmp;
+	struct ubi_scan_txn_peb *tp, *tp_tmp;
 	struct ubi_scan_volume *sv;
 	struct rb_node *rb;
 
+	list_for_each_entry_safe(tp, tp_tmp, &si->txn, list) {
+		list_del(&tp->list);
+		kfree(tp);
+	}
 	list_for_each_entry_safe(seb, seb_tmp, &si->alien, u.list) {
 		list_del(&seb->u.list);
 		kfree(seb);
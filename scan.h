@@ -31,6 +31,8 @@
  * @lnum: logical eraseblock number
  * @scrub: if this physical eraseblock needs scrubbing
  * @sqnum: sequence number
+ * @data_size: data size from the VID header, %0 if not known
+ * @data_crc: data CRC from the VID header
  * @u: unions RB-tree or @list links
  * @u.rb: link in the per-volume RB-tree of &struct ubi_scan_leb objects
  * @u.list: link in one of the eraseblock lists
@@ -44,6 +46,8 @@ struct ubi_scan_leb {
 	int lnum;
 	int scrub;
 	unsigned long long sqnum;
+	int data_size;
+	uint32_t data_crc;
 	union {
 		struct rb_node rb;
 		struct list_head list;
@@ -91,6 +95,8 @@ struct ubi_scan_volume {
  * @erase: list of physical eraseblocks which have to be erased
  * @alien: list of physical eraseblocks which should not be used by UBI (e.g.,
  *         those belonging to "preserve"-compatible internal volumes)
+ * @txn: list of physical eraseblocks written by multi-LEB transactions, which
+ *       are added to the volumes only after the transaction table was read
  * @bad_peb_count: count of bad physical eraseblocks
  * @vols_found: number of volumes found during scanning
  * @highest_vol_id: highest volume ID
@@ -113,6 +119,7 @@ struct ubi_scan_info {
 	struct list_head free;
 	struct list_head erase;
 	struct list_head alien;
+	struct list_head txn;
 	int bad_peb_count;
 	int vols_found;
 	int highest_vol_id;
@@ -0,0 +1,325 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * UBI per-operation overhead micro-benchmark.
+ *
+ * This program measures the cost of small UBI operations, where the time is
+ * dominated by UBI itself rather than by the flash: several threads read
+ * random 4KiB chunks from a UBI volume character device, and optionally
+ * several other threads keep un-mapping and mapping logical eraseblocks of
+ * the same volume at the same time. The result is the number of operations
+ * per second and the average time of one operation.
+ *
+ * To measure UBI rather than the flash, use nandsim, which keeps the
+ * simulated flash in RAM, and read either un-mapped logical eraseblocks,
+ * which UBI does not read from the flash at all, or a volume which was just
+ * written. For example:
+ *
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xa2 \
+ *		 third_id_byte=0x00 fourth_id_byte=0x15
+ *	modprobe ubi mtd=0
+ *	ubimkvol /dev/ubi0 -N bench -m
+ *	ubi-bench -t 4 -s 10 /dev/ubi0_0
+ *	ubi-bench -t 4 -W 4 -s 10 /dev/ubi0_0
+ *
+ * The second run adds parallel writers, each of them un-maps and maps its own
+ * logical eraseblocks, which takes the LEB locks for writing and allocates
+ * sequence numbers.
+ *
+ * To see what a change costs or saves, build the UBI module from the tree
+ * before and after the change, and repeat the same runs on the same machine
+ * with each of them loaded. Use several threads on a multi-processor machine,
+ * a single CPU hides contention. The "ns/op" of the "read" line is the
+ * per-operation overhead of UBI, compare it between the two modules.
+ *
+ * Note, with parallel writers the interesting number is how much the reads
+ * slow down compared to the first run. Sequence numbers used to be allocated
+ * under the same spinlock which also protected the LEB lock tree, so every
+ * map operation of a writer could contend with every read. Now readers and
+ * writers of different logical eraseblocks share no lock except when their
+ * LEBs hash to the same LEB lock, and on 64-bit architectures the sequence
+ * number is a single atomic increment. Whether this removes measurable
+ * contention depends on the machine: compare the slow-down of the "read"
+ * line between the old and the new module, and the "map" rate with 1, 4 and
+ * 8 writers. What remains shared between writers is the cache line of the
+ * sequence counter and the WL sub-system's @ubi->wl_lock, taken when getting
+ * and putting physical eraseblocks, so the "map" rate is expected to stop
+ * scaling at a few writers.
+ *
+ * To measure the contention on physical eraseblock allocation alone, run
+ * writers without readers and compare the "map" rates of a kernel with and
+ * without the per-CPU caches of free eraseblocks
+ * (CONFIG_MTD_UBI_WL_PEB_CACHE). The caches only serve data of unknown type,
+ * which is the default here, "-d long" or "-d short" bypass them:
+ *
+ *	ubi-bench -t 0 -W 1 -s 10 /dev/ubi0_0
+ *	ubi-bench -t 0 -W 8 -s 10 /dev/ubi0_0
+ *	ubi-bench -t 0 -W 8 -d long -s 10 /dev/ubi0_0
+ *
+ * Build it like this:
+ *
+ *	gcc -O2 -Wall -o ubi-bench tools/ubi-bench/ubi-bench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <mtd/ubi-user.h>
+
+#define PROGRAM_NAME "ubi-bench"
+
+#define CHUNK_SIZE 4096
+
+/*
+ * Values of the @dtype field of &struct ubi_map_req. Newer versions of
+ * ubi-user.h do not define them any more, so they are repeated here.
+ */
+#define DTYPE_LONGTERM 1
+#define DTYPE_SHORTTERM 2
+#define DTYPE_UNKNOWN 3
+#define MAX_THREADS 64
+
+struct thread {
+	pthread_t tid;
+	int fd;
+	int num;
+	unsigned int seed;
+	unsigned long long ops;
+	unsigned long long ns;
+	int err;
+};
+
+static const char *dev;
+static long long vol_size;
+static int leb_size, leb_count;
+static int writers, writer_lebs = 4, dtype = DTYPE_UNKNOWN;
+static volatile int stop;
+
+static void __attribute__((noreturn)) die(const char *msg)
+{
+	fprintf(stderr, PROGRAM_NAME ": %s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read a number from "/sys/class/ubi/<volume>/<name>" */
+static long long read_sysfs(const char *name)
+{
+	char path[256], *p = strrchr(dev, '/');
+	long long val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/ubi/%s/%s",
+		 p ? p + 1 : dev, name);
+	f = fopen(path, "r");
+	if (!f || fscanf(f, "%lld", &val) != 1)
+		die("cannot read volume information from sysfs");
+	fclose(f);
+	return val;
+}
+
+static void *reader(void *arg)
+{
+	struct thread *t = arg;
+	long long chunks = vol_size / CHUNK_SIZE;
+	unsigned long long start;
+	char buf[CHUNK_SIZE];
+
+	start = now_ns();
+	while (!stop) {
+		off_t offs = (rand_r(&t->seed) % chunks) * CHUNK_SIZE;
+
+		if (pread(t->fd, buf, CHUNK_SIZE, offs) != CHUNK_SIZE) {
+			t->err = errno;
+			break;
+		}
+		t->ops += 1;
+	}
+	t->ns = now_ns() - start;
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct thread *t = arg;
+	int first = leb_count - (t->num + 1) * writer_lebs, i = 0;
+	unsigned long long start;
+
+	start = now_ns();
+	while (!stop) {
+		struct ubi_map_req req;
+		int32_t lnum = first + i;
+
+		memset(&req, 0, sizeof(struct ubi_map_req));
+		req.lnum = lnum;
+		req.dtype = dtype;
+		if (ioctl(t->fd, UBI_IOCEBUNMAP, &lnum) ||
+		    ioctl(t->fd, UBI_IOCEBMAP, &req)) {
+			t->err = errno;
+			break;
+		}
+		t->ops += 1;
+		i = (i + 1) % writer_lebs;
+	}
+	t->ns = now_ns() - start;
+	return NULL;
+}
+
+static void report(const char *what, struct thread *t, int count, int secs)
+{
+	unsigned long long ops = 0, ns = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (t[i].err)
+			fprintf(stderr, PROGRAM_NAME ": %s thread %d failed: "
+				"%s\n", what, i, strerror(t[i].err));
+		ops += t[i].ops;
+		ns += t[i].ns;
+	}
+	if (!ops)
+		return;
+
+	printf("%-8s %3d threads %12llu ops %12.0f ops/s %10.0f ns/op\n",
+	       what, count, ops, (double)ops / secs, (double)ns / ops);
+}
+
+static void usage(void)
+{
+	printf("Usage: " PROGRAM_NAME " [options] <UBI volume device>\n"
+	"Measure the per-operation overhead of 4KiB reads from a UBI volume\n"
+	"and of mapping its LEBs.\n\n"
+	"  -t <count>    count of reader threads, may be 0 (default 1)\n"
+	"  -W <count>    count of writer threads which un-map and map LEBs\n"
+	"                at the end of the volume (default 0)\n"
+	"  -l <count>    LEBs per writer thread (default %d)\n"
+	"  -d <type>     data type of mapped LEBs: long, short or unknown\n"
+	"                (default unknown)\n"
+	"  -s <seconds>  how long to run (default 5)\n"
+	"  -r            do not read the LEBs used by the writers\n",
+	writer_lebs);
+}
+
+int main(int argc, char * const argv[])
+{
+	struct thread rd[MAX_THREADS], wr[MAX_THREADS];
+	int readers = 1, secs = 5, skip_written = 0, c, i;
+
+	while ((c = getopt(argc, argv, "t:W:l:d:s:rh")) != -1) {
+		switch (c) {
+		case 't':
+			readers = atoi(optarg);
+			break;
+		case 'W':
+			writers = atoi(optarg);
+			break;
+		case 'l':
+			writer_lebs = atoi(optarg);
+			break;
+		case 'd':
+			if (!strcmp(optarg, "long"))
+				dtype = DTYPE_LONGTERM;
+			else if (!strcmp(optarg, "short"))
+				dtype = DTYPE_SHORTTERM;
+			else if (!strcmp(optarg, "unknown"))
+				dtype = DTYPE_UNKNOWN;
+			else
+				die("bad data type");
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		case 'r':
+			skip_written = 1;
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	dev = argv[optind];
+
+	if (readers < 0 || readers > MAX_THREADS || writers < 0 ||
+	    writers > MAX_THREADS || readers + writers < 1 ||
+	    writer_lebs < 1 || secs < 1)
+		die("bad arguments");
+
+	leb_size = read_sysfs("usable_eb_size");
+	leb_count = read_sysfs("reserved_ebs");
+	if (writers * writer_lebs >= leb_count)
+		die("the volume is too small for that many writers");
+	vol_size = (long long)leb_size * leb_count;
+	if (skip_written)
+		vol_size -= (long long)leb_size * writers * writer_lebs;
+	if (vol_size < CHUNK_SIZE)
+		die("the volume is too small");
+
+	memset(rd, 0, sizeof(rd));
+	memset(wr, 0, sizeof(wr));
+	for (i = 0; i < readers + writers; i++) {
+		struct thread *t = i < readers ? &rd[i] : &wr[i - readers];
+
+		t->num = i < readers ? i : i - readers;
+		t->seed = i + 1;
+		t->fd = open(dev, i < readers ? O_RDONLY : O_RDWR);
+		if (t->fd == -1)
+			die("cannot open the volume");
+		if (pthread_create(&t->tid, NULL, i < readers ? reader : writer,
+				   t))
+			die("cannot create thread");
+	}
+
+	sleep(secs);
+	stop = 1;
+
+	for (i = 0; i < readers; i++) {
+		pthread_join(rd[i].tid, NULL);
+		close(rd[i].fd);
+	}
+	for (i = 0; i < writers; i++) {
+		pthread_join(wr[i].tid, NULL);
+		close(wr[i].fd);
+	}
+
+	report("read", rd, readers, secs);
+	report("map", wr, writers, secs);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1 @@
+/* Userspace replacement of <asm/system.h> for the wear-leveling simulator */
@@ -0,0 +1,20 @@
+/*
+ * Userspace replacement of <linux/kernel.h> for the wear-leveling simulator.
+ * Only what wl-policy.h needs is provided.
+ */
+#ifndef __WLSIM_LINUX_KERNEL_H__
+#define __WLSIM_LINUX_KERNEL_H__
+
+/* Find the last (most significant) bit set, the same as in the kernel */
+static inline int fls(unsigned int x)
+{
+	int r = 0;
+
+	while (x) {
+		x >>= 1;
+		r += 1;
+	}
+	return r;
+}
+
+#endif /* !__WLSIM_LINUX_KERNEL_H__ */
@@ -0,0 +1,817 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * UBI wear-leveling policy simulator.
+ *
+ * This program replays LEB operation traces recorded by UBI (see
+ * CONFIG_MTD_UBI_DEBUG_TRACE and the "ubi/ubiX/trace" debugfs file) against a
+ * userspace model of the wear-leveling sub-system and reports the resulting
+ * erase counter distribution, the amount of wear-leveling copies and the
+ * write amplification. The trace may be replayed many times in a row to see
+ * what happens to the flash after years of the same workload.
+ *
+ * The model follows the policy of wl.c: how 'ubi_wl_get_peb()' picks free
+ * physical eraseblocks for the different data types, the protection queue
+ * and its adaptive length, how the wear-leveling worker picks what to move
+ * and where (including the hot data check), scrubbing because of read
+ * disturb and the adaptive wear-leveling threshold. The wear-leveling entry,
+ * the trees and lists of entries, the constants and the decisions which do
+ * not depend on locking or I/O come from wl-policy.h, which wl.c uses as
+ * well. What is not modelled is
+ * concurrency: works are done between trace operations, at most @bgt_works
+ * of them after each operation, and the rest when a writer has to wait for a
+ * free physical eraseblock. Bad eraseblocks and torturing are not modelled
+ * either. When the way wl.c drives the policy changes, this file has to be
+ * changed as well.
+ *
+ * Build it from the UBI source directory like this:
+ *
+ *	gcc -O2 -Wall -I. -Itools/wlsim/include -o ubi-wlsim \
+ *	    tools/wlsim/ubi-wlsim.c -lm
+ *
+ * tools/wlsim/wl-threshold-test.sh uses it to check that adapting the
+ * wear-leveling threshold does not make the erase counter spread worse.
+ *
+ * Trace format: one operation per line, "<op> <vol_id> <lnum> <dtype>", where
+ * <op> is 'M' (the LEB was mapped to a new physical eraseblock), 'U' (the LEB
+ * was un-mapped), 'R' (the LEB was read) or 'L' (<lnum> records were lost).
+ * Empty lines and lines starting with '#' are ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <getopt.h>
+#include "wl-policy.h"
+
+#define PROGRAM_NAME "ubi-wlsim"
+
+/* Data types, the same values as in <linux/mtd/ubi.h> */
+#define UBI_LONGTERM  1
+#define UBI_SHORTTERM 2
+#define UBI_UNKNOWN   3
+
+/* Default values of the corresponding Kconfig options */
+#define DFLT_WL_THRESHOLD 4096
+#define DFLT_WL_WA_BUDGET 10
+#define DFLT_RD_THRESHOLD 100000
+
+/* Count of volume slots, the last one is for all the internal volumes */
+#define SIM_VOLUMES 129
+
+/* The volume ID of the static data created by the -s option */
+#define SIM_STATIC_VOL_ID 127
+
+/* Count of erase counter histogram buckets in the report */
+#define SIM_EC_HIST_BUCKETS 10
+
+/**
+ * struct sim_peb - what the simulated flash stores in a physical eraseblock.
+ * @vol_id: volume ID of the LEB mapped to this physical eraseblock
+ * @lnum: the LEB mapped to this physical eraseblock (%-1 if none)
+ * @sqnum: sequence number the LEB was written with
+ * @copy_flag: if the LEB was written by the wear-leveling worker
+ * @reads: reads since the last erasure
+ *
+ * In the kernel this is in the VID header of the physical eraseblock, so it
+ * is kept aside of the wear-leveling entries, in the same way.
+ */
+struct sim_peb {
+	int vol_id;
+	int lnum;
+	unsigned long long sqnum;
+	int copy_flag;
+	int reads;
+};
+
+/* A pending work: a physical eraseblock to erase or %NULL for wear-leveling */
+struct sim_work {
+	struct ubi_wl_entry *e;
+};
+
+struct sim_op {
+	char op;
+	int vol_id;
+	int lnum;
+	int dtype;
+};
+
+/**
+ * struct sim - the simulated UBI device.
+ * The fields have the same meaning as the corresponding fields of
+ * &struct ubi_device.
+ */
+struct sim {
+	int peb_count;
+	struct ubi_wl_entry *lookuptbl;
+	struct sim_peb *pebs;
+	int *eba_tbl[SIM_VOLUMES];
+
+	struct ubi_wl_tree used, free, scrub;
+	int pq_head;
+	int pq_len;
+	unsigned int pq_erases;
+	int pq_sweep;
+	int pq_life[UBI_PQ_LIFE_BUCKETS];
+	int pq_adapt_puts;
+
+	struct sim_work *works;
+	int works_size;
+	int works_head;
+	int works_count;
+	int wl_scheduled;
+	int bgt_works;
+
+	unsigned long long global_sqnum;
+	int max_ec;
+	int wl_threshold;
+	int wl_threshold_min;
+	int wl_threshold_max;
+	int wl_wa_budget;
+	int wl_adapt_erases;
+	unsigned long long wl_adapt_copies;
+	unsigned long long wl_adapt_sqnum;
+	unsigned long long wl_wa_copies;
+	unsigned long long wl_wa_writes;
+	int rd_threshold;
+
+	unsigned long long user_writes;
+	unsigned long long wl_copies;
+	unsigned long long wl_moves;
+	unsigned long long scrub_count;
+	unsigned long long wl_wasted_copies;
+	unsigned long long erases;
+	unsigned long long rd_scrubs;
+	unsigned long long pq_evictions;
+	unsigned long long wl_protected;
+};
+
+static void __attribute__((noreturn)) die(const char *msg)
+{
+	fprintf(stderr, PROGRAM_NAME ": %s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static void *xzalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p)
+		die("out of memory");
+	return p;
+}
+
+static int sim_pnum(struct sim *s, struct ubi_wl_entry *e)
+{
+	return e - s->lookuptbl;
+}
+
+static void prot_queue_add(struct sim *s, struct ubi_wl_entry *e)
+{
+	int pq_tail = (s->pq_head + s->pq_len - 1) & (UBI_PROT_QUEUE_MAX - 1);
+
+	if (e->state == UBI_WL_FREE) {
+		e->stamp = s->pq_erases & WL_STAMP_MASK;
+		e->stamp_src = WL_STAMP_GET;
+	}
+	wl_list_add_tail(s->lookuptbl, e, s->peb_count + pq_tail);
+	e->state = UBI_WL_PROT;
+}
+
+static void schedule_work(struct sim *s, struct ubi_wl_entry *e)
+{
+	int i;
+
+	if (s->works_count == s->works_size) {
+		struct sim_work *w;
+
+		w = xzalloc(2 * s->works_size * sizeof(struct sim_work));
+		for (i = 0; i < s->works_count; i++)
+			w[i] = s->works[(s->works_head + i) % s->works_size];
+		free(s->works);
+		s->works = w;
+		s->works_head = 0;
+		s->works_size *= 2;
+	}
+
+	i = (s->works_head + s->works_count) % s->works_size;
+	s->works[i].e = e;
+	s->works_count += 1;
+}
+
+static void schedule_erase(struct sim *s, struct ubi_wl_entry *e)
+{
+	e->state = UBI_WL_ERASE;
+	schedule_work(s, e);
+}
+
+static void wl_entry_del(struct sim *s, struct ubi_wl_entry *e)
+{
+	switch (e->state) {
+	case UBI_WL_USED:
+		wl_tree_del(e, &s->used);
+		break;
+	case UBI_WL_SCRUB:
+		wl_tree_del(e, &s->scrub);
+		break;
+	case UBI_WL_PROT:
+		wl_list_del(s->lookuptbl, e);
+		break;
+	default:
+		die("bad physical eraseblock state");
+	}
+}
+
+static void ensure_wear_leveling(struct sim *s)
+{
+	if (s->wl_scheduled)
+		return;
+
+	if (wl_tree_empty(&s->scrub)) {
+		struct ubi_wl_entry *e1, *e2;
+
+		if (wl_tree_empty(&s->used) || wl_tree_empty(&s->free))
+			return;
+
+		e1 = wl_tree_first(&s->used);
+		e2 = find_wl_entry(&s->free, WL_FREE_MAX_DIFF(s));
+		if (!(e2->ec - e1->ec >= s->wl_threshold))
+			return;
+	}
+
+	s->wl_scheduled = 1;
+	schedule_work(s, NULL);
+}
+
+static void serve_prot_queue(struct sim *s)
+{
+	struct ubi_wl_entry *tbl = s->lookuptbl;
+	unsigned int head = s->peb_count + s->pq_head;
+
+	while (!wl_list_empty(tbl, head)) {
+		struct ubi_wl_entry *e = &tbl[tbl[head].right];
+
+		wl_list_del(tbl, e);
+		wl_tree_add(e, &s->used);
+		e->state = UBI_WL_USED;
+		s->pq_evictions += 1;
+	}
+
+	s->pq_head += 1;
+	if (s->pq_head == UBI_PROT_QUEUE_MAX)
+		s->pq_head = 0;
+	s->pq_erases += 1;
+	s->pq_sweep = wl_stamp_sweep(tbl, s->pq_sweep, s->peb_count,
+				     s->pq_erases);
+}
+
+static void pq_account_put(struct sim *s, struct ubi_wl_entry *e)
+{
+	unsigned int life = wl_stamp_life(e, s->pq_erases);
+	int src = e->stamp_src;
+
+	e->stamp_src = WL_STAMP_NONE;
+	if (src == WL_STAMP_MOVE) {
+		if (life < UBI_PROT_QUEUE_MAX)
+			s->wl_wasted_copies += 1;
+		return;
+	} else if (src != WL_STAMP_GET && src != WL_STAMP_OLD)
+		return;
+
+	s->pq_life[pq_life_bucket(life)] += 1;
+	if (++s->pq_adapt_puts >= WL_PQ_ADAPT_PERIOD) {
+		s->pq_len = pq_choose_len(s->pq_life, s->pq_adapt_puts);
+		memset(s->pq_life, 0, sizeof(s->pq_life));
+		s->pq_adapt_puts = 0;
+	}
+}
+
+static void wl_adapt_threshold(struct sim *s)
+{
+	int min_ec = INT_MAX, spread, wa;
+	unsigned long long copies, writes;
+	struct ubi_wl_entry *e;
+
+	if (++s->wl_adapt_erases < WL_ADAPT_PERIOD)
+		return;
+	s->wl_adapt_erases = 0;
+
+	copies = s->wl_copies - s->wl_adapt_copies;
+	writes = s->global_sqnum - s->wl_adapt_sqnum;
+	writes = writes > copies ? writes - copies : 0;
+	s->wl_adapt_copies = s->wl_copies;
+	s->wl_adapt_sqnum = s->global_sqnum;
+	s->wl_wa_copies += copies;
+	s->wl_wa_writes += writes;
+	if (s->wl_wa_writes < (unsigned long long)WL_WA_WINDOW * s->peb_count)
+		return;
+
+	wa = s->wl_wa_copies * 100 / s->wl_wa_writes;
+	s->wl_wa_copies >>= 1;
+	s->wl_wa_writes >>= 1;
+
+	if (!wl_tree_empty(&s->used)) {
+		e = wl_tree_first(&s->used);
+		min_ec = e->ec;
+	}
+	if (!wl_tree_empty(&s->free)) {
+		e = wl_tree_first(&s->free);
+		if (e->ec < min_ec)
+			min_ec = e->ec;
+	}
+	spread = min_ec == INT_MAX ? 0 : s->max_ec - min_ec;
+
+	s->wl_threshold = wl_choose_threshold(s->wl_threshold, wa,
+					      s->wl_wa_budget, spread,
+					      s->wl_threshold_min,
+					      s->wl_threshold_max);
+}
+
+static void erase_worker(struct sim *s, struct ubi_wl_entry *e)
+{
+	struct sim_peb *peb = &s->pebs[sim_pnum(s, e)];
+
+	e->ec += 1;
+	peb->reads = 0;
+	peb->vol_id = peb->lnum = -1;
+	if (e->ec > s->max_ec)
+		s->max_ec = e->ec;
+	s->erases += 1;
+
+	wl_tree_add(e, &s->free);
+	e->state = UBI_WL_FREE;
+
+	serve_prot_queue(s);
+	wl_adapt_threshold(s);
+	ensure_wear_leveling(s);
+}
+
+static void wear_leveling_worker(struct sim *s)
+{
+	int scrubbing = 0, hot;
+	struct ubi_wl_entry *e1, *e2;
+	struct sim_peb *from, *to;
+
+	if (wl_tree_empty(&s->free) ||
+	    (wl_tree_empty(&s->used) && wl_tree_empty(&s->scrub)))
+		goto out_cancel;
+
+	if (wl_tree_empty(&s->scrub)) {
+		e1 = wl_tree_first(&s->used);
+		e2 = find_wl_entry(&s->free, WL_FREE_MAX_DIFF(s));
+		if (!(e2->ec - e1->ec >= s->wl_threshold))
+			goto out_cancel;
+		wl_tree_del(e1, &s->used);
+	} else {
+		scrubbing = 1;
+		e1 = wl_tree_first(&s->scrub);
+		wl_tree_del(e1, &s->scrub);
+	}
+	e1->state = UBI_WL_NONE;
+
+	from = &s->pebs[sim_pnum(s, e1)];
+	hot = data_is_hot(s->global_sqnum, from->sqnum, from->copy_flag,
+			  s->peb_count);
+	if (hot && !scrubbing) {
+		prot_queue_add(s, e1);
+		s->wl_protected += 1;
+		goto out_cancel;
+	}
+
+	if (hot)
+		e2 = find_wl_entry(&s->free, WL_FREE_MAX_DIFF(s) / 2);
+	else
+		e2 = find_wl_entry(&s->free, WL_FREE_MAX_DIFF(s));
+	wl_tree_del(e2, &s->free);
+
+	/* Copy the LEB, the copy gets a new sequence number */
+	to = &s->pebs[sim_pnum(s, e2)];
+	to->vol_id = from->vol_id;
+	to->lnum = from->lnum;
+	to->sqnum = ++s->global_sqnum;
+	to->copy_flag = 1;
+	s->eba_tbl[to->vol_id][to->lnum] = sim_pnum(s, e2);
+
+	s->wl_copies += 1;
+	if (scrubbing)
+		s->scrub_count += 1;
+	else
+		s->wl_moves += 1;
+
+	e2->stamp = s->pq_erases & WL_STAMP_MASK;
+	e2->stamp_src = WL_STAMP_MOVE;
+	wl_tree_add(e2, &s->used);
+	e2->state = UBI_WL_USED;
+	s->wl_scheduled = 0;
+
+	schedule_erase(s, e1);
+	return;
+
+out_cancel:
+	s->wl_scheduled = 0;
+}
+
+static int do_work(struct sim *s)
+{
+	struct sim_work wrk;
+
+	if (!s->works_count)
+		return 0;
+
+	wrk = s->works[s->works_head];
+	s->works_head = (s->works_head + 1) % s->works_size;
+	s->works_count -= 1;
+
+	if (wrk.e)
+		erase_worker(s, wrk.e);
+	else
+		wear_leveling_worker(s);
+	return 1;
+}
+
+static int get_peb(struct sim *s, int dtype)
+{
+	struct ubi_wl_entry *e;
+
+	while (wl_tree_empty(&s->free))
+		if (!do_work(s))
+			die("no free eraseblocks, too few PEBs for this trace");
+
+	switch (dtype) {
+	case UBI_LONGTERM:
+		e = find_wl_entry(&s->free, WL_FREE_MAX_DIFF(s));
+		break;
+	case UBI_SHORTTERM:
+		e = wl_tree_first(&s->free);
+		break;
+	default:
+		e = find_mean_wl_entry(&s->free, WL_FREE_MAX_DIFF(s));
+		break;
+	}
+
+	wl_tree_del(e, &s->free);
+	prot_queue_add(s, e);
+	return sim_pnum(s, e);
+}
+
+static void put_peb(struct sim *s, int pnum)
+{
+	struct ubi_wl_entry *e = &s->lookuptbl[pnum];
+
+	wl_entry_del(s, e);
+	pq_account_put(s, e);
+	schedule_erase(s, e);
+}
+
+static void scrub_peb(struct sim *s, int pnum)
+{
+	struct ubi_wl_entry *e = &s->lookuptbl[pnum];
+
+	if (e->state == UBI_WL_SCRUB)
+		return;
+
+	wl_entry_del(s, e);
+	wl_tree_add(e, &s->scrub);
+	e->state = UBI_WL_SCRUB;
+	ensure_wear_leveling(s);
+}
+
+static int *leb_slot(struct sim *s, int vol_id, int lnum)
+{
+	int idx = vol_id >= 0 && vol_id < SIM_VOLUMES - 1 ? vol_id :
+		  SIM_VOLUMES - 1;
+
+	if (lnum < 0 || lnum >= s->peb_count)
+		die("bad LEB number in the trace");
+	return &s->eba_tbl[idx][lnum];
+}
+
+static void map_leb(struct sim *s, int vol_id, int lnum, int dtype)
+{
+	int *slot = leb_slot(s, vol_id, lnum), old = *slot, pnum;
+	struct sim_peb *peb;
+
+	/* Like the atomic LEB change, get the new PEB first */
+	pnum = get_peb(s, dtype);
+	peb = &s->pebs[pnum];
+	peb->vol_id = vol_id >= 0 && vol_id < SIM_VOLUMES - 1 ? vol_id :
+		      SIM_VOLUMES - 1;
+	peb->lnum = lnum;
+	peb->sqnum = ++s->global_sqnum;
+	peb->copy_flag = 0;
+	*slot = pnum;
+	s->user_writes += 1;
+
+	if (old >= 0)
+		put_peb(s, old);
+}
+
+static void unmap_leb(struct sim *s, int vol_id, int lnum)
+{
+	int *slot = leb_slot(s, vol_id, lnum), pnum = *slot;
+
+	if (pnum < 0)
+		return;
+	*slot = -1;
+	put_peb(s, pnum);
+}
+
+static void read_leb(struct sim *s, int vol_id, int lnum)
+{
+	int pnum = *leb_slot(s, vol_id, lnum);
+
+	if (pnum < 0 || !s->rd_threshold)
+		return;
+	if (++s->pebs[pnum].reads == s->rd_threshold) {
+		s->rd_scrubs += 1;
+		scrub_peb(s, pnum);
+	}
+}
+
+static void sim_init(struct sim *s, int peb_count, int init_ec)
+{
+	int i;
+
+	s->peb_count = peb_count;
+	s->lookuptbl = xzalloc((peb_count + UBI_PROT_QUEUE_MAX) *
+			       sizeof(struct ubi_wl_entry));
+	s->pebs = xzalloc(peb_count * sizeof(struct sim_peb));
+	for (i = 0; i < SIM_VOLUMES; i++) {
+		s->eba_tbl[i] = xzalloc(peb_count * sizeof(int));
+		memset(s->eba_tbl[i], 0xFF, peb_count * sizeof(int));
+	}
+
+	wl_tree_init(&s->used, s->lookuptbl);
+	wl_tree_init(&s->free, s->lookuptbl);
+	wl_tree_init(&s->scrub, s->lookuptbl);
+	for (i = 0; i < UBI_PROT_QUEUE_MAX; i++)
+		wl_list_init(s->lookuptbl, peb_count + i);
+	s->pq_len = UBI_PROT_QUEUE_LEN;
+
+	s->works_size = 64;
+	s->works = xzalloc(s->works_size * sizeof(struct sim_work));
+
+	s->wl_threshold_min = s->wl_threshold / 4 > 2 ?
+			      s->wl_threshold / 4 : 2;
+	s->wl_threshold_max = s->wl_threshold * 2;
+	s->wl_adapt_sqnum = 1;
+	s->max_ec = init_ec;
+
+	for (i = 0; i < peb_count; i++) {
+		struct ubi_wl_entry *e = &s->lookuptbl[i];
+
+		e->ec = init_ec;
+		s->pebs[i].vol_id = s->pebs[i].lnum = -1;
+		wl_tree_add(e, &s->free);
+		e->state = UBI_WL_FREE;
+	}
+}
+
+/* Fill @count LEBs of a volume which is never changed with long term data */
+static void sim_add_static(struct sim *s, int count)
+{
+	int lnum;
+
+	for (lnum = 0; lnum < count; lnum++)
+		map_leb(s, SIM_STATIC_VOL_ID, lnum, UBI_LONGTERM);
+	s->user_writes -= count;
+}
+
+static struct sim_op *read_trace(const char *name, long *count, long *lost)
+{
+	FILE *f;
+	char line[128];
+	long size = 1024, n = 0;
+	struct sim_op *ops = xzalloc(size * sizeof(struct sim_op));
+
+	f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+	if (!f) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	*lost = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct sim_op op = { .dtype = UBI_UNKNOWN };
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%c %d %d %d", &op.op, &op.vol_id, &op.lnum,
+			   &op.dtype) < 3)
+			die("bad trace line");
+
+		if (op.op == 'L') {
+			*lost += op.lnum;
+			continue;
+		}
+		if (op.op != 'M' && op.op != 'U' && op.op != 'R')
+			die("unknown operation in the trace");
+
+		if (n == size) {
+			struct sim_op *o = xzalloc(2 * size * sizeof(*o));
+
+			memcpy(o, ops, size * sizeof(*o));
+			free(ops);
+			ops = o;
+			size *= 2;
+		}
+		ops[n++] = op;
+	}
+
+	if (f != stdin)
+		fclose(f);
+	*count = n;
+	return ops;
+}
+
+static void report(struct sim *s, double days, double endurance_days)
+{
+	int i, min_ec = INT_MAX, max_ec = 0, width;
+	int hist[SIM_EC_HIST_BUCKETS] = { 0 };
+	double sum = 0, sq = 0, mean, wa;
+
+	for (i = 0; i < s->peb_count; i++) {
+		int ec = s->lookuptbl[i].ec;
+
+		if (ec < min_ec)
+			min_ec = ec;
+		if (ec > max_ec)
+			max_ec = ec;
+		sum += ec;
+		sq += (double)ec * ec;
+	}
+	mean = sum / s->peb_count;
+
+	width = (max_ec - min_ec) / SIM_EC_HIST_BUCKETS + 1;
+	for (i = 0; i < s->peb_count; i++)
+		hist[(s->lookuptbl[i].ec - min_ec) / width] += 1;
+
+	wa = s->user_writes ?
+	     (double)(s->user_writes + s->wl_copies) / s->user_writes : 0;
+
+	if (days > 0)
+		printf("simulated time:        %.2f years\n", days / 365);
+	printf("user LEB writes:       %llu\n", s->user_writes);
+	printf("WL copies:             %llu (wear-leveling %llu, scrubbing "
+	       "%llu, wasted %llu)\n", s->wl_copies, s->wl_moves,
+	       s->scrub_count, s->wl_wasted_copies);
+	printf("hot LEBs not moved:    %llu\n", s->wl_protected);
+	printf("read disturb scrubs:   %llu\n", s->rd_scrubs);
+	printf("erasures:              %llu\n", s->erases);
+	printf("write amplification:   %.4f\n", wa);
+	printf("erase counters:        min %d, max %d, mean %.1f, "
+	       "stddev %.1f\n", min_ec, max_ec, mean,
+	       sqrt(sq / s->peb_count - mean * mean));
+	printf("WL threshold:          %d\n", s->wl_threshold);
+	printf("protection queue len:  %d\n", s->pq_len);
+	if (endurance_days >= 0)
+		printf("endurance reached:     after %.2f years\n",
+		       endurance_days / 365);
+	printf("erase counter histogram:\n");
+	for (i = 0; i < SIM_EC_HIST_BUCKETS; i++)
+		if (min_ec + i * width <= max_ec)
+			printf("  %10d .. %-10d %d\n", min_ec + i * width,
+			       min_ec + (i + 1) * width - 1, hist[i]);
+}
+
+static void usage(void)
+{
+	printf("Usage: " PROGRAM_NAME " [options] <trace file or ->\n"
+	"Replay a UBI LEB operation trace against the wear-leveling policy.\n\n"
+	"  -p <count>    count of physical eraseblocks (default 1024)\n"
+	"  -n <times>    how many times to replay the trace (default 1)\n"
+	"  -d <days>     how many days of operation the trace covers, to\n"
+	"                report the results in years\n"
+	"  -s <count>    fill <count> LEBs with static data before replaying\n"
+	"  -e <count>    flash endurance in erase cycles, report when the\n"
+	"                first PEB reaches it\n"
+	"  -i <ec>       initial erase counter of all PEBs (default 0)\n"
+	"  -t <count>    initial WL threshold (default %d)\n"
+	"  -w <percent>  WL write amplification budget (default %d)\n"
+	"  -f            do not adjust the WL threshold\n"
+	"  -r <count>    read disturb threshold, 0 disables (default %d)\n"
+	"  -b <count>    works the background thread does after each\n"
+	"                operation, -1 means all (default -1)\n",
+	DFLT_WL_THRESHOLD, DFLT_WL_WA_BUDGET, DFLT_RD_THRESHOLD);
+}
+
+int main(int argc, char * const argv[])
+{
+	struct sim s = {
+		.wl_threshold = DFLT_WL_THRESHOLD,
+		.wl_wa_budget = DFLT_WL_WA_BUDGET,
+		.rd_threshold = DFLT_RD_THRESHOLD,
+		.bgt_works = -1,
+	};
+	int peb_count = 1024, loops = 1, static_lebs = 0, init_ec = 0;
+	int endurance = 0, fixed_thr = 0, c, loop;
+	long i, count, lost;
+	double days = 0, endurance_days = -1;
+	struct sim_op *ops;
+
+	while ((c = getopt(argc, argv, "p:n:d:s:e:i:t:w:fr:b:h")) != -1) {
+		switch (c) {
+		case 'p':
+			peb_count = atoi(optarg);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'd':
+			days = atof(optarg);
+			break;
+		case 's':
+			static_lebs = atoi(optarg);
+			break;
+		case 'e':
+			endurance = atoi(optarg);
+			break;
+		case 'i':
+			init_ec = atoi(optarg);
+			break;
+		case 't':
+			s.wl_threshold = atoi(optarg);
+			break;
+		case 'w':
+			s.wl_wa_budget = atoi(optarg);
+			break;
+		case 'f':
+			fixed_thr = 1;
+			break;
+		case 'r':
+			s.rd_threshold = atoi(optarg);
+			break;
+		case 'b':
+			s.bgt_works = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (peb_count < UBI_PROT_QUEUE_MAX || peb_count > UBI_WL_MAX_PEBS ||
+	    loops < 1 || static_lebs < 0 ||
+	    static_lebs >= peb_count || s.wl_threshold < 2 || init_ec < 0)
+		die("bad arguments");
+
+	ops = read_trace(argv[optind], &count, &lost);
+	if (lost)
+		fprintf(stderr, PROGRAM_NAME ": warning: %ld records were "
+			"lost when the trace was recorded\n", lost);
+
+	sim_init(&s, peb_count, init_ec);
+	if (fixed_thr)
+		s.wl_threshold_min = s.wl_threshold_max = s.wl_threshold;
+	sim_add_static(&s, static_lebs);
+
+	for (loop = 0; loop < loops; loop++)
+		for (i = 0; i < count; i++) {
+			struct sim_op *op = &ops[i];
+			int n;
+
+			if (op->op == 'M')
+				map_leb(&s, op->vol_id, op->lnum, op->dtype);
+			else if (op->op == 'U')
+				unmap_leb(&s, op->vol_id, op->lnum);
+			else
+				read_leb(&s, op->vol_id, op->lnum);
+
+			for (n = 0; n != s.bgt_works && do_work(&s); n++)
+				;
+
+			if (endurance && endurance_days < 0 &&
+			    s.max_ec >= endurance)
+				endurance_days = days * (loop + (i + 1.0) /
+							 count);
+		}
+
+	while (do_work(&s))
+		;
+
+	report(&s, days * loops, days > 0 ? endurance_days : -1);
+	return EXIT_SUCCESS;
+}
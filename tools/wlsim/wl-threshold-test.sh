@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# Regression test of the adaptive wear-leveling threshold: replay a workload
+# where 80% of the writes go to a few hot LEBs and half of the flash holds
+# static data with the adaptive threshold, and fail if the erase counter
+# spread is worse than with a fixed threshold, or than with a budget which is
+# never exceeded, i.e. when the threshold is never raised. A 5% tolerance is
+# allowed for the noise.
+#
+# Usage: wl-threshold-test.sh [path to ubi-wlsim]
+
+SIM=${1:-./ubi-wlsim}
+ARGS="-p 1024 -s 500 -n 20"
+TRACE=$(mktemp) || exit 1
+trap 'rm -f "$TRACE"' EXIT
+
+awk 'BEGIN {
+	srand(3);
+	for (i = 0; i < 400000; i++) {
+		if (rand() < 0.8)
+			lnum = int(rand() * 64);
+		else
+			lnum = 64 + int(rand() * 336);
+		print "M 0", lnum, 0;
+	}
+}' > "$TRACE" || exit 1
+
+# Print "<max EC> <stddev>" of a simulation
+ec_spread() {
+	"$SIM" $ARGS "$@" "$TRACE" |
+	awk '/^erase counters:/ { sub(",", "", $6); print $6, $NF }'
+}
+
+# Fail if the first "<max EC> <stddev>" pair is worse than the second one
+not_worse() {
+	echo "$1 $2" | awk '{ exit !($1 <= $3 * 1.05 && $2 <= $4 * 1.05) }'
+}
+
+adaptive=$(ec_spread) || exit 1
+fixed=$(ec_spread -f) || exit 1
+unlimited=$(ec_spread -w 1000) || exit 1
+[ -n "$adaptive" ] && [ -n "$fixed" ] && [ -n "$unlimited" ] || exit 1
+
+echo "max EC, stddev with the adaptive threshold: $adaptive"
+echo "max EC, stddev with a fixed threshold:      $fixed"
+echo "max EC, stddev with unlimited budget:       $unlimited"
+
+if ! not_worse "$adaptive" "$fixed" || ! not_worse "$adaptive" "$unlimited"
+then
+	echo "FAIL: the adaptive threshold makes the EC spread worse"
+	exit 1
+fi
+echo "PASS"
@@ -176,6 +176,8 @@ struct ubi_ec_hdr {
  * @data_crc: CRC checksum of the data stored in this logical eraseblock
  * @padding2: reserved for future, zeroes
  * @sqnum: sequence number
+ * @txn_sqnum: sequence number of the multi-LEB transaction which wrote this
+ *             physical eraseblock, zero if it was not written by a transaction
  * @padding3: reserved for future, zeroes
  * @hdr_crc: volume identifier header CRC checksum
  *
@@ -226,8 +228,10 @@ struct ubi_ec_hdr {
  *
  * There are 2 sorts of volumes in UBI: user volumes and internal volumes.
  * Internal volumes are not seen from outside and are used for various internal
- * UBI purposes. In this implementation there is only one internal volume - the
- * layout volume. Internal volumes are the main mechanism of UBI extensions.
+ * UBI purposes. In this implementation there are two internal volumes - the
+ * layout volume and the transaction volume, which keeps the table of
+ * committed multi-LEB transactions. Internal volumes are the main mechanism
+ * of UBI extensions.
  * For example, in future one may introduce a journal internal volume. Internal
  * volumes have their own reserved range of IDs.
  *
@@ -264,6 +268,15 @@ struct ubi_ec_hdr {
  * parameter. So, effectively, the @data_pad field reduces the size of logical
  * eraseblocks of this volume. This is very handy when one uses block-oriented
  * software (say, cramfs) on top of the UBI volume.
+ *
+ * The @txn_sqnum field is non-zero only in physical eraseblocks written by a
+ * multi-LEB transaction. Such a physical eraseblock is valid only if the
+ * transaction is listed in the transaction table, which is stored in the
+ * transaction volume. Otherwise the transaction was interrupted and the
+ * physical eraseblock is ignored, so that the old contents of all logical
+ * eraseblocks of the transaction is preserved. Older UBI binaries ignore this
+ * field and treat such physical eraseblocks as ordinary ones, so they do not
+ * roll back interrupted transactions.
  */
 struct ubi_vid_hdr {
 	__be32  magic;
@@ -280,12 +293,13 @@ struct ubi_vid_hdr {
 	__be32  data_crc;
 	__u8    padding2[4];
 	__be64  sqnum;
-	__u8    padding3[12];
+	__be64  txn_sqnum;
+	__u8    padding3[4];
 	__be32  hdr_crc;
 } __attribute__ ((packed));
 
 /* Internal UBI volumes count */
-#define UBI_INT_VOL_COUNT 1
+#define UBI_INT_VOL_COUNT 2
 
 /*
  * Starting ID of internal volumes. There is reserved room for 4096 internal
@@ -302,6 +316,23 @@ struct ubi_vid_hdr {
 #define UBI_LAYOUT_VOLUME_NAME   "layout volume"
 #define UBI_LAYOUT_VOLUME_COMPAT UBI_COMPAT_REJECT
 
+/*
+ * The transaction volume contains the table of committed multi-LEB
+ * transactions. ID %UBI_INTERNAL_VOL_START + 1 is used by fastscan.
+ */
+
+#define UBI_TXN_VOLUME_ID     (UBI_INTERNAL_VOL_START + 2)
+#define UBI_TXN_VOLUME_TYPE   UBI_VID_DYNAMIC
+#define UBI_TXN_VOLUME_EBS    1
+#define UBI_TXN_VOLUME_NAME   "transaction volume"
+#define UBI_TXN_VOLUME_COMPAT UBI_COMPAT_PRESERVE
+
+/* Maximum count of logical eraseblocks changed by one transaction */
+#define UBI_TXN_MAX_LEBS 64
+
+/* Transaction table magic number (ASCII "UBIT") */
+#define UBI_TXN_TBL_MAGIC 0x55424954
+
 /* The maximum number of volumes per one UBI device */
 #define UBI_MAX_VOLUMES 128
 
@@ -365,4 +396,42 @@ struct ubi_vtbl_record {
 	__be32  crc;
 } __attribute__ ((packed));
 
+/**
+ * struct ubi_txn_tbl_hdr - transaction table header.
+ * @magic: transaction table magic number (%UBI_TXN_TBL_MAGIC)
+ * @count: count of &struct ubi_txn_tbl_entry objects following the header
+ * @padding: reserved for future, zeroes
+ * @crc: CRC32 checksum of the header (without this field) and the entries
+ *
+ * The transaction table is stored in the only logical eraseblock of the
+ * transaction volume and is changed by the atomic LEB change operation. It
+ * lists the physical eraseblocks written by committed multi-LEB transactions
+ * which still hold the current contents of their logical eraseblocks. The
+ * table is an array of &struct ubi_txn_tbl_entry objects, several entries of
+ * the same transaction have the same @txn_sqnum. Writing the new table is
+ * what commits a transaction.
+ */
+struct ubi_txn_tbl_hdr {
+	__be32  magic;
+	__be32  count;
+	__u8    padding[4];
+	__be32  crc;
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_txn_tbl_entry - transaction table entry.
+ * @txn_sqnum: sequence number of the transaction
+ * @vol_id: volume ID of the logical eraseblock
+ * @lnum: logical eraseblock number
+ * @pnum: physical eraseblock the transaction wrote the logical eraseblock to
+ * @padding: reserved for future, zeroes
+ */
+struct ubi_txn_tbl_entry {
+	__be64  txn_sqnum;
+	__be32  vol_id;
+	__be32  lnum;
+	__be32  pnum;
+	__u8    padding[4];
+} __attribute__ ((packed));
+
 #endif /* !__UBI_MEDIA_H__ */
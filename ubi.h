@@ -30,17 +30,21 @@
 #include <linux/wait.h>
 #include <linux/mutex.h>
 #include <linux/rwsem.h>
+#include <linux/semaphore.h>
 #include <linux/spinlock.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
 #include <linux/mtd/mtd.h>
 #include <linux/mtd/ubi.h>
 
 #include "ubi-media.h"
 #include "scan.h"
+#include "wl-policy.h"
 #include "debug.h"
 
 /* Maximum number of supported UBI devices */
@@ -64,21 +68,135 @@
 /* Background thread name pattern */
 #define UBI_BGT_NAME_PATTERN "ubi_bgt%dd"
 
+/* Shared background thread name pattern */
+#define UBI_BGT_POOL_NAME_PATTERN "ubi_bgt_pool%d"
+
 /* This marker in the EBA table means that the LEB is um-mapped */
 #define UBI_LEB_UNMAPPED -1
 
+/*
+ * Any volume or any logical eraseblock, used by 'ubi_wl_flush()' and for
+ * works which cannot be attributed to a particular logical eraseblock
+ */
+#define UBI_ALL -1
+
 /*
  * In case of errors, UBI tries to repeat the operation several times before
  * returning error. The below constant defines how many times UBI re-tries.
  */
 #define UBI_IO_RETRIES 3
 
+/* Number of buckets in the erase counter histogram */
+#define UBI_EC_HIST_BUCKETS 32
+
 /*
- * Length of the protection queue. The length is effectively equivalent to the
- * number of (global) erase cycles PEBs are protected from the wear-leveling
- * worker.
+ * Number of per-LEB locks (has to be a power of 2). Logical eraseblocks are
+ * hashed to the locks by (volume ID, LEB number), so unrelated logical
+ * eraseblocks may share a lock. See the EBA sub-system for details.
+ */
+#define UBI_LEB_LOCKS_SHIFT 8
+#define UBI_LEB_LOCKS (1 << UBI_LEB_LOCKS_SHIFT)
+
+/*
+ * How many VID header buffers are reserved in the per-device pool, i.e. how
+ * many I/O operations may go on in parallel when the system is out of memory.
+ * See 'ubi_zalloc_vid_hdr()'.
+ */
+#define UBI_VID_HDR_POOL_SIZE 4
+
+/*
+ * Read cache: reads spanning more than %UBI_RC_MAX_SPAN flash pages bypass the
+ * cache, and the cache cannot be enabled if the flash page (minimum I/O unit)
+ * is smaller than %UBI_RC_MIN_PAGE bytes. See 'rcache.c'.
+ */
+#define UBI_RC_MAX_SPAN 4
+#define UBI_RC_MIN_PAGE 512
+
+/* Maximum count of entries in the transaction table */
+#define UBI_TXN_TBL_MAX(ubi) ((int)(((ubi)->leb_size - \
+		sizeof(struct ubi_txn_tbl_hdr)) / sizeof(struct ubi_txn_tbl_entry)))
+
+/*
+ * Multi-LEB atomic change interface. These definitions belong to
+ * <linux/mtd/ubi.h> and <mtd/ubi-user.h> and are kept here until the public
+ * headers are updated.
+ */
+#ifndef UBI_IOCEBCHMULTI
+
+/**
+ * struct ubi_leb_change_vec - one logical eraseblock of a multi-LEB change.
+ * @lnum: logical eraseblock number to change
+ * @buf: new contents of the logical eraseblock
+ * @len: how many bytes to write
+ */
+struct ubi_leb_change_vec {
+	int lnum;
+	const void *buf;
+	int len;
+};
+
+int ubi_leb_change_multi(struct ubi_volume_desc *desc,
+			 const struct ubi_leb_change_vec *vec, int count,
+			 int dtype);
+
+/**
+ * struct ubi_leb_change_vec_req - one LEB of a multi-LEB change request.
+ * @lnum: logical eraseblock number to change
+ * @bytes: how many bytes to write
+ * @buf: pointer to the new contents in user-space
  */
-#define UBI_PROT_QUEUE_LEN 10
+struct ubi_leb_change_vec_req {
+	__s32 lnum;
+	__s32 bytes;
+	__u64 buf;
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_leb_change_multi_req - multi-LEB atomic change request.
+ * @count: count of logical eraseblocks to change
+ * @dtype: data type (%UBI_LONGTERM, %UBI_SHORTTERM, %UBI_UNKNOWN)
+ * @padding: reserved for future, not used, has to be zeroed
+ * @lebs: pointer to an array of @count &struct ubi_leb_change_vec_req
+ *
+ * All the logical eraseblocks are changed atomically as a whole: after an
+ * unclean reboot either all of them have the new contents or none of them.
+ */
+struct ubi_leb_change_multi_req {
+	__s32 count;
+	__s8  dtype;
+	__s8  padding[3];
+	__u64 lebs;
+} __attribute__ ((packed));
+
+/* Atomically change several logical eraseblocks of a volume */
+#define UBI_IOCEBCHMULTI _IOW(UBI_VOL_IOC_MAGIC, 16, \
+			      struct ubi_leb_change_multi_req)
+
+#endif /* !UBI_IOCEBCHMULTI */
+
+#ifndef UBI_IOCEBUNMAPRANGE
+
+int ubi_leb_unmap_range(struct ubi_volume_desc *desc, int lnum, int count);
+
+/**
+ * struct ubi_unmap_range_req - LEB range un-map request.
+ * @lnum: first logical eraseblock number to un-map
+ * @count: how many logical eraseblocks to un-map
+ */
+struct ubi_unmap_range_req {
+	__s32 lnum;
+	__s32 count;
+} __attribute__ ((packed));
+
+/* Un-map a range of logical eraseblocks */
+#define UBI_IOCEBUNMAPRANGE _IOW(UBI_VOL_IOC_MAGIC, 17, \
+				 struct ubi_unmap_range_req)
+
+#endif /* !UBI_IOCEBUNMAPRANGE */
+
+int ubi_leb_discard(struct ubi_volume_desc *desc, int lnum, int offset,
+		    int len);
+int ubi_leb_flush(struct ubi_volume_desc *desc);
 
 /*
  * Error codes returned by the I/O sub-system.
@@ -100,48 +218,26 @@ enum {
 	UBI_IO_BITFLIPS
 };
 
-/**
- * 每个WL子系统中的PEB，要么用红黑数来组织，要么用链表来组织
- * struct ubi_wl_entry - wear-leveling entry.
- * @u.rb: link in the corresponding (free/used) RB-tree
- * @u.list: link in the protection queue
- * @ec: erase counter
- * @pnum: physical eraseblock number
- *
- * This data structure is used in the WL sub-system. Each physical eraseblock
- * has a corresponding &struct wl_entry object which may be kept in different
- * RB-trees. See WL sub-system for details.
- */
-struct ubi_wl_entry {
-	union {
-		struct rb_node rb;
-		struct list_head list;
-	} u;
-	int ec;
-	int pnum;
-};
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+/* How many free physical eraseblocks each per-CPU cache may hold */
+#define UBI_PEB_CACHE_SIZE 4
 
 /**
- * struct ubi_ltree_entry - an entry in the lock tree.
- * @rb: links RB-tree nodes
- * @vol_id: volume ID of the locked logical eraseblock
- * @lnum: locked logical eraseblock number
- * @users: how many tasks are using this logical eraseblock or wait for it
- * @mutex: read/write mutex to implement read/write access serialization to
- *         the (@vol_id, @lnum) logical eraseblock
+ * struct ubi_peb_cache - per-CPU cache of free physical eraseblocks.
+ * @lock: protects the cache
+ * @count: how many physical eraseblocks are in the cache
+ * @pnums: numbers of the cached physical eraseblocks
  *
- * This data structure is used in the EBA sub-system to implement per-LEB
- * locking. When a logical eraseblock is being locked - corresponding
- * &struct ubi_ltree_entry object is inserted to the lock tree (@ubi->ltree).
- * See EBA sub-system for details.
+ * The cached physical eraseblocks have already been taken from the @ubi->free
+ * tree and put to the protection queue, and their bits are set in
+ * @ubi->peb_cached until they are handed out. See 'peb_cache_get()'.
  */
-struct ubi_ltree_entry {
-	struct rb_node rb;
-	int vol_id;
-	int lnum;
-	int users;
-	struct rw_semaphore mutex;
+struct ubi_peb_cache {
+	spinlock_t lock;
+	int count;
+	int pnums[UBI_PEB_CACHE_SIZE];
 };
+#endif
 
 /**
  * struct ubi_rename_entry - volume re-name description data structure.
@@ -166,6 +262,22 @@ struct ubi_rename_entry {
 
 struct ubi_volume_desc;
 
+/**
+ * struct ubi_st_leb - cached VID header data of a static volume LEB.
+ * @data_size: how many bytes of data the logical eraseblock contains, %0 if
+ *             not known
+ * @data_crc: CRC32 checksum of the data
+ *
+ * Checked reads of static volumes need the data size and CRC, which are
+ * stored in the VID header. These objects keep them in RAM so that the VID
+ * header does not have to be read each time. They are protected by
+ * @ubi->volumes_lock.
+ */
+struct ubi_st_leb {
+	int data_size;
+	uint32_t data_crc;
+};
+
 /**
  * struct ubi_volume - UBI volume description data structure.
  * @dev: device object to make use of the the Linux device model
@@ -209,6 +321,35 @@ struct ubi_volume_desc;
  * @changing_leb: %1 if the atomic LEB change ioctl command is in progress
  * @direct_writes: %1 if direct writes are enabled for this volume
  *
+ * @infer_dtype: %1 if the data type of %UBI_UNKNOWN writes is inferred from
+ *               the history of the logical eraseblocks
+ * @leb_maps: per-LEB count of recent mappings to a new physical eraseblock
+ *            (allocated when data type inference is enabled)
+ * @leb_maps_total: count of mappings since @leb_maps were halved last time
+ * @leb_dead: per-LEB offset where the discarded tail of the logical eraseblock
+ *            starts, %0 if nothing is known to be discarded (allocated on the
+ *            first discard)
+ * @st_lebs: per-LEB data size and CRC of static volumes (allocated at attach
+ *           or on first use, protected by @ubi->volumes_lock)
+ *
+ * @rc_lock: protects the read cache fields
+ * @rc_max: maximum count of pages in the read cache, %0 if it is disabled
+ * @rc_count: count of pages in the read cache
+ * @rc_lru: cached pages, most recently used first
+ * @rc_hash: hash table of cached pages, %NULL if the read cache is disabled
+ * @rc_hits: count of reads served from the read cache
+ * @rc_misses: count of reads which went to the flash
+ *
+ * @wb_mutex: protects the write buffer fields
+ * @wb_buf: write buffer of one minimum I/O unit, %NULL if it is disabled
+ * @wb_timeout: write buffer flush timeout in milliseconds
+ * @wb_lnum: logical eraseblock the buffered data belongs to
+ * @wb_offs: offset of the buffered data within the logical eraseblock
+ * @wb_used: count of buffered bytes
+ * @wb_dtype: data type of the buffered data
+ * @wb_err: error of the last failed flush on timeout, %0 if none
+ * @wb_work: flushes the write buffer on timeout
+ *
  * @gluebi_desc: gluebi UBI volume descriptor
  * @gluebi_refcount: reference count of the gluebi MTD device
  * @gluebi_mtd: MTD device description object of the gluebi MTD device
@@ -257,6 +398,30 @@ struct ubi_volume {
 	unsigned int changing_leb:1;
 	unsigned int direct_writes:1;
 
+	int infer_dtype;
+	unsigned char *leb_maps;
+	int leb_maps_total;
+	int *leb_dead;
+	struct ubi_st_leb *st_lebs;
+
+	spinlock_t rc_lock;
+	int rc_max;
+	int rc_count;
+	struct list_head rc_lru;
+	struct hlist_head *rc_hash;
+	unsigned long long rc_hits;
+	unsigned long long rc_misses;
+
+	struct mutex wb_mutex;
+	void *wb_buf;
+	int wb_timeout;
+	int wb_lnum;
+	int wb_offs;
+	int wb_used;
+	int wb_dtype;
+	int wb_err;
+	struct delayed_work wb_work;
+
 #ifdef CONFIG_MTD_UBI_GLUEBI
 	/*
 	 * Gluebi-related stuff may be compiled out.
@@ -311,35 +476,110 @@ struct ubi_wl_entry;
  *                 re-name and set property
  *
  * @max_ec: current highest erase counter value
+ * @min_ec: current lowest erase counter value, valid if @min_ec_count is not
+ *          zero
+ * @min_ec_count: count of physical eraseblocks with erase counter @min_ec
  * @mean_ec: current mean erase counter value
+ * @ec_sum: sum of erase counters of all good physical eraseblocks
+ * @ec_count: count of physical eraseblocks in @ec_sum and @ec_hist
+ * @ec_hist: erase counter histogram (count of physical eraseblocks in each
+ *           erase counter range)
+ * @ec_hist_width: width of an @ec_hist bucket
  *
- * @global_sqnum: global sequence number
- * @ltree_lock: protects the lock tree and @global_sqnum
- * @ltree: the lock tree
- * @alc_mutex: serializes "atomic LEB change" operations
+ * @global_sqnum: global sequence number, see 'next_sqnum()'
+ * @sqnum_lock: protects @global_sqnum on architectures without 64-bit atomic
+ *              operations
+ * @leb_locks: per-LEB read/write locks, indexed by a hash of (volume ID, LEB
+ *             number)
+ * @leb_multi_mutex: serializes tasks which hold several @leb_locks at once
+ * @alc_slots: how many PEBs are reserved for "atomic LEB change" operations
+ * @alc_sem: limits the count of parallel "atomic LEB change" operations to
+ *           @alc_slots
  *
- * @used: RB-tree of used physical eraseblocks
- * @free: RB-tree of free physical eraseblocks
- * @scrub: RB-tree of physical eraseblocks which need scrubbing
- * @pq: protection queue (contain physical eraseblocks which are temporarily
- *      protected from the wear-leveling worker)
- * @pq_head: protection queue head
- * @wl_lock: protects the @used, @free, @pq, @pq_head, @lookuptbl, @move_from,
- * 	     @move_to, @move_to_put @erase_pending, @wl_scheduled and @works
+ * @used: tree of used physical eraseblocks
+ * @free: tree of free physical eraseblocks
+ * @scrub: tree of physical eraseblocks which need scrubbing
+ * @pq_head: protection queue head (the protection queue contains physical
+ *           eraseblocks which are temporarily protected from the
+ *           wear-leveling worker, its lists are linked through @lookuptbl)
+ * @pq_len: current length of the protection queue
+ * @pq_erases: count of erase operations, used to measure physical eraseblock
+ *             life times
+ * @pq_sweep: next wear-leveling entry to check for an old stamp (see
+ *            'wl_stamp_sweep()')
+ * @pq_life: histogram of life times of physical eraseblocks put since the
+ *           protection queue length was re-considered
+ * @pq_adapt_puts: count of physical eraseblocks in @pq_life
+ * @wl_wasted_copies: count of wear-leveling moves of LEBs which were
+ *                    un-mapped or re-written shortly after the move
+ * @read_counts: per-PEB read counters (indexed by physical eraseblock number)
+ * @rd_threshold: how many times a physical eraseblock may be read before it
+ *                is scrubbed (%0 means no limit)
+ * @rd_scrubs: count of physical eraseblocks scrubbed because of read disturb
+ * @wl_lock: protects the @used, @free, @scrub fields, @lookuptbl, @move_from,
+ * 	     @move_to, @move_to_put, @move_vol_id, @move_lnum, @erase_pending,
+ * 	     @wl_scheduled, @max_ec, @mean_ec, the erase counter statistics,
+ * 	     the WL counters, the wear-leveling threshold fields and @works
  * 	     fields
  * @move_mutex: serializes eraseblock moves
  * @work_sem: synchronizes the WL worker with use tasks
  * @wl_scheduled: non-zero if the wear-leveling was scheduled
- * @lookuptbl: a table to quickly find a &struct ubi_wl_entry object for any
- *             physical eraseblock
+ * @lookuptbl: array of &struct ubi_wl_entry objects of all physical
+ *             eraseblocks, indexed by the physical eraseblock number, followed
+ *             by the %UBI_PROT_QUEUE_MAX protection queue list heads
  * @move_from: physical eraseblock from where the data is being moved
  * @move_to: physical eraseblock where the data is being moved to
  * @move_to_put: if the "to" PEB was put
+ * @move_vol_id: volume ID of the logical eraseblock being moved
+ * @move_lnum: logical eraseblock number of the logical eraseblock being moved
+ * @move_vid_hdr: VID header buffer of the WL worker (protected by
+ *                @move_mutex)
+ * @wl_copies: count of LEBs copied by the WL worker (both wear-leveling and
+ *             scrubbing)
+ * @wl_moves: count of LEBs moved for wear-leveling purposes
+ * @scrub_count: count of LEBs moved because of scrubbing
+ * @wl_bytes_copied: count of data bytes copied by the WL worker
+ * @torture_count: count of torture tests
+ * @torture_failures: count of torture tests which failed, i.e., of physical
+ *                    eraseblocks found bad by torturing
+ * @pq_evictions: count of physical eraseblocks moved from the protection
+ *                queue to the @used tree
+ * @wl_threshold: current wear-leveling threshold
+ * @wl_threshold_min: lowest value the wear-leveling threshold may be lowered to
+ * @wl_threshold_max: highest value the wear-leveling threshold may be raised to
+ * @wl_wa_budget: how many LEB copies per 100 LEB writes the WL worker may do
+ * @wl_adapt_erases: erase operations since the threshold was re-considered
+ * @wl_adapt_copies: @wl_copies when the threshold was re-considered
+ * @wl_adapt_sqnum: global sequence number when the threshold was re-considered
+ * @wl_wa_copies: LEB copies made by the WL worker in the write amplification
+ *                window (see %WL_WA_WINDOW)
+ * @wl_wa_writes: LEB writes of the users in the write amplification window
+ * @peb_cache: per-CPU caches of free physical eraseblocks
+ * @peb_cached: bitmap of physical eraseblocks which sit in a per-CPU cache
  * @works: list of pending works
- * @works_count: count of pending works
+ * @torture_works: list of pending torture works, which are only done when
+ *                 there are no other pending works
+ * @works_count: count of pending works (including torture works)
+ * @works_inflight: list of works which are being done at the moment
+ * @works_wait: wait queue to wait for in-flight works to finish
  * @bgt_thread: background thread description object
  * @thread_enabled: if the background thread is enabled
  * @bgt_name: background thread name
+ * @bgt_rate: how many works per second the background thread may do if the
+ *            device is not idle (%0 means no limit)
+ * @bgt_burst: how many works the background thread may do in a burst
+ * @bgt_idle_ms: for how long there has to be no foreground I/O to consider
+ *               the device idle
+ * @bgt_tokens: background thread token bucket (in 1/HZ fractions of a work)
+ * @bgt_refill_stamp: when the token bucket was re-filled last time
+ * @bgt_defer_start: when the background thread started deferring works
+ * @bgt_deferred: if the background thread is deferring works
+ * @bgt_pool_list: link in the queue of the shared background thread pool
+ * @bgt_pool_state: state of the device in the shared background thread pool
+ * @bgt_group: background thread pool group (devices sharing a controller)
+ * @bgt_active_group: the group the device is being served in
+ * @bgt_next: when the device may be served by the pool again
+ * @bgt_failures: count of consecutive failed works
  *
  * @flash_size: underlying MTD device size (in bytes)
  * @peb_count: count of physical eraseblocks on the MTD device
@@ -362,14 +602,28 @@ struct ubi_wl_entry;
  * @bad_allowed: whether the MTD device admits of bad physical eraseblocks or
  *               not
  * @mtd: MTD device descriptor
+ * @fg_io_inflight: count of foreground I/O operations in flight
+ * @fg_io_stamp: time (in jiffies) of the last foreground I/O
  *
+ * @vid_hdr_pool: pool of VID header buffers
  * @peb_buf1: a buffer of PEB size used for different purposes
  * @peb_buf2: another buffer of PEB size used for different purposes
  * @buf_mutex: protects @peb_buf1 and @peb_buf2
+ * @torture_buf: a buffer of PEB size used for torturing physical eraseblocks
+ * @torture_mutex: protects @torture_buf
  * @ckvol_mutex: serializes static volume checking when opening
  * @mult_mutex: serializes operations on multiple volumes, like re-naming
  * @dbg_peb_buf: buffer of PEB size used for debugging
  * @dbg_buf_mutex: protects @dbg_peb_buf
+ * @lat: writer wait statistics, indexed by %UBI_LAT_GET_PEB, etc
+ * @lat_lock: protects @lat
+ * @trace: LEB operation trace ring buffer
+ * @trace_head: index of the next record to write to @trace
+ * @trace_tail: index of the next record to read from @trace
+ * @trace_lost: count of records lost since the last recorded one
+ * @trace_enabled: non-zero if LEB operations are recorded
+ * @trace_lock: protects the trace fields
+ * @dfs_dir: debugfs directory of the UBI device
  */
 struct ubi_device {
 	struct cdev cdev;
@@ -393,34 +647,94 @@ struct ubi_device {
 	struct mutex volumes_mutex;
 
 	int max_ec;
-	/* Note, mean_ec is not updated run-time - should be fixed */
+	int min_ec;
+	int min_ec_count;
 	int mean_ec;
+	unsigned long long ec_sum;
+	int ec_count;
+	int ec_hist[UBI_EC_HIST_BUCKETS];
+	int ec_hist_width;
 
 	/* EBA sub-system's stuff */
+#ifdef CONFIG_64BIT
+	atomic64_t global_sqnum;
+#else
 	unsigned long long global_sqnum;
-	spinlock_t ltree_lock;
-	struct rb_root ltree;
-	struct mutex alc_mutex;
+	spinlock_t sqnum_lock;
+#endif
+	struct rw_semaphore leb_locks[UBI_LEB_LOCKS];
+	struct mutex leb_multi_mutex;
+	int alc_slots;
+	struct semaphore alc_sem;
 
 	/* Wear-leveling sub-system's stuff */
-	struct rb_root used;
-	struct rb_root free;
-	struct rb_root scrub;
-	struct list_head pq[UBI_PROT_QUEUE_LEN];
+	struct ubi_wl_tree used;
+	struct ubi_wl_tree free;
+	struct ubi_wl_tree scrub;
 	int pq_head;
+	int pq_len;
+	unsigned int pq_erases;
+	int pq_sweep;
+	int pq_life[UBI_PQ_LIFE_BUCKETS];
+	int pq_adapt_puts;
+	unsigned long long wl_wasted_copies;
+	atomic_t *read_counts;
+	int rd_threshold;
+	unsigned long long rd_scrubs;
 	spinlock_t wl_lock;
 	struct mutex move_mutex;
 	struct rw_semaphore work_sem;
 	int wl_scheduled;
-	struct ubi_wl_entry **lookuptbl;
+	struct ubi_wl_entry *lookuptbl;
 	struct ubi_wl_entry *move_from;
 	struct ubi_wl_entry *move_to;
 	int move_to_put;
+	int move_vol_id;
+	int move_lnum;
+	struct ubi_vid_hdr *move_vid_hdr;
+	unsigned long long wl_copies;
+	unsigned long long wl_moves;
+	unsigned long long scrub_count;
+	unsigned long long wl_bytes_copied;
+	unsigned long long torture_count;
+	unsigned long long torture_failures;
+	unsigned long long pq_evictions;
+	int wl_threshold;
+	int wl_threshold_min;
+	int wl_threshold_max;
+	int wl_wa_budget;
+	int wl_adapt_erases;
+	unsigned long long wl_adapt_copies;
+	unsigned long long wl_adapt_sqnum;
+	unsigned long long wl_wa_copies;
+	unsigned long long wl_wa_writes;
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+	struct ubi_peb_cache *peb_cache;
+	unsigned long *peb_cached;
+#endif
 	struct list_head works;
+	struct list_head torture_works;
 	int works_count;
+	struct list_head works_inflight;
+	wait_queue_head_t works_wait;
 	struct task_struct *bgt_thread;
 	int thread_enabled;
 	char bgt_name[sizeof(UBI_BGT_NAME_PATTERN)+2];
+	int bgt_rate;
+	int bgt_burst;
+	int bgt_idle_ms;
+	long bgt_tokens;
+	unsigned long bgt_refill_stamp;
+	unsigned long bgt_defer_start;
+	int bgt_deferred;
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	struct list_head bgt_pool_list;
+	int bgt_pool_state;
+	int bgt_group;
+	int bgt_active_group;
+	unsigned long bgt_next;
+	int bgt_failures;
+#endif
 
 	/* I/O sub-system's stuff */
 	long long flash_size;
@@ -440,16 +754,36 @@ struct ubi_device {
 	int vid_hdr_shift;
 	int bad_allowed;
 	struct mtd_info *mtd;
+	atomic_t fg_io_inflight;
+	unsigned long fg_io_stamp;
 
+	mempool_t *vid_hdr_pool;
 	void *peb_buf1;
 	void *peb_buf2;
 	struct mutex buf_mutex;
+	void *torture_buf;
+	struct mutex torture_mutex;
 	struct mutex ckvol_mutex;
 	struct mutex mult_mutex;
 #ifdef CONFIG_MTD_UBI_DEBUG
 	void *dbg_peb_buf;
 	struct mutex dbg_buf_mutex;
 #endif
+#ifdef CONFIG_MTD_UBI_DEBUG_LATENCY
+	struct ubi_lat_stat lat[UBI_LAT_POINTS];
+	spinlock_t lat_lock;
+#endif
+#ifdef CONFIG_MTD_UBI_DEBUG_TRACE
+	struct ubi_trace_rec *trace;
+	unsigned int trace_head;
+	unsigned int trace_tail;
+	unsigned int trace_lost;
+	int trace_enabled;
+	spinlock_t trace_lock;
+#endif
+#ifdef CONFIG_MTD_UBI_DEBUGFS
+	struct dentry *dfs_dir;
+#endif
 
 #ifdef CONFIG_MTD_UBI_FASTSCAN
 	void *fs_buf;
@@ -459,7 +793,6 @@ struct ubi_device {
 #endif
 };
 
-extern struct kmem_cache *ubi_wl_entry_slab;
 extern const struct file_operations ubi_ctrl_cdev_operations;
 extern const struct file_operations ubi_cdev_operations;
 extern const struct file_operations ubi_vol_cdev_operations;
@@ -496,6 +829,8 @@ int ubi_calc_data_len(const struct ubi_device *ubi, const void *buf,
 		      int length);
 int ubi_check_volume(struct ubi_device *ubi, int vol_id);
 void ubi_calculate_reserved(struct ubi_device *ubi);
+uint32_t ubi_txn_tbl_crc(const void *buf, int count);
+int ubi_check_txn_tbl(const struct ubi_device *ubi, const void *buf);
 
 /* gluebi.c */
 #ifdef CONFIG_MTD_UBI_GLUEBI
@@ -511,6 +846,10 @@ void ubi_gluebi_updated(struct ubi_volume *vol);
 /* eba.c */
 int ubi_eba_unmap_leb(struct ubi_device *ubi, struct ubi_volume *vol,
 		      int lnum);
+int ubi_eba_unmap_lebs(struct ubi_device *ubi, struct ubi_volume *vol,
+		       int lnum, int count);
+int ubi_eba_discard(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		    int offset, int len);
 int ubi_eba_read_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
 		     void *buf, int offset, int len, int check);
 int ubi_eba_write_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
@@ -520,22 +859,65 @@ int ubi_eba_write_leb_st(struct ubi_device *ubi, struct ubi_volume *vol,
 			 int used_ebs);
 int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 			      int lnum, const void *buf, int len, int dtype);
+int ubi_eba_atomic_leb_change_multi(struct ubi_device *ubi,
+				    struct ubi_volume *vol,
+				    const struct ubi_leb_change_vec *vec,
+				    int count, int dtype);
 int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		     struct ubi_vid_hdr *vid_hdr);
 int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
+unsigned long long ubi_eba_cur_sqnum(struct ubi_device *ubi);
 
 #ifdef CONFIG_MTD_UBI_FASTSCAN
 unsigned long long next_sqnum(struct ubi_device *ubi);
 #endif
 
+/* rcache.c */
+void ubi_rc_init(struct ubi_volume *vol);
+int ubi_rc_set_size(struct ubi_device *ubi, struct ubi_volume *vol, int pages);
+int ubi_rc_lookup(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		  void *buf, int offset, int len);
+void ubi_rc_insert(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		   const void *buf, int offset, int len);
+void ubi_rc_invalidate(struct ubi_volume *vol, int lnum);
+void ubi_rc_free(struct ubi_volume *vol);
+
+/* wbuf.c */
+void ubi_wb_init(struct ubi_volume *vol);
+int ubi_wb_set_timeout(struct ubi_device *ubi, struct ubi_volume *vol,
+		       int timeout);
+void ubi_wb_close(struct ubi_device *ubi, struct ubi_volume *vol);
+int ubi_wb_write(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		 const void *buf, int offset, int len, int dtype);
+int ubi_wb_read(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		void *buf, int offset, int len, int check);
+void ubi_wb_drop(struct ubi_volume *vol, int lnum, int count);
+int ubi_wb_flush_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum);
+int ubi_wb_flush(struct ubi_device *ubi, struct ubi_volume *vol);
+int ubi_wb_sync(struct ubi_device *ubi);
+
 /* wl.c */
 int ubi_wl_get_peb(struct ubi_device *ubi, int dtype);
-int ubi_wl_put_peb(struct ubi_device *ubi, int pnum, int torture);
-int ubi_wl_flush(struct ubi_device *ubi);
+int ubi_wl_put_peb(struct ubi_device *ubi, int vol_id, int lnum, int pnum,
+		   int torture);
+int ubi_wl_put_pebs(struct ubi_device *ubi, int vol_id, int lnum,
+		    const int *pnums, int count);
+int ubi_wl_flush(struct ubi_device *ubi, int vol_id, int lnum);
 int ubi_wl_scrub_peb(struct ubi_device *ubi, int pnum);
 int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
 void ubi_wl_close(struct ubi_device *ubi);
 int ubi_thread(void *u);
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+void ubi_bgt_pool_start(struct ubi_device *ubi);
+void ubi_bgt_pool_stop(struct ubi_device *ubi);
+int ubi_bgt_pool_init(void);
+void ubi_bgt_pool_exit(void);
+#endif
+int ubi_wl_min_ec(struct ubi_device *ubi);
+int ubi_wl_account_read(struct ubi_device *ubi, int pnum);
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+void ubi_wl_drain_peb_caches(struct ubi_device *ubi);
+#endif
 
 #ifdef CONFIG_MTD_UBI_FASTSCAN
 struct ubi_work {
@@ -543,10 +925,12 @@ struct ubi_work {
 	int (*func)(struct ubi_device *ubi, struct ubi_work *wrk, int cancel);
 	/* The below fields are only relevant to erasure works */
 	struct ubi_wl_entry *e;
+	int vol_id;
+	int lnum;
 	int torture;
 };
 /* wl.c fastscan-related function */
-int fastscan_find_pebs(struct rb_root *root, struct ubi_wl_entry **pebs); 
+int fastscan_find_pebs(struct ubi_wl_tree *t, struct ubi_wl_entry **pebs); 
 int fastscan_is_erase_work(struct ubi_work *wrk);
 
 /* update.c */
@@ -558,7 +942,7 @@ int fastscan(struct ubi_device *ubi, struct ubi_scan_info *si);
 #endif
 
 /* io.c */
-int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
+int ubi_io_read(struct ubi_device *ubi, void *buf, int pnum, int offset,
 		int len);
 int ubi_io_write(struct ubi_device *ubi, const void *buf, int pnum, int offset,
 		 int len);
@@ -602,16 +986,20 @@ int ubi_major2num(int major);
  *
  * This function returns a pointer to the newly allocated and zero-filled
  * volume identifier header object in case of success and %NULL in case of
- * failure.
+ * failure. The objects come from the per-device pool, so if @gfp_flags allow
+ * sleeping, this function does not fail but waits for another task to free
+ * its object when memory is short. This is why a task must not allocate a
+ * second object while holding one.
  */
 static inline struct ubi_vid_hdr *
 ubi_zalloc_vid_hdr(const struct ubi_device *ubi, gfp_t gfp_flags)
 {
 	void *vid_hdr;
 
-	vid_hdr = kzalloc(ubi->vid_hdr_alsize, gfp_flags);
+	vid_hdr = mempool_alloc(ubi->vid_hdr_pool, gfp_flags);
 	if (!vid_hdr)
 		return NULL;
+	memset(vid_hdr, 0, ubi->vid_hdr_alsize);
 
 	/*
 	 * VID headers may be stored at un-aligned flash offsets, so we shift
@@ -633,7 +1021,7 @@ static inline void ubi_free_vid_hdr(const struct ubi_device *ubi,
 	if (!p)
 		return;
 
-	kfree(p - ubi->vid_hdr_shift);
+	mempool_free(p - ubi->vid_hdr_shift, ubi->vid_hdr_pool);
 }
 
 /*
@@ -641,7 +1029,7 @@ static inline void ubi_free_vid_hdr(const struct ubi_device *ubi,
  * the beginning of the logical eraseblock, not to the beginning of the
  * physical eraseblock.
  */
-static inline int ubi_io_read_data(const struct ubi_device *ubi, void *buf,
+static inline int ubi_io_read_data(struct ubi_device *ubi, void *buf,
 				   int pnum, int offset, int len)
 {
 	ubi_assert(offset >= 0);
@@ -660,6 +1048,17 @@ static inline int ubi_io_write_data(struct ubi_device *ubi, const void *buf,
 	return ubi_io_write(ubi, buf, pnum, offset + ubi->leb_start, len);
 }
 
+/**
+ * ubi_wl_pnum - get the physical eraseblock number of a wear-leveling entry.
+ * @ubi: UBI device description object
+ * @e: the wear-leveling entry
+ */
+static inline int ubi_wl_pnum(const struct ubi_device *ubi,
+			      const struct ubi_wl_entry *e)
+{
+	return e - ubi->lookuptbl;
+}
+
 /**
  * ubi_ro_mode - switch to read-only mode.
  * @ubi: UBI device description object
@@ -679,7 +1078,10 @@ static inline void ubi_ro_mode(struct ubi_device *ubi)
  */
 static inline int vol_id2idx(const struct ubi_device *ubi, int vol_id)
 {
-	if (vol_id >= UBI_INTERNAL_VOL_START)
+	/* ID %UBI_INTERNAL_VOL_START + 1 is fastscan's and has no slot */
+	if (vol_id == UBI_TXN_VOLUME_ID)
+		return ubi->vtbl_slots + 1;
+	else if (vol_id >= UBI_INTERNAL_VOL_START)
 		return vol_id - UBI_INTERNAL_VOL_START + ubi->vtbl_slots;
 	else
 		return vol_id;
@@ -692,7 +1094,9 @@ static inline int vol_id2idx(const struct ubi_device *ubi, int vol_id)
  */
 static inline int idx2vol_id(const struct ubi_device *ubi, int idx)
 {
-	if (idx >= ubi->vtbl_slots)
+	if (idx == ubi->vtbl_slots + 1)
+		return UBI_TXN_VOLUME_ID;
+	else if (idx >= ubi->vtbl_slots)
 		return idx - ubi->vtbl_slots + UBI_INTERNAL_VOL_START;
 	else
 		return idx;
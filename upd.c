@@ -129,7 +129,7 @@ static int clear_update_marker(struct ubi_device *ubi, struct ubi_volume *vol,
 int ubi_start_update(struct ubi_device *ubi, struct ubi_volume *vol,
 		     long long bytes)
 {
-	int i, err;
+	int err;
 
 	dbg_gen("start update of volume %d, %llu bytes", vol->vol_id, bytes);
 	ubi_assert(!vol->updating && !vol->changing_leb);
@@ -140,17 +140,15 @@ int ubi_start_update(struct ubi_device *ubi, struct ubi_volume *vol,
 		return err;
 
 	/* Before updating - wipe out the volume */
-	for (i = 0; i < vol->reserved_pebs; i++) {
-		err = ubi_eba_unmap_leb(ubi, vol, i);
-		if (err)
-			return err;
-	}
+	err = ubi_eba_unmap_lebs(ubi, vol, 0, vol->reserved_pebs);
+	if (err)
+		return err;
 
 	if (bytes == 0) {
 		err = clear_update_marker(ubi, vol, 0);
 		if (err)
 			return err;
-		err = ubi_wl_flush(ubi);
+		err = ubi_wl_flush(ubi, vol->vol_id, UBI_ALL);
 		if (!err)
 			vol->updating = 0;
 	}
@@ -366,7 +364,7 @@ int ubi_more_update_data(struct ubi_device *ubi, struct ubi_volume *vol,
 		err = clear_update_marker(ubi, vol, vol->upd_bytes);
 		if (err)
 			return err;
-		err = ubi_wl_flush(ubi);
+		err = ubi_wl_flush(ubi, vol->vol_id, UBI_ALL);
 		if (err == 0) {
 			vol->updating = 0;
 			err = to_write;
@@ -417,6 +415,7 @@ int ubi_more_leb_change_data(struct ubi_device *ubi, struct ubi_volume *vol,
 		memset(vol->upd_buf + vol->upd_bytes, 0xFF,
 		       len - vol->upd_bytes);
 		len = ubi_calc_data_len(ubi, vol->upd_buf, len);
+		ubi_wb_drop(vol, vol->ch_lnum, 1);
 		err = ubi_eba_atomic_leb_change(ubi, vol, vol->ch_lnum,
 						vol->upd_buf, len, UBI_UNKNOWN);
 		if (err)
@@ -56,7 +56,6 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 	void *fs_raw;
 	size_t fs_pos = 0;
 	struct ubi_vid_hdr *fs_vhdr;
-	struct rb_node *node;
 	struct ubi_wl_entry *wl_e;
 	struct ubi_work *ubi_wrk;
 	struct ubi_volume *vol;
@@ -110,15 +109,14 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 	vol_count = 0;
 	used_blocks = ubi->fs_size / ubi->leb_size;
 
-	/***********收集free红黑树的擦除信息填充到fs_raw,同时累加空闲的擦出块数***********/
-	ubi_msg("collect pnum and ec data of free PEB from free red black tree");
-	for(node = rb_first(&ubi->free); node; node = rb_next(node))
+	/***********收集free树的擦除信息填充到fs_raw,同时累加空闲的擦出块数***********/
+	ubi_msg("collect pnum and ec data of free PEB from free tree");
+	wl_tree_for_each(wl_e, &ubi->free)
 	{
-		wl_e = rb_entry(node, struct ubi_wl_entry, u.rb);
 		ubi_assert(wl_e);
 		fs_meta_wl = (struct fastscan_metadata_wl *)(fs_raw + fs_pos);	
 		
-		fs_meta_wl->pnum = cpu_to_be32(wl_e->pnum);
+		fs_meta_wl->pnum = cpu_to_be32(ubi_wl_pnum(ubi, wl_e));
 		fs_meta_wl->ec = cpu_to_be32(wl_e->ec);
 
 		free_peb_count++;
@@ -127,14 +125,13 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 	}
 	fs_meta_hdr->free_peb_count = cpu_to_be32(free_peb_count);
 
-	ubi_msg("collect pnum and ec data of used PEB from used red black tree");
-	for(node = rb_first(&ubi->used); node; node = rb_next(node))
+	ubi_msg("collect pnum and ec data of used PEB from used tree");
+	wl_tree_for_each(wl_e, &ubi->used)
 	{
-		wl_e = rb_entry(node, struct ubi_wl_entry, u.rb);
 		ubi_assert(wl_e);
 		fs_meta_wl = (struct fastscan_metadata_wl *)(fs_raw + fs_pos);	
 		
-		fs_meta_wl->pnum = cpu_to_be32(wl_e->pnum);
+		fs_meta_wl->pnum = cpu_to_be32(ubi_wl_pnum(ubi, wl_e));
 		fs_meta_wl->ec = cpu_to_be32(wl_e->ec);
 
 		used_peb_count++;
@@ -143,14 +140,13 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 	}
 	fs_meta_hdr->used_peb_count = cpu_to_be32(used_peb_count);
 
-	ubi_msg("collect pnum and ec data of scrub PEB from scrub red black tree");
-	for(node = rb_first(&ubi->scrub); node; node = rb_next(node))
+	ubi_msg("collect pnum and ec data of scrub PEB from scrub tree");
+	wl_tree_for_each(wl_e, &ubi->scrub)
 	{
-		wl_e = rb_entry(node, struct ubi_wl_entry, u.rb);
 		ubi_assert(wl_e);
 		fs_meta_wl = (struct fastscan_metadata_wl *)(fs_raw + fs_pos);	
 		
-		fs_meta_wl->pnum = cpu_to_be32(wl_e->pnum);
+		fs_meta_wl->pnum = cpu_to_be32(ubi_wl_pnum(ubi, wl_e));
 		fs_meta_wl->ec = cpu_to_be32(wl_e->ec);
 
 		scrub_peb_count++;
@@ -170,7 +166,7 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 
 			fs_meta_wl = (struct fastscan_metadata_wl *)(fs_raw + fs_pos);	
 		
-			fs_meta_wl->pnum = cpu_to_be32(wl_e->pnum);
+			fs_meta_wl->pnum = cpu_to_be32(ubi_wl_pnum(ubi, wl_e));
 			fs_meta_wl->ec = cpu_to_be32(wl_e->ec);
 
 			erase_peb_count++;
@@ -178,8 +174,27 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 			ubi_assert(fs_pos <= ubi->fs_size);
 		}
 	}
+	list_for_each_entry(ubi_wrk, &ubi->torture_works, list)
+	{
+		wl_e = ubi_wrk->e;
+		ubi_assert(wl_e);
+
+		fs_meta_wl = (struct fastscan_metadata_wl *)(fs_raw + fs_pos);
+
+		fs_meta_wl->pnum = cpu_to_be32(ubi_wl_pnum(ubi, wl_e));
+		fs_meta_wl->ec = cpu_to_be32(wl_e->ec);
+
+		erase_peb_count++;
+		fs_pos += sizeof(*fs_meta_wl);
+		ubi_assert(fs_pos <= ubi->fs_size);
+	}
 	fs_meta_hdr->erase_peb_count = cpu_to_be32(erase_peb_count);
 
+	/*
+	 * The EBA tables only refer to physical eraseblocks of committed
+	 * multi-LEB transactions, so the snapshot never contains interrupted
+	 * ones. The transaction volume is saved like any other volume.
+	 */
 	/***********collect volume-related metadata to fullfill the fs_raw***********/
 	ubi_msg("collect volume-related data from ubi->volumes");
 	for(i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++)
@@ -226,11 +241,11 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 		fs_vhdr->sqnum = cpu_to_be32(next_sqnum(ubi));
 		fs_vhdr->lnum = i;
 		ubi_msg("writing fastscan volume header to PEB %d, sqnum %llu", 
-						pebs[i]->pnum, fs_vhdr->sqnum);
-		ret = ubi_io_write_vid_hdr(ubi, pebs[i]->pnum, fs_vhdr);
+						ubi_wl_pnum(ubi, pebs[i]), fs_vhdr->sqnum);
+		ret = ubi_io_write_vid_hdr(ubi, ubi_wl_pnum(ubi, pebs[i]), fs_vhdr);
 		if(ret != 0)
 		{
-			ubi_msg("failed to write fs_vhdr to PEB %i",pebs[i]->pnum); 
+			ubi_msg("failed to write fs_vhdr to PEB %i",ubi_wl_pnum(ubi, pebs[i])); 
 			goto out_kfree;
 		}
 	}
@@ -239,19 +254,19 @@ int fastscan_write_metadata(struct ubi_device *ubi, struct ubi_wl_entry **pebs)
 	ubi_msg("writing fastscan data to Flash %d blocks", used_blocks);
 	for(i = 0; i < used_blocks; i++)
 	{
-		ubi_msg("writing fs_raw data to PEB %d", pebs[i]->pnum);
+		ubi_msg("writing fs_raw data to PEB %d", ubi_wl_pnum(ubi, pebs[i]));
 		ret = ubi_io_write(ubi, fs_raw + (i * ubi->leb_size), 
-						pebs[i]->pnum, ubi->leb_start, ubi->leb_size);	
+						ubi_wl_pnum(ubi, pebs[i]), ubi->leb_start, ubi->leb_size);	
 		if(ret != 0)
 		{
-			ubi_msg("failed to write data to PEB %i",pebs[i]->pnum); 
+			ubi_msg("failed to write data to PEB %i",ubi_wl_pnum(ubi, pebs[i])); 
 			goto out_kfree;
 		}
 	}
 	/*
 	for(i = used_blocks; i < UBI_FASTSCAN_PEB_COUNT; i++)
 	{
-		ret = ubi_wl_put_peb(ubi, pebs[i]->pnum, 0);
+		ret = ubi_wl_put_peb(ubi, UBI_ALL, UBI_ALL, ubi_wl_pnum(ubi, pebs[i]), 0);
 	}
 	*/	
 
@@ -279,6 +294,11 @@ int fastscan_update_metadata(struct ubi_device *ubi)
 	for(i = 0; i < UBI_FASTSCAN_PEB_COUNT; i++)
 		pebs[i] = NULL;
 
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+	/* Cached free PEBs are in no tree, put them back to be saved */
+	ubi_wl_drain_peb_caches(ubi);
+#endif
+
 	ret = fastscan_alloc_pebs(ubi, pebs);
 	if(ret != 0)
 	{
@@ -286,7 +306,7 @@ int fastscan_update_metadata(struct ubi_device *ubi)
 	}
 	ubi_msg("find available pebs");	
 	for(i = 0; i < UBI_FASTSCAN_PEB_COUNT; i++)
-		ubi_msg("pebs[%d] = %d", i, pebs[i]->pnum);
+		ubi_msg("pebs[%d] = %d", i, ubi_wl_pnum(ubi, pebs[i]));
 
 	ret = fastscan_write_metadata(ubi, pebs);
 	if(ret != 0)
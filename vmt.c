@@ -35,6 +35,9 @@ static int paranoid_check_volumes(struct ubi_device *ubi);
 
 static ssize_t vol_attribute_show(struct device *dev,
 				  struct device_attribute *attr, char *buf);
+static ssize_t vol_attribute_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count);
 
 /* Device attributes corresponding to files in '/<sysfs>/class/ubi/ubiX_Y' */
 static struct device_attribute attr_vol_reserved_ebs =
@@ -53,6 +56,19 @@ static struct device_attribute attr_vol_data_bytes =
 	__ATTR(data_bytes, S_IRUGO, vol_attribute_show, NULL);
 static struct device_attribute attr_vol_upd_marker =
 	__ATTR(upd_marker, S_IRUGO, vol_attribute_show, NULL);
+static struct device_attribute attr_vol_infer_dtype =
+	__ATTR(infer_dtype, S_IRUGO | S_IWUSR, vol_attribute_show,
+	       vol_attribute_store);
+static struct device_attribute attr_vol_read_cache =
+	__ATTR(read_cache, S_IRUGO | S_IWUSR, vol_attribute_show,
+	       vol_attribute_store);
+static struct device_attribute attr_vol_read_cache_hits =
+	__ATTR(read_cache_hits, S_IRUGO, vol_attribute_show, NULL);
+static struct device_attribute attr_vol_read_cache_misses =
+	__ATTR(read_cache_misses, S_IRUGO, vol_attribute_show, NULL);
+static struct device_attribute attr_vol_write_buffer =
+	__ATTR(write_buffer, S_IRUGO | S_IWUSR, vol_attribute_show,
+	       vol_attribute_store);
 
 /*
  * "Show" method for files in '/<sysfs>/class/ubi/ubiX_Y/'.
@@ -109,6 +125,23 @@ static ssize_t vol_attribute_show(struct device *dev,
 		ret = sprintf(buf, "%lld\n", vol->used_bytes);
 	else if (attr == &attr_vol_upd_marker)
 		ret = sprintf(buf, "%d\n", vol->upd_marker);
+	else if (attr == &attr_vol_infer_dtype)
+		ret = sprintf(buf, "%d\n", vol->infer_dtype);
+	else if (attr == &attr_vol_read_cache)
+		ret = sprintf(buf, "%d\n", vol->rc_max);
+	else if (attr == &attr_vol_read_cache_hits ||
+		 attr == &attr_vol_read_cache_misses) {
+		unsigned long long cnt;
+
+		spin_lock(&vol->rc_lock);
+		if (attr == &attr_vol_read_cache_hits)
+			cnt = vol->rc_hits;
+		else
+			cnt = vol->rc_misses;
+		spin_unlock(&vol->rc_lock);
+		ret = sprintf(buf, "%llu\n", cnt);
+	} else if (attr == &attr_vol_write_buffer)
+		ret = sprintf(buf, "%d\n", vol->wb_timeout);
 	else
 		/* This must be a bug */
 		ret = -EINVAL;
@@ -122,12 +155,102 @@ static ssize_t vol_attribute_show(struct device *dev,
 	return ret;
 }
 
+/*
+ * "Store" method for files in '/<sysfs>/class/ubi/ubiX_Y/'. The volume is
+ * referenced the same way as in 'vol_attribute_show()'.
+ */
+static ssize_t vol_attribute_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	ssize_t ret = count;
+	long val;
+	char *endp;
+	unsigned char *maps = NULL;
+	struct ubi_volume *vol = container_of(dev, struct ubi_volume, dev);
+	struct ubi_device *ubi;
+
+	val = simple_strtol(buf, &endp, 0);
+	if (endp == buf || (*endp && *endp != '\n'))
+		return -EINVAL;
+
+	ubi = ubi_get_device(vol->ubi->ubi_num);
+	if (!ubi)
+		return -ENODEV;
+
+	spin_lock(&ubi->volumes_lock);
+	if (!ubi->volumes[vol->vol_id]) {
+		spin_unlock(&ubi->volumes_lock);
+		ubi_put_device(ubi);
+		return -ENODEV;
+	}
+	vol->ref_count += 1;
+	spin_unlock(&ubi->volumes_lock);
+
+	if (attr == &attr_vol_infer_dtype) {
+		if (val != 0 && val != 1)
+			ret = -EINVAL;
+		else if (val && !vol->leb_maps) {
+			/*
+			 * The counters are allocated on first use and are
+			 * kept until the volume is re-sized or removed, so
+			 * writers may use them without locking.
+			 */
+			maps = kzalloc(vol->reserved_pebs, GFP_KERNEL);
+			if (!maps)
+				ret = -ENOMEM;
+		}
+
+		if (ret > 0) {
+			spin_lock(&ubi->volumes_lock);
+			if (maps && !vol->leb_maps) {
+				vol->leb_maps = maps;
+				maps = NULL;
+			}
+			vol->infer_dtype = val;
+			spin_unlock(&ubi->volumes_lock);
+		}
+		kfree(maps);
+	} else if (attr == &attr_vol_read_cache) {
+		/* The value is the maximum count of cached flash pages */
+		if (val < 0 || val > INT_MAX)
+			ret = -EINVAL;
+		else {
+			ret = ubi_rc_set_size(ubi, vol, val);
+			if (!ret)
+				ret = count;
+		}
+	} else if (attr == &attr_vol_write_buffer) {
+		/* The value is the flush timeout in milliseconds */
+		if (val < 0 || val > INT_MAX)
+			ret = -EINVAL;
+		else {
+			ret = ubi_wb_set_timeout(ubi, vol, val);
+			if (!ret)
+				ret = count;
+		}
+	} else
+		/* This must be a bug */
+		ret = -EINVAL;
+
+	spin_lock(&ubi->volumes_lock);
+	vol->ref_count -= 1;
+	ubi_assert(vol->ref_count >= 0);
+	spin_unlock(&ubi->volumes_lock);
+	ubi_put_device(ubi);
+	return ret;
+}
+
 /* Release method for volume devices */
 static void vol_release(struct device *dev)
 {
 	struct ubi_volume *vol = container_of(dev, struct ubi_volume, dev);
 
 	kfree(vol->eba_tbl);
+	kfree(vol->leb_maps);
+	kfree(vol->leb_dead);
+	kfree(vol->st_lebs);
+	ubi_rc_free(vol);
 	kfree(vol);
 }
 
@@ -169,6 +292,21 @@ static int volume_sysfs_init(struct ubi_device *ubi, struct ubi_volume *vol)
 	if (err)
 		return err;
 	err = device_create_file(&vol->dev, &attr_vol_upd_marker);
+	if (err)
+		return err;
+	err = device_create_file(&vol->dev, &attr_vol_infer_dtype);
+	if (err)
+		return err;
+	err = device_create_file(&vol->dev, &attr_vol_read_cache);
+	if (err)
+		return err;
+	err = device_create_file(&vol->dev, &attr_vol_read_cache_hits);
+	if (err)
+		return err;
+	err = device_create_file(&vol->dev, &attr_vol_read_cache_misses);
+	if (err)
+		return err;
+	err = device_create_file(&vol->dev, &attr_vol_write_buffer);
 	return err;
 }
 
@@ -178,6 +316,11 @@ static int volume_sysfs_init(struct ubi_device *ubi, struct ubi_volume *vol)
  */
 static void volume_sysfs_close(struct ubi_volume *vol)
 {
+	device_remove_file(&vol->dev, &attr_vol_write_buffer);
+	device_remove_file(&vol->dev, &attr_vol_read_cache_misses);
+	device_remove_file(&vol->dev, &attr_vol_read_cache_hits);
+	device_remove_file(&vol->dev, &attr_vol_read_cache);
+	device_remove_file(&vol->dev, &attr_vol_infer_dtype);
 	device_remove_file(&vol->dev, &attr_vol_upd_marker);
 	device_remove_file(&vol->dev, &attr_vol_data_bytes);
 	device_remove_file(&vol->dev, &attr_vol_usable_eb_size);
@@ -213,6 +356,8 @@ int ubi_create_volume(struct ubi_device *ubi, struct ubi_mkvol_req *req)
 	vol = kzalloc(sizeof(struct ubi_volume), GFP_KERNEL);
 	if (!vol)
 		return -ENOMEM;
+	ubi_rc_init(vol);
+	ubi_wb_init(vol);
 
 	spin_lock(&ubi->volumes_lock);
 	if (vol_id == UBI_VOL_NUM_AUTO) {
@@ -277,9 +422,10 @@ int ubi_create_volume(struct ubi_device *ubi, struct ubi_mkvol_req *req)
 
 	/*
 	 * Finish all pending erases because there may be some LEBs belonging
-	 * to the same volume ID.
+	 * to the same volume ID. Erasures scheduled at attach time cannot be
+	 * attributed to a volume, so flush everything.
 	 */
-	err = ubi_wl_flush(ubi);
+	err = ubi_wl_flush(ubi, UBI_ALL, UBI_ALL);
 	if (err)
 		goto out_acc;
 
@@ -441,12 +587,11 @@ int ubi_remove_volume(struct ubi_volume_desc *desc, int no_vtbl)
 			goto out_err;
 	}
 
-	for (i = 0; i < vol->reserved_pebs; i++) {
-		err = ubi_eba_unmap_leb(ubi, vol, i);
-		if (err)
-			goto out_err;
-	}
+	err = ubi_eba_unmap_lebs(ubi, vol, 0, vol->reserved_pebs);
+	if (err)
+		goto out_err;
 
+	ubi_wb_close(ubi, vol);
 	cdev_del(&vol->cdev);
 	volume_sysfs_close(vol);
 
@@ -555,11 +700,9 @@ int ubi_resize_volume(struct ubi_volume_desc *desc, int reserved_pebs)
 		goto out_acc;
 
 	if (pebs < 0) {
-		for (i = 0; i < -pebs; i++) {
-			err = ubi_eba_unmap_leb(ubi, vol, reserved_pebs + i);
-			if (err)
-				goto out_acc;
-		}
+		err = ubi_eba_unmap_lebs(ubi, vol, reserved_pebs, -pebs);
+		if (err)
+			goto out_acc;
 		spin_lock(&ubi->volumes_lock);
 		ubi->rsvd_pebs += pebs;
 		ubi->avail_pebs -= pebs;
@@ -580,6 +723,37 @@ int ubi_resize_volume(struct ubi_volume_desc *desc, int reserved_pebs)
 	}
 
 	vol->reserved_pebs = reserved_pebs;
+	if (vol->leb_maps) {
+		/*
+		 * Nobody else has the volume open, so nobody uses the
+		 * counters. Just start collecting the history from scratch.
+		 */
+		kfree(vol->leb_maps);
+		vol->leb_maps = kzalloc(reserved_pebs, GFP_KERNEL);
+		vol->leb_maps_total = 0;
+	}
+	if (vol->leb_dead) {
+		/*
+		 * The WL worker may look at the dead tails, so replace them
+		 * under the lock. They are re-allocated on next discard.
+		 */
+		int *leb_dead = vol->leb_dead;
+
+		spin_lock(&ubi->volumes_lock);
+		vol->leb_dead = NULL;
+		spin_unlock(&ubi->volumes_lock);
+		kfree(leb_dead);
+	}
+	if (vol->vol_type == UBI_STATIC_VOLUME) {
+		/* Same as the dead tails, re-filled on next checked read */
+		struct ubi_st_leb *st_lebs;
+
+		spin_lock(&ubi->volumes_lock);
+		st_lebs = vol->st_lebs;
+		vol->st_lebs = NULL;
+		spin_unlock(&ubi->volumes_lock);
+		kfree(st_lebs);
+	}
 	if (vol->vol_type == UBI_DYNAMIC_VOLUME) {
 		vol->used_ebs = reserved_pebs;
 		vol->last_eb_bytes = vol->usable_leb_size;
@@ -712,6 +886,7 @@ void ubi_free_volume(struct ubi_device *ubi, struct ubi_volume *vol)
 
 	dbg_gen("free volume %d", vol->vol_id);
 
+	ubi_wb_close(ubi, vol);
 	ubi->volumes[vol->vol_id] = NULL;
 	err = ubi_destroy_gluebi(vol);
 	cdev_del(&vol->cdev);
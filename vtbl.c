@@ -562,6 +562,8 @@ static int init_volumes(struct ubi_device *ubi, const struct ubi_scan_info *si,
 		vol = kzalloc(sizeof(struct ubi_volume), GFP_KERNEL);
 		if (!vol)
 			return -ENOMEM;
+		ubi_rc_init(vol);
+		ubi_wb_init(vol);
 
 		vol->reserved_pebs = be32_to_cpu(vtbl[i].reserved_pebs);
 		vol->alignment = be32_to_cpu(vtbl[i].alignment);
@@ -640,6 +642,8 @@ static int init_volumes(struct ubi_device *ubi, const struct ubi_scan_info *si,
 	vol = kzalloc(sizeof(struct ubi_volume), GFP_KERNEL);
 	if (!vol)
 		return -ENOMEM;
+	ubi_rc_init(vol);
+	ubi_wb_init(vol);
 
 	vol->reserved_pebs = UBI_LAYOUT_VOLUME_EBS;
 	vol->alignment = 1;
@@ -660,6 +664,38 @@ static int init_volumes(struct ubi_device *ubi, const struct ubi_scan_info *si,
 	ubi->vol_count += 1;
 	vol->ubi = ubi;
 
+	/* And the transaction volume */
+	vol = kzalloc(sizeof(struct ubi_volume), GFP_KERNEL);
+	if (!vol)
+		return -ENOMEM;
+	ubi_rc_init(vol);
+	ubi_wb_init(vol);
+
+	vol->reserved_pebs = UBI_TXN_VOLUME_EBS;
+	vol->alignment = 1;
+	vol->vol_type = UBI_DYNAMIC_VOLUME;
+	vol->name_len = sizeof(UBI_TXN_VOLUME_NAME) - 1;
+	memcpy(vol->name, UBI_TXN_VOLUME_NAME, vol->name_len + 1);
+	vol->usable_leb_size = ubi->leb_size;
+	vol->used_ebs = vol->reserved_pebs;
+	vol->last_eb_bytes = vol->usable_leb_size;
+	vol->used_bytes = (long long)vol->used_ebs * vol->usable_leb_size;
+	vol->vol_id = UBI_TXN_VOLUME_ID;
+	vol->ref_count = 1;
+
+	ubi->volumes[vol_id2idx(ubi, vol->vol_id)] = vol;
+	ubi->vol_count += 1;
+	vol->ubi = ubi;
+
+	/*
+	 * The transaction table physical eraseblock is reserved by the first
+	 * transaction (see 'ubi_eba_atomic_leb_change_multi()'), so images
+	 * which never used transactions may still be attached when they are
+	 * full.
+	 */
+	if (ubi_scan_find_sv(si, UBI_TXN_VOLUME_ID))
+		reserved_pebs += vol->reserved_pebs;
+
 	if (reserved_pebs > ubi->avail_pebs)
 		ubi_err("not enough PEBs, required %d, available %d",
 			reserved_pebs, ubi->avail_pebs);
@@ -0,0 +1,413 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * The per-volume write buffer.
+ *
+ * Writes to UBI volumes have to be aligned to the minimum I/O unit (the NAND
+ * page), so users which append small records to a logical eraseblock either
+ * pad each record to the page size, which wastes flash space and issues one
+ * flash write per record, or keep their own buffers. The write buffer does
+ * this for them: appends to the same logical eraseblock are gathered in a
+ * one-page buffer, which is written to the flash when it gets full.
+ *
+ * The write buffer is disabled by default and is enabled for a dynamic
+ * volume by writing the flush timeout in milliseconds to the "write_buffer"
+ * sysfs file of the volume. The buffer is also flushed by 'ubi_leb_flush()',
+ * by 'ubi_sync()' (and so by fsync() on the volume character device), when
+ * another logical eraseblock or another offset is written to, and when the
+ * volume is removed or the UBI device is detached. Flushing a partially
+ * filled buffer pads it with 0xFF bytes and writes the whole page. A NAND
+ * page cannot be written twice, so the padding stays, and the next append to
+ * the logical eraseblock has to start at the next minimum I/O unit boundary;
+ * writes to the rest of the flushed page are refused with %-EINVAL. So the
+ * timeout should be longer than the usual pause between appends.
+ *
+ * Errors of flushes done on timeout are remembered and returned by the next
+ * 'ubi_leb_flush()' or 'ubi_sync()' call.
+ *
+ * Reads see the buffered data. Un-mapping and atomically changing a logical
+ * eraseblock drop its buffered data. The buffer is protected by
+ * @vol->wb_mutex, which is taken before the logical eraseblock locks and is
+ * never taken while holding one.
+ */
+
+#include <linux/slab.h>
+#include "ubi.h"
+
+/**
+ * wb_flush - write out the write buffer.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ *
+ * This function pads the buffered data with 0xFF bytes up to the minimum I/O
+ * unit, writes it to the flash and empties the buffer. Returns zero in case of
+ * success and a negative error code in case of failure, the buffered data is
+ * dropped in the latter case as well. Note, @vol->wb_mutex has to be locked.
+ */
+static int wb_flush(struct ubi_device *ubi, struct ubi_volume *vol)
+{
+	int err;
+
+	if (!vol->wb_used)
+		return 0;
+
+	dbg_gen("flush %d bytes of LEB %d:%d, offset %d", vol->wb_used,
+		vol->vol_id, vol->wb_lnum, vol->wb_offs);
+
+	memset(vol->wb_buf + vol->wb_used, 0xFF,
+	       ubi->min_io_size - vol->wb_used);
+	err = ubi_eba_write_leb(ubi, vol, vol->wb_lnum, vol->wb_buf,
+				vol->wb_offs, ubi->min_io_size, vol->wb_dtype);
+	vol->wb_offs += ubi->min_io_size;
+	vol->wb_used = 0;
+	return err;
+}
+
+/**
+ * wb_take_err - flush the write buffer and collect the timeout flush error.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ *
+ * This function returns the error of 'wb_flush()' or, if it succeeded, the
+ * error of the last failed flush on timeout, which is reported only once.
+ * Note, @vol->wb_mutex has to be locked.
+ */
+static int wb_take_err(struct ubi_device *ubi, struct ubi_volume *vol)
+{
+	int err;
+
+	err = wb_flush(ubi, vol);
+	if (!err)
+		err = vol->wb_err;
+	vol->wb_err = 0;
+	return err;
+}
+
+/**
+ * wb_timeout - write buffer timeout work function.
+ * @work: the work object
+ */
+static void wb_timeout(struct work_struct *work)
+{
+	struct ubi_volume *vol = container_of(work, struct ubi_volume,
+					      wb_work.work);
+	int err;
+
+	mutex_lock(&vol->wb_mutex);
+	err = wb_flush(vol->ubi, vol);
+	if (err && !vol->wb_err)
+		vol->wb_err = err;
+	mutex_unlock(&vol->wb_mutex);
+	if (err)
+		ubi_err("cannot flush write buffer of volume %d, error %d",
+			vol->vol_id, err);
+}
+
+/**
+ * ubi_wb_init - initialize the write buffer of a volume.
+ * @vol: volume description object
+ */
+void ubi_wb_init(struct ubi_volume *vol)
+{
+	mutex_init(&vol->wb_mutex);
+	INIT_DELAYED_WORK(&vol->wb_work, wb_timeout);
+}
+
+/**
+ * ubi_wb_set_timeout - enable or disable the write buffer of a volume.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @timeout: flush timeout in milliseconds, %0 disables the write buffer
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubi_wb_set_timeout(struct ubi_device *ubi, struct ubi_volume *vol,
+		       int timeout)
+{
+	void *buf = NULL;
+	int err = 0;
+
+	if (timeout < 0)
+		return -EINVAL;
+	if (timeout && (vol->vol_type != UBI_DYNAMIC_VOLUME ||
+			ubi->min_io_size == 1))
+		return -EINVAL;
+
+	if (timeout) {
+		buf = kmalloc(ubi->min_io_size, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&vol->wb_mutex);
+	if (!timeout)
+		err = wb_take_err(ubi, vol);
+	if (!timeout || !vol->wb_buf)
+		swap(vol->wb_buf, buf);
+	vol->wb_timeout = timeout;
+	mutex_unlock(&vol->wb_mutex);
+
+	if (!timeout)
+		cancel_delayed_work_sync(&vol->wb_work);
+	kfree(buf);
+	return err;
+}
+
+/**
+ * ubi_wb_close - flush and disable the write buffer of a volume.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ *
+ * This function is called when the volume is removed or the UBI device is
+ * detached.
+ */
+void ubi_wb_close(struct ubi_device *ubi, struct ubi_volume *vol)
+{
+	int err;
+
+	err = ubi_wb_set_timeout(ubi, vol, 0);
+	if (err)
+		ubi_err("cannot flush write buffer of volume %d, error %d",
+			vol->vol_id, err);
+}
+
+/**
+ * ubi_wb_write - write data through the write buffer.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @buf: the data to write
+ * @offset: offset within the logical eraseblock where to write
+ * @len: how many bytes to write
+ * @dtype: data type
+ *
+ * This function is used instead of 'ubi_eba_write_leb()' by the volume
+ * interfaces. If the write buffer of the volume is disabled, it just calls
+ * 'ubi_eba_write_leb()'. Otherwise, the write either has to continue the
+ * buffered data or has to start at a minimum I/O unit boundary, but its
+ * length does not have to be aligned. Whole minimum I/O units are written to
+ * the flash at once, and the unaligned tail is kept in the buffer. Once a
+ * partially filled page is flushed, its rest is padding, so the next write
+ * has to start at a minimum I/O unit boundary.
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubi_wb_write(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		 const void *buf, int offset, int len, int dtype)
+{
+	int err = 0, n, min_io = ubi->min_io_size;
+
+	mutex_lock(&vol->wb_mutex);
+	if (!vol->wb_buf) {
+		mutex_unlock(&vol->wb_mutex);
+		if (offset & (min_io - 1) || len & (min_io - 1))
+			return -EINVAL;
+		return ubi_eba_write_leb(ubi, vol, lnum, buf, offset, len,
+					 dtype);
+	}
+
+	if (vol->wb_used && (lnum != vol->wb_lnum ||
+			     offset != vol->wb_offs + vol->wb_used)) {
+		err = wb_flush(ubi, vol);
+		if (err)
+			goto out_unlock;
+	}
+
+	if (!vol->wb_used) {
+		if (offset & (min_io - 1)) {
+			err = -EINVAL;
+			goto out_unlock;
+		}
+		vol->wb_lnum = lnum;
+		vol->wb_offs = offset;
+		vol->wb_dtype = dtype;
+	}
+
+	while (len) {
+		if (!vol->wb_used && len >= min_io) {
+			/* Write whole minimum I/O units directly */
+			n = len & ~(min_io - 1);
+			err = ubi_eba_write_leb(ubi, vol, lnum, buf,
+						vol->wb_offs, n, dtype);
+			if (err)
+				goto out_unlock;
+			vol->wb_offs += n;
+		} else {
+			n = min(len, min_io - vol->wb_used);
+			memcpy(vol->wb_buf + vol->wb_used, buf, n);
+			vol->wb_used += n;
+			if (vol->wb_used == min_io) {
+				err = wb_flush(ubi, vol);
+				if (err)
+					goto out_unlock;
+			}
+		}
+		buf += n;
+		len -= n;
+	}
+
+	if (vol->wb_used)
+		schedule_delayed_work(&vol->wb_work,
+				      msecs_to_jiffies(vol->wb_timeout));
+
+out_unlock:
+	mutex_unlock(&vol->wb_mutex);
+	return err;
+}
+
+/**
+ * ubi_wb_read - read data taking the write buffer into account.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ * @buf: buffer to store the read data
+ * @offset: offset from where to read
+ * @len: how many bytes to read
+ * @check: data CRC check flag
+ *
+ * This function is used instead of 'ubi_eba_read_leb()' by the volume
+ * interfaces and returns the same values. If the range is buffered in the
+ * write buffer, the buffered data is returned instead of the flash contents.
+ */
+int ubi_wb_read(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
+		void *buf, int offset, int len, int check)
+{
+	int err, start, end;
+
+	mutex_lock(&vol->wb_mutex);
+	start = max(offset, vol->wb_offs);
+	end = min(offset + len, vol->wb_offs + vol->wb_used);
+	if (!vol->wb_buf || !vol->wb_used || lnum != vol->wb_lnum ||
+	    start >= end) {
+		mutex_unlock(&vol->wb_mutex);
+		return ubi_eba_read_leb(ubi, vol, lnum, buf, offset, len,
+					check);
+	}
+
+	/*
+	 * Read under @vol->wb_mutex, otherwise the buffer could be flushed
+	 * between the flash read and the copy.
+	 */
+	err = ubi_eba_read_leb(ubi, vol, lnum, buf, offset, len, check);
+	if (!err)
+		memcpy(buf + start - offset, vol->wb_buf + start - vol->wb_offs,
+		       end - start);
+	mutex_unlock(&vol->wb_mutex);
+	return err;
+}
+
+/**
+ * ubi_wb_drop - drop buffered data of logical eraseblocks.
+ * @vol: volume description object
+ * @lnum: first logical eraseblock number
+ * @count: count of logical eraseblocks
+ *
+ * This function is called when logical eraseblocks are un-mapped or changed
+ * atomically, so their buffered data must not be written any more. The
+ * caller must not hold any logical eraseblock lock.
+ */
+void ubi_wb_drop(struct ubi_volume *vol, int lnum, int count)
+{
+	mutex_lock(&vol->wb_mutex);
+	if (vol->wb_buf && vol->wb_used && vol->wb_lnum >= lnum &&
+	    vol->wb_lnum < lnum + count) {
+		dbg_gen("drop %d buffered bytes of LEB %d:%d", vol->wb_used,
+			vol->vol_id, vol->wb_lnum);
+		vol->wb_used = 0;
+	}
+	mutex_unlock(&vol->wb_mutex);
+}
+
+/**
+ * ubi_wb_flush_leb - write out and drop buffered data of a logical eraseblock.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ * @lnum: logical eraseblock number
+ *
+ * This function is called before a part of logical eraseblock @lnum is
+ * discarded. The buffered data may precede the discarded range, so it is
+ * written out. The caller must not hold any logical eraseblock lock. Returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+int ubi_wb_flush_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum)
+{
+	int err = 0;
+
+	mutex_lock(&vol->wb_mutex);
+	if (vol->wb_buf && vol->wb_lnum == lnum)
+		err = wb_flush(ubi, vol);
+	mutex_unlock(&vol->wb_mutex);
+	return err;
+}
+
+/**
+ * ubi_wb_flush - flush the write buffer of a volume.
+ * @ubi: UBI device description object
+ * @vol: volume description object
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure, including the case when an earlier flush on timeout failed.
+ */
+int ubi_wb_flush(struct ubi_device *ubi, struct ubi_volume *vol)
+{
+	int err = 0;
+
+	mutex_lock(&vol->wb_mutex);
+	if (vol->wb_buf)
+		err = wb_take_err(ubi, vol);
+	mutex_unlock(&vol->wb_mutex);
+	return err;
+}
+
+/**
+ * ubi_wb_sync - flush write buffers of all volumes.
+ * @ubi: UBI device description object
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubi_wb_sync(struct ubi_device *ubi)
+{
+	int i, err, ret = 0;
+
+	for (i = 0; i < ubi->vtbl_slots; i++) {
+		struct ubi_volume *vol;
+
+		spin_lock(&ubi->volumes_lock);
+		vol = ubi->volumes[i];
+		if (!vol || !vol->wb_buf) {
+			spin_unlock(&ubi->volumes_lock);
+			continue;
+		}
+		/* Take a reference to prevent volume removal */
+		vol->ref_count += 1;
+		spin_unlock(&ubi->volumes_lock);
+
+		err = ubi_wb_flush(ubi, vol);
+		if (err && !ret)
+			ret = err;
+
+		spin_lock(&ubi->volumes_lock);
+		vol->ref_count -= 1;
+		ubi_assert(vol->ref_count >= 0);
+		spin_unlock(&ubi->volumes_lock);
+	}
+
+	return ret;
+}
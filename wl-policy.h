@@ -0,0 +1,728 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * The wear-leveling policy: the wear-leveling entry, the trees and lists the
+ * entries are kept in, the constants and the decisions of the WL sub-system
+ * which do not depend on locking, I/O or the rest of the UBI device - which
+ * free physical eraseblock to pick, whether data is hot, how long the
+ * protection queue is and how the wear-leveling threshold adapts.
+ *
+ * Besides wl.c, this file is compiled into the userspace wear-leveling
+ * simulator (tools/wlsim), so that the simulator replays traces against the
+ * very same policy and the very same data structures. Only <linux/kernel.h>
+ * may be used here, the simulator provides a userspace replacement for it.
+ */
+
+#ifndef __UBI_WL_POLICY_H__
+#define __UBI_WL_POLICY_H__
+
+#include <linux/kernel.h>
+
+/*
+ * Length of the protection queue. The length is effectively equivalent to the
+ * number of (global) erase cycles PEBs are protected from the wear-leveling
+ * worker. This is the initial length, it is adjusted run-time within
+ * [%UBI_PROT_QUEUE_MIN, %UBI_PROT_QUEUE_MAX] depending on for how long the
+ * users keep the physical eraseblocks they write to. %UBI_PROT_QUEUE_MAX has
+ * to be a power of 2.
+ */
+#define UBI_PROT_QUEUE_LEN 10
+#define UBI_PROT_QUEUE_MIN 2
+#define UBI_PROT_QUEUE_MAX 64
+
+/*
+ * Number of buckets in the histogram of physical eraseblock life times. The
+ * buckets are logarithmic, the last one is for life times of
+ * %UBI_PROT_QUEUE_MAX erase cycles and more.
+ */
+#define UBI_PQ_LIFE_BUCKETS 8
+
+/*
+ * How many erase operations have to happen before the wear-leveling threshold
+ * is re-considered.
+ */
+#define WL_ADAPT_PERIOD 256
+
+/*
+ * The write amplification caused by the wear-leveling worker is measured over
+ * a window of LEB writes, not over the last %WL_ADAPT_PERIOD erase operations,
+ * because the worker moves LEBs in bursts whenever the erase counters drift
+ * apart by the threshold. The wear-leveling threshold is only re-considered
+ * when the window holds %WL_WA_WINDOW LEB writes per physical eraseblock, and
+ * then the older half of the window is dropped.
+ */
+#define WL_WA_WINDOW 64
+
+/*
+ * How many physical eraseblocks have to be put before the protection queue
+ * length is re-considered.
+ */
+#define WL_PQ_ADAPT_PERIOD 128
+
+/*
+ * What the @stamp field of a wear-leveling entry means: nothing, when the
+ * physical eraseblock was handed out by 'ubi_wl_get_peb()', or when it became
+ * the target of a wear-leveling move. %WL_STAMP_OLD means that it was handed
+ * out at least %UBI_PROT_QUEUE_MAX erase operations ago, and the stamp is not
+ * needed any more.
+ */
+#define WL_STAMP_NONE 0
+#define WL_STAMP_GET  1
+#define WL_STAMP_MOVE 2
+#define WL_STAMP_OLD  3
+
+/*
+ * The stamp is the count of erase operations modulo 2^%WL_STAMP_BITS. To make
+ * sure it never wraps around, 'wl_stamp_sweep()' visits every entry at least
+ * once per %WL_STAMP_SWEEP_PERIOD erase operations, and
+ * %UBI_PROT_QUEUE_MAX + %WL_STAMP_SWEEP_PERIOD must not exceed
+ * 2^%WL_STAMP_BITS.
+ */
+#define WL_STAMP_BITS 8
+#define WL_STAMP_MASK ((1 << WL_STAMP_BITS) - 1)
+#define WL_STAMP_SWEEP_PERIOD 128
+
+/*
+ * When a physical eraseblock is moved, the WL sub-system has to pick the target
+ * physical eraseblock to move to. The simplest way would be just to pick the
+ * one with the highest erase counter. But in certain workloads this could lead
+ * to an unlimited wear of one or few physical eraseblock. Indeed, imagine a
+ * situation when the picked physical eraseblock is constantly erased after the
+ * data is written to it. So, we have a constant which limits the highest erase
+ * counter of the free physical eraseblock to pick. Namely, the WL sub-system
+ * does not pick eraseblocks with erase counter greater than the lowest erase
+ * counter plus %WL_FREE_MAX_DIFF. @p is anything with a @wl_threshold field.
+ */
+#define WL_FREE_MAX_DIFF(p) (2*(p)->wl_threshold)
+
+/*
+ * Wear-leveling entry states.
+ *
+ * UBI_WL_NONE: the entry has not been initialized
+ * UBI_WL_FREE: the physical eraseblock is in the @ubi->free tree
+ * UBI_WL_USED: the physical eraseblock is in the @ubi->used tree
+ * UBI_WL_PROT: the physical eraseblock is in the protection queue
+ * UBI_WL_SCRUB: the physical eraseblock is in the @ubi->scrub tree
+ * UBI_WL_MOVING: the physical eraseblock is being moved from or to
+ * UBI_WL_ERASE: the physical eraseblock is scheduled for erasure
+ * UBI_WL_TORTURE: the physical eraseblock is suspected to be bad, it is
+ *                 quarantined until it is tortured
+ * UBI_WL_BAD: the physical eraseblock went bad
+ */
+enum {
+	UBI_WL_NONE = 0,
+	UBI_WL_FREE,
+	UBI_WL_USED,
+	UBI_WL_PROT,
+	UBI_WL_SCRUB,
+	UBI_WL_MOVING,
+	UBI_WL_ERASE,
+	UBI_WL_TORTURE,
+	UBI_WL_BAD
+};
+
+/*
+ * Wear-leveling entries do not point to each other, they are linked by
+ * physical eraseblock numbers (indices in the array of the entries), and
+ * %WL_NIL is the "no entry" value. The links are 24 bits wide, so the WL
+ * sub-system supports at most %UBI_WL_MAX_PEBS physical eraseblocks. Note,
+ * the heads of the protection queue lists live in the same array, after the
+ * entries of the physical eraseblocks, see 'wl_list_init()'.
+ */
+#define WL_NIL 0xFFFFFF
+#define UBI_WL_MAX_PEBS (WL_NIL - UBI_PROT_QUEUE_MAX)
+
+/**
+ * 每个WL子系统中的PEB，要么用树来组织，要么用链表来组织
+ * struct ubi_wl_entry - wear-leveling entry.
+ * @left: left child in the corresponding (free/used/scrub) tree, or the
+ *        previous entry in the protection queue list
+ * @state: which WL sub-system structure the entry is in (%UBI_WL_FREE, etc)
+ * @stamp_src: what @stamp means (%WL_STAMP_GET, etc)
+ * @right: right child in the corresponding (free/used/scrub) tree, or the
+ *         next entry in the protection queue list
+ * @stamp: count of erase operations (modulo 2^%WL_STAMP_BITS) when the
+ *         physical eraseblock was handed out or became the target of a
+ *         wear-leveling move
+ * @ec: erase counter
+ *
+ * This data structure is used in the WL sub-system. Each physical eraseblock
+ * has a corresponding &struct wl_entry object which may be kept in different
+ * trees. The objects of all physical eraseblocks are kept in one array
+ * indexed by the physical eraseblock number, so the physical eraseblock
+ * number is not stored, it is the index of the object in the array. See WL
+ * sub-system for details.
+ *
+ * The links are 24-bit indices instead of pointers, and the trees are treaps
+ * which do not need parent links and colors (see 'wl_tree_add()'), so the
+ * links and the state take 2 words instead of the 3 words of an RB-tree node.
+ * The stamp is packed into the spare bits of the second word, so the entry
+ * takes 3 words together with the erase counter.
+ */
+struct ubi_wl_entry {
+	unsigned int left:24;
+	unsigned int state:4;
+	unsigned int stamp_src:2;
+	unsigned int right:24;
+	unsigned int stamp:WL_STAMP_BITS;
+	int ec;
+};
+
+/**
+ * struct ubi_wl_tree - a tree of wear-leveling entries.
+ * @tbl: the array of wear-leveling entries the tree links
+ * @root: index of the root entry (%WL_NIL if the tree is empty)
+ *
+ * The entries are ordered by (erase counter, physical eraseblock number)
+ * pairs. The tree is a treap: besides being a binary search tree, it is a
+ * heap with respect to a pseudo-random priority of the entries, which is
+ * computed from the physical eraseblock number, so it does not have to be
+ * stored. This keeps the tree balanced with high probability, and unlike
+ * RB-trees, a treap can be maintained without parent links.
+ */
+struct ubi_wl_tree {
+	struct ubi_wl_entry *tbl;
+	unsigned int root;
+};
+
+/**
+ * wl_tree_init - initialize an empty tree.
+ * @t: the tree to initialize
+ * @tbl: the array of wear-leveling entries the tree will link
+ */
+static inline void wl_tree_init(struct ubi_wl_tree *t, struct ubi_wl_entry *tbl)
+{
+	t->tbl = tbl;
+	t->root = WL_NIL;
+}
+
+/**
+ * wl_tree_empty - check if a tree is empty.
+ * @t: the tree to check
+ */
+static inline int wl_tree_empty(const struct ubi_wl_tree *t)
+{
+	return t->root == WL_NIL;
+}
+
+/**
+ * wl_tree_entry - get a wear-leveling entry by its index.
+ * @t: the tree
+ * @i: index of the entry (%WL_NIL is allowed)
+ *
+ * Returns the entry or %NULL if @i is %WL_NIL.
+ */
+static inline struct ubi_wl_entry *wl_tree_entry(const struct ubi_wl_tree *t,
+						 unsigned int i)
+{
+	return i == WL_NIL ? NULL : &t->tbl[i];
+}
+
+/**
+ * wl_prio - get the treap priority of a wear-leveling entry.
+ * @i: index of the entry
+ *
+ * The priority is a hash of the physical eraseblock number. The hash is a
+ * bijection, so different entries never have the same priority.
+ */
+static inline unsigned int wl_prio(unsigned int i)
+{
+	i ^= i >> 16;
+	i *= 0x85EBCA6B;
+	i ^= i >> 13;
+	i *= 0xC2B2AE35;
+	i ^= i >> 16;
+	return i;
+}
+
+/**
+ * wl_less - compare the keys of two wear-leveling entries.
+ * @tbl: the array of wear-leveling entries
+ * @a: index of the first entry
+ * @b: index of the second entry
+ *
+ * Returns non-zero if entry @a goes before entry @b in the trees.
+ */
+static inline int wl_less(const struct ubi_wl_entry *tbl, unsigned int a,
+			  unsigned int b)
+{
+	if (tbl[a].ec != tbl[b].ec)
+		return tbl[a].ec < tbl[b].ec;
+	return a < b;
+}
+
+/**
+ * wl_tree_link - change a link of a tree.
+ * @t: the tree
+ * @parent: index of the entry to change the link of (%WL_NIL means the root)
+ * @right: whether the right or the left child link has to be changed
+ * @i: index to link
+ */
+static inline void wl_tree_link(struct ubi_wl_tree *t, unsigned int parent,
+				int right, unsigned int i)
+{
+	if (parent == WL_NIL)
+		t->root = i;
+	else if (right)
+		t->tbl[parent].right = i;
+	else
+		t->tbl[parent].left = i;
+}
+
+/**
+ * wl_tree_add - add a wear-leveling entry to a tree.
+ * @e: the wear-leveling entry to add
+ * @t: the tree
+ *
+ * The entry is linked where its priority puts it, and the sub-tree which was
+ * there is split into the entries less and greater than @e, which become the
+ * left and the right sub-trees of @e.
+ */
+static inline void wl_tree_add(struct ubi_wl_entry *e, struct ubi_wl_tree *t)
+{
+	struct ubi_wl_entry *tbl = t->tbl;
+	unsigned int i = e - tbl, prio = wl_prio(i);
+	unsigned int parent = WL_NIL, cur = t->root, l = i, r = i;
+	int right = 0;
+
+	while (cur != WL_NIL && wl_prio(cur) > prio) {
+		parent = cur;
+		right = wl_less(tbl, cur, i);
+		cur = right ? tbl[cur].right : tbl[cur].left;
+	}
+	wl_tree_link(t, parent, right, i);
+
+	e->left = e->right = WL_NIL;
+	while (cur != WL_NIL) {
+		if (wl_less(tbl, cur, i)) {
+			if (l == i)
+				e->left = cur;
+			else
+				tbl[l].right = cur;
+			l = cur;
+			cur = tbl[cur].right;
+		} else {
+			if (r == i)
+				e->right = cur;
+			else
+				tbl[r].left = cur;
+			r = cur;
+			cur = tbl[cur].left;
+		}
+	}
+	if (l != i)
+		tbl[l].right = WL_NIL;
+	if (r != i)
+		tbl[r].left = WL_NIL;
+}
+
+/**
+ * wl_tree_del - remove a wear-leveling entry from a tree.
+ * @e: the wear-leveling entry to remove
+ * @t: the tree
+ *
+ * There are no parent links, so @e is looked up from the root by its key.
+ * This means that the erase counter of @e must not be changed while it is in
+ * the tree. The sub-trees of @e are merged in place of @e. Nothing is done if
+ * @e is not in the tree.
+ */
+static inline void wl_tree_del(struct ubi_wl_entry *e, struct ubi_wl_tree *t)
+{
+	struct ubi_wl_entry *tbl = t->tbl;
+	unsigned int i = e - tbl, parent = WL_NIL, cur = t->root, l, r;
+	int right = 0;
+
+	while (cur != i) {
+		if (cur == WL_NIL)
+			return;
+		parent = cur;
+		right = wl_less(tbl, cur, i);
+		cur = right ? tbl[cur].right : tbl[cur].left;
+	}
+
+	l = e->left;
+	r = e->right;
+	while (l != WL_NIL && r != WL_NIL) {
+		if (wl_prio(l) > wl_prio(r)) {
+			wl_tree_link(t, parent, right, l);
+			parent = l;
+			right = 1;
+			l = tbl[l].right;
+		} else {
+			wl_tree_link(t, parent, right, r);
+			parent = r;
+			right = 0;
+			r = tbl[r].left;
+		}
+	}
+	wl_tree_link(t, parent, right, l != WL_NIL ? l : r);
+}
+
+/**
+ * wl_tree_first - get the wear-leveling entry with the lowest key.
+ * @t: the tree
+ *
+ * Returns the entry or %NULL if the tree is empty.
+ */
+static inline struct ubi_wl_entry *wl_tree_first(const struct ubi_wl_tree *t)
+{
+	unsigned int i = t->root;
+
+	if (i != WL_NIL)
+		while (t->tbl[i].left != WL_NIL)
+			i = t->tbl[i].left;
+	return wl_tree_entry(t, i);
+}
+
+/**
+ * wl_tree_last - get the wear-leveling entry with the highest key.
+ * @t: the tree
+ *
+ * Returns the entry or %NULL if the tree is empty.
+ */
+static inline struct ubi_wl_entry *wl_tree_last(const struct ubi_wl_tree *t)
+{
+	unsigned int i = t->root;
+
+	if (i != WL_NIL)
+		while (t->tbl[i].right != WL_NIL)
+			i = t->tbl[i].right;
+	return wl_tree_entry(t, i);
+}
+
+/**
+ * wl_tree_next - get the next wear-leveling entry of a tree.
+ * @t: the tree
+ * @e: the current entry, which has to be in @t
+ *
+ * Without parent links, the next entry is looked up from the root if @e has
+ * no right sub-tree, so walking the whole tree this way takes O(n * log(n))
+ * steps. Returns the entry or %NULL if @e is the last one.
+ */
+static inline struct ubi_wl_entry *wl_tree_next(const struct ubi_wl_tree *t,
+						const struct ubi_wl_entry *e)
+{
+	const struct ubi_wl_entry *tbl = t->tbl;
+	unsigned int i = e - tbl, cur, next = WL_NIL;
+
+	if (e->right != WL_NIL) {
+		next = e->right;
+		while (tbl[next].left != WL_NIL)
+			next = tbl[next].left;
+		return wl_tree_entry(t, next);
+	}
+
+	cur = t->root;
+	while (cur != i && cur != WL_NIL)
+		if (wl_less(tbl, i, cur)) {
+			next = cur;
+			cur = tbl[cur].left;
+		} else
+			cur = tbl[cur].right;
+	return wl_tree_entry(t, next);
+}
+
+/**
+ * wl_tree_for_each - iterate over the wear-leveling entries of a tree.
+ * @e: the &struct ubi_wl_entry pointer to use as the iterator
+ * @t: the tree
+ *
+ * The entries are walked in the order of their keys. The tree must not be
+ * changed meanwhile.
+ */
+#define wl_tree_for_each(e, t) \
+	for (e = wl_tree_first(t); e; e = wl_tree_next(t, e))
+
+/**
+ * wl_list_init - initialize an empty protection queue list.
+ * @tbl: the array of wear-leveling entries
+ * @head: index of the list head
+ *
+ * Protection queue lists are circular doubly-linked lists like
+ * &struct list_head lists, the @left and @right links of the entries are the
+ * "prev" and "next" links. The list head is an unused wear-leveling entry in
+ * @tbl, so that the entries can be linked to it by index.
+ */
+static inline void wl_list_init(struct ubi_wl_entry *tbl, unsigned int head)
+{
+	tbl[head].left = tbl[head].right = head;
+}
+
+/**
+ * wl_list_empty - check if a protection queue list is empty.
+ * @tbl: the array of wear-leveling entries
+ * @head: index of the list head
+ */
+static inline int wl_list_empty(const struct ubi_wl_entry *tbl,
+				unsigned int head)
+{
+	return tbl[head].right == head;
+}
+
+/**
+ * wl_list_add_tail - add a wear-leveling entry to a protection queue list.
+ * @tbl: the array of wear-leveling entries
+ * @e: the entry to add
+ * @head: index of the list head
+ */
+static inline void wl_list_add_tail(struct ubi_wl_entry *tbl,
+				    struct ubi_wl_entry *e, unsigned int head)
+{
+	unsigned int i = e - tbl, prev = tbl[head].left;
+
+	e->left = prev;
+	e->right = head;
+	tbl[prev].right = i;
+	tbl[head].left = i;
+}
+
+/**
+ * wl_list_del - remove a wear-leveling entry from its protection queue list.
+ * @tbl: the array of wear-leveling entries
+ * @e: the entry to remove
+ */
+static inline void wl_list_del(struct ubi_wl_entry *tbl,
+			       struct ubi_wl_entry *e)
+{
+	tbl[e->left].right = e->right;
+	tbl[e->right].left = e->left;
+	e->left = e->right = WL_NIL;
+}
+
+/**
+ * find_wl_entry - find wear-leveling entry closest to certain erase counter.
+ * @t: the tree where to look for
+ * @max: highest possible erase counter
+ *
+ * This function looks for a wear leveling entry with erase counter closest to
+ * @max and less then @max.
+ */
+static inline struct ubi_wl_entry *find_wl_entry(const struct ubi_wl_tree *t,
+						 int max)
+{
+	unsigned int p;
+	struct ubi_wl_entry *e;
+	/* 首先找到擦除次数最少的PEB */
+	e = wl_tree_first(t);
+	/* 要找的PEB必须在 PEBwlEC(PEB-with-lowest-EC) ~ PEBwlEC + max 之间*/
+	max += e->ec;
+
+	p = t->root;
+	while (p != WL_NIL) {
+		struct ubi_wl_entry *e1;
+
+		e1 = &t->tbl[p];
+		if (e1->ec >= max)
+			p = e1->left;
+		else {
+			p = e1->right;
+			e = e1;
+		}
+	}
+
+	return e;
+}
+
+/**
+ * find_mean_wl_entry - find a free wear-leveling entry with medium EC.
+ * @t: the tree of free physical eraseblocks
+ * @max_diff: the current %WL_FREE_MAX_DIFF value
+ *
+ * 对于不知类型的数据，找擦除次数在中间的PEB。
+ * 但不能找大于等于阈值上限的PEB
+ * For unknown data we pick a physical eraseblock with medium erase counter.
+ * But we by no means can pick a physical eraseblock with erase counter greater
+ * or equivalent than the lowest erase counter plus @max_diff. The @t tree
+ * must not be empty.
+ */
+static inline struct ubi_wl_entry *
+find_mean_wl_entry(const struct ubi_wl_tree *t, int max_diff)
+{
+	int medium_ec;
+	struct ubi_wl_entry *first, *last;
+
+	first = wl_tree_first(t);
+	last = wl_tree_last(t);
+
+	if (last->ec - first->ec < max_diff)
+		/* 所有PEB都满足条件，直接取根节点，它在树中的位置是随机的 */
+		return &t->tbl[t->root];
+
+	medium_ec = (first->ec + max_diff)/2;
+	return find_wl_entry(t, medium_ec);
+}
+
+/**
+ * data_is_hot - check if a logical eraseblock contains recently written data.
+ * @cur_sqnum: the current global sequence number
+ * @sqnum: sequence number the logical eraseblock was written with
+ * @copy_flag: if the logical eraseblock is a copy
+ * @peb_count: count of good physical eraseblocks
+ *
+ * Every LEB write takes a new sequence number, so the difference between the
+ * current global sequence number and the sequence number of the LEB tells how
+ * many LEB writes happened since the LEB was written. If less than one
+ * "device worth" of writes happened, the data is considered to be hot, i.e.
+ * likely to be re-written soon. Otherwise the data is cold.
+ *
+ * Note, when a LEB is copied (by the WL worker or by the atomic LEB change
+ * operation), the copy gets a new sequence number and the @copy_flag is set,
+ * so the sequence number tells nothing about the age of the data in this
+ * case. Such eraseblocks are treated as cold, which is what the WL worker did
+ * before it started taking the data age into account.
+ *
+ * This function returns non-zero if the data is hot and zero if it is cold.
+ */
+static inline int data_is_hot(unsigned long long cur_sqnum,
+			      unsigned long long sqnum, int copy_flag,
+			      int peb_count)
+{
+	if (copy_flag)
+		return 0;
+	return cur_sqnum - sqnum < (unsigned long long)peb_count;
+}
+
+/**
+ * pq_life_bucket - find the life time histogram bucket of a life time.
+ * @life: for how many erase operations the physical eraseblock was used
+ */
+static inline int pq_life_bucket(unsigned int life)
+{
+	if (life < UBI_PROT_QUEUE_MAX)
+		return fls(life);
+	return UBI_PQ_LIFE_BUCKETS - 1;
+}
+
+/**
+ * wl_stamp_life - find for how long a physical eraseblock was used.
+ * @e: the wear-leveling entry
+ * @erases: current count of erase operations
+ *
+ * Returns the count of erase operations since @e was stamped, or
+ * %UBI_PROT_QUEUE_MAX if the stamp is %WL_STAMP_OLD.
+ */
+static inline unsigned int wl_stamp_life(const struct ubi_wl_entry *e,
+					 unsigned int erases)
+{
+	if (e->stamp_src == WL_STAMP_OLD)
+		return UBI_PROT_QUEUE_MAX;
+	return (erases - e->stamp) & WL_STAMP_MASK;
+}
+
+/**
+ * wl_stamp_sweep - retire old stamps before they wrap around.
+ * @tbl: the array of wear-leveling entries
+ * @pos: the entry to start from
+ * @peb_count: count of entries in @tbl
+ * @erases: current count of erase operations
+ *
+ * This function has to be called once per erase operation. It visits the next
+ * 1/%WL_STAMP_SWEEP_PERIOD of the entries and retires the stamps which are at
+ * least %UBI_PROT_QUEUE_MAX erase operations old: a handed out physical
+ * eraseblock becomes %WL_STAMP_OLD, and a wear-leveling move target is not
+ * interesting any more. Returns the entry to start from next time.
+ */
+static inline int wl_stamp_sweep(struct ubi_wl_entry *tbl, int pos,
+				 int peb_count, unsigned int erases)
+{
+	int n = (peb_count + WL_STAMP_SWEEP_PERIOD - 1) / WL_STAMP_SWEEP_PERIOD;
+
+	while (n--) {
+		struct ubi_wl_entry *e = &tbl[pos];
+
+		if ((e->stamp_src == WL_STAMP_GET ||
+		     e->stamp_src == WL_STAMP_MOVE) &&
+		    wl_stamp_life(e, erases) >= UBI_PROT_QUEUE_MAX) {
+			if (e->stamp_src == WL_STAMP_GET)
+				e->stamp_src = WL_STAMP_OLD;
+			else
+				e->stamp_src = WL_STAMP_NONE;
+		}
+		if (++pos >= peb_count)
+			pos = 0;
+	}
+
+	return pos;
+}
+
+/**
+ * pq_choose_len - pick the protection queue length.
+ * @pq_life: histogram of life times of the recently put physical eraseblocks
+ * @puts: count of physical eraseblocks in @pq_life
+ *
+ * This function picks the shortest protection queue length which covers 90%
+ * of the short-lived physical eraseblocks, i.e., of those which lived less
+ * than %UBI_PROT_QUEUE_MAX erase operations. This way short-lived LEBs are
+ * almost never moved by the WL worker. If only few physical eraseblocks were
+ * short-lived, protecting them is not worth it, and the shortest length is
+ * used.
+ */
+static inline int pq_choose_len(const int *pq_life, int puts)
+{
+	int i, short_lived = 0, sum = 0, len = UBI_PROT_QUEUE_MIN;
+
+	for (i = 0; i < UBI_PQ_LIFE_BUCKETS - 1; i++)
+		short_lived += pq_life[i];
+
+	if (short_lived * 8 >= puts)
+		for (i = 0; i < UBI_PQ_LIFE_BUCKETS - 1; i++) {
+			sum += pq_life[i];
+			if (sum * 10 >= short_lived * 9) {
+				len = 1 << i;
+				break;
+			}
+		}
+
+	if (len < UBI_PROT_QUEUE_MIN)
+		len = UBI_PROT_QUEUE_MIN;
+	if (len > UBI_PROT_QUEUE_MAX)
+		len = UBI_PROT_QUEUE_MAX;
+	return len;
+}
+
+/**
+ * wl_choose_threshold - pick the new wear-leveling threshold.
+ * @thr: the current threshold
+ * @wa: write amplification caused by the WL worker over the last window
+ *      (LEB copies per 100 LEB writes of the users, see %WL_WA_WINDOW)
+ * @budget: write amplification budget
+ * @spread: difference between the highest and the lowest erase counter
+ * @min: lowest allowed threshold
+ * @max: highest allowed threshold
+ *
+ * If the budget was exceeded, the threshold is increased by a quarter to make
+ * wear-leveling less aggressive. If less than a half of the budget was used
+ * and the erase counters differ more than the threshold, the threshold is
+ * decreased by a fifth, which undoes one increase. The threshold always stays
+ * within [@min, @max].
+ */
+static inline int wl_choose_threshold(int thr, int wa, int budget, int spread,
+				      int min, int max)
+{
+	if (wa > budget)
+		thr += thr / 4 ? thr / 4 : 1;
+	else if (wa < budget / 2 && spread > thr)
+		thr -= thr / 5 ? thr / 5 : 1;
+
+	if (thr > max)
+		thr = max;
+	if (thr < min)
+		thr = min;
+	return thr;
+}
+
+#endif /* !__UBI_WL_POLICY_H__ */
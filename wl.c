@@ -63,8 +63,8 @@
  * as moving it for wear-leveling reasons.
  *
  * As it was said, for the UBI sub-system all physical eraseblocks are either
- * "free" or "used". Free eraseblock are kept in the @wl->free RB-tree, while
- * used eraseblocks are kept in @wl->used or @wl->scrub RB-trees, or
+ * "free" or "used". Free eraseblock are kept in the @wl->free tree, while
+ * used eraseblocks are kept in @wl->used or @wl->scrub trees, or
  * (temporarily) in the @wl->pq queue.
  *
  * 从WL子系统中拿出来(通过wl_ubi_get_peb())的PEB，可以写数据，但是要过一段时间才能
@@ -100,26 +100,36 @@
  * o scrubbing is needed (@wl->scrub tree).
  *
  * Depending on the sub-state, wear-leveling entries of the used physical
- * eraseblocks may be kept in one of those structures.
+ * eraseblocks may be kept in one of those structures. The state of each entry
+ * is recorded in the entry itself (@e->state), so finding out where a physical
+ * eraseblock is does not require searching the trees.
  *
  * Note, in this implementation, we keep a small in-RAM object for each physical
- * eraseblock. This is surely not a scalable solution. But it appears to be good
- * enough for moderately large flashes and it is simple. In future, one may
- * re-work this sub-system and make it more scalable.
+ * eraseblock. The objects are not allocated one by one - they live in one
+ * array indexed by the physical eraseblock number (@ubi->lookuptbl), so there
+ * is neither a per-object allocation overhead nor a separate pointer table.
+ * The objects do not contain pointers either: the trees and the protection
+ * queue lists link them by 24-bit physical eraseblock numbers, and the trees
+ * are treaps, which need no parent links (see wl-policy.h). So an object takes
+ * 12 bytes on both 32-bit and 64-bit machines, instead of a 40-byte slab
+ * object plus an 8-byte pointer in the pointer table, and e.g. 256K physical
+ * eraseblocks take 3MiB instead of 12MiB.
  *
- * At the moment this sub-system does not utilize the sequence number, which
- * was introduced relatively recently. But it would be wise to do this because
- * the sequence number of a logical eraseblock characterizes how old is it. For
- * example, when we move a PEB with low erase counter, and we need to pick the
- * target PEB, we pick a PEB with the highest EC if our PEB is "old" and we
- * pick target PEB with an average EC if our PEB is not very "old". This is a
- * room for future re-works of the WL sub-system.
+ * The sequence number of a logical eraseblock characterizes how old is it, and
+ * the WL worker uses it when moving data. "Old" (cold) data is moved to a PEB
+ * with high erase counter, while "young" (hot) data is not moved for
+ * wear-leveling purposes at all, because it is likely to be re-written soon.
+ * If hot data has to be scrubbed, it is moved to a PEB with medium erase
+ * counter. See 'leb_is_hot()' for details.
  */
 
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/crc32.h>
 #include <linux/freezer.h>
 #include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
 #include "ubi.h"
 #include "fastscan.h"
 
@@ -130,22 +140,37 @@
  * Maximum difference between two erase counters. If this threshold is
  * exceeded, the WL sub-system starts moving data from used physical
  * eraseblocks with low erase counter to free physical eraseblocks with high
- * erase counter.
+ * erase counter. This is only the initial value - the actual threshold is
+ * kept in @ubi->wl_threshold and is adjusted run-time, see
+ * 'wl_adapt_threshold()'.
  */
 #define UBI_WL_THRESHOLD CONFIG_MTD_UBI_WL_THRESHOLD
 
 /*
- * When a physical eraseblock is moved, the WL sub-system has to pick the target
- * physical eraseblock to move to. The simplest way would be just to pick the
- * one with the highest erase counter. But in certain workloads this could lead
- * to an unlimited wear of one or few physical eraseblock. Indeed, imagine a
- * situation when the picked physical eraseblock is constantly erased after the
- * data is written to it. So, we have a constant which limits the highest erase
- * counter of the free physical eraseblock to pick. Namely, the WL sub-system
- * does not pick eraseblocks with erase counter greater than the lowest erase
- * counter plus %WL_FREE_MAX_DIFF.
- */
-#define WL_FREE_MAX_DIFF (2*UBI_WL_THRESHOLD)
+ * Write amplification budget of the wear-leveling (in percent): how many LEB
+ * copies the WL worker may do per 100 LEB writes of the users.
+ */
+#define UBI_WL_WA_BUDGET CONFIG_MTD_UBI_WL_WA_BUDGET
+
+/*
+ * How many times a physical eraseblock may be read before it is scrubbed to
+ * prevent read disturb errors (zero means read disturb is not taken into
+ * account). This is only the initial value, see @ubi->rd_threshold.
+ */
+#define UBI_READ_DISTURB_THRESHOLD CONFIG_MTD_UBI_READ_DISTURB_THRESHOLD
+
+/*
+ * The logical eraseblock of works which do not erase any data, like the
+ * wear-leveling work before it has read the VID header of the physical
+ * eraseblock it moves. Unlike %UBI_ALL, it does not match any targeted flush.
+ */
+#define WL_NO_LEB (-2)
+
+/*
+ * Value the read counter of a physical eraseblock is latched at once it has
+ * been reported for read disturb scrubbing, see 'ubi_wl_account_read()'.
+ */
+#define RD_LATCHED INT_MIN
 
 /*
  * Maximum number of consecutive background thread failures which is enough to
@@ -153,6 +178,19 @@
  */
 #define WL_MAX_FAILURES 32
 
+/*
+ * For how long the background thread may defer works because of in-flight
+ * foreground I/O when throttling is enabled.
+ */
+#define WL_BGT_MAX_DEFER HZ
+
+/*
+ * Default token bucket size (in works) and idle time (in milliseconds) of the
+ * background thread throttling. Throttling itself is disabled by default.
+ */
+#define WL_BGT_BURST 16
+#define WL_BGT_IDLE_MS 500
+
 /**
  * 工作类型可以是擦除工作，也可以是损耗均衡工作
  * 两者分别由erase_worker()和wear_leveling_worker()实现
@@ -161,12 +199,19 @@
  * @func: worker function
  * 如果工作的类型是擦除工作,e就是要擦除的对象
  * @e: physical eraseblock to erase
+ * @vol_id: the volume ID the erased data belonged to
+ * @lnum: the logical eraseblock number the erased data belonged to
  * @torture: if the physical eraseblock has to be tortured
  *
  * The @func pointer points to the worker function. If the @cancel argument is
  * not zero, the worker has to free the resources and exit immediately. The
  * worker has to return zero in case of success and a negative error code in
  * case of failure.
+ *
+ * The @vol_id and @lnum fields are used by 'ubi_wl_flush()' to find the works
+ * it has to wait for. They are %UBI_ALL if the erased data cannot be
+ * attributed to a logical eraseblock, and %WL_NO_LEB for works which do not
+ * erase any data.
  */
 #ifndef CONFIG_MTD_UBI_FASTSCAN
 struct ubi_work {
@@ -174,14 +219,31 @@ struct ubi_work {
 	int (*func)(struct ubi_device *ubi, struct ubi_work *wrk, int cancel);
 	/* The below fields are only relevant to erasure works */
 	struct ubi_wl_entry *e;
+	int vol_id;
+	int lnum;
 	int torture;
 };
 #endif
 
+/**
+ * struct ubi_work_inflight - a work which is being done at the moment.
+ * @list: a link in the @ubi->works_inflight list
+ * @vol_id: the volume ID of the work
+ * @lnum: the logical eraseblock number of the work
+ *
+ * The worker functions free the work objects, so the fields 'ubi_wl_flush()'
+ * needs are saved in this on-stack object while the work is being done.
+ */
+struct ubi_work_inflight {
+	struct list_head list;
+	int vol_id;
+	int lnum;
+};
+
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
 static int paranoid_check_ec(struct ubi_device *ubi, int pnum, int ec);
 static int paranoid_check_in_wl_tree(struct ubi_wl_entry *e,
-				     struct rb_root *root);
+				     struct ubi_wl_tree *root);
 static int paranoid_check_in_pq(struct ubi_device *ubi, struct ubi_wl_entry *e);
 #else
 #define paranoid_check_ec(ubi, pnum, ec) 0
@@ -189,45 +251,109 @@ static int paranoid_check_in_pq(struct ubi_device *ubi, struct ubi_wl_entry *e);
 #define paranoid_check_in_pq(ubi, e) 0
 #endif
 
+/*
+ * The protection queue lists are linked through @ubi->lookuptbl, their heads
+ * follow the entries of the physical eraseblocks there. This macro gives the
+ * index of the head of the list of protection queue slot @i.
+ */
+#define pq_list(ubi, i) ((ubi)->peb_count + (i))
+
+#ifdef CONFIG_MTD_UBI_DEBUG
+/*
+ * Valid wear-leveling entry state transitions: for each state, the bit-mask
+ * of states the entry may go to.
+ */
+static const unsigned int wl_state_transitions[] = {
+	[UBI_WL_NONE]    = 1 << UBI_WL_FREE | 1 << UBI_WL_USED |
+			   1 << UBI_WL_SCRUB | 1 << UBI_WL_ERASE,
+	[UBI_WL_FREE]    = 1 << UBI_WL_PROT | 1 << UBI_WL_MOVING,
+	/* Used and scrub PEBs go back to used if they cannot be erased */
+	[UBI_WL_USED]    = 1 << UBI_WL_USED | 1 << UBI_WL_SCRUB |
+			   1 << UBI_WL_MOVING | 1 << UBI_WL_ERASE |
+			   1 << UBI_WL_TORTURE,
+	/* Cached PEBs go back to free when the caches are drained */
+	[UBI_WL_PROT]    = 1 << UBI_WL_USED | 1 << UBI_WL_SCRUB |
+			   1 << UBI_WL_ERASE | 1 << UBI_WL_TORTURE |
+			   1 << UBI_WL_FREE,
+	[UBI_WL_SCRUB]   = 1 << UBI_WL_USED | 1 << UBI_WL_MOVING |
+			   1 << UBI_WL_ERASE | 1 << UBI_WL_TORTURE,
+	[UBI_WL_MOVING]  = 1 << UBI_WL_USED | 1 << UBI_WL_SCRUB |
+			   1 << UBI_WL_PROT | 1 << UBI_WL_ERASE |
+			   1 << UBI_WL_TORTURE,
+	[UBI_WL_ERASE]   = 1 << UBI_WL_FREE | 1 << UBI_WL_ERASE |
+			   1 << UBI_WL_BAD,
+	[UBI_WL_TORTURE] = 1 << UBI_WL_FREE | 1 << UBI_WL_TORTURE |
+			   1 << UBI_WL_BAD,
+	[UBI_WL_BAD]     = 0,
+};
+#endif
+
 /**
- * wl_tree_add - add a wear-leveling entry to a WL RB-tree.
- * @e: the wear-leveling entry to add
- * @root: the root of the tree
+ * set_wl_state - change the state of a wear-leveling entry.
+ * @e: the wear-leveling entry
+ * @state: the new state
  *
- * Note, we use (erase counter, physical eraseblock number) pairs as keys in
- * the @ubi->used and @ubi->free RB-trees.
+ * The state tells which WL sub-system structure the entry is in, so it has to
+ * be changed whenever the entry is moved from one structure to another. Note,
+ * @ubi->wl_lock has to be locked.
  */
-static void wl_tree_add(struct ubi_wl_entry *e, struct rb_root *root)
+static void set_wl_state(struct ubi_wl_entry *e, int state)
 {
-	struct rb_node **p, *parent = NULL;
-
-	p = &root->rb_node;
-	while (*p) {
-		struct ubi_wl_entry *e1;
-
-		parent = *p;
-		e1 = rb_entry(parent, struct ubi_wl_entry, u.rb);
-
-		if (e->ec < e1->ec)
-			p = &(*p)->rb_left;
-		else if (e->ec > e1->ec)
-			p = &(*p)->rb_right;
-		else {
-			ubi_assert(e->pnum != e1->pnum);
-			if (e->pnum < e1->pnum)
-				p = &(*p)->rb_left;
-			else
-				p = &(*p)->rb_right;
-		}
-	}
+	ubi_assert(wl_state_transitions[e->state] & (1 << state));
+	e->state = state;
+}
+
+/**
+ * work_matches - check if a work belongs to a logical eraseblock.
+ * @wvol_id: volume ID of the work
+ * @wlnum: logical eraseblock number of the work
+ * @vol_id: the volume ID to check against (%UBI_ALL means any)
+ * @lnum: the logical eraseblock number to check against (%UBI_ALL means any)
+ *
+ * Returns non-zero if the work has to be done for @vol_id:@lnum to be flushed.
+ * Erasures which cannot be attributed to a logical eraseblock (%UBI_ALL) match
+ * every flush, because the physical eraseblock may contain an older copy of
+ * @vol_id:@lnum which would come back after an unclean reboot if it was not
+ * erased. Works which never erase data (%WL_NO_LEB) only match when everything
+ * is flushed.
+ */
+static int work_matches(int wvol_id, int wlnum, int vol_id, int lnum)
+{
+	if (vol_id == UBI_ALL || wvol_id == UBI_ALL)
+		return 1;
+	if (wvol_id != vol_id)
+		return 0;
+	return lnum == UBI_ALL || wlnum == lnum;
+}
 
-	rb_link_node(&e->u.rb, parent, p);
-	rb_insert_color(&e->u.rb, root);
+/**
+ * find_work - find the next pending work to do.
+ * @ubi: UBI device description object
+ * @vol_id: the volume ID the work has to belong to (%UBI_ALL means any)
+ * @lnum: the logical eraseblock the work has to belong to (%UBI_ALL means any)
+ *
+ * Torture works are only picked if there are no other matching works. Returns
+ * the work or %NULL if there are no matching pending works. Note,
+ * @ubi->wl_lock has to be locked.
+ */
+static struct ubi_work *find_work(struct ubi_device *ubi, int vol_id, int lnum)
+{
+	struct ubi_work *wrk;
+
+	list_for_each_entry(wrk, &ubi->works, list)
+		if (work_matches(wrk->vol_id, wrk->lnum, vol_id, lnum))
+			return wrk;
+	list_for_each_entry(wrk, &ubi->torture_works, list)
+		if (work_matches(wrk->vol_id, wrk->lnum, vol_id, lnum))
+			return wrk;
+	return NULL;
 }
 
 /**
  * do_work - do one pending work.
  * @ubi: UBI device description object
+ * @vol_id: the volume ID the work has to belong to (%UBI_ALL means any)
+ * @lnum: the logical eraseblock the work has to belong to (%UBI_ALL means any)
  *
  * 使用ubi_device中的工作链表成员进行一次"工作"
  * 工作的类型擦除(erase_worker)，也可能是(wear_leveling_worker)
@@ -235,10 +361,11 @@ static void wl_tree_add(struct ubi_wl_entry *e, struct rb_root *root)
  * This function returns zero in case of success and a negative error code in
  * case of failure.
  */
-static int do_work(struct ubi_device *ubi)
+static int do_work(struct ubi_device *ubi, int vol_id, int lnum)
 {
 	int err;
 	struct ubi_work *wrk;
+	struct ubi_work_inflight inflight;
 
 	cond_resched();
 
@@ -250,16 +377,18 @@ static int do_work(struct ubi_device *ubi)
 	 */
 	down_read(&ubi->work_sem);
 	spin_lock(&ubi->wl_lock);
-	if (list_empty(&ubi->works)) {
+	wrk = find_work(ubi, vol_id, lnum);
+	if (!wrk) {
 		spin_unlock(&ubi->wl_lock);
 		up_read(&ubi->work_sem);
 		return 0;
 	}
-
-	wrk = list_entry(ubi->works.next, struct ubi_work, list);
 	list_del(&wrk->list);
 	ubi->works_count -= 1;
 	ubi_assert(ubi->works_count >= 0);
+	inflight.vol_id = wrk->vol_id;
+	inflight.lnum = wrk->lnum;
+	list_add(&inflight.list, &ubi->works_inflight);
 	spin_unlock(&ubi->wl_lock);
 
 	/*
@@ -270,6 +399,11 @@ static int do_work(struct ubi_device *ubi)
 	err = wrk->func(ubi, wrk, 0);
 	if (err)
 		ubi_err("work failed with error code %d", err);
+
+	spin_lock(&ubi->wl_lock);
+	list_del(&inflight.list);
+	spin_unlock(&ubi->wl_lock);
+	wake_up_all(&ubi->works_wait);
 	up_read(&ubi->work_sem);
 
 	return err;
@@ -290,11 +424,11 @@ static int produce_free_peb(struct ubi_device *ubi)
 	int err;
 
 	spin_lock(&ubi->wl_lock);
-	while (!ubi->free.rb_node) {
+	while (wl_tree_empty(&ubi->free)) {
 		spin_unlock(&ubi->wl_lock);
 
 		dbg_wl("do one work synchronously");
-		err = do_work(ubi);
+		err = do_work(ubi, UBI_ALL, UBI_ALL);
 		if (err)
 			return err;
 
@@ -306,101 +440,152 @@ static int produce_free_peb(struct ubi_device *ubi)
 }
 
 /**
- * in_wl_tree - check if wear-leveling entry is present in a WL RB-tree.
- * @e: the wear-leveling entry to check
- * @root: the root of the tree
+ * prot_queue_add - add physical eraseblock to the protection queue.
+ * @ubi: UBI device description object
+ * @e: the physical eraseblock to add
  *
- * This function returns non-zero if @e is in the @root RB-tree and zero if it
- * is not.
+ * This function adds @e to the tail of the protection queue @ubi->pq, where
+ * @e will stay for @ubi->pq_len erase operations and will be temporarily
+ * protected from the wear-leveling worker. If @e is a free physical
+ * eraseblock which is being handed out, its life time measurement starts.
+ * Note, @wl->lock has to be locked.
+ */
+static void prot_queue_add(struct ubi_device *ubi, struct ubi_wl_entry *e)
+{
+	/* pq_head对应的链表中的PEB受保护的时间最长		*/
+	/* pq_head+1对应的链表中的PEB受保护的时间次长	*/
+	/* . . . 										*/
+	/* pq_tail对应的链表中的PEB受保护的时间最短		*/
+	int pq_tail;
+
+	pq_tail = (ubi->pq_head + ubi->pq_len - 1) & (UBI_PROT_QUEUE_MAX - 1);
+	ubi_assert(pq_tail >= 0 && pq_tail < UBI_PROT_QUEUE_MAX);
+	if (e->state == UBI_WL_FREE) {
+		e->stamp = ubi->pq_erases & WL_STAMP_MASK;
+		e->stamp_src = WL_STAMP_GET;
+	}
+	wl_list_add_tail(ubi->lookuptbl, e, pq_list(ubi, pq_tail));
+	set_wl_state(e, UBI_WL_PROT);
+	dbg_wl("added PEB %d EC %d to the protection queue",
+	       ubi_wl_pnum(ubi, e), e->ec);
+}
+
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+/**
+ * peb_cache_get - get a physical eraseblock from the per-CPU cache.
+ * @ubi: UBI device description object
+ *
+ * Each CPU has a small cache of free physical eraseblocks for data of unknown
+ * type. When the cache of the current CPU is empty, it is re-filled with up
+ * to %UBI_PEB_CACHE_SIZE physical eraseblocks under @ubi->wl_lock, picked the
+ * same way as 'ubi_wl_get_peb()' picks them for %UBI_UNKNOWN data. The whole
+ * batch is put to the protection queue right away, so handing out a cached
+ * physical eraseblock does not need @ubi->wl_lock at all.
+ *
+ * While a physical eraseblock sits in the cache, its bit in @ubi->peb_cached
+ * is set, and 'serve_prot_queue()' keeps it in the protection queue instead
+ * of moving it to the @ubi->used tree, because there is no data to move yet.
+ * Note, the life time of a cached physical eraseblock is measured from the
+ * moment the cache was re-filled.
+ *
+ * This function returns a physical eraseblock number in case of success and
+ * %-ENOSPC if the cache is empty and cannot be re-filled.
  */
-static int in_wl_tree(struct ubi_wl_entry *e, struct rb_root *root)
+static int peb_cache_get(struct ubi_device *ubi)
 {
-	struct rb_node *p;
+	int pnum = -ENOSPC;
+	struct ubi_peb_cache *pc;
 
-	p = root->rb_node;
-	while (p) {
-		struct ubi_wl_entry *e1;
+	pc = per_cpu_ptr(ubi->peb_cache, get_cpu());
+	spin_lock(&pc->lock);
+	if (pc->count == 0) {
+		spin_lock(&ubi->wl_lock);
+		while (pc->count < UBI_PEB_CACHE_SIZE &&
+		       !wl_tree_empty(&ubi->free)) {
+			struct ubi_wl_entry *e;
 
-		e1 = rb_entry(p, struct ubi_wl_entry, u.rb);
+			e = find_mean_wl_entry(&ubi->free,
+					       WL_FREE_MAX_DIFF(ubi));
 
-		if (e->pnum == e1->pnum) {
-			ubi_assert(e == e1);
-			return 1;
+			wl_tree_del(e, &ubi->free);
+			prot_queue_add(ubi, e);
+			set_bit(ubi_wl_pnum(ubi, e), ubi->peb_cached);
+			pc->pnums[pc->count++] = ubi_wl_pnum(ubi, e);
 		}
+		spin_unlock(&ubi->wl_lock);
+	}
 
-		if (e->ec < e1->ec)
-			p = p->rb_left;
-		else if (e->ec > e1->ec)
-			p = p->rb_right;
-		else {
-			ubi_assert(e->pnum != e1->pnum);
-			if (e->pnum < e1->pnum)
-				p = p->rb_left;
-			else
-				p = p->rb_right;
-		}
+	if (pc->count) {
+		pnum = pc->pnums[--pc->count];
+		clear_bit(pnum, ubi->peb_cached);
 	}
+	spin_unlock(&pc->lock);
+	put_cpu();
 
-	return 0;
+	dbg_wl("PEB %d from the per-CPU cache", pnum);
+	return pnum;
 }
 
 /**
- * prot_queue_add - add physical eraseblock to the protection queue.
+ * peb_cache_steal - get a physical eraseblock from any per-CPU cache.
  * @ubi: UBI device description object
- * @e: the physical eraseblock to add
  *
- * This function adds @e to the tail of the protection queue @ubi->pq, where
- * @e will stay for %UBI_PROT_QUEUE_LEN erase operations and will be
- * temporarily protected from the wear-leveling worker. Note, @wl->lock has to
- * be locked.
+ * This function is called when there are no free physical eraseblocks left
+ * and no pending works which could produce them. Some physical eraseblocks may
+ * still sit in per-CPU caches, take one of them. Returns a physical eraseblock
+ * number in case of success and %-ENOSPC if all caches are empty.
  */
-static void prot_queue_add(struct ubi_device *ubi, struct ubi_wl_entry *e)
+static int peb_cache_steal(struct ubi_device *ubi)
 {
-	/* pq_head对应的链表中的PEB受保护的时间最长		*/
-	/* pq_head+1对应的链表中的PEB受保护的时间次长	*/
-	/* . . . 										*/
-	/* pq_tail对应的链表中的PEB受保护的时间最短		*/
-	int pq_tail = ubi->pq_head - 1;
+	int cpu, pnum = -ENOSPC;
 
-	if (pq_tail < 0)
-		pq_tail = UBI_PROT_QUEUE_LEN - 1;
-	ubi_assert(pq_tail >= 0 && pq_tail < UBI_PROT_QUEUE_LEN);
-	list_add_tail(&e->u.list, &ubi->pq[pq_tail]);
-	dbg_wl("added PEB %d EC %d to the protection queue", e->pnum, e->ec);
+	for_each_possible_cpu(cpu) {
+		struct ubi_peb_cache *pc = per_cpu_ptr(ubi->peb_cache, cpu);
+
+		spin_lock(&pc->lock);
+		if (pc->count) {
+			pnum = pc->pnums[--pc->count];
+			clear_bit(pnum, ubi->peb_cached);
+		}
+		spin_unlock(&pc->lock);
+		if (pnum >= 0)
+			break;
+	}
+
+	return pnum;
 }
 
 /**
- * find_wl_entry - find wear-leveling entry closest to certain erase counter.
- * @root: the RB-tree where to look for
- * @max: highest possible erase counter
+ * ubi_wl_drain_peb_caches - return cached physical eraseblocks.
+ * @ubi: UBI device description object
  *
- * This function looks for a wear leveling entry with erase counter closest to
- * @max and less then @max.
+ * This function puts all physical eraseblocks of the per-CPU caches back to
+ * the @ubi->free tree. It is used before the free physical eraseblocks are
+ * saved in the fastscan metadata, which only looks at the @ubi->free tree.
  */
-static struct ubi_wl_entry *find_wl_entry(struct rb_root *root, int max)
+void ubi_wl_drain_peb_caches(struct ubi_device *ubi)
 {
-	struct rb_node *p;
-	struct ubi_wl_entry *e;
-	/* 首先找到擦除次数最少的PEB */
-	e = rb_entry(rb_first(root), struct ubi_wl_entry, u.rb);
-	/* 要找的PEB必须在 PEBwlEC(PEB-with-lowest-EC) ~ PEBwlEC + max 之间*/
-	max += e->ec;
-
-	p = root->rb_node;
-	while (p) {
-		struct ubi_wl_entry *e1;
-
-		e1 = rb_entry(p, struct ubi_wl_entry, u.rb);
-		if (e1->ec >= max)
-			p = p->rb_left;
-		else {
-			p = p->rb_right;
-			e = e1;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ubi_peb_cache *pc = per_cpu_ptr(ubi->peb_cache, cpu);
+
+		spin_lock(&pc->lock);
+		spin_lock(&ubi->wl_lock);
+		while (pc->count) {
+			struct ubi_wl_entry *e;
+
+			e = &ubi->lookuptbl[pc->pnums[--pc->count]];
+			clear_bit(ubi_wl_pnum(ubi, e), ubi->peb_cached);
+			wl_list_del(ubi->lookuptbl, e);
+			set_wl_state(e, UBI_WL_FREE);
+			wl_tree_add(e, &ubi->free);
 		}
+		spin_unlock(&ubi->wl_lock);
+		spin_unlock(&pc->lock);
 	}
-
-	return e;
 }
+#endif
 
 /**
  * ubi_wl_get_peb - get a physical eraseblock.
@@ -412,24 +597,41 @@ static struct ubi_wl_entry *find_wl_entry(struct rb_root *root, int max)
  */
 int ubi_wl_get_peb(struct ubi_device *ubi, int dtype)
 {
-	int err, medium_ec;
-	struct ubi_wl_entry *e, *first, *last;
+	int err;
+	struct ubi_wl_entry *e;
+	ubi_lat_t start;
 
 	ubi_assert(dtype == UBI_LONGTERM || dtype == UBI_SHORTTERM ||
 		   dtype == UBI_UNKNOWN);
 
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+	if (dtype == UBI_UNKNOWN) {
+		err = peb_cache_get(ubi);
+		if (err >= 0)
+			return err;
+	}
+#endif
+
 retry:
 	spin_lock(&ubi->wl_lock);
-	if (!ubi->free.rb_node) {
+	if (wl_tree_empty(&ubi->free)) {
 		if (ubi->works_count == 0) {
 			ubi_assert(list_empty(&ubi->works));
-			ubi_err("no free eraseblocks");
+			ubi_assert(list_empty(&ubi->torture_works));
 			spin_unlock(&ubi->wl_lock);
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+			err = peb_cache_steal(ubi);
+			if (err >= 0)
+				return err;
+#endif
+			ubi_err("no free eraseblocks");
 			return -ENOSPC;
 		}
 		spin_unlock(&ubi->wl_lock);
 
+		start = ubi_lat_begin();
 		err = produce_free_peb(ubi);
+		ubi_lat_end(ubi, UBI_LAT_GET_PEB, start);
 		if (err < 0)
 			return err;
 		goto retry;
@@ -444,36 +646,17 @@ retry:
 		 * bounded by the the lowest erase counter plus
 		 * %WL_FREE_MAX_DIFF.
 		 */
-		e = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF(ubi));
 		break;
 	case UBI_UNKNOWN:
-		/*
-		 * 对于不知类型的数据，找擦除次数在中间的PEB。
-		 * 但不能找大于等于阈值上限的PEB
-		 * For unknown data we pick a physical eraseblock with medium
-		 * erase counter. But we by no means can pick a physical
-		 * eraseblock with erase counter greater or equivalent than the
-		 * lowest erase counter plus %WL_FREE_MAX_DIFF.
-		 */
-		first = rb_entry(rb_first(&ubi->free), struct ubi_wl_entry,
-					u.rb);
-		last = rb_entry(rb_last(&ubi->free), struct ubi_wl_entry, u.rb);
-
-		if (last->ec - first->ec < WL_FREE_MAX_DIFF)
-			/* 红黑树的第一个节点正好是EC在中间的，所以直接取第一个节点 */
-			e = rb_entry(ubi->free.rb_node,
-					struct ubi_wl_entry, u.rb);
-		else {
-			medium_ec = (first->ec + WL_FREE_MAX_DIFF)/2;
-			e = find_wl_entry(&ubi->free, medium_ec);
-		}
+		e = find_mean_wl_entry(&ubi->free, WL_FREE_MAX_DIFF(ubi));
 		break;
 	case UBI_SHORTTERM:
 		/*
 		 * For short term data we pick a physical eraseblock with the
 		 * lowest erase counter as we expect it will be erased soon.
 		 */
-		e = rb_entry(rb_first(&ubi->free), struct ubi_wl_entry, u.rb);
+		e = wl_tree_first(&ubi->free);
 		break;
 	default:
 		BUG();
@@ -485,39 +668,124 @@ retry:
 	 * Move the physical eraseblock to the protection queue where it will
 	 * be protected from being moved for some time.
 	 */
-	rb_erase(&e->u.rb, &ubi->free);
-	dbg_wl("PEB %d EC %d", e->pnum, e->ec);
+	wl_tree_del(e, &ubi->free);
+	dbg_wl("PEB %d EC %d", ubi_wl_pnum(ubi, e), e->ec);
 	prot_queue_add(ubi, e);
 	spin_unlock(&ubi->wl_lock);
-	return e->pnum;
+	return ubi_wl_pnum(ubi, e);
 }
 
 /**
- * 该函数只是将PEB从保护队列数组的一个元素对应的一条链表中删除
- * 解除保护的对象是PEB
- * prot_queue_del - remove a physical eraseblock from the protection queue.
+ * wl_entry_del - remove a wear-leveling entry from its WL structure.
  * @ubi: UBI device description object
- * @pnum: the physical eraseblock to remove
+ * @e: the wear-leveling entry to remove
  *
- * This function deletes PEB @pnum from the protection queue and returns zero
- * in case of success and %-ENODEV if the PEB was not found.
+ * This function removes used, scrub or protected physical eraseblock @e from
+ * the @ubi->used tree, @ubi->scrub tree or the protection queue, depending on
+ * its state. Returns zero in case of success and %-ENODEV if @e is in none of
+ * them. Note, @ubi->wl_lock has to be locked.
  */
-static int prot_queue_del(struct ubi_device *ubi, int pnum)
+static int wl_entry_del(struct ubi_device *ubi, struct ubi_wl_entry *e)
 {
-	struct ubi_wl_entry *e;
-
-	e = ubi->lookuptbl[pnum];
-	if (!e)
-		return -ENODEV;
-
-	if (paranoid_check_in_pq(ubi, e))
+	switch (e->state) {
+	case UBI_WL_USED:
+		paranoid_check_in_wl_tree(e, &ubi->used);
+		wl_tree_del(e, &ubi->used);
+		break;
+	case UBI_WL_SCRUB:
+		paranoid_check_in_wl_tree(e, &ubi->scrub);
+		wl_tree_del(e, &ubi->scrub);
+		break;
+	case UBI_WL_PROT:
+		/* 将PEB从保护队列数组的一个元素对应的一条链表中删除 */
+		if (paranoid_check_in_pq(ubi, e))
+			return -ENODEV;
+		wl_list_del(ubi->lookuptbl, e);
+		dbg_wl("deleted PEB %d from the protection queue",
+		       ubi_wl_pnum(ubi, e));
+		break;
+	default:
 		return -ENODEV;
+	}
 
-	list_del(&e->u.list);
-	dbg_wl("deleted PEB %d from the protection queue", e->pnum);
 	return 0;
 }
 
+/**
+ * ec_hist_add - account a physical eraseblock in the erase counter statistics.
+ * @ubi: UBI device description object
+ * @ec: erase counter of the physical eraseblock
+ * @n: %1 to add the physical eraseblock, %-1 to remove it
+ *
+ * The erase counter histogram has %UBI_EC_HIST_BUCKETS buckets of the same
+ * width. When an erase counter does not fit the histogram anymore, the width
+ * is doubled and the neighbouring buckets are merged. This function also
+ * maintains the sum and the count of the erase counters, the mean erase
+ * counter and the count of physical eraseblocks with the lowest erase counter
+ * (see 'ubi_wl_min_ec()'). Note, @ubi->wl_lock has to be locked.
+ */
+static void ec_hist_add(struct ubi_device *ubi, int ec, int n)
+{
+	int i;
+
+	while (ec / ubi->ec_hist_width >= UBI_EC_HIST_BUCKETS) {
+		for (i = 0; i < UBI_EC_HIST_BUCKETS / 2; i++)
+			ubi->ec_hist[i] = ubi->ec_hist[2 * i] +
+					  ubi->ec_hist[2 * i + 1];
+		for (; i < UBI_EC_HIST_BUCKETS; i++)
+			ubi->ec_hist[i] = 0;
+		ubi->ec_hist_width <<= 1;
+	}
+
+	ubi->ec_hist[ec / ubi->ec_hist_width] += n;
+	if (ubi->min_ec_count) {
+		if (n > 0 && ec < ubi->min_ec) {
+			ubi->min_ec = ec;
+			ubi->min_ec_count = 1;
+		} else if (ec == ubi->min_ec)
+			ubi->min_ec_count += n;
+	}
+	ubi->ec_sum += (long long)n * ec;
+	ubi->ec_count += n;
+	if (ubi->ec_count)
+		ubi->mean_ec = div_u64(ubi->ec_sum, ubi->ec_count);
+}
+
+/**
+ * ubi_wl_min_ec - find out the lowest erase counter.
+ * @ubi: UBI device description object
+ *
+ * The lowest erase counter is maintained by 'ec_hist_add()' together with the
+ * count of physical eraseblocks which have it. Erase counters only grow, so
+ * the lowest one has to be looked up again only when all those physical
+ * eraseblocks have been erased or went bad, which happens once per erase
+ * cycle of the whole device. In this case this function walks all
+ * wear-leveling entries under @ubi->wl_lock.
+ */
+int ubi_wl_min_ec(struct ubi_device *ubi)
+{
+	int pnum, min_ec;
+
+	spin_lock(&ubi->wl_lock);
+	if (!ubi->min_ec_count) {
+		for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+			struct ubi_wl_entry *e = &ubi->lookuptbl[pnum];
+
+			if (e->state == UBI_WL_NONE || e->state == UBI_WL_BAD)
+				continue;
+			if (!ubi->min_ec_count || e->ec < ubi->min_ec) {
+				ubi->min_ec = e->ec;
+				ubi->min_ec_count = 1;
+			} else if (e->ec == ubi->min_ec)
+				ubi->min_ec_count += 1;
+		}
+	}
+	min_ec = ubi->min_ec_count ? ubi->min_ec : 0;
+	spin_unlock(&ubi->wl_lock);
+
+	return min_ec;
+}
+
 /**
  * sync_erase - synchronously erase a physical eraseblock.
  * @ubi: UBI device description object
@@ -530,13 +798,13 @@ static int prot_queue_del(struct ubi_device *ubi, int pnum)
 static int sync_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
 		      int torture)
 {
-	int err;
+	int err, pnum = ubi_wl_pnum(ubi, e);
 	struct ubi_ec_hdr *ec_hdr;
 	unsigned long long ec = e->ec;
 
-	dbg_wl("erase PEB %d, old EC %llu", e->pnum, ec);
+	dbg_wl("erase PEB %d, old EC %llu", pnum, ec);
 
-	err = paranoid_check_ec(ubi, e->pnum, e->ec);
+	err = paranoid_check_ec(ubi, pnum, e->ec);
 	if (err > 0)
 		return -EINVAL;
 
@@ -544,9 +812,21 @@ static int sync_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
 	if (!ec_hdr)
 		return -ENOMEM;
 
-	err = ubi_io_sync_erase(ubi, e->pnum, torture);
-	if (err < 0)
+	if (torture) {
+		spin_lock(&ubi->wl_lock);
+		ubi->torture_count += 1;
+		spin_unlock(&ubi->wl_lock);
+	}
+
+	err = ubi_io_sync_erase(ubi, pnum, torture);
+	if (err < 0) {
+		if (torture) {
+			spin_lock(&ubi->wl_lock);
+			ubi->torture_failures += 1;
+			spin_unlock(&ubi->wl_lock);
+		}
 		goto out_free;
+	}
 
 	ec += err;
 	if (ec > UBI_MAX_ERASECOUNTER) {
@@ -555,21 +835,26 @@ static int sync_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
 		 * erase counters internally.
 		 */
 		ubi_err("erase counter overflow at PEB %d, EC %llu",
-			e->pnum, ec);
+			pnum, ec);
 		err = -EINVAL;
 		goto out_free;
 	}
 
-	dbg_wl("erased PEB %d, new EC %llu", e->pnum, ec);
+	dbg_wl("erased PEB %d, new EC %llu", pnum, ec);
 
 	ec_hdr->ec = cpu_to_be64(ec);
 
-	err = ubi_io_write_ec_hdr(ubi, e->pnum, ec_hdr);
+	err = ubi_io_write_ec_hdr(ubi, pnum, ec_hdr);
 	if (err)
 		goto out_free;
 
-	e->ec = ec;
+	/* Erasure re-freshes the cells, so start counting reads from scratch */
+	atomic_set(&ubi->read_counts[pnum], 0);
+
 	spin_lock(&ubi->wl_lock);
+	ec_hist_add(ubi, e->ec, -1);
+	ec_hist_add(ubi, ec, 1);
+	e->ec = ec;
 	if (e->ec > ubi->max_ec)
 		ubi->max_ec = e->ec;
 	spin_unlock(&ubi->wl_lock);
@@ -590,7 +875,8 @@ out_free:
  */
 static void serve_prot_queue(struct ubi_device *ubi)
 {
-	struct ubi_wl_entry *e, *tmp;
+	struct ubi_wl_entry *e;
+	unsigned int head, i, next;
 	int count;
 
 	/*
@@ -600,12 +886,36 @@ static void serve_prot_queue(struct ubi_device *ubi)
 repeat:
 	count = 0;
 	spin_lock(&ubi->wl_lock);
-	list_for_each_entry_safe(e, tmp, &ubi->pq[ubi->pq_head], u.list) {
+	head = pq_list(ubi, ubi->pq_head);
+	for (i = ubi->lookuptbl[head].right; i != head; i = next) {
+		e = &ubi->lookuptbl[i];
+		next = e->right;
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+		if (test_bit(i, ubi->peb_cached)) {
+			/*
+			 * Still in a per-CPU cache, i.e., not written yet.
+			 * Re-queue it to the tail. If the queue is as long as
+			 * it can be, the head becomes the tail, so just leave
+			 * it where it is.
+			 */
+			int tail = (ubi->pq_head + ubi->pq_len) &
+				   (UBI_PROT_QUEUE_MAX - 1);
+
+			if (tail != ubi->pq_head) {
+				wl_list_del(ubi->lookuptbl, e);
+				wl_list_add_tail(ubi->lookuptbl, e,
+						 pq_list(ubi, tail));
+			}
+			continue;
+		}
+#endif
 		dbg_wl("PEB %d EC %d protection over, move to used tree",
-			e->pnum, e->ec);
+			ubi_wl_pnum(ubi, e), e->ec);
 
-		list_del(&e->u.list);
+		wl_list_del(ubi->lookuptbl, e);
 		wl_tree_add(e, &ubi->used);
+		set_wl_state(e, UBI_WL_USED);
+		ubi->pq_evictions += 1;
 		/* 如果删除了33个PEB，耗时过长，请求调度，之后再次被调度时再删 */
 		if (count++ > 32) {
 			/*
@@ -619,29 +929,114 @@ repeat:
 	}
 
 	ubi->pq_head += 1;
-	if (ubi->pq_head == UBI_PROT_QUEUE_LEN)
+	if (ubi->pq_head == UBI_PROT_QUEUE_MAX)
 		ubi->pq_head = 0;
-	ubi_assert(ubi->pq_head >= 0 && ubi->pq_head < UBI_PROT_QUEUE_LEN);
+	ubi_assert(ubi->pq_head >= 0 && ubi->pq_head < UBI_PROT_QUEUE_MAX);
+	ubi->pq_erases += 1;
+	ubi->pq_sweep = wl_stamp_sweep(ubi->lookuptbl, ubi->pq_sweep,
+				       ubi->peb_count, ubi->pq_erases);
 	spin_unlock(&ubi->wl_lock);
 }
 
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+
+/*
+ * The shared background thread pool. Instead of having one background thread
+ * per UBI device, a small pool of threads serves all UBI devices. UBI devices
+ * with pending works are queued to @bgt_pool_queue, and pool threads take
+ * them from the head of the queue, do one work and put them back to the tail
+ * of the queue if they have more works. So devices are served in round-robin
+ * manner and a device with a long backlog cannot starve the others.
+ *
+ * UBI devices which sit on the same flash controller or bus may be put to the
+ * same group via the "bgt_group" sysfs file. At most
+ * %UBI_BGT_POOL_GROUP_LIMIT works of one group are done at a time, so
+ * background works do not fight for the bus. By default, every device is in
+ * its own group.
+ *
+ * A device is served by at most one pool thread at a time. While serving,
+ * @ubi->bgt_thread points to the serving thread, so I/O of the background
+ * works is recognized as background I/O.
+ */
+#define UBI_BGT_POOL_THREADS CONFIG_MTD_UBI_BGT_POOL_THREADS
+#define UBI_BGT_POOL_GROUP_LIMIT CONFIG_MTD_UBI_BGT_POOL_GROUP_LIMIT
+
+/* States of an UBI device in the pool */
+#define BGT_POOL_IDLE    0
+#define BGT_POOL_QUEUED  1
+#define BGT_POOL_SERVING 2
+
+static struct task_struct *bgt_pool[UBI_BGT_POOL_THREADS];
+static LIST_HEAD(bgt_pool_queue);
+static DEFINE_SPINLOCK(bgt_pool_lock);
+static DECLARE_WAIT_QUEUE_HEAD(bgt_pool_wait);
+static DECLARE_WAIT_QUEUE_HEAD(bgt_pool_idle);
+static int bgt_group_active[UBI_MAX_DEVICES];
+
+/**
+ * bgt_pool_add - queue an UBI device for the pool threads.
+ * @ubi: UBI device description object
+ *
+ * Note, @bgt_pool_lock has to be locked.
+ */
+static void bgt_pool_add(struct ubi_device *ubi)
+{
+	if (!ubi->thread_enabled || ubi->bgt_pool_state != BGT_POOL_IDLE)
+		return;
+
+	list_add_tail(&ubi->bgt_pool_list, &bgt_pool_queue);
+	ubi->bgt_pool_state = BGT_POOL_QUEUED;
+	wake_up(&bgt_pool_wait);
+}
+#endif /* CONFIG_MTD_UBI_BGT_POOL */
+
+/**
+ * bgt_wake - wake up the background thread.
+ * @ubi: UBI device description object
+ *
+ * This function makes the background thread (or the shared background thread
+ * pool) aware of new pending works. Note, @ubi->wl_lock has to be locked.
+ */
+static void bgt_wake(struct ubi_device *ubi)
+{
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	spin_lock(&bgt_pool_lock);
+	bgt_pool_add(ubi);
+	spin_unlock(&bgt_pool_lock);
+#else
+	if (ubi->thread_enabled)
+		wake_up_process(ubi->bgt_thread);
+#endif
+}
+
 /**
  * 将一个工作成员加入到ubi_device的工作链表
- * schedule_ubi_work - schedule a work.
+ * __schedule_ubi_work - schedule a work.
  * @ubi: UBI device description object
  * @wrk: the work to schedule
  *
  * This function adds a work defined by @wrk to the tail of the pending works
- * list.
+ * list. Note, @ubi->wl_lock has to be locked.
  */
-static void schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
+static void __schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
 {
-	spin_lock(&ubi->wl_lock);
 	list_add_tail(&wrk->list, &ubi->works);
 	ubi_assert(ubi->works_count >= 0);
 	ubi->works_count += 1;
-	if (ubi->thread_enabled)
-		wake_up_process(ubi->bgt_thread);
+	bgt_wake(ubi);
+}
+
+/**
+ * schedule_ubi_work - schedule a work.
+ * @ubi: UBI device description object
+ * @wrk: the work to schedule
+ *
+ * This is the same as '__schedule_ubi_work()' but it locks @ubi->wl_lock.
+ */
+static void schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
+{
+	spin_lock(&ubi->wl_lock);
+	__schedule_ubi_work(ubi, wrk);
 	spin_unlock(&ubi->wl_lock);
 }
 
@@ -660,18 +1055,26 @@ int fastscan_is_erase_work(struct ubi_work *wrk)
  * schedule_erase - schedule an erase work.
  * @ubi: UBI device description object
  * @e: the WL entry of the physical eraseblock to erase
+ * @vol_id: the volume ID the data in @e belonged to (%UBI_ALL if unknown)
+ * @lnum: the logical eraseblock the data in @e belonged to (%UBI_ALL if
+ *        unknown)
  * @torture: if the physical eraseblock has to be tortured
  *
- * This function returns zero in case of success and a %-ENOMEM in case of
- * failure.
+ * Torturing takes long, so physical eraseblocks which have to be tortured are
+ * put to the separate @ubi->torture_works queue, which is served only when
+ * there are no other pending works. This way normal erasures and
+ * wear-leveling are not blocked by the torture test. The physical eraseblock
+ * is quarantined in the meanwhile, i.e., it is not in any WL sub-system
+ * structure and cannot be used. This function returns zero in case of success
+ * and a %-ENOMEM in case of failure.
  */
 static int schedule_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
-			  int torture)
+			  int vol_id, int lnum, int torture)
 {
 	struct ubi_work *wl_wrk;
 
-	dbg_wl("schedule erasure of PEB %d, EC %d, torture %d",
-	       e->pnum, e->ec, torture);
+	dbg_wl("schedule erasure of PEB %d, EC %d, LEB %d:%d, torture %d",
+	       ubi_wl_pnum(ubi, e), e->ec, vol_id, lnum, torture);
 
 	wl_wrk = kmalloc(sizeof(struct ubi_work), GFP_NOFS);
 	if (!wl_wrk)
@@ -679,12 +1082,57 @@ static int schedule_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
 
 	wl_wrk->func = &erase_worker;
 	wl_wrk->e = e;
+	wl_wrk->vol_id = vol_id;
+	wl_wrk->lnum = lnum;
 	wl_wrk->torture = torture;
 
-	schedule_ubi_work(ubi, wl_wrk);
+	spin_lock(&ubi->wl_lock);
+	if (torture) {
+		set_wl_state(e, UBI_WL_TORTURE);
+		list_add_tail(&wl_wrk->list, &ubi->torture_works);
+		ubi->works_count += 1;
+		bgt_wake(ubi);
+	} else {
+		set_wl_state(e, UBI_WL_ERASE);
+		__schedule_ubi_work(ubi, wl_wrk);
+	}
+	spin_unlock(&ubi->wl_lock);
 	return 0;
 }
 
+/**
+ * leb_is_hot - check if a physical eraseblock contains recently written data.
+ * @ubi: UBI device description object
+ * @vid_hdr: VID header of the physical eraseblock
+ *
+ * See 'data_is_hot()' in wl-policy.h for how the data age is judged.
+ *
+ * This function returns non-zero if the data is hot and zero if it is cold.
+ */
+static int leb_is_hot(struct ubi_device *ubi,
+		      const struct ubi_vid_hdr *vid_hdr)
+{
+	return data_is_hot(ubi_eba_cur_sqnum(ubi), be64_to_cpu(vid_hdr->sqnum),
+			   vid_hdr->copy_flag, ubi->good_peb_count);
+}
+
+/**
+ * move_done - finish moving a logical eraseblock.
+ * @ubi: UBI device description object
+ *
+ * The wear-leveling worker calls this function when it has scheduled the
+ * physical eraseblocks involved in the movement for erasure, if needed.
+ * From this point 'ubi_wl_flush()' may find these erasures in the works queue
+ * and does not have to wait for the movement anymore.
+ */
+static void move_done(struct ubi_device *ubi)
+{
+	spin_lock(&ubi->wl_lock);
+	ubi->move_vol_id = ubi->move_lnum = WL_NO_LEB;
+	spin_unlock(&ubi->wl_lock);
+	mutex_unlock(&ubi->move_mutex);
+}
+
 /**
  * wear_leveling_worker - wear-leveling worker function.
  * @ubi: UBI device description object
@@ -692,25 +1140,28 @@ static int schedule_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
  * @cancel: non-zero if the worker has to free memory and exit
  *
  * This function copies a more worn out physical eraseblock to a less worn out
- * one. Returns zero in case of success and a negative error code in case of
- * failure.
+ * one. The target physical eraseblock is picked depending on how old the data
+ * is: cold data is moved to a highly worn-out physical eraseblock, while hot
+ * data (which may only be moved because of scrubbing) goes to a physical
+ * eraseblock with medium erase counter. Hot data is not moved for
+ * wear-leveling purposes at all, because it is likely to be re-written soon
+ * anyway - it is put back to the protection queue instead. Returns zero in
+ * case of success and a negative error code in case of failure.
  */
 static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 				int cancel)
 {
-	int err, scrubbing = 0, torture = 0;
-	struct ubi_wl_entry *e1, *e2;
+	int err, scrubbing = 0, torture = 0, hot, copied;
+	int vol_id = UBI_ALL, lnum = UBI_ALL;
+	struct ubi_wl_entry *e1, *e2 = NULL;
 	struct ubi_vid_hdr *vid_hdr;
 
 	kfree(wrk);
 	if (cancel)
 		return 0;
 
-	vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
-	if (!vid_hdr)
-		return -ENOMEM;
-
 	mutex_lock(&ubi->move_mutex);
+	vid_hdr = ubi->move_vid_hdr;
 	spin_lock(&ubi->wl_lock);
 	ubi_assert(!ubi->move_from && !ubi->move_to);
 	ubi_assert(!ubi->move_to_put);
@@ -719,8 +1170,8 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 	 * 或者所有的块都放在了保护队列中，而我们约定保护队列中的PEB
 	 * 不能搬移，所以也放弃
 	 */
-	if (!ubi->free.rb_node ||
-	    (!ubi->used.rb_node && !ubi->scrub.rb_node)) {
+	if (wl_tree_empty(&ubi->free) ||
+	    (wl_tree_empty(&ubi->used) && wl_tree_empty(&ubi->scrub))) {
 		/*
 		 * No free physical eraseblocks? Well, they must be waiting in
 		 * the queue to be erased. Cancel movement - it will be
@@ -732,56 +1183,55 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		 * triggered again.
 		 */
 		dbg_wl("cancel WL, a list is empty: free %d, used %d",
-		       !ubi->free.rb_node, !ubi->used.rb_node);
+		       wl_tree_empty(&ubi->free), wl_tree_empty(&ubi->used));
 		goto out_cancel;
 	}
 
-	if (!ubi->scrub.rb_node) {
+	if (wl_tree_empty(&ubi->scrub)) {
 		/*
 		 * Now pick the least worn-out used physical eraseblock and a
 		 * highly worn-out free physical eraseblock. If the erase
 		 * counters differ much enough, start wear-leveling.
 		 */
-		e1 = rb_entry(rb_first(&ubi->used), struct ubi_wl_entry, u.rb);
-		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e1 = wl_tree_first(&ubi->used);
+		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF(ubi));
 
-		if (!(e2->ec - e1->ec >= UBI_WL_THRESHOLD)) {
+		if (!(e2->ec - e1->ec >= ubi->wl_threshold)) {
 			dbg_wl("no WL needed: min used EC %d, max free EC %d",
 			       e1->ec, e2->ec);
 			goto out_cancel;
 		}
 		paranoid_check_in_wl_tree(e1, &ubi->used);
-		rb_erase(&e1->u.rb, &ubi->used);
-		dbg_wl("move PEB %d EC %d to PEB %d EC %d",
-		       e1->pnum, e1->ec, e2->pnum, e2->ec);
+		wl_tree_del(e1, &ubi->used);
+		set_wl_state(e1, UBI_WL_MOVING);
+		dbg_wl("move PEB %d EC %d", ubi_wl_pnum(ubi, e1), e1->ec);
 	} else {
 		/* Perform scrubbing */
 		scrubbing = 1;
-		e1 = rb_entry(rb_first(&ubi->scrub), struct ubi_wl_entry, u.rb);
-		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e1 = wl_tree_first(&ubi->scrub);
 		paranoid_check_in_wl_tree(e1, &ubi->scrub);
-		rb_erase(&e1->u.rb, &ubi->scrub);
-		dbg_wl("scrub PEB %d to PEB %d", e1->pnum, e2->pnum);
+		wl_tree_del(e1, &ubi->scrub);
+		set_wl_state(e1, UBI_WL_MOVING);
+		dbg_wl("scrub PEB %d", ubi_wl_pnum(ubi, e1));
 	}
 
-	paranoid_check_in_wl_tree(e2, &ubi->free);
-	rb_erase(&e2->u.rb, &ubi->free);
+	/* The target PEB is picked once we know how old the data is */
+	e2 = NULL;
 	ubi->move_from = e1;
-	ubi->move_to = e2;
 	spin_unlock(&ubi->wl_lock);
 
 	/*
-	 * Now we are going to copy physical eraseblock @e1->pnum to @e2->pnum.
+	 * Now we are going to copy physical eraseblock @e1 somewhere.
 	 * We so far do not know which logical eraseblock our physical
-	 * eraseblock (@e1) belongs to. We have to read the volume identifier
-	 * header first.
+	 * eraseblock (@e1) belongs to and how old is the data. We have to read
+	 * the volume identifier header first.
 	 *
 	 * Note, we are protected from this PEB being unmapped and erased. The
 	 * 'ubi_wl_put_peb()' would wait for moving to be finished if the PEB
 	 * which is being moved was unmapped.
 	 */
 
-	err = ubi_io_read_vid_hdr(ubi, e1->pnum, vid_hdr, 0);
+	err = ubi_io_read_vid_hdr(ubi, ubi_wl_pnum(ubi, e1), vid_hdr, 0);
 	if (err && err != UBI_IO_BITFLIPS) {
 		if (err == UBI_IO_PEB_FREE) {
 			/*
@@ -792,32 +1242,76 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 			 * Just re-schedule the work, so that next time it will
 			 * likely have the VID header in place.
 			 */
-			dbg_wl("PEB %d has no VID header", e1->pnum);
+			dbg_wl("PEB %d has no VID header",
+			       ubi_wl_pnum(ubi, e1));
 			goto out_not_moved;
 		}
 
 		ubi_err("error %d while reading VID header from PEB %d",
-			err, e1->pnum);
+			err, ubi_wl_pnum(ubi, e1));
 		if (err > 0)
 			err = -EIO;
 		goto out_error;
 	}
 
-	err = ubi_eba_copy_leb(ubi, e1->pnum, e2->pnum, vid_hdr);
-	if (err) {
-		if (err == -EAGAIN)
-			goto out_not_moved;
-		if (err < 0)
-			goto out_error;
-		if (err == 2) {
-			/* Target PEB write error, torture it */
-			torture = 1;
-			goto out_not_moved;
-		}
+	vol_id = be32_to_cpu(vid_hdr->vol_id);
+	lnum = be32_to_cpu(vid_hdr->lnum);
+	spin_lock(&ubi->wl_lock);
+	ubi->move_vol_id = vol_id;
+	ubi->move_lnum = lnum;
+	spin_unlock(&ubi->wl_lock);
 
+	hot = leb_is_hot(ubi, vid_hdr);
+	if (hot && !scrubbing) {
 		/*
-		 * 如果PEB所属的卷都没有了，进行数据搬移没有意义
-		 * 同样如果PEB被放入WL子系统，说明其上数据没有用了，可以直接擦除
+		 * The data is likely to be re-written soon, and then the
+		 * physical eraseblock will be put anyway. Moving it now would
+		 * only waste an erase cycle, so protect it for some more time.
+		 */
+		dbg_wl("PEB %d contains hot data, do not move it",
+		       ubi_wl_pnum(ubi, e1));
+		goto out_protect;
+	}
+
+	spin_lock(&ubi->wl_lock);
+	if (wl_tree_empty(&ubi->free)) {
+		spin_unlock(&ubi->wl_lock);
+		dbg_wl("no free PEBs to move PEB %d to", ubi_wl_pnum(ubi, e1));
+		goto out_not_moved;
+	}
+
+	if (hot)
+		/* Hot data goes to a PEB with medium erase counter */
+		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF(ubi) / 2);
+	else
+		/* Cold data goes to a highly worn-out PEB */
+		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF(ubi));
+	paranoid_check_in_wl_tree(e2, &ubi->free);
+	wl_tree_del(e2, &ubi->free);
+	set_wl_state(e2, UBI_WL_MOVING);
+	ubi->move_to = e2;
+	spin_unlock(&ubi->wl_lock);
+
+	dbg_wl("move %s data from PEB %d EC %d to PEB %d EC %d",
+	       hot ? "hot" : "cold", ubi_wl_pnum(ubi, e1), e1->ec,
+	       ubi_wl_pnum(ubi, e2), e2->ec);
+
+	err = ubi_eba_copy_leb(ubi, ubi_wl_pnum(ubi, e1), ubi_wl_pnum(ubi, e2),
+			       vid_hdr);
+	if (err) {
+		if (err == -EAGAIN)
+			goto out_not_moved;
+		if (err < 0)
+			goto out_error;
+		if (err == 2) {
+			/* Target PEB write error, torture it */
+			torture = 1;
+			goto out_not_moved;
+		}
+
+		/*
+		 * 如果PEB所属的卷都没有了，进行数据搬移没有意义
+		 * 同样如果PEB被放入WL子系统，说明其上数据没有用了，可以直接擦除
 		 * 不用搬移
 		 * The LEB has not been moved because the volume is being
 		 * deleted or the PEB has been put meanwhile. We should prevent
@@ -825,49 +1319,48 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		 * again, so put it to the protection queue.
 		 */
 
-		dbg_wl("canceled moving PEB %d", e1->pnum);
+		dbg_wl("canceled moving PEB %d", ubi_wl_pnum(ubi, e1));
 		ubi_assert(err == 1);
-
-		ubi_free_vid_hdr(ubi, vid_hdr);
-		vid_hdr = NULL;
-
-		spin_lock(&ubi->wl_lock);
-		prot_queue_add(ubi, e1);
-		ubi_assert(!ubi->move_to_put);
-		ubi->move_from = ubi->move_to = NULL;
-		ubi->wl_scheduled = 0;
-		spin_unlock(&ubi->wl_lock);
-
-		e1 = NULL;
-		err = schedule_erase(ubi, e2, 0);
-		if (err)
-			goto out_error;
-		mutex_unlock(&ubi->move_mutex);
-		return 0;
+		goto out_protect;
 	}
 
-	/* The PEB has been successfully moved */
-	ubi_free_vid_hdr(ubi, vid_hdr);
-	vid_hdr = NULL;
+	/*
+	 * The PEB has been successfully moved. If there was any data,
+	 * 'ubi_eba_copy_leb()' has set the copy flag and the data size in
+	 * @vid_hdr.
+	 */
+	copied = vid_hdr->copy_flag ? be32_to_cpu(vid_hdr->data_size) : 0;
 	if (scrubbing)
 		ubi_msg("scrubbed PEB %d, data moved to PEB %d",
-			e1->pnum, e2->pnum);
+			ubi_wl_pnum(ubi, e1), ubi_wl_pnum(ubi, e2));
 
 	spin_lock(&ubi->wl_lock);
+	ubi->wl_copies += 1;
+	ubi->wl_bytes_copied += copied;
+	if (scrubbing)
+		ubi->scrub_count += 1;
+	else
+		ubi->wl_moves += 1;
 	/**
 	 * move_to_put表示将目标PEB也put到WL子系统
 	 * 意思就是要将它擦除，所以如果move_to_put置位
 	 * 将目标PEB也擦除
 	 */
+	e2->stamp = ubi->pq_erases & WL_STAMP_MASK;
+	e2->stamp_src = WL_STAMP_MOVE;
 	if (!ubi->move_to_put) {
 		wl_tree_add(e2, &ubi->used);
+		set_wl_state(e2, UBI_WL_USED);
 		e2 = NULL;
+	} else {
+		/* The LEB was un-mapped or re-written while being copied */
+		ubi->wl_wasted_copies += 1;
 	}
 	ubi->move_from = ubi->move_to = NULL;
 	ubi->move_to_put = ubi->wl_scheduled = 0;
 	spin_unlock(&ubi->wl_lock);
 
-	err = schedule_erase(ubi, e1, 0);
+	err = schedule_erase(ubi, e1, vol_id, lnum, 0);
 	if (err) {
 		e1 = NULL;
 		goto out_error;
@@ -878,14 +1371,36 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		 * Well, the target PEB was put meanwhile, schedule it for
 		 * erasure.
 		 */
-		dbg_wl("PEB %d was put meanwhile, erase", e2->pnum);
-		err = schedule_erase(ubi, e2, 0);
+		dbg_wl("PEB %d was put meanwhile, erase", ubi_wl_pnum(ubi, e2));
+		err = schedule_erase(ubi, e2, vol_id, lnum, 0);
 		if (err)
 			goto out_error;
 	}
 
 	dbg_wl("done");
-	mutex_unlock(&ubi->move_mutex);
+	move_done(ubi);
+	return 0;
+
+	/*
+	 * The LEB has not been moved and should not be selected for movement
+	 * for some time, so @e1 goes to the protection queue. @e2, if it was
+	 * picked, has not been used and is scheduled for erasure.
+	 */
+out_protect:
+	spin_lock(&ubi->wl_lock);
+	prot_queue_add(ubi, e1);
+	ubi_assert(!ubi->move_to_put);
+	ubi->move_from = ubi->move_to = NULL;
+	ubi->wl_scheduled = 0;
+	spin_unlock(&ubi->wl_lock);
+
+	e1 = NULL;
+	if (e2) {
+		err = schedule_erase(ubi, e2, vol_id, lnum, 0);
+		if (err)
+			goto out_error;
+	}
+	move_done(ubi);
 	return 0;
 
 	/*
@@ -894,51 +1409,48 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 	 * have been changed, schedule it for erasure.
 	 */
 out_not_moved:
-	dbg_wl("canceled moving PEB %d", e1->pnum);
-	ubi_free_vid_hdr(ubi, vid_hdr);
-	vid_hdr = NULL;
+	dbg_wl("canceled moving PEB %d", ubi_wl_pnum(ubi, e1));
 	spin_lock(&ubi->wl_lock);
-	if (scrubbing)
+	if (scrubbing) {
 		wl_tree_add(e1, &ubi->scrub);
-	else
+		set_wl_state(e1, UBI_WL_SCRUB);
+	} else {
 		wl_tree_add(e1, &ubi->used);
+		set_wl_state(e1, UBI_WL_USED);
+	}
 	ubi_assert(!ubi->move_to_put);
 	ubi->move_from = ubi->move_to = NULL;
 	ubi->wl_scheduled = 0;
 	spin_unlock(&ubi->wl_lock);
 
 	e1 = NULL;
-	err = schedule_erase(ubi, e2, torture);
-	if (err)
-		goto out_error;
+	if (e2) {
+		err = schedule_erase(ubi, e2, vol_id, lnum, torture);
+		if (err)
+			goto out_error;
+	}
 
-	mutex_unlock(&ubi->move_mutex);
+	move_done(ubi);
 	return 0;
 
 out_error:
-	ubi_err("error %d while moving PEB %d to PEB %d",
-		err, e1->pnum, e2->pnum);
+	ubi_err("error %d while moving PEB %d to PEB %d", err,
+		e1 ? ubi_wl_pnum(ubi, e1) : -1, e2 ? ubi_wl_pnum(ubi, e2) : -1);
 
-	ubi_free_vid_hdr(ubi, vid_hdr);
 	spin_lock(&ubi->wl_lock);
 	ubi->move_from = ubi->move_to = NULL;
 	ubi->move_to_put = ubi->wl_scheduled = 0;
 	spin_unlock(&ubi->wl_lock);
 
-	if (e1)
-		kmem_cache_free(ubi_wl_entry_slab, e1);
-	if (e2)
-		kmem_cache_free(ubi_wl_entry_slab, e2);
 	ubi_ro_mode(ubi);
 
-	mutex_unlock(&ubi->move_mutex);
+	move_done(ubi);
 	return err;
 
 out_cancel:
 	ubi->wl_scheduled = 0;
 	spin_unlock(&ubi->wl_lock);
 	mutex_unlock(&ubi->move_mutex);
-	ubi_free_vid_hdr(ubi, vid_hdr);
 	return 0;
 }
 
@@ -966,8 +1478,8 @@ static int ensure_wear_leveling(struct ubi_device *ubi)
 	 * If the ubi->scrub tree is not empty, scrubbing is needed, and the
 	 * the WL worker has to be scheduled anyway.
 	 */
-	if (!ubi->scrub.rb_node) {
-		if (!ubi->used.rb_node || !ubi->free.rb_node)
+	if (wl_tree_empty(&ubi->scrub)) {
+		if (wl_tree_empty(&ubi->used) || wl_tree_empty(&ubi->free))
 			/* No physical eraseblocks - no deal */
 			goto out_unlock;
 
@@ -975,12 +1487,12 @@ static int ensure_wear_leveling(struct ubi_device *ubi)
 		 * We schedule wear-leveling only if the difference between the
 		 * lowest erase counter of used physical eraseblocks and a high
 		 * erase counter of free physical eraseblocks is greater than
-		 * %UBI_WL_THRESHOLD.
+		 * the wear-leveling threshold.
 		 */
-		e1 = rb_entry(rb_first(&ubi->used), struct ubi_wl_entry, u.rb);
-		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e1 = wl_tree_first(&ubi->used);
+		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF(ubi));
 
-		if (!(e2->ec - e1->ec >= UBI_WL_THRESHOLD))
+		if (!(e2->ec - e1->ec >= ubi->wl_threshold))
 			goto out_unlock;
 		dbg_wl("schedule wear-leveling");
 	} else
@@ -996,6 +1508,7 @@ static int ensure_wear_leveling(struct ubi_device *ubi)
 	}
 
 	wrk->func = &wear_leveling_worker;
+	wrk->vol_id = wrk->lnum = WL_NO_LEB;
 	schedule_ubi_work(ubi, wrk);
 	return err;
 
@@ -1007,6 +1520,80 @@ out_unlock:
 	return err;
 }
 
+/**
+ * wl_adapt_threshold - adjust the wear-leveling threshold.
+ * @ubi: UBI device description object
+ *
+ * This function is called after each erase operation and every
+ * %WL_ADAPT_PERIOD erase operations it adds the LEB writes of the users and
+ * the copies made by the WL worker since the last time to the write
+ * amplification window. When the window is full (see %WL_WA_WINDOW), the
+ * write amplification over the window (LEB copies per 100 LEB writes of the
+ * users) is compared to the budget @ubi->wl_wa_budget, see
+ * 'wl_choose_threshold()', and the older half of the window is dropped. The
+ * threshold always stays within [@ubi->wl_threshold_min,
+ * @ubi->wl_threshold_max], so setting both limits to the same value via sysfs
+ * effectively disables the adaptation.
+ */
+static void wl_adapt_threshold(struct ubi_device *ubi)
+{
+	int min_ec = INT_MAX, spread, wa, old, thr;
+	unsigned long long sqnum, copies, writes;
+	struct ubi_wl_entry *e;
+
+	sqnum = ubi_eba_cur_sqnum(ubi);
+
+	spin_lock(&ubi->wl_lock);
+	if (++ubi->wl_adapt_erases < WL_ADAPT_PERIOD)
+		goto out_unlock;
+	ubi->wl_adapt_erases = 0;
+
+	/*
+	 * Copies made by the WL worker take sequence numbers as well, so
+	 * subtract them to get the amount of LEB writes done by users.
+	 */
+	copies = ubi->wl_copies - ubi->wl_adapt_copies;
+	writes = sqnum - ubi->wl_adapt_sqnum;
+	writes = writes > copies ? writes - copies : 0;
+	ubi->wl_adapt_copies = ubi->wl_copies;
+	ubi->wl_adapt_sqnum = sqnum;
+	ubi->wl_wa_copies += copies;
+	ubi->wl_wa_writes += writes;
+	if (ubi->wl_wa_writes <
+	    (unsigned long long)WL_WA_WINDOW * ubi->peb_count)
+		goto out_unlock;
+
+	copies = ubi->wl_wa_copies;
+	writes = ubi->wl_wa_writes;
+	wa = div64_u64(copies * 100, writes);
+	ubi->wl_wa_copies >>= 1;
+	ubi->wl_wa_writes >>= 1;
+
+	if (!wl_tree_empty(&ubi->used)) {
+		e = wl_tree_first(&ubi->used);
+		min_ec = e->ec;
+	}
+	if (!wl_tree_empty(&ubi->free)) {
+		e = wl_tree_first(&ubi->free);
+		if (e->ec < min_ec)
+			min_ec = e->ec;
+	}
+	spread = min_ec == INT_MAX ? 0 : ubi->max_ec - min_ec;
+
+	old = ubi->wl_threshold;
+	thr = wl_choose_threshold(old, wa, ubi->wl_wa_budget, spread,
+				  ubi->wl_threshold_min, ubi->wl_threshold_max);
+	ubi->wl_threshold = thr;
+
+	if (thr != old)
+		dbg_wl("WL threshold %d -> %d: EC spread %d, WA %d%% "
+		       "(budget %d%%), %llu copies per %llu writes", old, thr,
+		       spread, wa, ubi->wl_wa_budget, copies, writes);
+
+out_unlock:
+	spin_unlock(&ubi->wl_lock);
+}
+
 /**
  * 工作类型为擦除工作所调用的函数
  * erase_worker - physical eraseblock erase worker function.
@@ -1023,24 +1610,25 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 			int cancel)
 {
 	struct ubi_wl_entry *e = wl_wrk->e;
-	int pnum = e->pnum, err, need;
+	int pnum = ubi_wl_pnum(ubi, e), torture = wl_wrk->torture, err, need;
+	int vol_id = wl_wrk->vol_id, lnum = wl_wrk->lnum;
 
 	if (cancel) {
 		dbg_wl("cancel erasure of PEB %d EC %d", pnum, e->ec);
 		kfree(wl_wrk);
-		kmem_cache_free(ubi_wl_entry_slab, e);
 		return 0;
 	}
 
 	dbg_wl("erase PEB %d EC %d", pnum, e->ec);
 
-	err = sync_erase(ubi, e, wl_wrk->torture);
+	err = sync_erase(ubi, e, torture);
 	if (!err) {
 		/* Fine, we've erased it successfully */
 		kfree(wl_wrk);
 
 		spin_lock(&ubi->wl_lock);
 		wl_tree_add(e, &ubi->free);
+		set_wl_state(e, UBI_WL_FREE);
 		spin_unlock(&ubi->wl_lock);
 
 		/*
@@ -1049,6 +1637,9 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 		 */
 		serve_prot_queue(ubi);
 
+		/* Re-consider the wear-leveling threshold if it is time */
+		wl_adapt_threshold(ubi);
+
 		/* And take care about wear-leveling */
 		err = ensure_wear_leveling(ubi);
 		return err;
@@ -1056,14 +1647,13 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 
 	ubi_err("failed to erase PEB %d, error %d", pnum, err);
 	kfree(wl_wrk);
-	kmem_cache_free(ubi_wl_entry_slab, e);
 
 	if (err == -EINTR || err == -ENOMEM || err == -EAGAIN ||
 	    err == -EBUSY) {
 		int err1;
 
 		/* Re-schedule the LEB for erasure */
-		err1 = schedule_erase(ubi, e, 0);
+		err1 = schedule_erase(ubi, e, vol_id, lnum, torture);
 		if (err1) {
 			err = err1;
 			goto out_ro;
@@ -1109,6 +1699,11 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 	if (err)
 		goto out_ro;
 
+	spin_lock(&ubi->wl_lock);
+	set_wl_state(e, UBI_WL_BAD);
+	ec_hist_add(ubi, e->ec, -1);
+	spin_unlock(&ubi->wl_lock);
+
 	spin_lock(&ubi->volumes_lock);
 	ubi->beb_rsvd_pebs -= 1;
 	ubi->bad_peb_count += 1;
@@ -1125,9 +1720,62 @@ out_ro:
 	return err;
 }
 
+/**
+ * pq_adapt_len - adjust the protection queue length.
+ * @ubi: UBI device description object
+ *
+ * This function looks at the life times of the physical eraseblocks put during
+ * the last %WL_PQ_ADAPT_PERIOD puts and picks the new protection queue length
+ * using 'pq_choose_len()'. Note, @ubi->wl_lock has to be locked.
+ */
+static void pq_adapt_len(struct ubi_device *ubi)
+{
+	int len = pq_choose_len(ubi->pq_life, ubi->pq_adapt_puts);
+
+	if (len != ubi->pq_len)
+		dbg_wl("protection queue length %d -> %d after %d puts",
+		       ubi->pq_len, len, ubi->pq_adapt_puts);
+	ubi->pq_len = len;
+
+	memset(ubi->pq_life, 0, sizeof(ubi->pq_life));
+	ubi->pq_adapt_puts = 0;
+}
+
+/**
+ * pq_account_put - account a physical eraseblock which is being put.
+ * @ubi: UBI device description object
+ * @e: the wear-leveling entry of the physical eraseblock
+ *
+ * This function measures for how many erase operations the physical eraseblock
+ * was used. If it was handed out by 'ubi_wl_get_peb()', the life time is added
+ * to the histogram the protection queue length is based on. If it was the
+ * target of a wear-leveling move, and it is put shortly after the move, the
+ * copy was wasted. Note, @ubi->wl_lock has to be locked.
+ */
+static void pq_account_put(struct ubi_device *ubi, struct ubi_wl_entry *e)
+{
+	unsigned int life = wl_stamp_life(e, ubi->pq_erases);
+	int src = e->stamp_src;
+
+	e->stamp_src = WL_STAMP_NONE;
+	if (src == WL_STAMP_MOVE) {
+		if (life < UBI_PROT_QUEUE_MAX)
+			ubi->wl_wasted_copies += 1;
+		return;
+	} else if (src != WL_STAMP_GET && src != WL_STAMP_OLD)
+		return;
+
+	ubi->pq_life[pq_life_bucket(life)] += 1;
+
+	if (++ubi->pq_adapt_puts >= WL_PQ_ADAPT_PERIOD)
+		pq_adapt_len(ubi);
+}
+
 /**
  * ubi_wl_put_peb - return a PEB to the wear-leveling sub-system.
  * @ubi: UBI device description object
+ * @vol_id: the volume ID the logical eraseblock belonged to
+ * @lnum: the logical eraseblock the physical eraseblock was mapped to
  * @pnum: physical eraseblock to return
  * @torture: if this physical eraseblock has to be tortured
  *
@@ -1136,18 +1784,20 @@ out_ro:
  * occurred to this @pnum and it has to be tested. This function returns zero
  * in case of success, and a negative error code in case of failure.
  */
-int ubi_wl_put_peb(struct ubi_device *ubi, int pnum, int torture)
+int ubi_wl_put_peb(struct ubi_device *ubi, int vol_id, int lnum, int pnum,
+		   int torture)
 {
 	int err;
 	struct ubi_wl_entry *e;
+	ubi_lat_t start;
 
-	dbg_wl("PEB %d", pnum);
+	dbg_wl("PEB %d of LEB %d:%d", pnum, vol_id, lnum);
 	ubi_assert(pnum >= 0);
 	ubi_assert(pnum < ubi->peb_count);
 
 retry:
 	spin_lock(&ubi->wl_lock);
-	e = ubi->lookuptbl[pnum];
+	e = &ubi->lookuptbl[pnum];
 	if (e == ubi->move_from) {
 		/*
 		 * User is putting the physical eraseblock which was selected to
@@ -1158,8 +1808,10 @@ retry:
 		spin_unlock(&ubi->wl_lock);
 
 		/* Wait for the WL worker by taking the @ubi->move_mutex */
+		start = ubi_lat_begin();
 		mutex_lock(&ubi->move_mutex);
 		mutex_unlock(&ubi->move_mutex);
+		ubi_lat_end(ubi, UBI_LAT_MOVE_MUTEX, start);
 		goto retry;
 	} else if (e == ubi->move_to) {
 		/*
@@ -1177,34 +1829,156 @@ retry:
 		spin_unlock(&ubi->wl_lock);
 		return 0;
 	} else {
-		if (in_wl_tree(e, &ubi->used)) {
-			paranoid_check_in_wl_tree(e, &ubi->used);
-			rb_erase(&e->u.rb, &ubi->used);
-		} else if (in_wl_tree(e, &ubi->scrub)) {
-			paranoid_check_in_wl_tree(e, &ubi->scrub);
-			rb_erase(&e->u.rb, &ubi->scrub);
-		} else {
-			err = prot_queue_del(ubi, e->pnum);
-			if (err) {
-				ubi_err("PEB %d not found", pnum);
-				ubi_ro_mode(ubi);
-				spin_unlock(&ubi->wl_lock);
-				return err;
-			}
+		err = wl_entry_del(ubi, e);
+		if (err) {
+			ubi_err("PEB %d not found", pnum);
+			ubi_ro_mode(ubi);
+			spin_unlock(&ubi->wl_lock);
+			return err;
 		}
+		pq_account_put(ubi, e);
 	}
 	spin_unlock(&ubi->wl_lock);
 
-	err = schedule_erase(ubi, e, torture);
+	err = schedule_erase(ubi, e, vol_id, lnum, torture);
 	if (err) {
 		spin_lock(&ubi->wl_lock);
 		wl_tree_add(e, &ubi->used);
+		set_wl_state(e, UBI_WL_USED);
 		spin_unlock(&ubi->wl_lock);
 	}
 
 	return err;
 }
 
+/**
+ * ubi_wl_put_pebs - return several PEBs to the wear-leveling sub-system.
+ * @ubi: UBI device description object
+ * @vol_id: the volume ID the logical eraseblocks belonged to
+ * @lnum: the logical eraseblock @pnums[0] was mapped to
+ * @pnums: physical eraseblocks to return, negative elements are skipped
+ * @count: count of elements in @pnums
+ *
+ * This function is the same as calling 'ubi_wl_put_peb()' for physical
+ * eraseblock @pnums[i] of logical eraseblock @lnum + i, without torture, for
+ * all @i. But the erase works are allocated up-front and queued at once under
+ * one @ubi->wl_lock, so un-mapping many logical eraseblocks does not cost a
+ * lock round-trip and a wake-up of the background thread per physical
+ * eraseblock. If the works cannot be allocated, the physical eraseblocks are
+ * put one by one, so that none of them is lost. A physical eraseblock which
+ * cannot be put does not stop the others from being put either. Returns zero
+ * in case of success and the first error code in case of failure.
+ */
+int ubi_wl_put_pebs(struct ubi_device *ubi, int vol_id, int lnum,
+		    const int *pnums, int count)
+{
+	int err = 0, err1, i, queued = 0;
+	struct ubi_work *wrk, *tmp;
+	struct ubi_wl_entry *e;
+	ubi_lat_t start;
+	LIST_HEAD(spare);
+	LIST_HEAD(batch);
+
+	dbg_wl("%d PEBs of LEBs %d:%d-%d", count, vol_id, lnum,
+	       lnum + count - 1);
+
+	for (i = 0; i < count; i++) {
+		if (pnums[i] < 0)
+			continue;
+		ubi_assert(pnums[i] < ubi->peb_count);
+
+		wrk = kmalloc(sizeof(struct ubi_work), GFP_NOFS);
+		if (!wrk)
+			goto out_one_by_one;
+		list_add(&wrk->list, &spare);
+	}
+
+	i = 0;
+retry:
+	spin_lock(&ubi->wl_lock);
+	for (; i < count; i++) {
+		if (pnums[i] < 0)
+			continue;
+
+		e = &ubi->lookuptbl[pnums[i]];
+		if (e == ubi->move_from) {
+			/*
+			 * Queue what we have so far and wait for the WL worker,
+			 * see 'ubi_wl_put_peb()'.
+			 */
+			dbg_wl("PEB %d is being moved, wait", pnums[i]);
+			list_splice_tail_init(&batch, &ubi->works);
+			ubi->works_count += queued;
+			if (queued)
+				bgt_wake(ubi);
+			queued = 0;
+			spin_unlock(&ubi->wl_lock);
+
+			start = ubi_lat_begin();
+			mutex_lock(&ubi->move_mutex);
+			mutex_unlock(&ubi->move_mutex);
+			ubi_lat_end(ubi, UBI_LAT_MOVE_MUTEX, start);
+			goto retry;
+		} else if (e == ubi->move_to) {
+			dbg_wl("PEB %d is the target of data moving",
+			       pnums[i]);
+			ubi_assert(!ubi->move_to_put);
+			ubi->move_to_put = 1;
+			continue;
+		}
+
+		err1 = wl_entry_del(ubi, e);
+		if (err1) {
+			/* Still put the rest, so that they are not lost */
+			ubi_err("PEB %d not found", pnums[i]);
+			ubi_ro_mode(ubi);
+			if (!err)
+				err = err1;
+			continue;
+		}
+		pq_account_put(ubi, e);
+
+		wrk = list_entry(spare.next, struct ubi_work, list);
+		list_del(&wrk->list);
+		wrk->func = &erase_worker;
+		wrk->e = e;
+		wrk->vol_id = vol_id;
+		wrk->lnum = lnum + i;
+		wrk->torture = 0;
+		set_wl_state(e, UBI_WL_ERASE);
+		list_add_tail(&wrk->list, &batch);
+		queued += 1;
+	}
+
+	list_splice_tail(&batch, &ubi->works);
+	ubi_assert(ubi->works_count >= 0);
+	ubi->works_count += queued;
+	if (queued)
+		bgt_wake(ubi);
+	spin_unlock(&ubi->wl_lock);
+
+out_free:
+	list_for_each_entry_safe(wrk, tmp, &spare, list) {
+		list_del(&wrk->list);
+		kfree(wrk);
+	}
+	return err;
+
+out_one_by_one:
+	list_for_each_entry_safe(wrk, tmp, &spare, list) {
+		list_del(&wrk->list);
+		kfree(wrk);
+	}
+	for (i = 0; i < count; i++) {
+		if (pnums[i] < 0)
+			continue;
+		err1 = ubi_wl_put_peb(ubi, vol_id, lnum + i, pnums[i], 0);
+		if (err1 && !err)
+			err = err1;
+	}
+	return err;
+}
+
 /**
  * ubi_wl_scrub_peb - schedule a physical eraseblock for scrubbing.
  * @ubi: UBI device description object
@@ -1223,8 +1997,8 @@ int ubi_wl_scrub_peb(struct ubi_device *ubi, int pnum)
 
 retry:
 	spin_lock(&ubi->wl_lock);
-	e = ubi->lookuptbl[pnum];
-	if (e == ubi->move_from || in_wl_tree(e, &ubi->scrub)) {
+	e = &ubi->lookuptbl[pnum];
+	if (e == ubi->move_from || e->state == UBI_WL_SCRUB) {
 		spin_unlock(&ubi->wl_lock);
 		return 0;
 	}
@@ -1242,22 +2016,15 @@ retry:
 		goto retry;
 	}
 
-	if (in_wl_tree(e, &ubi->used)) {
-		paranoid_check_in_wl_tree(e, &ubi->used);
-		rb_erase(&e->u.rb, &ubi->used);
-	} else {
-		int err;
-
-		err = prot_queue_del(ubi, e->pnum);
-		if (err) {
-			ubi_err("PEB %d not found", pnum);
-			ubi_ro_mode(ubi);
-			spin_unlock(&ubi->wl_lock);
-			return err;
-		}
+	if (wl_entry_del(ubi, e)) {
+		ubi_err("PEB %d not found", pnum);
+		ubi_ro_mode(ubi);
+		spin_unlock(&ubi->wl_lock);
+		return -ENODEV;
 	}
 
 	wl_tree_add(e, &ubi->scrub);
+	set_wl_state(e, UBI_WL_SCRUB);
 	spin_unlock(&ubi->wl_lock);
 
 	/*
@@ -1268,15 +2035,133 @@ retry:
 }
 
 /**
- * ubi_wl_flush - flush all pending works.
+ * ubi_wl_account_read - account a read from a physical eraseblock.
+ * @ubi: UBI device description object
+ * @pnum: the physical eraseblock which was read
+ *
+ * This function counts reads of physical eraseblock @pnum. The counter is
+ * reset when the physical eraseblock is erased. When the counter reaches the
+ * read disturb threshold @ubi->rd_threshold, the physical eraseblock has to be
+ * scrubbed before the read disturb makes the data hard to correct. The caller
+ * does this using 'ubi_wl_scrub_peb()', the same way as for bit-flips, so the
+ * data are moved by the WL worker in background. Returns %1 if the physical
+ * eraseblock has to be scrubbed and %0 if not.
+ *
+ * Each physical eraseblock is reported only once per erasure: the counter is
+ * latched at %RD_LATCHED when the threshold is reached, so further reads do
+ * not reach the threshold again until the physical eraseblock is erased.
+ */
+int ubi_wl_account_read(struct ubi_device *ubi, int pnum)
+{
+	int cnt, thr = ubi->rd_threshold;
+
+	if (!thr)
+		return 0;
+
+	cnt = atomic_inc_return(&ubi->read_counts[pnum]);
+	if (cnt < thr)
+		return 0;
+
+	/* Only the reader which latches the counter reports the PEB */
+	cnt = atomic_xchg(&ubi->read_counts[pnum], RD_LATCHED);
+	if (cnt < thr)
+		return 0;
+
+	dbg_wl("PEB %d was read %d times, scrub it", pnum, cnt);
+	spin_lock(&ubi->wl_lock);
+	ubi->rd_scrubs += 1;
+	spin_unlock(&ubi->wl_lock);
+	return 1;
+}
+
+/**
+ * works_busy - check if there are works a targeted flush has to wait for.
  * @ubi: UBI device description object
+ * @vol_id: the volume ID to flush
+ * @lnum: the logical eraseblock to flush (%UBI_ALL means the whole volume)
+ *
+ * Returns non-zero if there are pending or in-flight works belonging to
+ * @vol_id:@lnum, or if the wear-leveling worker is moving a logical eraseblock
+ * which belongs to @vol_id:@lnum. Note, @ubi->wl_lock has to be locked.
+ */
+static int works_busy(struct ubi_device *ubi, int vol_id, int lnum)
+{
+	struct ubi_work_inflight *inflight;
+
+	if (find_work(ubi, vol_id, lnum))
+		return 1;
+	if (work_matches(ubi->move_vol_id, ubi->move_lnum, vol_id, lnum))
+		return 1;
+	list_for_each_entry(inflight, &ubi->works_inflight, list)
+		if (work_matches(inflight->vol_id, inflight->lnum, vol_id,
+				 lnum))
+			return 1;
+	return 0;
+}
+
+/**
+ * inflight_done - check if in-flight works of a LEB are done.
+ * @ubi: UBI device description object
+ * @vol_id: the volume ID to flush
+ * @lnum: the logical eraseblock to flush (%UBI_ALL means the whole volume)
+ *
+ * Returns non-zero if there are no in-flight works belonging to @vol_id:@lnum
+ * or if there is a pending work belonging to @vol_id:@lnum, which the caller
+ * may do itself.
+ */
+static int inflight_done(struct ubi_device *ubi, int vol_id, int lnum)
+{
+	int ret;
+
+	spin_lock(&ubi->wl_lock);
+	ret = !works_busy(ubi, vol_id, lnum) || find_work(ubi, vol_id, lnum);
+	spin_unlock(&ubi->wl_lock);
+	return ret;
+}
+
+/**
+ * ubi_wl_flush - flush pending works.
+ * @ubi: UBI device description object
+ * @vol_id: the volume ID to flush works for (%UBI_ALL means any)
+ * @lnum: the logical eraseblock to flush works for (%UBI_ALL means any)
+ *
+ * This function makes sure all the works affecting logical eraseblock
+ * @vol_id:@lnum are done, e.g., the physical eraseblocks it was unmapped from
+ * are erased. If @lnum is %UBI_ALL, works of all logical eraseblocks of the
+ * volume are flushed. The works which do not belong to @vol_id:@lnum are left
+ * in the queue and the caller does not wait for them, so flushing a single
+ * logical eraseblock takes one erase at most even if there are many pending
+ * works. If @vol_id is %UBI_ALL, all pending works are flushed.
  *
  * This function returns zero in case of success and a negative error code in
  * case of failure.
  */
-int ubi_wl_flush(struct ubi_device *ubi)
+int ubi_wl_flush(struct ubi_device *ubi, int vol_id, int lnum)
 {
-	int err;
+	int err, pending;
+
+	if (vol_id != UBI_ALL) {
+		dbg_wl("flush works of LEB %d:%d", vol_id, lnum);
+		while (1) {
+			spin_lock(&ubi->wl_lock);
+			if (!works_busy(ubi, vol_id, lnum)) {
+				spin_unlock(&ubi->wl_lock);
+				break;
+			}
+			pending = !!find_work(ubi, vol_id, lnum);
+			spin_unlock(&ubi->wl_lock);
+
+			if (pending) {
+				err = do_work(ubi, vol_id, lnum);
+				if (err)
+					return err;
+			} else
+				/* Somebody else is doing the work, wait */
+				wait_event(ubi->works_wait,
+					   inflight_done(ubi, vol_id, lnum));
+		}
+		return 0;
+	}
 
 	/*
 	 * Erase while the pending works queue is not empty, but not more than
@@ -1284,7 +2169,7 @@ int ubi_wl_flush(struct ubi_device *ubi)
 	 */
 	dbg_wl("flush (%d pending works)", ubi->works_count);
 	while (ubi->works_count) {
-		err = do_work(ubi);
+		err = do_work(ubi, UBI_ALL, UBI_ALL);
 		if (err)
 			return err;
 	}
@@ -1302,7 +2187,7 @@ int ubi_wl_flush(struct ubi_device *ubi)
 	 */
 	while (ubi->works_count) {
 		dbg_wl("flush more (%d pending works)", ubi->works_count);
-		err = do_work(ubi);
+		err = do_work(ubi, UBI_ALL, UBI_ALL);
 		if (err)
 			return err;
 	}
@@ -1311,34 +2196,69 @@ int ubi_wl_flush(struct ubi_device *ubi)
 }
 
 /**
- * tree_destroy - destroy an RB-tree.
- * @root: the root of the tree to destroy
+ * bgt_throttle - check if the background thread may do one more work.
+ * @ubi: UBI device description object
+ *
+ * Background works are throttled only if @ubi->bgt_rate is not zero. Then
+ * they are limited by a token bucket, which is filled with @ubi->bgt_rate
+ * tokens per second up to @ubi->bgt_burst tokens, and each work takes one
+ * token. While foreground I/O is in flight, works are deferred, but not for
+ * longer than %WL_BGT_MAX_DEFER. If there was no foreground I/O for
+ * @ubi->bgt_idle_ms milliseconds, the device is idle and works are not limited
+ * at all.
+ *
+ * This function returns zero if the work may be done now, and the number of
+ * jiffies to wait otherwise. The rate and the burst may be changed via sysfs
+ * at any time, so they are read only once.
  */
-static void tree_destroy(struct rb_root *root)
+static long bgt_throttle(struct ubi_device *ubi)
 {
-	struct rb_node *rb;
-	struct ubi_wl_entry *e;
+	unsigned long now = jiffies;
+	int rate = ACCESS_ONCE(ubi->bgt_rate);
+	long elapsed, full;
 
-	rb = root->rb_node;
-	while (rb) {
-		if (rb->rb_left)
-			rb = rb->rb_left;
-		else if (rb->rb_right)
-			rb = rb->rb_right;
-		else {
-			e = rb_entry(rb, struct ubi_wl_entry, u.rb);
-
-			rb = rb_parent(rb);
-			if (rb) {
-				if (rb->rb_left == &e->u.rb)
-					rb->rb_left = NULL;
-				else
-					rb->rb_right = NULL;
-			}
+	if (!rate)
+		return 0;
+
+	/*
+	 * Re-fill the bucket, tokens are kept in 1/HZ fractions. The bucket
+	 * is full after @full / @rate jiffies, so cap @elapsed there to keep
+	 * the multiplication from overflowing after a long sleep.
+	 */
+	full = (long)ACCESS_ONCE(ubi->bgt_burst) * HZ;
+	elapsed = now - ubi->bgt_refill_stamp;
+	ubi->bgt_refill_stamp = now;
+	if (elapsed < 0 || elapsed >= full / rate)
+		ubi->bgt_tokens = full;
+	else {
+		ubi->bgt_tokens += elapsed * rate;
+		if (ubi->bgt_tokens > full)
+			ubi->bgt_tokens = full;
+	}
 
-			kmem_cache_free(ubi_wl_entry_slab, e);
+	if (!atomic_read(&ubi->fg_io_inflight) &&
+	    time_after_eq(now, ubi->fg_io_stamp +
+				msecs_to_jiffies(ubi->bgt_idle_ms))) {
+		/* The device is idle, no need to limit anything */
+		ubi->bgt_deferred = 0;
+		return 0;
+	}
+
+	if (atomic_read(&ubi->fg_io_inflight)) {
+		if (!ubi->bgt_deferred) {
+			ubi->bgt_deferred = 1;
+			ubi->bgt_defer_start = now;
 		}
+		if (time_before(now, ubi->bgt_defer_start + WL_BGT_MAX_DEFER))
+			return 1;
 	}
+	ubi->bgt_deferred = 0;
+
+	if (ubi->bgt_tokens < HZ)
+		return DIV_ROUND_UP(HZ - ubi->bgt_tokens, rate);
+
+	ubi->bgt_tokens -= HZ;
+	return 0;
 }
 
 /**
@@ -1356,6 +2276,7 @@ int ubi_thread(void *u)
 	set_freezable();
 	for (;;) {
 		int err;
+		long delay;
 
 		if (kthread_should_stop())
 			break;
@@ -1364,7 +2285,8 @@ int ubi_thread(void *u)
 			continue;
 
 		spin_lock(&ubi->wl_lock);
-		if (list_empty(&ubi->works) || ubi->ro_mode ||
+		if ((list_empty(&ubi->works) &&
+		     list_empty(&ubi->torture_works)) || ubi->ro_mode ||
 			       !ubi->thread_enabled) {
 			set_current_state(TASK_INTERRUPTIBLE);
 			spin_unlock(&ubi->wl_lock);
@@ -1373,7 +2295,13 @@ int ubi_thread(void *u)
 		}
 		spin_unlock(&ubi->wl_lock);
 
-		err = do_work(ubi);
+		delay = bgt_throttle(ubi);
+		if (delay) {
+			schedule_timeout_interruptible(delay);
+			continue;
+		}
+
+		err = do_work(ubi, UBI_ALL, UBI_ALL);
 		if (err) {
 			ubi_err("%s: work failed with error code %d",
 				ubi->bgt_name, err);
@@ -1398,12 +2326,237 @@ int ubi_thread(void *u)
 	return 0;
 }
 
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+
+/**
+ * bgt_pool_pick - pick an UBI device to serve.
+ * @timeout: for how long the caller may sleep if nothing was picked is
+ *           returned here
+ *
+ * This function picks the first queued UBI device which is not deferred by
+ * background thread throttling and whose group is not at the concurrency
+ * limit. Returns the UBI device or %NULL if there is nothing to serve. Note,
+ * @bgt_pool_lock has to be locked.
+ */
+static struct ubi_device *bgt_pool_pick(long *timeout)
+{
+	struct ubi_device *ubi;
+
+	*timeout = MAX_SCHEDULE_TIMEOUT;
+	list_for_each_entry(ubi, &bgt_pool_queue, bgt_pool_list) {
+		if (bgt_group_active[ubi->bgt_group] >=
+		    UBI_BGT_POOL_GROUP_LIMIT)
+			continue;
+
+		if (time_before(jiffies, ubi->bgt_next)) {
+			long t = ubi->bgt_next - jiffies;
+
+			if (t < *timeout)
+				*timeout = t;
+			continue;
+		}
+
+		list_del_init(&ubi->bgt_pool_list);
+		ubi->bgt_pool_state = BGT_POOL_SERVING;
+		ubi->bgt_active_group = ubi->bgt_group;
+		bgt_group_active[ubi->bgt_group] += 1;
+		ubi->bgt_thread = current;
+		return ubi;
+	}
+
+	return NULL;
+}
+
+/**
+ * bgt_pool_serve - do one work of an UBI device.
+ * @ubi: UBI device description object
+ *
+ * This is what 'ubi_thread()' does in one iteration, but instead of sleeping
+ * when the device is throttled, the time the device may be served again is
+ * remembered in @ubi->bgt_next. Like 'ubi_thread()', it does nothing if the
+ * background thread is disabled.
+ */
+static void bgt_pool_serve(struct ubi_device *ubi)
+{
+	int err;
+	long delay;
+
+	spin_lock(&ubi->wl_lock);
+	if (!ubi->works_count || ubi->ro_mode || !ubi->thread_enabled) {
+		spin_unlock(&ubi->wl_lock);
+		return;
+	}
+	spin_unlock(&ubi->wl_lock);
+
+	delay = bgt_throttle(ubi);
+	if (delay) {
+		ubi->bgt_next = jiffies + delay;
+		return;
+	}
+
+	err = do_work(ubi, UBI_ALL, UBI_ALL);
+	if (err) {
+		ubi_err("%s: work failed with error code %d",
+			ubi->bgt_name, err);
+		if (ubi->bgt_failures++ > WL_MAX_FAILURES) {
+			ubi_msg("%s: %d consecutive failures",
+				ubi->bgt_name, WL_MAX_FAILURES);
+			ubi_ro_mode(ubi);
+			ubi->thread_enabled = 0;
+		}
+	} else
+		ubi->bgt_failures = 0;
+}
+
+/**
+ * bgt_pool_done - finish serving an UBI device.
+ * @ubi: UBI device description object
+ *
+ * This function puts the device back to the tail of the queue if it has more
+ * works to do.
+ */
+static void bgt_pool_done(struct ubi_device *ubi)
+{
+	spin_lock(&ubi->wl_lock);
+	spin_lock(&bgt_pool_lock);
+	bgt_group_active[ubi->bgt_active_group] -= 1;
+	ubi->bgt_thread = NULL;
+	ubi->bgt_pool_state = BGT_POOL_IDLE;
+	if (ubi->works_count && !ubi->ro_mode)
+		bgt_pool_add(ubi);
+	spin_unlock(&bgt_pool_lock);
+	spin_unlock(&ubi->wl_lock);
+
+	/* The group may be served by others now */
+	wake_up(&bgt_pool_wait);
+	wake_up_all(&bgt_pool_idle);
+}
+
+/**
+ * bgt_pool_thread - shared UBI background thread.
+ * @u: not used
+ */
+static int bgt_pool_thread(void *u)
+{
+	DEFINE_WAIT(wait);
+	struct ubi_device *ubi;
+	long timeout;
+
+	ubi_msg("background thread \"%s\" started, PID %d",
+		current->comm, task_pid_nr(current));
+
+	set_freezable();
+	for (;;) {
+		if (kthread_should_stop())
+			break;
+
+		if (try_to_freeze())
+			continue;
+
+		prepare_to_wait(&bgt_pool_wait, &wait, TASK_INTERRUPTIBLE);
+		spin_lock(&bgt_pool_lock);
+		ubi = bgt_pool_pick(&timeout);
+		spin_unlock(&bgt_pool_lock);
+		if (!ubi) {
+			if (!kthread_should_stop())
+				schedule_timeout(timeout);
+			finish_wait(&bgt_pool_wait, &wait);
+			continue;
+		}
+		finish_wait(&bgt_pool_wait, &wait);
+
+		bgt_pool_serve(ubi);
+		bgt_pool_done(ubi);
+		cond_resched();
+	}
+
+	dbg_wl("background thread \"%s\" is killed", current->comm);
+	return 0;
+}
+
+/**
+ * ubi_bgt_pool_start - start serving an UBI device by the pool threads.
+ * @ubi: UBI device description object
+ *
+ * This function is called when the UBI device is attached, instead of waking
+ * up the per-device background thread.
+ */
+void ubi_bgt_pool_start(struct ubi_device *ubi)
+{
+	spin_lock(&ubi->wl_lock);
+	spin_lock(&bgt_pool_lock);
+	if (ubi->works_count)
+		bgt_pool_add(ubi);
+	spin_unlock(&bgt_pool_lock);
+	spin_unlock(&ubi->wl_lock);
+}
+
+/**
+ * ubi_bgt_pool_stop - stop serving an UBI device by the pool threads.
+ * @ubi: UBI device description object
+ *
+ * This function removes the UBI device from the pool queue and waits until no
+ * pool thread serves it, so the device may be detached afterwards.
+ */
+void ubi_bgt_pool_stop(struct ubi_device *ubi)
+{
+	spin_lock(&bgt_pool_lock);
+	ubi->thread_enabled = 0;
+	if (ubi->bgt_pool_state == BGT_POOL_QUEUED) {
+		list_del_init(&ubi->bgt_pool_list);
+		ubi->bgt_pool_state = BGT_POOL_IDLE;
+	}
+	spin_unlock(&bgt_pool_lock);
+
+	wait_event(bgt_pool_idle, ubi->bgt_pool_state != BGT_POOL_SERVING);
+}
+
+/**
+ * ubi_bgt_pool_init - create the shared background threads.
+ *
+ * This function returns zero in case of success and a negative error code in
+ * case of failure.
+ */
+int ubi_bgt_pool_init(void)
+{
+	int i, err;
+
+	for (i = 0; i < UBI_BGT_POOL_THREADS; i++) {
+		bgt_pool[i] = kthread_run(bgt_pool_thread, NULL,
+					  UBI_BGT_POOL_NAME_PATTERN, i);
+		if (IS_ERR(bgt_pool[i])) {
+			err = PTR_ERR(bgt_pool[i]);
+			ubi_err("cannot spawn background thread %d, error %d",
+				i, err);
+			while (i--)
+				kthread_stop(bgt_pool[i]);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ubi_bgt_pool_exit - stop the shared background threads.
+ */
+void ubi_bgt_pool_exit(void)
+{
+	int i;
+
+	for (i = 0; i < UBI_BGT_POOL_THREADS; i++)
+		kthread_stop(bgt_pool[i]);
+}
+
+#endif /* CONFIG_MTD_UBI_BGT_POOL */
+
 /**
  * cancel_pending - cancel all pending works.
  * @ubi: UBI device description object
  */
 static void cancel_pending(struct ubi_device *ubi)
 {
+	list_splice_tail_init(&ubi->torture_works, &ubi->works);
 	while (!list_empty(&ubi->works)) {
 		struct ubi_work *wrk;
 
@@ -1415,6 +2568,26 @@ static void cancel_pending(struct ubi_device *ubi)
 	}
 }
 
+/**
+ * wl_entry_init - initialize the wear-leveling entry of a PEB.
+ * @ubi: UBI device description object
+ * @pnum: physical eraseblock number
+ * @ec: erase counter of the physical eraseblock
+ *
+ * Wear-leveling entries are not allocated dynamically, they live in the
+ * @ubi->lookuptbl array which is indexed by the physical eraseblock number.
+ * This function initializes the entry of PEB @pnum and returns it.
+ */
+static struct ubi_wl_entry *wl_entry_init(struct ubi_device *ubi, int pnum,
+					  int ec)
+{
+	struct ubi_wl_entry *e = &ubi->lookuptbl[pnum];
+
+	e->ec = ec;
+	ec_hist_add(ubi, ec, 1);
+	return e;
+}
+
 /**
  * ubi_wl_init_scan - initialize the WL sub-system using scanning information.
  * @ubi: UBI device description object
@@ -1431,89 +2604,123 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 	struct ubi_scan_leb *seb, *tmp;
 	struct ubi_wl_entry *e;
 
-	ubi->used = ubi->free = ubi->scrub = RB_ROOT;
 	spin_lock_init(&ubi->wl_lock);
 	mutex_init(&ubi->move_mutex);
 	init_rwsem(&ubi->work_sem);
 	ubi->max_ec = si->max_ec;
+	ubi->ec_hist_width = 1;
+	ubi->wl_threshold = UBI_WL_THRESHOLD;
+	ubi->wl_threshold_min = max_t(int, UBI_WL_THRESHOLD / 4, 2);
+	ubi->wl_threshold_max = UBI_WL_THRESHOLD * 2;
+	ubi->wl_wa_budget = UBI_WL_WA_BUDGET;
+	ubi->wl_adapt_sqnum = si->max_sqnum + 1;
+	ubi->rd_threshold = UBI_READ_DISTURB_THRESHOLD;
+#ifdef CONFIG_MTD_UBI_BGT_POOL
+	INIT_LIST_HEAD(&ubi->bgt_pool_list);
+	ubi->bgt_group = ubi->ubi_num;
+	ubi->bgt_next = jiffies;
+#endif
+	ubi->bgt_burst = WL_BGT_BURST;
+	ubi->bgt_idle_ms = WL_BGT_IDLE_MS;
+	ubi->bgt_refill_stamp = jiffies;
+	ubi->bgt_tokens = (long)ubi->bgt_burst * HZ;
 	INIT_LIST_HEAD(&ubi->works);
+	INIT_LIST_HEAD(&ubi->torture_works);
+	INIT_LIST_HEAD(&ubi->works_inflight);
+	init_waitqueue_head(&ubi->works_wait);
+	ubi->move_vol_id = ubi->move_lnum = WL_NO_LEB;
 
 	sprintf(ubi->bgt_name, UBI_BGT_NAME_PATTERN, ubi->ubi_num);
 
+	if (ubi->peb_count > UBI_WL_MAX_PEBS) {
+		ubi_err("too many physical eraseblocks (%d, max. %d)",
+			ubi->peb_count, UBI_WL_MAX_PEBS);
+		return -EINVAL;
+	}
+
 	err = -ENOMEM;
-	ubi->lookuptbl = kzalloc(ubi->peb_count * sizeof(void *), GFP_KERNEL);
+	i = ubi->peb_count + UBI_PROT_QUEUE_MAX;
+	ubi->lookuptbl = vmalloc(i * sizeof(struct ubi_wl_entry));
 	if (!ubi->lookuptbl)
 		return err;
+	memset(ubi->lookuptbl, 0, i * sizeof(struct ubi_wl_entry));
+	wl_tree_init(&ubi->used, ubi->lookuptbl);
+	wl_tree_init(&ubi->free, ubi->lookuptbl);
+	wl_tree_init(&ubi->scrub, ubi->lookuptbl);
+
+	ubi->read_counts = vmalloc(ubi->peb_count * sizeof(atomic_t));
+	if (!ubi->read_counts) {
+		vfree(ubi->lookuptbl);
+		return err;
+	}
+	for (i = 0; i < ubi->peb_count; i++)
+		atomic_set(&ubi->read_counts[i], 0);
+
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+	ubi->peb_cache = alloc_percpu(struct ubi_peb_cache);
+	ubi->peb_cached = kzalloc(BITS_TO_LONGS(ubi->peb_count) *
+				  sizeof(unsigned long), GFP_KERNEL);
+	if (!ubi->peb_cache || !ubi->peb_cached) {
+		kfree(ubi->peb_cached);
+		if (ubi->peb_cache)
+			free_percpu(ubi->peb_cache);
+		vfree(ubi->read_counts);
+		vfree(ubi->lookuptbl);
+		return err;
+	}
+	for_each_possible_cpu(i) {
+		struct ubi_peb_cache *pc = per_cpu_ptr(ubi->peb_cache, i);
 
-	for (i = 0; i < UBI_PROT_QUEUE_LEN; i++)
-		INIT_LIST_HEAD(&ubi->pq[i]);
+		spin_lock_init(&pc->lock);
+		pc->count = 0;
+	}
+#endif
+
+	for (i = 0; i < UBI_PROT_QUEUE_MAX; i++)
+		wl_list_init(ubi->lookuptbl, pq_list(ubi, i));
 	ubi->pq_head = 0;
+	ubi->pq_len = UBI_PROT_QUEUE_LEN;
 
 	list_for_each_entry_safe(seb, tmp, &si->erase, u.list) {
 		cond_resched();
 
-		e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_KERNEL);
-		if (!e)
+		e = wl_entry_init(ubi, seb->pnum, seb->ec);
+		if (schedule_erase(ubi, e, UBI_ALL, UBI_ALL, 0))
 			goto out_free;
-
-		e->pnum = seb->pnum;
-		e->ec = seb->ec;
-		ubi->lookuptbl[e->pnum] = e;
-		if (schedule_erase(ubi, e, 0)) {
-			kmem_cache_free(ubi_wl_entry_slab, e);
-			goto out_free;
-		}
 	}
 
 	list_for_each_entry(seb, &si->free, u.list) {
 		cond_resched();
 
-		e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_KERNEL);
-		if (!e)
-			goto out_free;
-
-		e->pnum = seb->pnum;
-		e->ec = seb->ec;
+		e = wl_entry_init(ubi, seb->pnum, seb->ec);
 		ubi_assert(e->ec >= 0);
 		wl_tree_add(e, &ubi->free);
-		ubi->lookuptbl[e->pnum] = e;
+		set_wl_state(e, UBI_WL_FREE);
 	}
 
 	list_for_each_entry(seb, &si->corr, u.list) {
 		cond_resched();
 
-		e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_KERNEL);
-		if (!e)
-			goto out_free;
-
-		e->pnum = seb->pnum;
-		e->ec = seb->ec;
-		ubi->lookuptbl[e->pnum] = e;
-		if (schedule_erase(ubi, e, 0)) {
-			kmem_cache_free(ubi_wl_entry_slab, e);
+		e = wl_entry_init(ubi, seb->pnum, seb->ec);
+		if (schedule_erase(ubi, e, UBI_ALL, UBI_ALL, 0))
 			goto out_free;
-		}
 	}
 
 	ubi_rb_for_each_entry(rb1, sv, &si->volumes, rb) {
 		ubi_rb_for_each_entry(rb2, seb, &sv->root, u.rb) {
 			cond_resched();
 
-			e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_KERNEL);
-			if (!e)
-				goto out_free;
-
-			e->pnum = seb->pnum;
-			e->ec = seb->ec;
-			ubi->lookuptbl[e->pnum] = e;
+			e = wl_entry_init(ubi, seb->pnum, seb->ec);
 			if (!seb->scrub) {
 				dbg_wl("add PEB %d EC %d to the used tree",
-				       e->pnum, e->ec);
+				       ubi_wl_pnum(ubi, e), e->ec);
 				wl_tree_add(e, &ubi->used);
+				set_wl_state(e, UBI_WL_USED);
 			} else {
 				dbg_wl("add PEB %d EC %d to the scrub tree",
-				       e->pnum, e->ec);
+				       ubi_wl_pnum(ubi, e), e->ec);
 				wl_tree_add(e, &ubi->scrub);
+				set_wl_state(e, UBI_WL_SCRUB);
 			}
 		}
 	}
@@ -1535,30 +2742,15 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 
 out_free:
 	cancel_pending(ubi);
-	tree_destroy(&ubi->used);
-	tree_destroy(&ubi->free);
-	tree_destroy(&ubi->scrub);
-	kfree(ubi->lookuptbl);
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+	kfree(ubi->peb_cached);
+	free_percpu(ubi->peb_cache);
+#endif
+	vfree(ubi->read_counts);
+	vfree(ubi->lookuptbl);
 	return err;
 }
 
-/**
- * protection_queue_destroy - destroy the protection queue.
- * @ubi: UBI device description object
- */
-static void protection_queue_destroy(struct ubi_device *ubi)
-{
-	int i;
-	struct ubi_wl_entry *e, *tmp;
-
-	for (i = 0; i < UBI_PROT_QUEUE_LEN; ++i) {
-		list_for_each_entry_safe(e, tmp, &ubi->pq[i], u.list) {
-			list_del(&e->u.list);
-			kmem_cache_free(ubi_wl_entry_slab, e);
-		}
-	}
-}
-
 /**
  * ubi_wl_close - close the wear-leveling sub-system.
  * @ubi: UBI device description object
@@ -1567,15 +2759,41 @@ void ubi_wl_close(struct ubi_device *ubi)
 {
 	dbg_wl("close the WL sub-system");
 	cancel_pending(ubi);
-	protection_queue_destroy(ubi);
-	tree_destroy(&ubi->used);
-	tree_destroy(&ubi->free);
-	tree_destroy(&ubi->scrub);
-	kfree(ubi->lookuptbl);
+#ifdef CONFIG_MTD_UBI_WL_PEB_CACHE
+	kfree(ubi->peb_cached);
+	free_percpu(ubi->peb_cache);
+#endif
+	vfree(ubi->read_counts);
+	vfree(ubi->lookuptbl);
 }
 
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
 
+/**
+ * in_wl_tree - check if wear-leveling entry is present in a WL tree.
+ * @e: the wear-leveling entry to check
+ * @root: the tree
+ *
+ * This function returns non-zero if @e is in the @root tree and zero if it
+ * is not.
+ */
+static int in_wl_tree(struct ubi_wl_entry *e, struct ubi_wl_tree *root)
+{
+	unsigned int i = e - root->tbl, p = root->root;
+
+	while (p != WL_NIL) {
+		if (p == i)
+			return 1;
+
+		if (wl_less(root->tbl, i, p))
+			p = root->tbl[p].left;
+		else
+			p = root->tbl[p].right;
+	}
+
+	return 0;
+}
+
 /**
  * paranoid_check_ec - make sure that the erase counter of a PEB is correct.
  * @ubi: UBI device description object
@@ -1618,21 +2836,20 @@ out_free:
 }
 
 /**
- * paranoid_check_in_wl_tree - check that wear-leveling entry is in WL RB-tree.
+ * paranoid_check_in_wl_tree - check that wear-leveling entry is in WL tree.
  * @e: the wear-leveling entry to check
- * @root: the root of the tree
+ * @root: the tree
  *
- * This function returns zero if @e is in the @root RB-tree and %1 if it is
- * not.
+ * This function returns zero if @e is in the @root tree and %1 if it is not.
  */
 static int paranoid_check_in_wl_tree(struct ubi_wl_entry *e,
-				     struct rb_root *root)
+				     struct ubi_wl_tree *root)
 {
 	if (in_wl_tree(e, root))
 		return 0;
 
-	ubi_err("paranoid check failed for PEB %d, EC %d, RB-tree %p ",
-		e->pnum, e->ec, root);
+	ubi_err("paranoid check failed for PEB %td, EC %d, tree %p ",
+		e - root->tbl, e->ec, root);
 	ubi_dbg_dump_stack();
 	return 1;
 }
@@ -1647,32 +2864,34 @@ static int paranoid_check_in_wl_tree(struct ubi_wl_entry *e,
  */
 static int paranoid_check_in_pq(struct ubi_device *ubi, struct ubi_wl_entry *e)
 {
-	struct ubi_wl_entry *p;
+	unsigned int head, p;
 	int i;
 
-	for (i = 0; i < UBI_PROT_QUEUE_LEN; ++i)
-		list_for_each_entry(p, &ubi->pq[i], u.list)
-			if (p == e)
+	for (i = 0; i < UBI_PROT_QUEUE_MAX; ++i) {
+		head = pq_list(ubi, i);
+		for (p = ubi->lookuptbl[head].right; p != head;
+		     p = ubi->lookuptbl[p].right)
+			if (&ubi->lookuptbl[p] == e)
 				return 0;
+	}
 
 	ubi_err("paranoid check failed for PEB %d, EC %d, Protect queue",
-		e->pnum, e->ec);
+		ubi_wl_pnum(ubi, e), e->ec);
 	ubi_dbg_dump_stack();
 	return 1;
 }
 #endif /* CONFIG_MTD_UBI_DEBUG_PARANOID */
 
 #ifdef CONFIG_MTD_UBI_FASTSCAN
-int fastscan_find_pebs(struct rb_root *root, struct ubi_wl_entry **pebs) 
+int fastscan_find_pebs(struct ubi_wl_tree *t, struct ubi_wl_entry **pebs) 
 {
-	struct rb_node *p;
 	struct ubi_wl_entry *e;
 	int i, count = 0;
 
-	ubi_msg("traverse the rb_tree to find available pebs");
-	ubi_rb_for_each_entry(p, e, root, u.rb)
+	ubi_msg("traverse the tree to find available pebs");
+	wl_tree_for_each(e, t)
 	{
-		if(e->pnum < UBI_FASTSCAN_END)	
+		if(e - t->tbl < UBI_FASTSCAN_END)	
 		{
 			pebs[count] = kzalloc(sizeof(struct ubi_wl_entry), GFP_KERNEL);
 			if(!pebs[count])